@@ -0,0 +1,130 @@
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpCapture.h>
+#include <RemoteControlProtocol/RcpReplayTransport.h>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std;
+using namespace std::chrono;
+
+// Usage: CaptureReplay [--fast] [--port <peer port>] [--repeat <n>] capture
+// Plays what one peer sent in a pcap or pcapng capture to a socket that is
+// connected without a handshake, as if it was the other end of the connection.
+// The capture may come from RcpSocket::startCapture or from tcpdump.
+// The peer is the sender of the first numbered RCP datagram, or the one sending
+// from --port. The datagrams keep their original spacing, unless --fast is
+// given, then they are received back to back, which measures how fast the
+// socket decodes, reorders and acknowledges them.
+
+
+struct ReplayResult {
+	uint64_t messages = 0;
+	uint64_t bytes = 0;
+	RcpReplayTransport::Statistics statistics;
+	nanoseconds elapsed = nanoseconds(0);
+};
+
+
+ReplayResult Replay(const vector<RcpCapturedDatagram>& datagrams, uint32_t sequenceNumber, uint32_t batchNumber, bool isFast) {
+	ReplayResult result;
+	const RcpCapturedDatagram& first = datagrams.front();
+
+	RcpReplayTransport* replay = new RcpReplayTransport(datagrams, !isFast);
+	RcpSocket socket{ unique_ptr<RcpTransport>(replay) };
+	socket.bind(first.destinationPort);
+	socket.debug_connect(first.source.toString(), first.sourcePort, sequenceNumber, batchNumber);
+
+	auto start = steady_clock::now();
+	auto last = start;
+	RcpPacket packet;
+	while (true) {
+		// the last few datagrams may still be reordered when the capture is over
+		if (!socket.receive(packet, replay->isFinished() ? 100 : 1000)) {
+			if (replay->isFinished()) {
+				break;
+			}
+			continue;
+		}
+		result.messages++;
+		result.bytes += packet.getDataSize();
+		last = steady_clock::now();
+	}
+	// until the last message, the wait for stragglers after it does not count
+	result.elapsed = duration_cast<nanoseconds>(last - start);
+	result.statistics = replay->getStatistics();
+
+	socket.debug_kill();
+	return result;
+}
+
+
+int main(int argc, char* argv[]) {
+	bool isFast = false;
+	uint16_t peerPort = 0;
+	int repeat = 1;
+	string path;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--fast") {
+			isFast = true;
+			continue;
+		}
+		if (arg == "--port" && i + 1 < argc) {
+			peerPort = (uint16_t)strtoul(argv[++i], nullptr, 10);
+			continue;
+		}
+		if (arg == "--repeat" && i + 1 < argc) {
+			repeat = max(1, atoi(argv[++i]));
+			continue;
+		}
+		path = arg;
+	}
+	if (path.empty()) {
+		cerr << "Usage: CaptureReplay [--fast] [--port <peer port>] [--repeat <n>] capture" << endl;
+		return 1;
+	}
+
+	RcpCaptureReader reader;
+	if (!reader.open(path)) {
+		cerr << "Could not read " << path << ", it's not a pcap or pcapng file" << endl;
+		return 1;
+	}
+	vector<RcpCapturedDatagram> capture = reader.readAll();
+	uint32_t sequenceNumber = 0, batchNumber = 0;
+	vector<RcpCapturedDatagram> datagrams = RcpReplayTransport::selectConnection(capture, peerPort, sequenceNumber, batchNumber);
+	cout << capture.size() << " UDP datagrams in the capture, " << reader.getSkipped() << " other frames skipped" << endl;
+	if (datagrams.empty()) {
+		cerr << "No RCP traffic" << (peerPort != 0 ? " from port " + to_string(peerPort) : string()) << " in the capture" << endl;
+		return 1;
+	}
+	const RcpCapturedDatagram& first = datagrams.front();
+	cout << "Replaying " << datagrams.size() << " datagrams from "
+		<< first.source.toString() << ":" << first.sourcePort << " to "
+		<< first.destination.toString() << ":" << first.destinationPort
+		<< (isFast ? ", back to back" : ", at the original pace") << endl << endl;
+
+	for (int run = 0; run < repeat; ++run) {
+		ReplayResult result = Replay(datagrams, sequenceNumber, batchNumber, isFast);
+		double seconds = result.elapsed.count() / 1e9;
+		cout << "run " << run + 1 << ": "
+			<< result.statistics.replayed << " datagrams -> "
+			<< result.messages << " messages (" << result.bytes << " bytes), "
+			<< result.statistics.sent << " datagrams sent back, in "
+			<< fixed << setprecision(3) << seconds * 1000 << " ms";
+		if (result.statistics.replayed > 0 && seconds > 0) {
+			cout << ", " << setprecision(0) << result.statistics.replayed / seconds << " datagrams/s, "
+				<< setprecision(2) << result.elapsed.count() / 1000.0 / result.statistics.replayed << " us each";
+		}
+		cout << endl;
+	}
+
+	return 0;
+}
@@ -0,0 +1,295 @@
+#include "LoadClient.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std::chrono;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Profiles and statistics
+
+const char* GetProfileName(eLoadProfile profile) {
+	switch (profile) {
+		case eLoadProfile::STEADY: return "steady";
+		case eLoadProfile::BURST: return "burst";
+		case eLoadProfile::QUERY: return "query";
+		case eLoadProfile::RECONNECT: return "reconnect";
+	}
+	return "unknown";
+}
+
+bool ParseProfileName(const std::string& name, eLoadProfile& profile) {
+	for (auto candidate : { eLoadProfile::STEADY, eLoadProfile::BURST, eLoadProfile::QUERY, eLoadProfile::RECONNECT }) {
+		if (name == GetProfileName(candidate)) {
+			profile = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void LatencyStats::Add(double sample) {
+	samples.push_back(sample);
+}
+
+void LatencyStats::Add(const LatencyStats& other) {
+	samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+}
+
+auto LatencyStats::Summarize() const -> Summary {
+	Summary summary;
+	if (samples.empty()) {
+		return summary;
+	}
+	std::vector<double> sorted = samples;
+	std::sort(sorted.begin(), sorted.end());
+	auto Percentile = [&](double p) {
+		return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+	};
+	double sum = 0;
+	for (auto sample : sorted) {
+		sum += sample;
+	}
+	summary.count = sorted.size();
+	summary.min = sorted.front();
+	summary.mean = sum / sorted.size();
+	summary.p50 = Percentile(0.5);
+	summary.p90 = Percentile(0.9);
+	summary.p99 = Percentile(0.99);
+	summary.max = sorted.back();
+	return summary;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Constructor and destructor
+
+LoadClient::LoadClient(int id, eLoadProfile profile, const LoadOptions& options, uint16_t serverPort, int channelBase)
+	: id(id), profile(profile), options(options), serverPort(serverPort), channelBase(channelBase)
+{
+	queriesInFlight = 0;
+	runCollector = false;
+	client.SetLocalPort(RcpSocket::AnyPort);
+}
+
+
+LoadClient::~LoadClient() {
+	Join();
+}
+
+
+void LoadClient::Start(steady_clock::time_point endTime) {
+	this->endTime = endTime;
+	runCollector = true;
+	collectorThread = std::thread([this] { CollectorThreadFunc(); });
+	runThread = std::thread([this] { Run(); });
+}
+
+
+void LoadClient::Join() {
+	if (runThread.joinable()) {
+		runThread.join();
+	}
+	{
+		std::lock_guard<std::mutex> lk(pendingMutex);
+		runCollector = false;
+	}
+	pendingCondvar.notify_all();
+	if (collectorThread.joinable()) {
+		collectorThread.join();
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Running profiles
+
+void LoadClient::Run() {
+	// when clients share a server, they have to wait for their turn
+	while (!Connect()) {
+		if (steady_clock::now() >= endTime) {
+			return;
+		}
+		std::this_thread::sleep_for(milliseconds(100));
+	}
+
+	switch (profile) {
+		case eLoadProfile::STEADY: RunSteady(); break;
+		case eLoadProfile::BURST: RunBurst(); break;
+		case eLoadProfile::QUERY: RunQuery(); break;
+		case eLoadProfile::RECONNECT: RunReconnect(); break;
+	}
+
+	WaitPendingQueries(steady_clock::now() + milliseconds(options.queryTimeout));
+	Disconnect();
+}
+
+
+bool LoadClient::Connect() {
+	auto start = steady_clock::now();
+	bool isConnected = client.Connect(options.address, serverPort, 2000).get();
+	if (isConnected) {
+		results.connects++;
+		results.connectLatency.Add(duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0);
+	}
+	else {
+		results.connectFailures++;
+	}
+	return isConnected;
+}
+
+
+void LoadClient::Disconnect() {
+	client.Disconnect();
+}
+
+
+void LoadClient::SendUpdate(uint64_t tick) {
+	std::vector<RemoteControlClient::ServoCommand> commands;
+	for (int i = 0; i < options.channels; ++i) {
+		// a slow sweep, every channel shifted a bit
+		float state = float((tick + i * 10) % 200) / 100.0f - 1.0f;
+		commands.push_back({ channelBase + i, state });
+	}
+	if (client.SetServos(commands)) {
+		results.commandsSent += commands.size();
+	}
+	else {
+		results.commandsFailed += commands.size();
+	}
+}
+
+
+void LoadClient::SendProbe() {
+	PendingQuery query;
+	query.sendTime = steady_clock::now();
+	query.reply = client.QueryServo(channelBase);
+	{
+		std::lock_guard<std::mutex> lk(pendingMutex);
+		pendingQueries.push_back(std::move(query));
+		queriesInFlight++;
+	}
+	pendingCondvar.notify_all();
+	results.queriesSent++;
+}
+
+
+bool LoadClient::WaitPendingQueries(steady_clock::time_point until) {
+	std::unique_lock<std::mutex> lk(pendingMutex);
+	return pendingCondvar.wait_until(lk, until, [this] { return queriesInFlight == 0; });
+}
+
+
+void LoadClient::RunSteady() {
+	auto period = duration_cast<steady_clock::duration>(duration<double>(1.0 / options.rate));
+	uint64_t probeInterval = std::max<uint64_t>(1, (uint64_t)std::llround(options.rate / options.probeRate));
+
+	auto nextTick = steady_clock::now();
+	for (uint64_t tick = 0; nextTick < endTime; ++tick) {
+		SendUpdate(tick);
+		if (tick % probeInterval == 0) {
+			SendProbe();
+		}
+		nextTick += period;
+		std::this_thread::sleep_until(nextTick);
+	}
+}
+
+
+void LoadClient::RunBurst() {
+	auto period = duration_cast<steady_clock::duration>(duration<double>(1.0 / options.probeRate));
+	auto nextBurst = steady_clock::now();
+	auto nextTick = nextBurst;
+	uint64_t tick = 0;
+
+	while (nextTick < endTime) {
+		if (nextTick >= nextBurst) {
+			for (int i = 0; i < options.burstSize; ++i) {
+				SendUpdate(tick++);
+			}
+			nextBurst += seconds(1);
+		}
+		// the first probe after the burst queues up behind it
+		SendProbe();
+		nextTick += period;
+		std::this_thread::sleep_until(nextTick);
+	}
+}
+
+
+void LoadClient::RunQuery() {
+	while (steady_clock::now() < endTime) {
+		{
+			std::unique_lock<std::mutex> lk(pendingMutex);
+			bool hasRoom = pendingCondvar.wait_until(lk, endTime, [this] {
+				return queriesInFlight < (size_t)options.queryDepth;
+			});
+			if (!hasRoom) {
+				break;
+			}
+		}
+		SendProbe();
+	}
+}
+
+
+void LoadClient::RunReconnect() {
+	auto runEnd = endTime;
+	while (steady_clock::now() < runEnd) {
+		endTime = std::min(runEnd, steady_clock::now() + duration_cast<steady_clock::duration>(duration<double>(options.reconnectPeriod)));
+		RunSteady();
+		if (endTime >= runEnd) {
+			break;
+		}
+
+		// in-flight queries would fail with the connection, and count as lost
+		WaitPendingQueries(steady_clock::now() + milliseconds(options.queryTimeout));
+		Disconnect();
+		while (!Connect() && steady_clock::now() < runEnd) {
+			std::this_thread::sleep_for(milliseconds(100));
+		}
+	}
+	endTime = runEnd;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Latency collection
+
+void LoadClient::CollectorThreadFunc() {
+	std::unique_lock<std::mutex> lk(pendingMutex);
+	while (true) {
+		pendingCondvar.wait(lk, [this] { return !runCollector || !pendingQueries.empty(); });
+		if (pendingQueries.empty()) {
+			return;
+		}
+		PendingQuery query = std::move(pendingQueries.front());
+		pendingQueries.pop_front();
+		lk.unlock();
+
+		// replies arrive in order, so waiting for the oldest one first is accurate
+		bool isAnswered = query.reply.wait_until(query.sendTime + milliseconds(options.queryTimeout)) == std::future_status::ready;
+		auto replyTime = steady_clock::now();
+		if (isAnswered) {
+			try {
+				query.reply.get();
+			}
+			catch (std::exception&) {
+				isAnswered = false;
+			}
+		}
+
+		lk.lock();
+		if (isAnswered) {
+			results.queriesAnswered++;
+			results.queryLatency.Add(duration_cast<nanoseconds>(replyTime - query.sendTime).count() / 1000.0);
+		}
+		else {
+			results.queriesLost++;
+		}
+		queriesInFlight--;
+		pendingCondvar.notify_all();
+	}
+}
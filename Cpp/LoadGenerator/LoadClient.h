@@ -0,0 +1,131 @@
+#pragma once
+
+#include <RemoteControlClient/RemoteControlClient.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <chrono>
+
+
+/// Scripted behaviour of a simulated client.
+enum class eLoadProfile {
+	STEADY,		// fixed rate updates of all channels, occasional latency probes
+	BURST,		// back-to-back batches once a second, idle in between
+	QUERY,		// a fixed number of queries always in flight
+	RECONNECT,	// steady updates, dropping and re-establishing the connection periodically
+};
+
+const char* GetProfileName(eLoadProfile profile);
+bool ParseProfileName(const std::string& name, eLoadProfile& profile);
+
+
+/// Parameters shared by all clients.
+struct LoadOptions {
+	std::string address = "127.0.0.1";
+	int channels = 8;				// channels driven by each client
+	double rate = 50.0;				// Hz, steady updates
+	double probeRate = 10.0;		// Hz, latency probes of non-query profiles
+	int burstSize = 50;				// batches per burst
+	int queryDepth = 16;			// queries in flight for the query profile
+	double reconnectPeriod = 2.0;	// seconds connected between reconnects
+	int queryTimeout = 1000;		// ms until an unanswered query counts as lost
+};
+
+
+/// Collects samples and summarizes them.
+class LatencyStats {
+public:
+	struct Summary {
+		size_t count = 0;
+		double min = 0, mean = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
+	};
+
+	void Add(double sample);
+	void Add(const LatencyStats& other);
+	Summary Summarize() const;
+private:
+	std::vector<double> samples;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// A simulated client running a profile on its own thread.
+/// Latency is measured with servo queries: a separate thread waits for the
+/// replies in order, so the samples are not quantized to the update rate.
+////////////////////////////////////////////////////////////////////////////////
+
+class LoadClient {
+public:
+	struct Results {
+		uint64_t commandsSent = 0;		// accepted by the socket
+		uint64_t commandsFailed = 0;	// could not be sent, e.g. while reconnecting
+		uint64_t queriesSent = 0;
+		uint64_t queriesAnswered = 0;
+		uint64_t queriesLost = 0;		// timed out or failed with the connection
+		uint64_t connects = 0;
+		uint64_t connectFailures = 0;
+		LatencyStats queryLatency;		// microseconds
+		LatencyStats connectLatency;	// microseconds
+	};
+
+public:
+	/// \param channelBase The first servo channel of this client on the server.
+	LoadClient(int id, eLoadProfile profile, const LoadOptions& options, uint16_t serverPort, int channelBase);
+	~LoadClient();
+
+	/// Run the profile in the background until the given time.
+	void Start(std::chrono::steady_clock::time_point endTime);
+	/// Wait for the profile to finish and disconnect.
+	void Join();
+
+	int GetId() const { return id; }
+	eLoadProfile GetProfile() const { return profile; }
+	uint16_t GetServerPort() const { return serverPort; }
+	int GetChannelBase() const { return channelBase; }
+	/// Only valid after Join.
+	const Results& GetResults() const { return results; }
+private:
+	void Run();
+	bool Connect();
+	void Disconnect();
+	void SendUpdate(uint64_t tick);
+	void SendProbe();
+	bool WaitPendingQueries(std::chrono::steady_clock::time_point until);
+
+	void RunSteady();
+	void RunBurst();
+	void RunQuery();
+	void RunReconnect();
+
+	void CollectorThreadFunc();
+private:
+	int id;
+	eLoadProfile profile;
+	LoadOptions options;
+	uint16_t serverPort;
+	int channelBase;
+	std::chrono::steady_clock::time_point endTime;
+
+	RemoteControlClient client;
+	std::thread runThread;
+	Results results;
+
+	// queries in flight, answered in order
+	struct PendingQuery {
+		std::chrono::steady_clock::time_point sendTime;
+		std::future<float> reply;
+	};
+	std::thread collectorThread;
+	std::mutex pendingMutex;
+	std::condition_variable pendingCondvar;
+	std::deque<PendingQuery> pendingQueries;
+	size_t queriesInFlight; // queued plus the one the collector waits for
+	bool runCollector;
+};
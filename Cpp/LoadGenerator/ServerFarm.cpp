@@ -0,0 +1,347 @@
+#include "ServerFarm.h"
+
+#include <RemoteControlServer/RemoteControlServer.h>
+#include <RemoteControlServer/IServoProvider.h>
+#include <RemoteControlProtocol/RcpListener.h>
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+
+#ifdef REMCON_LINUX
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+using namespace std::chrono;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Server instances
+
+// Remembers servo states like a dummy, but counts commands per client instead of logging.
+class CountingServoProvider : public IServoProvider {
+public:
+	CountingServoProvider(int slots, int channelsPerSlot)
+		: channelsPerSlot(channelsPerSlot), states(slots * channelsPerSlot, 0.0f), counts(new std::atomic<uint64_t>[slots])
+	{
+		for (int i = 0; i < slots; ++i) {
+			counts[i] = 0;
+		}
+	}
+
+	int GetNumPorts() const override {
+		return (int)states.size();
+	}
+	void SetState(float state, int port = 0) override {
+		if (0 <= port && port < (int)states.size()) {
+			states[port] = state;
+			counts[port / channelsPerSlot]++;
+		}
+	}
+	float GetState(int port = 0) const override {
+		return 0 <= port && port < (int)states.size() ? states[port] : 0.0f;
+	}
+	uint64_t GetCount(int slot) const {
+		return counts[slot];
+	}
+private:
+	int channelsPerSlot;
+	std::vector<float> states;
+	std::unique_ptr<std::atomic<uint64_t>[]> counts;
+};
+
+
+class ServerFarm::Instance {
+public:
+	/// \param listener Take sessions from it instead of an own port, null if none.
+	/// \param provider Not owned.
+	Instance(CountingServoProvider* provider, RcpListener* listener) : provider(provider), listener(listener) {
+		server.GetManagerServo().AddProvider(provider, 0);
+	}
+
+	bool Start() {
+		if (!listener && !server.SetLocalPort(RcpSocket::AnyPort)) {
+			return false;
+		}
+		// a listening server cannot be interrupted, so the thread is never joined
+		// and instances are never destroyed
+		std::thread([this] { Serve(); }).detach();
+		return true;
+	}
+
+	uint16_t GetPort() const {
+		return listener ? listener->getLocalPort() : server.GetLocalPort();
+	}
+
+	uint64_t GetCount(int slot) const {
+		return provider->GetCount(slot);
+	}
+private:
+	void Serve() {
+		while (true) {
+			bool isListening = listener ? server.Listen(*listener) : server.Listen();
+			if (!isListening || !server.Reply(true)) {
+				continue;
+			}
+			while (server.IsConnected()) {
+				std::this_thread::sleep_for(milliseconds(10));
+			}
+		}
+	}
+private:
+	CountingServoProvider* provider;
+	RcpListener* listener;
+	RemoteControlServer server;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Child process plumbing
+
+#ifdef REMCON_LINUX
+static bool WriteAll(int fd, const std::string& data) {
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t result = write(fd, data.data() + written, data.size() - written);
+		if (result <= 0) {
+			return false;
+		}
+		written += result;
+	}
+	return true;
+}
+
+static bool ReadLine(int fd, std::string& line) {
+	line.clear();
+	char c;
+	while (read(fd, &c, 1) == 1) {
+		if (c == '\n') {
+			return true;
+		}
+		line += c;
+	}
+	return false;
+}
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Farm
+
+ServerFarm::ServerFarm(int numServers, int slotsPerServer, int channelsPerSlot, bool separateProcess, int numShards)
+	: numServers(numServers), slotsPerServer(slotsPerServer), channelsPerSlot(channelsPerSlot), numShards(numShards)
+{
+#ifdef REMCON_LINUX
+	this->separateProcess = separateProcess;
+#else
+	this->separateProcess = false;
+#endif
+	childPid = -1;
+	commandPipe = -1;
+	resultPipe = -1;
+	listener = nullptr;
+	sharedProvider = nullptr;
+}
+
+
+ServerFarm::~ServerFarm() {
+#ifdef REMCON_LINUX
+	if (childPid > 0) {
+		kill(childPid, SIGKILL);
+		waitpid(childPid, nullptr, 0);
+		close(commandPipe);
+		close(resultPipe);
+	}
+#endif
+}
+
+
+bool ServerFarm::Start() {
+	return separateProcess ? StartChildProcess() : StartInProcess();
+}
+
+
+bool ServerFarm::StartInProcess() {
+	if (numShards > 0) {
+		listener = new RcpListener();
+		listener->setBacklog(numServers * slotsPerServer);
+		if (!listener->bind(RcpSocket::AnyPort, numShards)) {
+			return false;
+		}
+		sharedProvider = new CountingServoProvider(numServers * slotsPerServer, channelsPerSlot);
+	}
+	for (int i = 0; i < numServers; ++i) {
+		CountingServoProvider* provider = sharedProvider ? sharedProvider : new CountingServoProvider(slotsPerServer, channelsPerSlot);
+		Instance* instance = new Instance(provider, listener);
+		if (!instance->Start()) {
+			delete instance;
+			return false;
+		}
+		instances.push_back(instance);
+		ports.push_back(instance->GetPort());
+	}
+	return true;
+}
+
+
+bool ServerFarm::StartChildProcess() {
+#ifdef REMCON_LINUX
+	int toChild[2], fromChild[2];
+	if (pipe(toChild) != 0) {
+		return false;
+	}
+	if (pipe(fromChild) != 0) {
+		close(toChild[0]);
+		close(toChild[1]);
+		return false;
+	}
+
+	// must happen before the parent starts any threads
+	pid_t pid = fork();
+	if (pid < 0) {
+		return false;
+	}
+	if (pid == 0) {
+		close(toChild[1]);
+		close(fromChild[0]);
+		// the server prints diagnostics, they must not mix with the report
+		if (!freopen("/dev/null", "w", stdout)) {
+			_exit(1);
+		}
+
+		// report ports, wait for the stop command, then report counts
+		std::ostringstream portsLine;
+		if (StartInProcess()) {
+			portsLine << "ports";
+			for (auto port : ports) {
+				portsLine << " " << port;
+			}
+		}
+		portsLine << "\n";
+		WriteAll(fromChild[1], portsLine.str());
+
+		std::string command;
+		ReadLine(toChild[0], command);
+
+		std::ostringstream countsLine;
+		countsLine << "counts";
+		for (auto& server : CollectCounts()) {
+			for (auto count : server) {
+				countsLine << " " << count;
+			}
+		}
+		countsLine << "\n";
+		WriteAll(fromChild[1], countsLine.str());
+		_exit(0);
+	}
+
+	close(toChild[0]);
+	close(fromChild[1]);
+	childPid = pid;
+	commandPipe = toChild[1];
+	resultPipe = fromChild[0];
+
+	std::string line;
+	if (!ReadLine(resultPipe, line)) {
+		return false;
+	}
+	std::istringstream ls(line);
+	std::string tag;
+	uint16_t port;
+	ls >> tag;
+	while (ls >> port) {
+		ports.push_back(port);
+	}
+	return tag == "ports" && (int)ports.size() == numServers;
+#else
+	return false;
+#endif
+}
+
+
+std::vector<std::vector<uint64_t>> ServerFarm::CollectCounts() const {
+	std::vector<std::vector<uint64_t>> counts;
+	for (int server = 0; server < (int)instances.size(); ++server) {
+		counts.emplace_back();
+		for (int slot = 0; slot < slotsPerServer; ++slot) {
+			// a shared provider counts the global channel blocks
+			uint64_t count = sharedProvider
+				? sharedProvider->GetCount(server * slotsPerServer + slot)
+				: instances[server]->GetCount(slot);
+			counts.back().push_back(count);
+		}
+	}
+	return counts;
+}
+
+
+int ServerFarm::GetChannelBase(int server, int slot) const {
+	return numShards > 0 ? (server * slotsPerServer + slot) * channelsPerSlot : slot * channelsPerSlot;
+}
+
+
+std::vector<std::vector<uint64_t>> ServerFarm::Stop() {
+	if (!separateProcess) {
+		return CollectCounts();
+	}
+
+	std::vector<std::vector<uint64_t>> counts(numServers, std::vector<uint64_t>(slotsPerServer, 0));
+#ifdef REMCON_LINUX
+	if (childPid <= 0) {
+		return counts;
+	}
+	std::string line;
+	if (WriteAll(commandPipe, "stop\n") && ReadLine(resultPipe, line)) {
+		std::istringstream ls(line);
+		std::string tag;
+		ls >> tag;
+		for (auto& server : counts) {
+			for (auto& count : server) {
+				ls >> count;
+			}
+		}
+	}
+	waitpid(childPid, nullptr, 0);
+	close(commandPipe);
+	close(resultPipe);
+	childPid = -1;
+#endif
+	return counts;
+}
+
+
+double ServerFarm::GetCpuSeconds() const {
+#ifdef REMCON_LINUX
+	if (childPid <= 0) {
+		return -1.0;
+	}
+	std::ifstream file("/proc/" + std::to_string(childPid) + "/stat");
+	std::string stat;
+	std::getline(file, stat);
+
+	// the command name may contain spaces, fields are counted from its closing paren
+	size_t nameEnd = stat.rfind(')');
+	if (nameEnd == std::string::npos) {
+		return -1.0;
+	}
+	std::istringstream fields(stat.substr(nameEnd + 1));
+	std::string field;
+	for (int i = 3; i < 14; ++i) {
+		fields >> field;
+	}
+	unsigned long long utime = 0, stime = 0;
+	if (!(fields >> utime >> stime)) {
+		return -1.0;
+	}
+	return double(utime + stime) / sysconf(_SC_CLK_TCK);
+#else
+	return -1.0;
+#endif
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+
+class RcpListener;
+class CountingServoProvider;
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Runs RemoteControlServer instances on loopback for the load generator.
+/// A server only has one session at a time, clients assigned to the same
+/// server are served one after the other.
+/// Every client gets its own block of channels on its server, so the commands
+/// that arrived can be counted per client.
+/// On Linux the servers run in a forked process by default, so their CPU time
+/// can be measured separately from the clients'.
+/// With shards, all servers take their sessions from one listener on a single
+/// port, and a client is served by whichever server is free. Channel blocks
+/// are then global, on a provider the servers share.
+////////////////////////////////////////////////////////////////////////////////
+
+class ServerFarm {
+public:
+	/// \param slotsPerServer The number of clients a server may have to serve.
+	/// \param channelsPerSlot The number of channels a client drives.
+	/// \param separateProcess Run servers in a child process. Ignored where unsupported.
+	/// \param numShards Listener shards on a shared port, 0 for a port per server.
+	ServerFarm(int numServers, int slotsPerServer, int channelsPerSlot, bool separateProcess, int numShards = 0);
+	~ServerFarm();
+	ServerFarm(const ServerFarm&) = delete;
+	ServerFarm& operator=(const ServerFarm&) = delete;
+
+	/// Bind and start the servers.
+	/// \return False if any of them could not be started.
+	bool Start();
+
+	/// Stop the servers and collect the number of servo commands they received.
+	/// \return Command counts indexed by [server][slot].
+	std::vector<std::vector<uint64_t>> Stop();
+
+	/// The ports the servers listen on, one per server.
+	const std::vector<uint16_t>& GetPorts() const { return ports; }
+
+	/// The first channel of a client's block.
+	int GetChannelBase(int server, int slot) const;
+
+	bool IsSeparateProcess() const { return separateProcess; }
+
+	/// CPU time used by the servers so far, in seconds.
+	/// \return Negative if the servers share the process with the clients.
+	double GetCpuSeconds() const;
+private:
+	class Instance;
+
+	bool StartInProcess();
+	bool StartChildProcess();
+	std::vector<std::vector<uint64_t>> CollectCounts() const;
+private:
+	int numServers;
+	int slotsPerServer;
+	int channelsPerSlot;
+	bool separateProcess;
+	int numShards;
+	std::vector<uint16_t> ports;
+	std::vector<Instance*> instances; // in this process only
+	RcpListener* listener; // with shards, like the instances, never destroyed
+	CountingServoProvider* sharedProvider; // with shards
+
+	// child process
+	int childPid;
+	int commandPipe; // to the child
+	int resultPipe; // from the child
+};
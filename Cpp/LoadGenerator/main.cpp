@@ -0,0 +1,269 @@
+#include "LoadClient.h"
+#include "ServerFarm.h"
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+
+using namespace std;
+using namespace std::chrono;
+
+// Usage: LoadGenerator [options]
+//   --clients <n>             simulated clients (4)
+//   --servers <n>             server instances, clients are spread round robin (= clients)
+//   --duration <s>            length of the run (10)
+//   --profile <p1,p2,...>     steady, burst, query or reconnect; clients cycle through the list (steady)
+//   --channels <n>            channels driven by each client (8)
+//   --rate <hz>               update rate of steady and reconnect clients (50)
+//   --probe-rate <hz>         latency probes of non-query clients (10)
+//   --burst <n>               batches per burst (50)
+//   --query-depth <n>         queries in flight for query clients (16)
+//   --reconnect-period <s>    time between reconnects (2)
+//   --shards <n>              servers share one port, sharded over n sockets and workers (0, a port per server)
+//   --in-process              run the servers in this process, server CPU is not measured
+//   --output <file>           write the JSON report here instead of stdout
+//
+// A client's loss is the ratio of its servo commands that did not reach the
+// server's provider; latency is the round trip of servo queries, in microseconds.
+// A client sends a packet per update, so with --channels 1 the aggregate
+// command rate in the totals is the packet rate the servers handled.
+
+
+struct Arguments {
+	int clients = 4;
+	int servers = 0;
+	int shards = 0;
+	double duration = 10.0;
+	vector<eLoadProfile> profiles = { eLoadProfile::STEADY };
+	bool inProcess = false;
+	string output;
+	LoadOptions options;
+};
+
+
+static bool ParseArguments(int argc, char* argv[], Arguments& args) {
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--in-process") {
+			args.inProcess = true;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			cerr << "Missing value for " << arg << endl;
+			return false;
+		}
+		string value = argv[++i];
+		if (arg == "--clients") {
+			args.clients = atoi(value.c_str());
+		}
+		else if (arg == "--servers") {
+			args.servers = atoi(value.c_str());
+		}
+		else if (arg == "--shards") {
+			args.shards = atoi(value.c_str());
+		}
+		else if (arg == "--duration") {
+			args.duration = atof(value.c_str());
+		}
+		else if (arg == "--profile") {
+			args.profiles.clear();
+			istringstream names(value);
+			string name;
+			while (getline(names, name, ',')) {
+				eLoadProfile profile;
+				if (!ParseProfileName(name, profile)) {
+					cerr << "Unknown profile: " << name << endl;
+					return false;
+				}
+				args.profiles.push_back(profile);
+			}
+		}
+		else if (arg == "--channels") {
+			args.options.channels = atoi(value.c_str());
+		}
+		else if (arg == "--rate") {
+			args.options.rate = atof(value.c_str());
+		}
+		else if (arg == "--probe-rate") {
+			args.options.probeRate = atof(value.c_str());
+		}
+		else if (arg == "--burst") {
+			args.options.burstSize = atoi(value.c_str());
+		}
+		else if (arg == "--query-depth") {
+			args.options.queryDepth = atoi(value.c_str());
+		}
+		else if (arg == "--reconnect-period") {
+			args.options.reconnectPeriod = atof(value.c_str());
+		}
+		else if (arg == "--output") {
+			args.output = value;
+		}
+		else {
+			cerr << "Unknown option: " << arg << endl;
+			return false;
+		}
+	}
+	if (args.servers <= 0) {
+		args.servers = args.clients;
+	}
+	bool isValid = args.clients > 0 && args.shards >= 0 && args.duration > 0 && !args.profiles.empty()
+		&& args.options.channels > 0 && args.options.rate > 0 && args.options.probeRate > 0
+		&& args.options.burstSize > 0 && args.options.queryDepth > 0 && args.options.reconnectPeriod > 0;
+	if (!isValid) {
+		cerr << "Counts, rates and durations must be positive" << endl;
+	}
+	return isValid;
+}
+
+
+static void WriteSummary(ostream& os, const LatencyStats& stats) {
+	auto summary = stats.Summarize();
+	os << "{ \"count\": " << summary.count
+		<< ", \"min\": " << summary.min
+		<< ", \"mean\": " << summary.mean
+		<< ", \"p50\": " << summary.p50
+		<< ", \"p90\": " << summary.p90
+		<< ", \"p99\": " << summary.p99
+		<< ", \"max\": " << summary.max << " }";
+}
+
+
+static double LossRatio(uint64_t sent, uint64_t received) {
+	return sent == 0 || received >= sent ? 0.0 : double(sent - received) / sent;
+}
+
+
+int main(int argc, char* argv[]) {
+	Arguments args;
+	if (!ParseArguments(argc, argv, args)) {
+		return 1;
+	}
+	int slotsPerServer = (args.clients + args.servers - 1) / args.servers;
+
+	// servers first, the child process must be forked before any thread starts
+	ServerFarm farm(args.servers, slotsPerServer, args.options.channels, !args.inProcess, args.shards);
+	if (!farm.Start()) {
+		cerr << "Could not start servers" << endl;
+		return 1;
+	}
+
+	vector<unique_ptr<LoadClient>> clients;
+	for (int i = 0; i < args.clients; ++i) {
+		int server = i % args.servers;
+		int slot = i / args.servers;
+		eLoadProfile profile = args.profiles[i % args.profiles.size()];
+		clients.emplace_back(new LoadClient(i, profile, args.options, farm.GetPorts()[server], farm.GetChannelBase(server, slot)));
+	}
+
+	cerr << "Running " << args.clients << " clients against " << args.servers << " servers for " << args.duration << " s" << endl;
+	double cpuStart = farm.GetCpuSeconds();
+	auto startTime = steady_clock::now();
+	auto endTime = startTime + duration_cast<steady_clock::duration>(duration<double>(args.duration));
+	for (auto& client : clients) {
+		client->Start(endTime);
+	}
+	for (auto& client : clients) {
+		client->Join();
+	}
+	double wallSeconds = duration<double>(steady_clock::now() - startTime).count();
+	double cpuEnd = farm.GetCpuSeconds();
+	auto counts = farm.Stop();
+
+	// report
+	ofstream file;
+	if (!args.output.empty()) {
+		file.open(args.output);
+		if (!file.is_open()) {
+			cerr << "Could not open " << args.output << endl;
+			return 1;
+		}
+	}
+	ostream& os = args.output.empty() ? cout : file;
+	os << fixed << setprecision(3);
+
+	os << "{" << endl;
+	os << "  \"config\": { \"clients\": " << args.clients
+		<< ", \"servers\": " << args.servers
+		<< ", \"shards\": " << args.shards
+		<< ", \"duration_s\": " << args.duration
+		<< ", \"profiles\": [";
+	for (size_t i = 0; i < args.profiles.size(); ++i) {
+		os << (i > 0 ? ", " : "") << "\"" << GetProfileName(args.profiles[i]) << "\"";
+	}
+	os << "], \"channels\": " << args.options.channels
+		<< ", \"rate_hz\": " << args.options.rate
+		<< ", \"probe_rate_hz\": " << args.options.probeRate
+		<< ", \"burst_size\": " << args.options.burstSize
+		<< ", \"query_depth\": " << args.options.queryDepth
+		<< ", \"reconnect_period_s\": " << args.options.reconnectPeriod
+		<< ", \"server_process\": \"" << (farm.IsSeparateProcess() ? "separate" : "shared") << "\" }," << endl;
+
+	uint64_t totalSent = 0, totalReceived = 0, totalQueries = 0, totalAnswered = 0, totalLost = 0;
+	LatencyStats totalLatency;
+	os << "  \"clients\": [" << endl;
+	for (size_t i = 0; i < clients.size(); ++i) {
+		const LoadClient& client = *clients[i];
+		const LoadClient::Results& results = client.GetResults();
+		int server = client.GetId() % args.servers;
+		uint64_t received = counts[server][client.GetId() / args.servers];
+
+		totalSent += results.commandsSent;
+		totalReceived += received;
+		totalQueries += results.queriesSent;
+		totalAnswered += results.queriesAnswered;
+		totalLost += results.queriesLost;
+		totalLatency.Add(results.queryLatency);
+
+		os << "    { \"id\": " << client.GetId()
+			<< ", \"profile\": \"" << GetProfileName(client.GetProfile()) << "\""
+			<< ", \"server\": " << server
+			<< ", \"commands_sent\": " << results.commandsSent
+			<< ", \"commands_failed\": " << results.commandsFailed
+			<< ", \"commands_received\": " << received
+			<< ", \"loss\": " << setprecision(6) << LossRatio(results.commandsSent, received) << setprecision(3)
+			<< ", \"queries_sent\": " << results.queriesSent
+			<< ", \"queries_answered\": " << results.queriesAnswered
+			<< ", \"queries_lost\": " << results.queriesLost
+			<< ", \"connects\": " << results.connects
+			<< ", \"connect_failures\": " << results.connectFailures
+			<< ", \"query_latency_us\": ";
+		WriteSummary(os, results.queryLatency);
+		os << ", \"connect_latency_us\": ";
+		WriteSummary(os, results.connectLatency);
+		os << " }" << (i + 1 < clients.size() ? "," : "") << endl;
+	}
+	os << "  ]," << endl;
+
+	os << "  \"server\": { \"wall_s\": " << wallSeconds << ", \"cpu_s\": ";
+	if (cpuStart >= 0 && cpuEnd >= 0) {
+		os << cpuEnd - cpuStart << ", \"cpu_percent\": " << 100.0 * (cpuEnd - cpuStart) / wallSeconds;
+	}
+	else {
+		os << "null, \"cpu_percent\": null";
+	}
+	os << " }," << endl;
+
+	os << "  \"totals\": { \"commands_sent\": " << totalSent
+		<< ", \"commands_received\": " << totalReceived
+		<< ", \"commands_per_s\": " << totalReceived / wallSeconds
+		<< ", \"loss\": " << setprecision(6) << LossRatio(totalSent, totalReceived) << setprecision(3)
+		<< ", \"queries_sent\": " << totalQueries
+		<< ", \"queries_answered\": " << totalAnswered
+		<< ", \"queries_lost\": " << totalLost
+		<< ", \"query_latency_us\": ";
+	WriteSummary(os, totalLatency);
+	os << " }" << endl;
+	os << "}" << endl;
+
+	// in-process servers are still listening and cannot be stopped
+	os.flush();
+	_Exit(0);
+}
@@ -0,0 +1,227 @@
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpRelay.h>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std;
+using namespace std::chrono;
+
+// Usage:
+//	Relay [--retransmit client|server] [--batch <n>] <port> <server address> <server port>
+//		Forwards the datagrams of the clients connecting to port to the server and back,
+//		and prints what went over each leg every second. --retransmit resends reliable
+//		datagrams lost on that leg, the lossy one.
+//	Relay --benchmark [--batch <n>] [--seconds <s>]
+//		Connects two sockets on loopback directly, then through a relay forwarding one
+//		datagram at a time, then in batches, and compares the round trip and the
+//		throughput of unreliable messages.
+
+
+struct BenchmarkResult {
+	microseconds roundTripMedian = microseconds(0);
+	microseconds roundTrip99 = microseconds(0);
+	uint64_t sent = 0;
+	uint64_t received = 0;
+	uint64_t forwarded = 0; // by the relay
+	double seconds = 0;
+};
+
+
+// batchSize 0 connects directly
+BenchmarkResult Benchmark(size_t batchSize, double seconds) {
+	BenchmarkResult result;
+	RcpSocket server, client;
+	RcpRelay relay;
+	server.bind(RcpSocket::AnyPort);
+	client.bind(RcpSocket::AnyPort);
+	uint16_t port = server.getLocalPort();
+	if (batchSize > 0) {
+		relay.setBatchSize(batchSize);
+		if (!relay.start(0, sf::IpAddress::LocalHost, port)) {
+			cerr << "Could not start the relay" << endl;
+			return result;
+		}
+		port = relay.getLocalPort();
+	}
+	thread acceptThread([&] { server.accept(2000); });
+	client.connect("127.0.0.1", port, 2000);
+	acceptThread.join();
+	if (!client.isConnected() || !server.isConnected()) {
+		cerr << "Could not connect" << endl;
+		return result;
+	}
+
+	// the server echoes pings and counts the rest
+	atomic_bool isRunning(true);
+	atomic<uint64_t> received(0);
+	thread echoThread([&] {
+		RcpPacket packet;
+		while (isRunning) {
+			if (!server.receive(packet, 100)) {
+				continue;
+			}
+			if (packet.getDataSize() == sizeof(uint64_t)) {
+				server.send(packet.getData(), packet.getDataSize(), false);
+			}
+			else {
+				received++;
+			}
+		}
+	});
+
+	// round trip of pings, one at a time
+	vector<microseconds> roundTrips;
+	RcpPacket packet;
+	for (uint64_t i = 0; i < 2000; ++i) {
+		auto start = steady_clock::now();
+		client.send(&i, sizeof(i), false);
+		while (client.receive(packet, 100)) {
+			if (packet.getDataSize() == sizeof(i) && *(const uint64_t*)packet.getData() == i) {
+				roundTrips.push_back(duration_cast<microseconds>(steady_clock::now() - start));
+				break;
+			}
+		}
+	}
+	if (!roundTrips.empty()) {
+		sort(roundTrips.begin(), roundTrips.end());
+		result.roundTripMedian = roundTrips[roundTrips.size() / 2];
+		result.roundTrip99 = roundTrips[roundTrips.size() * 99 / 100];
+	}
+
+	// throughput of unreliable messages, as fast as they can be sent
+	vector<uint8_t> message(1000, 0xAA);
+	uint64_t forwardedBefore = relay.getStatistics(RcpRelay::SERVER_LEG).forwarded;
+	auto start = steady_clock::now();
+	auto end = start + duration_cast<steady_clock::duration>(duration<double>(seconds));
+	while (steady_clock::now() < end) {
+		for (int i = 0; i < 64; ++i) {
+			client.send(message.data(), message.size(), false);
+		}
+		result.sent += 64;
+	}
+	this_thread::sleep_for(milliseconds(100));
+	result.received = received;
+	result.forwarded = relay.getStatistics(RcpRelay::SERVER_LEG).forwarded - forwardedBefore;
+	result.seconds = seconds;
+
+	isRunning = false;
+	echoThread.join();
+	client.disconnect();
+	server.disconnect();
+	relay.stop();
+	return result;
+}
+
+
+int RunBenchmark(size_t batchSize, double seconds) {
+	cout << "Round trip of 2000 pings, and " << seconds << " s of 1000 byte messages, on loopback" << endl;
+	cout << "The receiving socket takes fewer than sent, the relay's rate is what the hop can forward" << endl << endl;
+	cout << left << setw(24) << "" << right << setw(12) << "median" << setw(12) << "99%" << setw(16) << "received/s" << setw(12) << "MB/s"
+		<< setw(12) << "delivered" << setw(16) << "forwarded/s" << endl;
+
+	vector<pair<string, size_t>> runs = { { "direct", 0 }, { "relay, batch of 1", 1 } };
+	if (batchSize > 1) {
+		runs.push_back({ "relay, batch of " + to_string(batchSize), batchSize });
+	}
+	vector<BenchmarkResult> results;
+	for (auto& run : runs) {
+		BenchmarkResult result = Benchmark(run.second, seconds);
+		results.push_back(result);
+		double rate = result.received / result.seconds;
+		cout << left << setw(24) << run.first << right
+			<< setw(9) << result.roundTripMedian.count() << " us"
+			<< setw(9) << result.roundTrip99.count() << " us"
+			<< setw(16) << fixed << setprecision(0) << rate
+			<< setw(12) << setprecision(1) << rate * 1000 / 1e6
+			<< setw(11) << setprecision(1) << (result.sent > 0 ? 100.0 * result.received / result.sent : 0.0) << "%";
+		if (run.second > 0) {
+			cout << setw(16) << setprecision(0) << result.forwarded / result.seconds;
+		}
+		cout << endl;
+	}
+
+	// a hop adds to the way there and back
+	cout << endl;
+	for (size_t i = 1; i < results.size(); ++i) {
+		auto added = (results[i].roundTripMedian - results[0].roundTripMedian) / 2;
+		cout << "added latency per hop, " << runs[i].first << ": " << added.count() << " us one way" << endl;
+	}
+	return 0;
+}
+
+
+int RunRelay(uint16_t port, const string& serverAddress, uint16_t serverPort, size_t batchSize, int retransmit) {
+	RcpRelay relay;
+	relay.setBatchSize(batchSize);
+	if (retransmit >= 0) {
+		relay.setLocalRetransmission((RcpRelay::eLeg)retransmit, true);
+	}
+	if (!relay.start(port, serverAddress, serverPort)) {
+		cerr << "Could not bind port " << port << endl;
+		return 1;
+	}
+	cout << "Relaying from port " << relay.getLocalPort() << " to " << serverAddress << ":" << serverPort
+		<< " from port " << relay.getLocalPort(RcpRelay::SERVER_LEG) << endl;
+
+	while (true) {
+		this_thread::sleep_for(seconds(1));
+		auto toClient = relay.getStatistics(RcpRelay::CLIENT_LEG);
+		auto toServer = relay.getStatistics(RcpRelay::SERVER_LEG);
+		cout << "to server: " << toServer.forwarded << " datagrams, " << toServer.bytes << " bytes, "
+			<< toServer.retransmitted << " resent, round trip " << toServer.roundTrip.count() << " us | "
+			<< "to client: " << toClient.forwarded << " datagrams, " << toClient.bytes << " bytes, "
+			<< toClient.retransmitted << " resent, round trip " << toClient.roundTrip.count() << " us | "
+			<< relay.getRejectedCount() << " rejected" << endl;
+	}
+}
+
+
+int main(int argc, char* argv[]) {
+	bool isBenchmark = false;
+	size_t batchSize = 32;
+	double seconds = 1.0;
+	int retransmit = -1;
+	vector<string> positional;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--benchmark") {
+			isBenchmark = true;
+			continue;
+		}
+		if (arg == "--batch" && i + 1 < argc) {
+			batchSize = max(1, atoi(argv[++i]));
+			continue;
+		}
+		if (arg == "--seconds" && i + 1 < argc) {
+			seconds = max(0.1, atof(argv[++i]));
+			continue;
+		}
+		if (arg == "--retransmit" && i + 1 < argc) {
+			string leg = argv[++i];
+			retransmit = leg == "client" ? RcpRelay::CLIENT_LEG : leg == "server" ? RcpRelay::SERVER_LEG : -1;
+			continue;
+		}
+		positional.push_back(arg);
+	}
+
+	if (isBenchmark) {
+		return RunBenchmark(batchSize, seconds);
+	}
+	if (positional.size() != 3) {
+		cerr << "Usage: Relay [--retransmit client|server] [--batch <n>] <port> <server address> <server port>" << endl;
+		cerr << "       Relay --benchmark [--batch <n>] [--seconds <s>]" << endl;
+		return 1;
+	}
+	return RunRelay((uint16_t)strtoul(positional[0].c_str(), nullptr, 10), positional[1], (uint16_t)strtoul(positional[2].c_str(), nullptr, 10), batchSize, retransmit);
+}
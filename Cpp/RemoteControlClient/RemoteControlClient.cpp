@@ -0,0 +1,484 @@
+#include "RemoteControlClient.h"
+
+#include <RemoteControlServer/LatencyTrace.h>
+
+#include <functional>
+#include <chrono>
+#include <cmath>
+
+using namespace std::placeholders;
+using namespace std::chrono;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Constructor and destructor
+
+RemoteControlClient::RemoteControlClient() {
+	state = DISCONNECTED;
+	session = 0;
+	runReceiveThread = false;
+	isReceiveThreadDone = true;
+	isDisconnectRequested = false;
+	isDisconnectConfirmed = false;
+	nextRequestId = 1;
+	isTracing = false;
+	nextTraceId = 1;
+
+	// register handlers
+	messageDecoder.SetHandler(eMessageType::CONNECTION, std::bind(&RemoteControlClient::MH_Connection, this, _1, _2));
+	messageDecoder.SetHandler(eMessageType::ENUM_DEVICES, std::bind(&RemoteControlClient::MH_DeviceEnum, this, _1, _2));
+	messageDecoder.SetHandler(eMessageType::ENUM_CHANNELS, std::bind(&RemoteControlClient::MH_ChannelEnum, this, _1, _2));
+	messageDecoder.SetHandler(eMessageType::DEVICE_SERVO, std::bind(&RemoteControlClient::MH_Servo, this, _1, _2));
+}
+
+
+RemoteControlClient::~RemoteControlClient() {
+	Disconnect();
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Connection
+
+std::future<bool> RemoteControlClient::Connect(const std::string& address, uint16_t port, int timeout) {
+	eConnectionState expected = DISCONNECTED;
+	if (!state.compare_exchange_strong(expected, CONNECTING)) {
+		std::promise<bool> alreadyConnected;
+		alreadyConnected.set_value(false);
+		return alreadyConnected.get_future();
+	}
+
+	if (connectThread.joinable()) {
+		connectThread.join();
+	}
+	std::packaged_task<bool()> task(std::bind(&RemoteControlClient::ConnectFunc, this, address, port, timeout, false));
+	std::future<bool> result = task.get_future();
+	connectThread = std::thread(std::move(task));
+	return result;
+}
+
+
+std::future<bool> RemoteControlClient::Resume(const std::string& address, uint16_t port, int timeout) {
+	// the client may not have noticed yet that its server is lost
+	eConnectionState expected = state;
+	if (expected == CONNECTING || session == 0 || !state.compare_exchange_strong(expected, CONNECTING)) {
+		std::promise<bool> notResumable;
+		notResumable.set_value(false);
+		return notResumable.get_future();
+	}
+
+	if (connectThread.joinable()) {
+		connectThread.join();
+	}
+	std::packaged_task<bool()> task(std::bind(&RemoteControlClient::ConnectFunc, this, address, port, timeout, true));
+	std::future<bool> result = task.get_future();
+	connectThread = std::thread(std::move(task));
+	return result;
+}
+
+
+bool RemoteControlClient::ConnectFunc(std::string address, uint16_t port, int timeout, bool resume) {
+	// clean up after a connection the server closed, a lost server is not waited for
+	StopReceiveThread();
+	if (resume) {
+		unsigned linger = socket.getLinger();
+		socket.setLinger(0);
+		socket.disconnect();
+		socket.setLinger(linger);
+	}
+	else {
+		socket.disconnect();
+	}
+
+	try {
+		socket.connect(address, port, timeout);
+
+		ConnectionMessage request{ resume ? ConnectionMessage::RESUME_REQUEST : ConnectionMessage::CONNECTION_REQUEST };
+		request.session = resume ? ConnectionMessage::GetSessionId(session) : session.load();
+		auto data = request.Serialize();
+		socket.send(data.data(), data.size(), true);
+
+		// the server may ask for a password before replying
+		auto deadline = steady_clock::now() + milliseconds(timeout);
+		while (true) {
+			long long timeLeft = duration_cast<milliseconds>(deadline - steady_clock::now()).count();
+			RcpPacket packet;
+			if (timeLeft <= 0 || !socket.receive(packet, (int)timeLeft)) {
+				break;
+			}
+
+			ConnectionMessage msg;
+			if (!msg.Deserlialize(packet.getData(), packet.getDataSize())) {
+				continue;
+			}
+			if (msg.action == ConnectionMessage::PASSWORD_REQUEST) {
+				ConnectionMessage reply{ ConnectionMessage::PASSWORD_REPLY };
+				reply.password = password;
+				data = reply.Serialize();
+				socket.send(data.data(), data.size(), true);
+			}
+			else if (msg.action == ConnectionMessage::RESUME_CHALLENGE && resume) {
+				ConnectionMessage reply{ ConnectionMessage::RESUME_PROOF };
+				reply.challenge = ConnectionMessage::GetResumeProof(session, msg.challenge);
+				data = reply.Serialize();
+				socket.send(data.data(), data.size(), true);
+			}
+			else if (msg.action == ConnectionMessage::CONNECTION_REPLY) {
+				if (msg.isOk) {
+					session = msg.session;
+					state = CONNECTED;
+					StartReceiveThread();
+					return true;
+				}
+				break;
+			}
+		}
+	}
+	catch (RcpException&) {
+	}
+
+	socket.disconnect();
+	state = DISCONNECTED;
+	return false;
+}
+
+
+void RemoteControlClient::Disconnect(int timeout) {
+	if (connectThread.joinable()) {
+		connectThread.join();
+	}
+
+	if (state == CONNECTED) {
+		{
+			std::lock_guard<std::mutex> lk(disconnectMutex);
+			isDisconnectRequested = true;
+			isDisconnectConfirmed = false;
+		}
+
+		// tell the server, and wait for it to confirm
+		ConnectionMessage msg{ ConnectionMessage::DISCONNECT };
+		if (Send(msg.Serialize(), true)) {
+			std::unique_lock<std::mutex> lk(disconnectMutex);
+			disconnectCondvar.wait_for(lk, milliseconds(timeout), [this] { return isDisconnectConfirmed; });
+		}
+	}
+
+	StopReceiveThread();
+	socket.disconnect();
+	state = DISCONNECTED;
+	session = 0;
+	{
+		std::lock_guard<std::mutex> lk(disconnectMutex);
+		isDisconnectRequested = false;
+	}
+	FailPendingQueries();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// General behaviour
+
+void RemoteControlClient::SetPassword(const std::vector<uint8_t>& password) {
+	this->password = password;
+}
+
+const std::vector<uint8_t>& RemoteControlClient::GetPassword() const {
+	return password;
+}
+
+bool RemoteControlClient::SetLocalPort(uint16_t port) {
+	return socket.bind(port);
+}
+
+uint16_t RemoteControlClient::GetLocalPort() const {
+	return socket.getLocalPort();
+}
+
+bool RemoteControlClient::IsConnected() const {
+	return state == CONNECTED;
+}
+
+auto RemoteControlClient::GetConnectionState() const -> eConnectionState {
+	return state;
+}
+
+uint16_t RemoteControlClient::GetRemotePort() const {
+	return socket.getRemotePort();
+}
+
+std::string RemoteControlClient::GetRemoteAddress() const {
+	return socket.getRemoteAddress();
+}
+
+uint64_t RemoteControlClient::GetSession() const {
+	return session;
+}
+
+void RemoteControlClient::SetTracing(bool enable, uint64_t firstTraceId) {
+	nextTraceId = firstTraceId;
+	isTracing = enable;
+}
+
+RcpSocket& RemoteControlClient::GetSocket() {
+	return socket;
+}
+
+const RcpSocket& RemoteControlClient::GetSocket() const {
+	return socket;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Commands
+
+bool RemoteControlClient::SetServo(int32_t channel, float state, bool reliable) {
+	return Send(MakeServoCommand(channel, state), reliable);
+}
+
+
+bool RemoteControlClient::SetServos(const std::vector<ServoCommand>& commands, bool reliable) {
+	bool isAllSent = true;
+	BatchMessage batch;
+	size_t batchSize = BatchMessage::HeaderSize;
+
+	// pack as many commands into a packet as it can hold
+	for (auto& command : commands) {
+		std::vector<uint8_t> message = MakeServoCommand(command.channel, command.state);
+		if (batchSize + 2 + message.size() > (size_t)RcpSocket::MaxDatagramSize || batch.messages.size() == BatchMessage::MaxMessages) {
+			isAllSent = Send(batch.Serialize(), reliable) && isAllSent;
+			batch.messages.clear();
+			batchSize = BatchMessage::HeaderSize;
+		}
+		batchSize += 2 + message.size();
+		batch.messages.push_back(std::move(message));
+	}
+	if (!batch.messages.empty()) {
+		isAllSent = Send(batch.Serialize(), reliable) && isAllSent;
+	}
+
+	return isAllSent;
+}
+
+
+std::future<float> RemoteControlClient::QueryServo(int32_t channel) {
+	std::promise<float> promise;
+	std::future<float> result = promise.get_future();
+
+	ServoMessage msg;
+	msg.action = ServoMessage::QUERY;
+	msg.channel = channel;
+	msg.state = 0.0f;
+
+	// register before sending, the reply may arrive before send returns
+	{
+		std::lock_guard<std::mutex> lk(queryMutex);
+		msg.requestId = nextRequestId++;
+		servoQueries.insert({ msg.requestId, std::move(promise) });
+	}
+
+	if (!Send(msg.Serialize(), true)) {
+		std::lock_guard<std::mutex> lk(queryMutex);
+		auto it = servoQueries.find(msg.requestId);
+		if (it != servoQueries.end()) {
+			it->second.set_exception(std::make_exception_ptr(RcpNetworkException("query could not be sent")));
+			servoQueries.erase(it);
+		}
+	}
+	return result;
+}
+
+
+std::future<EnumDevicesMessage> RemoteControlClient::EnumDevices() {
+	std::promise<EnumDevicesMessage> promise;
+	std::future<EnumDevicesMessage> result = promise.get_future();
+
+	// enumeration replies have no request ID, they are answered in order
+	std::lock_guard<std::mutex> lk(queryMutex);
+	EnumDevicesMessage msg;
+	if (Send(msg.Serialize(), true)) {
+		deviceQueries.push_back(std::move(promise));
+	}
+	else {
+		promise.set_exception(std::make_exception_ptr(RcpNetworkException("query could not be sent")));
+	}
+	return result;
+}
+
+
+std::future<EnumChannelsMessage> RemoteControlClient::EnumChannels(EnumChannelsMessage::eDeviceType type) {
+	std::promise<EnumChannelsMessage> promise;
+	std::future<EnumChannelsMessage> result = promise.get_future();
+
+	std::lock_guard<std::mutex> lk(queryMutex);
+	EnumChannelsMessage msg;
+	msg.type = type;
+	if (Send(msg.Serialize(), true)) {
+		channelQueries.push_back(std::move(promise));
+	}
+	else {
+		promise.set_exception(std::make_exception_ptr(RcpNetworkException("query could not be sent")));
+	}
+	return result;
+}
+
+
+size_t RemoteControlClient::GetNumPendingQueries() const {
+	std::lock_guard<std::mutex> lk(queryMutex);
+	return servoQueries.size() + deviceQueries.size() + channelQueries.size();
+}
+
+
+bool RemoteControlClient::Send(const std::vector<uint8_t>& data, bool reliable) {
+	try {
+		socket.send(data.data(), data.size(), reliable);
+		return true;
+	}
+	catch (RcpException&) {
+		return false;
+	}
+}
+
+
+std::vector<uint8_t> RemoteControlClient::MakeServoCommand(int32_t channel, float state) {
+	ServoMessage msg;
+	msg.action = ServoMessage::SET;
+	msg.channel = channel;
+	msg.state = state;
+
+	if (isTracing) {
+		TraceMessage trace(nextTraceId++, TraceTimestamp(), msg);
+		return trace.Serialize();
+	}
+	return msg.Serialize();
+}
+
+
+void RemoteControlClient::FailPendingQueries() {
+	std::lock_guard<std::mutex> lk(queryMutex);
+	auto error = std::make_exception_ptr(RcpNetworkException("connection closed before reply"));
+	for (auto& query : servoQueries) {
+		query.second.set_exception(error);
+	}
+	for (auto& query : deviceQueries) {
+		query.set_exception(error);
+	}
+	for (auto& query : channelQueries) {
+		query.set_exception(error);
+	}
+	servoQueries.clear();
+	deviceQueries.clear();
+	channelQueries.clear();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Message handlers
+
+void RemoteControlClient::MH_Connection(const void* message, size_t length) {
+	ConnectionMessage msg;
+	if (!msg.Deserlialize(message, length) || msg.action != ConnectionMessage::DISCONNECT) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lk(disconnectMutex);
+	if (isDisconnectRequested) {
+		// server confirmed our request
+		isDisconnectConfirmed = true;
+		disconnectCondvar.notify_all();
+	}
+	else {
+		// server is closing the connection, confirm; it closes the socket afterwards
+		Send(msg.Serialize(), true);
+		state = DISCONNECTED;
+		runReceiveThread = false;
+	}
+}
+
+void RemoteControlClient::MH_Servo(const void* message, size_t length) {
+	ServoMessage msg;
+	if (!msg.Deserlialize(message, length) || msg.action != ServoMessage::REPLY) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lk(queryMutex);
+	auto it = servoQueries.find(msg.requestId);
+	if (it != servoQueries.end()) {
+		it->second.set_value(msg.state);
+		servoQueries.erase(it);
+	}
+}
+
+void RemoteControlClient::MH_DeviceEnum(const void* message, size_t length) {
+	EnumDevicesMessage msg;
+	if (!msg.Deserlialize(message, length)) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lk(queryMutex);
+	if (!deviceQueries.empty()) {
+		deviceQueries.front().set_value(std::move(msg));
+		deviceQueries.pop_front();
+	}
+}
+
+void RemoteControlClient::MH_ChannelEnum(const void* message, size_t length) {
+	EnumChannelsMessage msg;
+	if (!msg.Deserlialize(message, length)) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lk(queryMutex);
+	if (!channelQueries.empty()) {
+		channelQueries.front().set_value(std::move(msg));
+		channelQueries.pop_front();
+	}
+}
+
+
+
+void RemoteControlClient::ReceiveThreadFunc() {
+	while (runReceiveThread) {
+		try {
+			RcpPacket packet;
+			if (!socket.receive(packet)) {
+				break; // connection closed and no more packets
+			}
+			messageDecoder.ProcessMessage(packet.getData(), packet.getDataSize());
+		}
+		catch (RcpInterruptedException&) {
+			// cancelled by StopReceiveThread
+		}
+		catch (RcpException&) {
+			break;
+		}
+	}
+
+	// the connection is lost unless we are shutting down
+	if (runReceiveThread) {
+		state = DISCONNECTED;
+	}
+	FailPendingQueries();
+	isReceiveThreadDone = true;
+}
+
+void RemoteControlClient::StartReceiveThread() {
+	if (receiveThread.joinable()) {
+		receiveThread.join();
+	}
+	runReceiveThread = true;
+	isReceiveThreadDone = false;
+	receiveThread = std::thread([this] { ReceiveThreadFunc(); });
+}
+
+void RemoteControlClient::StopReceiveThread() {
+	runReceiveThread = false;
+	// a cancel may slip in between two receive calls and get lost, so repeat it
+	while (!isReceiveThreadDone) {
+		socket.cancel();
+		std::this_thread::sleep_for(milliseconds(5));
+	}
+	if (receiveThread.joinable()) {
+		receiveThread.join();
+	}
+}
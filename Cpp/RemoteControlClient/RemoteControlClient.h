@@ -0,0 +1,172 @@
+#pragma once
+
+#include <RemoteControlServer/Message.h>
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpPacket.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <limits>
+
+////////////////////////////////////////////////////////////////////////////////
+/// Client side of a remote control connection.
+/// Connecting and authenticating runs in the background, the caller gets a
+/// future of the outcome. Servo commands are fire-and-forget, and can be
+/// batched into a single packet. Queries return futures; any number of them
+/// may be in flight, a background thread matches replies to requests.
+/// All methods can be called from any thread.
+////////////////////////////////////////////////////////////////////////////////
+
+class RemoteControlClient {
+public:
+	enum eConnectionState {
+		DISCONNECTED,
+		CONNECTING,
+		CONNECTED,
+	};
+
+	/// One servo command of a batch.
+	struct ServoCommand {
+		int32_t channel;
+		float state;
+	};
+
+public:
+	// --- --- ctor & dtor --- --- //
+	RemoteControlClient();
+	~RemoteControlClient();
+	RemoteControlClient(const RemoteControlClient&) = delete;
+	RemoteControlClient& operator=(const RemoteControlClient&) = delete;
+
+	// --- --- network connection --- --- //
+
+	/// Connect to a server and go through its authentication in the background.
+	/// The password set by SetPassword is sent if the server asks for one.
+	/// \param timeout Milliseconds to wait for the server's answer.
+	/// \return A future that becomes true if the server accepted the connection,
+	/// or false on network errors and if the server declined.
+	std::future<bool> Connect(const std::string& address, uint16_t port, int timeout = 5000);
+
+	/// Continue the session on another server, e.g. the standby that took over from a lost server.
+	/// The server must know the session, the client does not authenticate again, it only proves
+	/// it holds the session's token, which is not sent. The old connection
+	/// is dropped without waiting for its server, queries pending on it fail.
+	/// \param timeout Milliseconds to wait for the server's answer.
+	/// \return A future that becomes true if the server resumed the session.
+	std::future<bool> Resume(const std::string& address, uint16_t port, int timeout = 5000);
+
+	/// Gracefully close the connection.
+	/// Waits for a connection attempt in progress to finish first.
+	/// Queries still pending fail with RcpNetworkException.
+	/// \param timeout Milliseconds to wait for the server to confirm.
+	void Disconnect(int timeout = 1000);
+
+
+	// --- --- connection parameters --- --- //
+
+	void SetPassword(const std::vector<uint8_t>& password);
+	const std::vector<uint8_t>& GetPassword() const;
+
+	bool SetLocalPort(uint16_t port);
+	uint16_t GetLocalPort() const;
+
+	bool IsConnected() const;
+	eConnectionState GetConnectionState() const;
+	uint16_t GetRemotePort() const;
+	std::string GetRemoteAddress() const;
+
+	/// Get the token of the session the server accepted, 0 if there's none.
+	uint64_t GetSession() const;
+
+
+	// --- --- commands --- --- //
+
+	/// Set the state of a servo channel. Returns immediately, the server does not answer.
+	/// \param reliable Unreliable commands may get lost, but a newer one usually follows anyway.
+	/// \return False if the command could not be sent.
+	bool SetServo(int32_t channel, float state, bool reliable = false);
+
+	/// Set several servo channels at once, in as few packets as possible.
+	/// \return False if any of the packets could not be sent.
+	bool SetServos(const std::vector<ServoCommand>& commands, bool reliable = false);
+
+	/// Query the state of a servo channel.
+	/// \return Future of the state, NaN if the channel does not exist. The future
+	/// throws RcpException if the connection is lost before the reply arrives.
+	std::future<float> QueryServo(int32_t channel);
+
+	/// Query the devices available on the server.
+	std::future<EnumDevicesMessage> EnumDevices();
+
+	/// Query the channels of a device type.
+	std::future<EnumChannelsMessage> EnumChannels(EnumChannelsMessage::eDeviceType type);
+
+	/// Get the number of queries waiting for a reply.
+	size_t GetNumPendingQueries() const;
+
+
+	// --- --- diagnostics --- --- //
+
+	/// Wrap servo commands into trace messages, so that the server records their latency.
+	/// Trace IDs are consecutive, starting from the given one.
+	void SetTracing(bool enable, uint64_t firstTraceId = 1);
+
+	/// Access the underlying socket, e.g. for timing and clock synchronization.
+	RcpSocket& GetSocket();
+	const RcpSocket& GetSocket() const;
+
+private:
+	bool ConnectFunc(std::string address, uint16_t port, int timeout, bool resume);
+	bool Send(const std::vector<uint8_t>& data, bool reliable);
+	std::vector<uint8_t> MakeServoCommand(int32_t channel, float state);
+	void FailPendingQueries();
+
+	// --- --- message handlers --- --- //
+	void MH_Connection(const void* message, size_t length);
+	void MH_Servo(const void* message, size_t length);
+	void MH_DeviceEnum(const void* message, size_t length);
+	void MH_ChannelEnum(const void* message, size_t length);
+
+	// receives and dispatches replies
+	void ReceiveThreadFunc();
+	void StartReceiveThread();
+	void StopReceiveThread();
+private:
+	// connection
+	std::vector<uint8_t> password;
+	std::atomic<eConnectionState> state;
+	std::atomic<uint64_t> session;
+	RcpSocket socket;
+	std::thread connectThread;
+
+	// processing
+	std::thread receiveThread;
+	std::atomic_bool runReceiveThread;
+	std::atomic_bool isReceiveThreadDone;
+	MessageDecoder messageDecoder;
+
+	// disconnect handshake
+	std::mutex disconnectMutex;
+	std::condition_variable disconnectCondvar;
+	bool isDisconnectRequested; // we sent a DISCONNECT and wait for the server's
+	bool isDisconnectConfirmed;
+
+	// pending queries
+	mutable std::mutex queryMutex;
+	uint32_t nextRequestId;
+	std::unordered_map<uint32_t, std::promise<float>> servoQueries;
+	std::deque<std::promise<EnumDevicesMessage>> deviceQueries;
+	std::deque<std::promise<EnumChannelsMessage>> channelQueries;
+
+	// tracing
+	std::atomic_bool isTracing;
+	std::atomic<uint64_t> nextTraceId;
+};
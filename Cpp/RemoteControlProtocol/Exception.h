@@ -50,3 +50,7 @@ public:
 };
 
 
+class RcpBudgetException : public RcpException {
+public:
+	using RcpException::RcpException;
+};
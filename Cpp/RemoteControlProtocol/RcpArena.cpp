@@ -0,0 +1,169 @@
+#include "RcpArena.h"
+#include "RcpRealTime.h"
+
+#include <algorithm>
+#include <cassert>
+#include <new>
+
+
+static const size_t MinBlockSize = 16; // the smallest class, blocks are aligned to it
+
+
+RcpArena::RcpArena() : current(0), peak(0), budget(0), reserved(0) {
+	for (auto& list : freeLists) {
+		list = nullptr;
+	}
+	chunkIndex = 0;
+	chunkOffset = 0;
+	numLarge = 0;
+	retainedSize = 1024 * 1024;
+}
+
+
+RcpArena::~RcpArena() {
+	for (auto chunk : chunks) {
+		::operator delete(chunk);
+	}
+}
+
+
+size_t RcpArena::getClass(size_t size) {
+	size_t index = 0;
+	size_t classSize = MinBlockSize;
+	while (classSize < size) {
+		classSize *= 2;
+		index++;
+	}
+	return index;
+}
+
+
+void* RcpArena::allocate(size_t size) {
+	if (size > MaxBlockSize) {
+		void* block = ::operator new(size);
+		numLarge++;
+		reserved += size;
+		addCurrent(size);
+		return block;
+	}
+
+	size_t index = getClass(size);
+	size_t classSize = MinBlockSize << index;
+	void* block;
+	if (freeLists[index] != nullptr) {
+		block = freeLists[index];
+		freeLists[index] = freeLists[index]->next;
+	}
+	else {
+		// blocks are cut from the chunks in order, the rest of a chunk is skipped if it's too short
+		if (chunkIndex < chunks.size() && chunkOffset + classSize > ChunkSize) {
+			chunkIndex++;
+			chunkOffset = 0;
+		}
+		if (chunkIndex == chunks.size()) {
+			chunks.push_back(static_cast<uint8_t*>(::operator new(ChunkSize)));
+			reserved += ChunkSize;
+		}
+		block = chunks[chunkIndex] + chunkOffset;
+		chunkOffset += classSize;
+	}
+	addCurrent(classSize);
+	return block;
+}
+
+
+void RcpArena::deallocate(void* block, size_t size) {
+	if (block == nullptr) {
+		return;
+	}
+	if (size > MaxBlockSize) {
+		::operator delete(block);
+		numLarge--;
+		reserved -= size;
+		current -= size;
+		return;
+	}
+
+	size_t index = getClass(size);
+	auto freeBlock = static_cast<FreeBlock*>(block);
+	freeBlock->next = freeLists[index];
+	freeLists[index] = freeBlock;
+	current -= MinBlockSize << index;
+}
+
+
+void RcpArena::charge(size_t size) {
+	addCurrent(size);
+}
+
+
+void RcpArena::discharge(size_t size) {
+	current -= std::min(size, current.load());
+}
+
+
+void RcpArena::recycle() {
+	// blocks still out would be handed out again
+	assert(numLarge == 0);
+
+	for (auto& list : freeLists) {
+		list = nullptr;
+	}
+	size_t numRetained = std::max(retainedSize / ChunkSize, size_t(1));
+	while (chunks.size() > numRetained) {
+		::operator delete(chunks.back());
+		chunks.pop_back();
+		reserved -= ChunkSize;
+	}
+	chunkIndex = 0;
+	chunkOffset = 0;
+	current = 0;
+}
+
+
+void RcpArena::setBudget(size_t budget) {
+	this->budget = budget;
+}
+
+
+void RcpArena::setRetainedSize(size_t size) {
+	retainedSize = size;
+}
+
+
+void RcpArena::reserve(size_t size) {
+	while (chunks.size() * ChunkSize < size) {
+		chunks.push_back(static_cast<uint8_t*>(::operator new(ChunkSize)));
+		RcpRealTime::prefault(chunks.back(), ChunkSize);
+		reserved += ChunkSize;
+	}
+	retainedSize = std::max(retainedSize, size);
+}
+
+
+bool RcpArena::isOverBudget(size_t size) const {
+	size_t limit = budget;
+	return limit != 0 && current + size > limit;
+}
+
+
+auto RcpArena::getUsage() const -> Usage {
+	Usage usage;
+	usage.current = current;
+	usage.peak = peak;
+	usage.budget = budget;
+	usage.reserved = reserved;
+	return usage;
+}
+
+
+void RcpArena::resetPeak() {
+	peak = current.load();
+}
+
+
+void RcpArena::addCurrent(size_t size) {
+	size_t now = current += size;
+	size_t highest = peak;
+	while (now > highest && !peak.compare_exchange_weak(highest, now)) {}
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include <type_traits>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory of a connection, recycled as a whole when the connection ends.
+//
+// The data structures of a session (reserved places, packets waiting for
+// acknowledgement, the receive queue) allocate many small nodes, and throw
+// all of them away on disconnect. Taking those from the general heap
+// fragments it on servers where peers reconnect all day. The arena takes
+// memory from the heap in chunks, and hands out blocks of a few size classes
+// from them. Freed blocks are kept on a list per class. When the session is
+// over and everything is freed, recycle() rewinds the chunks, and the next
+// session starts with a clean, already allocated arena.
+//
+// Blocks larger than the largest class come from the heap, one by one.
+// Bytes not allocated here, like the payload of received packets, can be
+// charged to the arena so its usage covers the whole connection.
+//
+// Allocation is not thread-safe, the owner must serialize it. Usage can be
+// read from any thread.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpArena {
+public:
+	static const size_t ChunkSize = 64 * 1024;
+	static const size_t MaxBlockSize = 2048; // larger ones come from the heap
+
+	struct Usage {
+		size_t current = 0; // bytes in use: allocated plus charged
+		size_t peak = 0; // the most that was in use since the last resetPeak
+		size_t budget = 0; // the limit, 0 if there's none
+		size_t reserved = 0; // bytes held from the heap, in chunks and large blocks
+	};
+
+	RcpArena();
+	~RcpArena();
+	RcpArena(const RcpArena&) = delete;
+	RcpArena& operator=(const RcpArena&) = delete;
+
+	void* allocate(size_t size);
+	void deallocate(void* block, size_t size);
+
+	/// Count bytes held elsewhere for the connection.
+	void charge(size_t size);
+	/// Uncount bytes charged before.
+	void discharge(size_t size);
+
+	/// Rewind the chunks after everything has been freed, for the next connection.
+	/// Chunks over the retained limit are given back to the heap.
+	void recycle();
+
+	/// Set the limit of bytes in use. It's not enforced by the arena,
+	/// the owner checks isOverBudget before growing. 0 is no limit (default).
+	void setBudget(size_t budget);
+
+	/// Set how many bytes of chunks recycle keeps for the next connection. Default is 1 MiB.
+	void setRetainedSize(size_t size);
+
+	/// Take chunks of at least size bytes from the heap up front, and fault their pages in.
+	/// They are retained over recycling.
+	void reserve(size_t size);
+
+	/// Tell if using size more bytes would go over the budget.
+	bool isOverBudget(size_t size = 0) const;
+
+	Usage getUsage() const;
+
+	/// Start measuring the peak from the current usage.
+	void resetPeak();
+private:
+	static const size_t NumClasses = 8; // 16, 32, ..., 2048 bytes
+	static size_t getClass(size_t size);
+	void addCurrent(size_t size);
+private:
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+	FreeBlock* freeLists[NumClasses];
+	std::vector<uint8_t*> chunks;
+	size_t chunkIndex; // the chunk blocks are cut from
+	size_t chunkOffset; // bytes of it cut already
+	size_t numLarge; // large blocks out on the heap
+	size_t retainedSize;
+
+	std::atomic<size_t> current, peak, budget, reserved;
+};
+
+
+/// Standard allocator on an arena, for containers of the connection.
+/// Copies use the same arena, and containers take it along on swap and move.
+template <class T>
+class RcpArenaAllocator {
+	template <class U>
+	friend class RcpArenaAllocator;
+public:
+	using value_type = T;
+	using propagate_on_container_copy_assignment = std::true_type;
+	using propagate_on_container_move_assignment = std::true_type;
+	using propagate_on_container_swap = std::true_type;
+
+	RcpArenaAllocator(RcpArena& arena) : arena(&arena) {}
+	template <class U>
+	RcpArenaAllocator(const RcpArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n) {
+		return static_cast<T*>(arena->allocate(n * sizeof(T)));
+	}
+	void deallocate(T* p, size_t n) {
+		arena->deallocate(p, n * sizeof(T));
+	}
+
+	template <class U>
+	bool operator==(const RcpArenaAllocator<U>& other) const {
+		return arena == other.arena;
+	}
+	template <class U>
+	bool operator!=(const RcpArenaAllocator<U>& other) const {
+		return arena != other.arena;
+	}
+private:
+	RcpArena* arena;
+};
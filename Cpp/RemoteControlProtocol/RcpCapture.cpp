@@ -0,0 +1,573 @@
+#include "RcpCapture.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+using namespace std::chrono;
+
+
+// pcapng block types and options, https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-01.html
+static const uint32_t SectionHeaderBlock = 0x0A0D0D0A;
+static const uint32_t InterfaceDescriptionBlock = 1;
+static const uint32_t SimplePacketBlock = 3;
+static const uint32_t EnhancedPacketBlock = 6;
+static const uint32_t ByteOrderMagic = 0x1A2B3C4D;
+static const uint16_t OptionEnd = 0;
+static const uint16_t OptionTimestampResolution = 9; // if_tsresol
+static const uint16_t OptionPacketFlags = 2; // epb_flags
+
+// pcap file magic numbers, microsecond and nanosecond timestamps
+static const uint32_t PcapMagic = 0xA1B2C3D4;
+static const uint32_t PcapMagicNs = 0xA1B23C4D;
+
+// link layer types, https://www.tcpdump.org/linktypes.html
+static const uint32_t LinkNull = 0; // BSD loopback
+static const uint32_t LinkEthernet = 1;
+static const uint32_t LinkRawBsd = 12;
+static const uint32_t LinkRaw = 101;
+static const uint32_t LinkLinuxSll = 113;
+static const uint32_t LinkIpv4 = 228;
+static const uint32_t LinkLinuxSll2 = 276;
+
+static const size_t IpHeaderSize = 20;
+static const size_t UdpHeaderSize = 8;
+
+
+static uint32_t swap32(uint32_t value) {
+	return (value >> 24) | ((value >> 8) & 0xFF00) | ((value << 8) & 0xFF0000) | (value << 24);
+}
+
+static uint16_t getBigEndian16(const uint8_t* bytes) {
+	return uint16_t((bytes[0] << 8) | bytes[1]);
+}
+
+static void putBigEndian16(uint8_t* bytes, uint16_t value) {
+	bytes[0] = uint8_t(value >> 8);
+	bytes[1] = uint8_t(value);
+}
+
+static void putBigEndian32(uint8_t* bytes, uint32_t value) {
+	putBigEndian16(bytes, uint16_t(value >> 16));
+	putBigEndian16(bytes + 2, uint16_t(value));
+}
+
+static size_t padTo4(size_t size) {
+	return (size + 3) & ~size_t(3);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Writer
+
+RcpCaptureWriter::RcpCaptureWriter() : isFileOpen(false), count(0), isTimeBase(false), wallTimeBase(0) {}
+
+
+RcpCaptureWriter::~RcpCaptureWriter() {
+	close();
+}
+
+
+bool RcpCaptureWriter::open(const std::string& path) {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (file.is_open()) {
+		file.close();
+	}
+	isFileOpen = false;
+	file.clear();
+	file.open(path, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) {
+		return false;
+	}
+
+	// blocks are written in the host's byte order, the section header tells readers which
+	struct {
+		uint32_t type, length, byteOrderMagic;
+		uint16_t major, minor;
+		uint32_t sectionLength[2]; // 64 bits, but not aligned to them; all ones is unspecified
+		uint32_t trailingLength;
+	} section = { SectionHeaderBlock, 28, ByteOrderMagic, 1, 0, { 0xFFFFFFFF, 0xFFFFFFFF }, 28 };
+	static_assert(sizeof(section) == 28, "section header block is packed");
+	file.write((const char*)&section, sizeof(section));
+
+	// one interface carrying raw IPv4, with nanosecond timestamps
+	struct {
+		uint32_t type, length;
+		uint16_t linkType, reserved;
+		uint32_t snapLength;
+		uint16_t resolutionCode, resolutionLength;
+		uint8_t resolution, padding[3];
+		uint16_t endCode, endLength;
+		uint32_t trailingLength;
+	} interface = { InterfaceDescriptionBlock, 32, (uint16_t)LinkRaw, 0, 0, OptionTimestampResolution, 1, 9, { 0, 0, 0 }, OptionEnd, 0, 32 };
+	static_assert(sizeof(interface) == 32, "interface description block is packed");
+	file.write((const char*)&interface, sizeof(interface));
+
+	count = 0;
+	isTimeBase = false;
+	isFileOpen = file.good();
+	return isFileOpen;
+}
+
+
+void RcpCaptureWriter::close() {
+	std::lock_guard<std::mutex> lk(mtx);
+	isFileOpen = false;
+	if (file.is_open()) {
+		file.close();
+	}
+}
+
+
+bool RcpCaptureWriter::isOpen() const {
+	return isFileOpen;
+}
+
+
+uint64_t RcpCaptureWriter::getCount() const {
+	return count;
+}
+
+
+void RcpCaptureWriter::write(eDirection direction, RcpClock::time_point time,
+							 const sf::IpAddress& source, uint16_t sourcePort,
+							 const sf::IpAddress& destination, uint16_t destinationPort,
+							 const void* data, size_t size, uint8_t dscp)
+{
+	if (!isFileOpen || size + IpHeaderSize + UdpHeaderSize > 0xFFFF) {
+		return;
+	}
+	std::lock_guard<std::mutex> lk(mtx);
+	if (!file.is_open()) {
+		return;
+	}
+
+	if (!isTimeBase) {
+		timeBase = time;
+		wallTimeBase = duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count();
+		isTimeBase = true;
+	}
+	uint64_t timestamp = uint64_t(wallTimeBase + duration_cast<nanoseconds>(time - timeBase).count());
+
+	// IPv4 and UDP headers, the UDP checksum is optional over IPv4
+	uint8_t headers[IpHeaderSize + UdpHeaderSize] = {};
+	size_t packetSize = sizeof(headers) + size;
+	uint8_t* ip = headers;
+	ip[0] = 0x45; // version 4, 5 words of header
+	ip[1] = uint8_t(dscp << 2);
+	putBigEndian16(ip + 2, (uint16_t)packetSize);
+	ip[8] = 64; // TTL
+	ip[9] = 17; // UDP
+	putBigEndian32(ip + 12, source.toInteger());
+	putBigEndian32(ip + 16, destination.toInteger());
+	uint32_t checksum = 0;
+	for (size_t i = 0; i < IpHeaderSize; i += 2) {
+		checksum += getBigEndian16(ip + i);
+	}
+	while (checksum > 0xFFFF) {
+		checksum = (checksum & 0xFFFF) + (checksum >> 16);
+	}
+	putBigEndian16(ip + 10, uint16_t(~checksum));
+	uint8_t* udp = headers + IpHeaderSize;
+	putBigEndian16(udp, sourcePort);
+	putBigEndian16(udp + 2, destinationPort);
+	putBigEndian16(udp + 4, uint16_t(UdpHeaderSize + size));
+
+	// enhanced packet block, with the direction in the flags
+	uint32_t blockLength = uint32_t(28 + padTo4(packetSize) + 8 + 4 + 4);
+	uint32_t block[7] = { EnhancedPacketBlock, blockLength, 0, uint32_t(timestamp >> 32), uint32_t(timestamp), (uint32_t)packetSize, (uint32_t)packetSize };
+	file.write((const char*)block, sizeof(block));
+	file.write((const char*)headers, sizeof(headers));
+	file.write((const char*)data, size);
+	static const char padding[4] = {};
+	file.write(padding, padTo4(packetSize) - packetSize);
+	uint16_t flagsOption[2] = { OptionPacketFlags, 4 };
+	uint16_t endOption[2] = { OptionEnd, 0 };
+	uint32_t flags = direction;
+	file.write((const char*)flagsOption, sizeof(flagsOption));
+	file.write((const char*)&flags, sizeof(flags));
+	file.write((const char*)endOption, sizeof(endOption));
+	file.write((const char*)&blockLength, sizeof(blockLength));
+	count++;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Reader
+
+RcpCaptureReader::RcpCaptureReader() : position(0), isNg(false), isSwapped(false), skipped(0) {}
+
+
+bool RcpCaptureReader::open(const std::string& path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) {
+		return false;
+	}
+	std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	return open(std::move(bytes));
+}
+
+
+bool RcpCaptureReader::open(std::vector<uint8_t> contents) {
+	this->contents = std::move(contents);
+	position = 0;
+	skipped = 0;
+	interfaces.clear();
+	if (this->contents.size() < 24) {
+		return false;
+	}
+
+	uint32_t magic;
+	memcpy(&magic, this->contents.data(), sizeof(magic));
+	if (magic == SectionHeaderBlock) {
+		// the byte order comes from the section header, read with the blocks
+		isNg = true;
+		uint32_t byteOrder;
+		memcpy(&byteOrder, this->contents.data() + 8, sizeof(byteOrder));
+		return byteOrder == ByteOrderMagic || byteOrder == swap32(ByteOrderMagic);
+	}
+
+	isNg = false;
+	isSwapped = magic == swap32(PcapMagic) || magic == swap32(PcapMagicNs);
+	if (!isSwapped && magic != PcapMagic && magic != PcapMagicNs) {
+		return false;
+	}
+	bool isNanoseconds = magic == PcapMagicNs || magic == swap32(PcapMagicNs);
+	interfaces.push_back({ get32(20) & 0xFFFF, isNanoseconds ? 1000000000 : 1000000 });
+	position = 24;
+	return true;
+}
+
+
+bool RcpCaptureReader::read(RcpCapturedDatagram& datagram) {
+	return isNg ? readPcapng(datagram) : readPcap(datagram);
+}
+
+
+std::vector<RcpCapturedDatagram> RcpCaptureReader::readAll() {
+	std::vector<uint8_t> bytes;
+	bytes.swap(contents);
+	open(std::move(bytes));
+	std::vector<RcpCapturedDatagram> datagrams;
+	RcpCapturedDatagram datagram;
+	while (read(datagram)) {
+		datagrams.push_back(std::move(datagram));
+	}
+	return datagrams;
+}
+
+
+uint64_t RcpCaptureReader::getSkipped() const {
+	return skipped;
+}
+
+
+bool RcpCaptureReader::readPcap(RcpCapturedDatagram& datagram) {
+	while (position + 16 <= contents.size()) {
+		uint32_t seconds = get32(position), fraction = get32(position + 4), length = get32(position + 8);
+		size_t frame = position + 16;
+		if (frame + length > contents.size()) {
+			break;
+		}
+		position = frame + length;
+		int64_t resolution = interfaces[0].resolution;
+		datagram.time = int64_t(seconds) * 1000000000 + int64_t(fraction) * (1000000000 / resolution);
+		if (decodeFrame(interfaces[0].linkType, contents.data() + frame, length, datagram)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+bool RcpCaptureReader::readPcapng(RcpCapturedDatagram& datagram) {
+	while (position + 12 <= contents.size()) {
+		size_t block = position;
+		uint32_t type;
+		memcpy(&type, contents.data() + block, sizeof(type));
+		if (type == SectionHeaderBlock) {
+			// a new section, possibly of another byte order, with interfaces of its own
+			uint32_t byteOrder;
+			memcpy(&byteOrder, contents.data() + block + 8, sizeof(byteOrder));
+			isSwapped = byteOrder != ByteOrderMagic;
+			interfaces.clear();
+		}
+		else if (isSwapped) {
+			type = swap32(type);
+		}
+		uint32_t length = get32(block + 4);
+		if (length < 12 || length % 4 != 0 || block + length > contents.size()) {
+			break;
+		}
+		position = block + length;
+
+		if (type == InterfaceDescriptionBlock && length >= 20) {
+			Interface interface = { get16(block + 8), 1000000 };
+			// look for the timestamp resolution among the options
+			for (size_t option = block + 16; option + 4 <= block + length - 4;) {
+				uint16_t code = get16(option), optionLength = get16(option + 2);
+				if (code == OptionEnd) {
+					break;
+				}
+				if (code == OptionTimestampResolution && optionLength >= 1) {
+					uint8_t value = contents[option + 4];
+					int64_t resolution = 1;
+					for (int i = 0; i < (value & 0x7F) && resolution < 1000000000000000000ll; ++i) {
+						resolution *= (value & 0x80) ? 2 : 10;
+					}
+					interface.resolution = resolution;
+				}
+				option += 4 + padTo4(optionLength);
+			}
+			interfaces.push_back(interface);
+		}
+		else if (type == EnhancedPacketBlock && length >= 32) {
+			uint32_t id = get32(block + 8);
+			uint64_t timestamp = (uint64_t(get32(block + 12)) << 32) | get32(block + 16);
+			uint32_t captured = get32(block + 20);
+			if (id >= interfaces.size() || 28 + captured > length) {
+				skipped++;
+				continue;
+			}
+			const Interface& interface = interfaces[id];
+			datagram.time = interface.resolution >= 1000000000
+				? int64_t(timestamp / (interface.resolution / 1000000000))
+				: int64_t(timestamp) * (1000000000 / interface.resolution);
+			if (decodeFrame(interface.linkType, contents.data() + block + 28, captured, datagram)) {
+				return true;
+			}
+		}
+		else if (type == SimplePacketBlock && length >= 16 && !interfaces.empty()) {
+			// no timestamp, it's as old as the one before
+			uint32_t original = get32(block + 8);
+			if (decodeFrame(interfaces[0].linkType, contents.data() + block + 12, std::min<size_t>(original, length - 16), datagram)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+
+bool RcpCaptureReader::decodeFrame(uint32_t linkType, const uint8_t* frame, size_t size, RcpCapturedDatagram& datagram) {
+	// strip the link layer
+	size_t offset = 0;
+	switch (linkType) {
+		case LinkEthernet: {
+			offset = 12;
+			// VLAN tags go before the type
+			while (offset + 2 <= size && (getBigEndian16(frame + offset) == 0x8100 || getBigEndian16(frame + offset) == 0x88A8)) {
+				offset += 4;
+			}
+			if (offset + 2 > size || getBigEndian16(frame + offset) != 0x0800) {
+				skipped++;
+				return false;
+			}
+			offset += 2;
+			break;
+		}
+		case LinkLinuxSll:
+			if (size < 16 || getBigEndian16(frame + 14) != 0x0800) {
+				skipped++;
+				return false;
+			}
+			offset = 16;
+			break;
+		case LinkLinuxSll2:
+			if (size < 20 || getBigEndian16(frame) != 0x0800) {
+				skipped++;
+				return false;
+			}
+			offset = 20;
+			break;
+		case LinkNull:
+			// the address family, in the byte order of the capturing host
+			if (size < 4 || (frame[0] != 2 && frame[3] != 2)) {
+				skipped++;
+				return false;
+			}
+			offset = 4;
+			break;
+		case LinkRaw:
+		case LinkRawBsd:
+		case LinkIpv4:
+			break;
+		default:
+			skipped++;
+			return false;
+	}
+
+	// IPv4, unfragmented UDP
+	const uint8_t* ip = frame + offset;
+	size -= std::min(size, offset);
+	if (size < IpHeaderSize || (ip[0] >> 4) != 4) {
+		skipped++;
+		return false;
+	}
+	size_t ipHeaderSize = (ip[0] & 0x0F) * 4;
+	size_t ipSize = std::min<size_t>(getBigEndian16(ip + 2), size);
+	bool isFragment = (getBigEndian16(ip + 6) & 0x3FFF) != 0; // more fragments, or an offset
+	if (ip[9] != 17 || isFragment || ipHeaderSize < IpHeaderSize || ipSize < ipHeaderSize + UdpHeaderSize) {
+		skipped++;
+		return false;
+	}
+	const uint8_t* udp = ip + ipHeaderSize;
+	size_t udpSize = getBigEndian16(udp + 4);
+	if (udpSize < UdpHeaderSize || ipHeaderSize + udpSize > ipSize) {
+		skipped++; // truncated by the snapshot length
+		return false;
+	}
+
+	datagram.dscp = ip[1] >> 2;
+	datagram.source = sf::IpAddress((uint32_t(getBigEndian16(ip + 12)) << 16) | getBigEndian16(ip + 14));
+	datagram.destination = sf::IpAddress((uint32_t(getBigEndian16(ip + 16)) << 16) | getBigEndian16(ip + 18));
+	datagram.sourcePort = getBigEndian16(udp);
+	datagram.destinationPort = getBigEndian16(udp + 2);
+	datagram.data.assign(udp + UdpHeaderSize, udp + udpSize);
+	return true;
+}
+
+
+uint16_t RcpCaptureReader::get16(size_t offset) const {
+	uint16_t value;
+	memcpy(&value, contents.data() + offset, sizeof(value));
+	return isSwapped ? uint16_t((value >> 8) | (value << 8)) : value;
+}
+
+
+uint32_t RcpCaptureReader::get32(size_t offset) const {
+	uint32_t value;
+	memcpy(&value, contents.data() + offset, sizeof(value));
+	return isSwapped ? swap32(value) : value;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Capturing transport
+
+RcpCaptureTransport::RcpCaptureTransport(std::unique_ptr<RcpTransport> transport, RcpCaptureWriter& writer, RcpClock& clock) :
+	transport(std::move(transport)), writer(writer), clock(clock), trafficClass(CS0), localAddress(sf::IpAddress::LocalHost) {}
+
+
+bool RcpCaptureTransport::bind(uint16_t port) {
+	localAddress = sf::IpAddress::getLocalAddress();
+	return transport->bind(port);
+}
+
+
+bool RcpCaptureTransport::bindGroup(const sf::IpAddress& group, uint16_t port) {
+	localAddress = sf::IpAddress::getLocalAddress();
+	return transport->bindGroup(group, port);
+}
+
+
+void RcpCaptureTransport::unbind() {
+	transport->unbind();
+}
+
+
+uint16_t RcpCaptureTransport::getLocalPort() const {
+	return transport->getLocalPort();
+}
+
+
+bool RcpCaptureTransport::send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) {
+	capture(RcpCaptureWriter::OUTBOUND, clock.now(), address, port, data, size, trafficClass);
+	return transport->send(data, size, address, port);
+}
+
+
+bool RcpCaptureTransport::setTrafficClass(uint8_t dscp) {
+	trafficClass = dscp & 0x3F;
+	return transport->setTrafficClass(dscp);
+}
+
+
+bool RcpCaptureTransport::sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp) {
+	capture(RcpCaptureWriter::OUTBOUND, clock.now(), address, port, data, size, dscp & 0x3F);
+	return transport->sendMarked(data, size, address, port, dscp);
+}
+
+
+bool RcpCaptureTransport::setLaunchTimes(bool enable) {
+	return transport->setLaunchTimes(enable);
+}
+
+
+bool RcpCaptureTransport::sendAt(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp, steady_clock::time_point launchTime) {
+	// stamped with when it leaves
+	capture(RcpCaptureWriter::OUTBOUND, std::max(clock.now(), launchTime), address, port, data, size, dscp & 0x3F);
+	return transport->sendAt(data, size, address, port, dscp, launchTime);
+}
+
+
+bool RcpCaptureTransport::wait(microseconds timeout) {
+	return transport->wait(timeout);
+}
+
+
+bool RcpCaptureTransport::receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) {
+	if (!transport->receive(packet, address, port)) {
+		return false;
+	}
+	capture(RcpCaptureWriter::INBOUND, clock.now(), address, port, packet.getData(), packet.getDataSize(), 0);
+	return true;
+}
+
+
+bool RcpCaptureTransport::setBufferSizes(size_t receive, size_t send) {
+	return transport->setBufferSizes(receive, send);
+}
+
+
+bool RcpCaptureTransport::getBufferSizes(size_t& receive, size_t& send) const {
+	return transport->getBufferSizes(receive, send);
+}
+
+
+uint64_t RcpCaptureTransport::getReceiveDrops() const {
+	return transport->getReceiveDrops();
+}
+
+
+size_t RcpCaptureTransport::receiveBatch(RcpDatagram* datagrams, size_t count) {
+	size_t received = transport->receiveBatch(datagrams, count);
+	auto now = clock.now();
+	for (size_t i = 0; i < received; ++i) {
+		capture(RcpCaptureWriter::INBOUND, now, datagrams[i].address, datagrams[i].port, datagrams[i].data.data(), datagrams[i].data.size(), 0);
+	}
+	return received;
+}
+
+
+size_t RcpCaptureTransport::sendBatch(const RcpDatagram* datagrams, size_t count) {
+	auto now = clock.now();
+	for (size_t i = 0; i < count; ++i) {
+		capture(RcpCaptureWriter::OUTBOUND, now, datagrams[i].address, datagrams[i].port, datagrams[i].data.data(), datagrams[i].data.size(), trafficClass);
+	}
+	return transport->sendBatch(datagrams, count);
+}
+
+
+void RcpCaptureTransport::capture(RcpCaptureWriter::eDirection direction, RcpClock::time_point time, const sf::IpAddress& peer, uint16_t peerPort, const void* data, size_t size, uint8_t dscp) {
+	if (!writer.isOpen()) {
+		return;
+	}
+	sf::IpAddress local = getLocalAddress(peer);
+	uint16_t localPort = transport->getLocalPort();
+	if (direction == RcpCaptureWriter::OUTBOUND) {
+		writer.write(direction, time, local, localPort, peer, peerPort, data, size, dscp);
+	}
+	else {
+		writer.write(direction, time, peer, peerPort, local, localPort, data, size, dscp);
+	}
+}
+
+
+sf::IpAddress RcpCaptureTransport::getLocalAddress(const sf::IpAddress& peer) {
+	// loopback traffic stays on loopback
+	if ((peer.toInteger() >> 24) == 127 || localAddress == sf::IpAddress::None) {
+		return sf::IpAddress::LocalHost;
+	}
+	return localAddress;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <chrono>
+
+#include "RcpClock.h"
+#include "RcpTransport.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Packet captures of RCP traffic.
+//
+// Sockets can write the datagrams they send and receive to a pcapng file,
+// framed as IPv4/UDP packets, so that Wireshark and tcpdump can read them,
+// and field captures can be replayed to sockets later, see RcpReplayTransport.
+//
+// The reader takes the captures of other tools too: pcap and pcapng files of
+// Ethernet, Linux cooked, BSD loopback or raw IP links. Everything but UDP
+// over IPv4 is skipped, and so are fragments.
+////////////////////////////////////////////////////////////////////////////////
+
+
+/// A UDP datagram read from a capture.
+struct RcpCapturedDatagram {
+	int64_t time; // nanoseconds since the Unix epoch, as the capturing host saw it
+	sf::IpAddress source;
+	uint16_t sourcePort;
+	sf::IpAddress destination;
+	uint16_t destinationPort;
+	uint8_t dscp;
+	std::vector<uint8_t> data; // the UDP payload
+};
+
+
+class RcpCaptureWriter {
+public:
+	enum eDirection : uint32_t {
+		INBOUND = 1,
+		OUTBOUND = 2,
+	};
+
+	RcpCaptureWriter();
+	~RcpCaptureWriter();
+	RcpCaptureWriter(const RcpCaptureWriter&) = delete;
+	RcpCaptureWriter& operator=(const RcpCaptureWriter&) = delete;
+
+	/// Start writing a new pcapng file, the one open before is closed.
+	/// \return False if the file could not be created.
+	bool open(const std::string& path);
+
+	/// Flush and close the file.
+	void close();
+
+	bool isOpen() const;
+
+	/// Write a datagram, if a file is open. Can be called from any thread.
+	/// \param time When it was sent or received. The first one written is stamped with the wall clock,
+	///		the ones after it keep their distance from it, so simulated clocks make sensible captures too.
+	void write(eDirection direction, RcpClock::time_point time,
+			   const sf::IpAddress& source, uint16_t sourcePort,
+			   const sf::IpAddress& destination, uint16_t destinationPort,
+			   const void* data, size_t size, uint8_t dscp = 0);
+
+	/// Number of datagrams written to the current file.
+	uint64_t getCount() const;
+private:
+	std::mutex mtx;
+	std::ofstream file;
+	std::atomic_bool isFileOpen; // looked at without the lock, so idle captures cost nothing
+	std::atomic<uint64_t> count;
+	bool isTimeBase;
+	RcpClock::time_point timeBase; // the first datagram's time
+	int64_t wallTimeBase; // and the wall clock at the time, in ns
+};
+
+
+class RcpCaptureReader {
+public:
+	RcpCaptureReader();
+
+	/// Load a pcap or pcapng file.
+	/// \return False if it could not be read, or is neither format.
+	bool open(const std::string& path);
+
+	/// Use a capture in memory, e.g. one that's been downloaded.
+	bool open(std::vector<uint8_t> contents);
+
+	/// Get the next UDP datagram of the capture.
+	/// \return False at the end of the capture.
+	bool read(RcpCapturedDatagram& datagram);
+
+	/// Read all UDP datagrams of the capture from the beginning.
+	std::vector<RcpCapturedDatagram> readAll();
+
+	/// Number of frames skipped because they were not UDP over IPv4, or were truncated.
+	uint64_t getSkipped() const;
+private:
+	struct Interface {
+		uint32_t linkType;
+		int64_t resolution; // timestamp units per second
+	};
+
+	bool readPcap(RcpCapturedDatagram& datagram);
+	bool readPcapng(RcpCapturedDatagram& datagram);
+	bool decodeFrame(uint32_t linkType, const uint8_t* frame, size_t size, RcpCapturedDatagram& datagram); // find the UDP datagram in a frame
+	uint16_t get16(size_t offset) const; // in the file's byte order
+	uint32_t get32(size_t offset) const;
+private:
+	std::vector<uint8_t> contents;
+	size_t position;
+	bool isNg;
+	bool isSwapped; // the file's byte order is not the host's
+	std::vector<Interface> interfaces; // of the current pcapng section, or the one of a pcap file
+	uint64_t skipped;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Transport that writes what another one sends and receives to a capture.
+// RcpSocket puts one around its transport, and starts writing on startCapture.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpCaptureTransport : public RcpTransport {
+public:
+	RcpCaptureTransport(std::unique_ptr<RcpTransport> transport, RcpCaptureWriter& writer, RcpClock& clock = RcpClock::system());
+
+	bool bind(uint16_t port) override;
+	bool bindGroup(const sf::IpAddress& group, uint16_t port) override;
+	void unbind() override;
+	uint16_t getLocalPort() const override;
+	bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) override;
+	bool setTrafficClass(uint8_t dscp) override;
+	bool sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp) override;
+	bool setLaunchTimes(bool enable) override;
+	bool sendAt(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp, std::chrono::steady_clock::time_point launchTime) override;
+	bool wait(std::chrono::microseconds timeout) override;
+	bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) override;
+	bool setBufferSizes(size_t receive, size_t send) override;
+	bool getBufferSizes(size_t& receive, size_t& send) const override;
+	uint64_t getReceiveDrops() const override;
+	size_t receiveBatch(RcpDatagram* datagrams, size_t count) override;
+	size_t sendBatch(const RcpDatagram* datagrams, size_t count) override;
+private:
+	void capture(RcpCaptureWriter::eDirection direction, RcpClock::time_point time, const sf::IpAddress& peer, uint16_t peerPort, const void* data, size_t size, uint8_t dscp);
+	sf::IpAddress getLocalAddress(const sf::IpAddress& peer); // as seen by peer
+private:
+	std::unique_ptr<RcpTransport> transport;
+	RcpCaptureWriter& writer;
+	RcpClock& clock;
+	std::atomic<uint8_t> trafficClass;
+	sf::IpAddress localAddress; // on the network, looked up at binding
+};
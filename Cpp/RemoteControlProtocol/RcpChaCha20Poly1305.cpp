@@ -0,0 +1,336 @@
+#include "RcpChaCha20Poly1305.h"
+
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define REMCON_CHACHA_SSE2
+#endif
+
+
+static inline uint32_t load32(const uint8_t* p) {
+	return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void store32(uint8_t* p, uint32_t value) {
+	p[0] = uint8_t(value);
+	p[1] = uint8_t(value >> 8);
+	p[2] = uint8_t(value >> 16);
+	p[3] = uint8_t(value >> 24);
+}
+
+static inline void store64(uint8_t* p, uint64_t value) {
+	store32(p, uint32_t(value));
+	store32(p + 4, uint32_t(value >> 32));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ChaCha20
+
+static inline uint32_t rotl32(uint32_t x, int b) {
+	return (x << b) | (x >> (32 - b));
+}
+
+#define CHACHA_QUARTER_ROUND(a, b, c, d) \
+	a += b; d ^= a; d = rotl32(d, 16); \
+	c += d; b ^= c; b = rotl32(b, 12); \
+	a += b; d ^= a; d = rotl32(d, 8); \
+	c += d; b ^= c; b = rotl32(b, 7);
+
+static void chachaBlock(const uint32_t state[16], uint8_t out[64]) {
+	uint32_t x[16];
+	memcpy(x, state, sizeof(x));
+	for (int i = 0; i < 10; ++i) {
+		CHACHA_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+		CHACHA_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+		CHACHA_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+		CHACHA_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+		CHACHA_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+		CHACHA_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+		CHACHA_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+		CHACHA_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (int i = 0; i < 16; ++i) {
+		store32(out + 4 * i, x[i] + state[i]);
+	}
+}
+
+#ifdef REMCON_CHACHA_SSE2
+// Four blocks side by side: lane k of register i is word i of block k.
+#define CHACHA_ROTL_SSE2(v, b) _mm_or_si128(_mm_slli_epi32(v, b), _mm_srli_epi32(v, 32 - b))
+#define CHACHA_QUARTER_ROUND_SSE2(a, b, c, d) \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL_SSE2(d, 16); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL_SSE2(b, 12); \
+	a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL_SSE2(d, 8); \
+	c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL_SSE2(b, 7);
+
+static void chachaBlocks4(const uint32_t state[16], uint8_t* data) {
+	__m128i x[16], input[16];
+	for (int i = 0; i < 16; ++i) {
+		input[i] = _mm_set1_epi32((int)state[i]);
+	}
+	input[12] = _mm_add_epi32(input[12], _mm_set_epi32(3, 2, 1, 0));
+	for (int i = 0; i < 16; ++i) {
+		x[i] = input[i];
+	}
+	for (int i = 0; i < 10; ++i) {
+		CHACHA_QUARTER_ROUND_SSE2(x[0], x[4], x[8], x[12]);
+		CHACHA_QUARTER_ROUND_SSE2(x[1], x[5], x[9], x[13]);
+		CHACHA_QUARTER_ROUND_SSE2(x[2], x[6], x[10], x[14]);
+		CHACHA_QUARTER_ROUND_SSE2(x[3], x[7], x[11], x[15]);
+		CHACHA_QUARTER_ROUND_SSE2(x[0], x[5], x[10], x[15]);
+		CHACHA_QUARTER_ROUND_SSE2(x[1], x[6], x[11], x[12]);
+		CHACHA_QUARTER_ROUND_SSE2(x[2], x[7], x[8], x[13]);
+		CHACHA_QUARTER_ROUND_SSE2(x[3], x[4], x[9], x[14]);
+	}
+	// transpose each 4 words back to the blocks, and XOR them into the data
+	for (int group = 0; group < 4; ++group) {
+		__m128i* w = x + 4 * group;
+		const __m128i* in = input + 4 * group;
+		__m128i w0 = _mm_add_epi32(w[0], in[0]), w1 = _mm_add_epi32(w[1], in[1]);
+		__m128i w2 = _mm_add_epi32(w[2], in[2]), w3 = _mm_add_epi32(w[3], in[3]);
+		__m128i t0 = _mm_unpacklo_epi32(w0, w1), t1 = _mm_unpacklo_epi32(w2, w3);
+		__m128i t2 = _mm_unpackhi_epi32(w0, w1), t3 = _mm_unpackhi_epi32(w2, w3);
+		__m128i blocks[4] = {
+			_mm_unpacklo_epi64(t0, t1),
+			_mm_unpackhi_epi64(t0, t1),
+			_mm_unpacklo_epi64(t2, t3),
+			_mm_unpackhi_epi64(t2, t3),
+		};
+		for (int block = 0; block < 4; ++block) {
+			__m128i* p = (__m128i*)(data + 64 * block + 16 * group);
+			_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), blocks[block]));
+		}
+	}
+}
+#endif
+
+
+void RcpChaCha20Poly1305::chacha20(const uint8_t* key, const uint8_t* nonce, uint32_t counter, void* data, size_t size) {
+	uint32_t state[16] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 }; // "expand 32-byte k"
+	for (int i = 0; i < 8; ++i) {
+		state[4 + i] = load32(key + 4 * i);
+	}
+	state[12] = counter;
+	for (int i = 0; i < 3; ++i) {
+		state[13 + i] = load32(nonce + 4 * i);
+	}
+
+	uint8_t* bytes = static_cast<uint8_t*>(data);
+#ifdef REMCON_CHACHA_SSE2
+	for (; size >= 256; size -= 256, bytes += 256) {
+		chachaBlocks4(state, bytes);
+		state[12] += 4;
+	}
+#endif
+	while (size > 0) {
+		uint8_t stream[64];
+		chachaBlock(state, stream);
+		size_t count = size < 64 ? size : 64;
+		for (size_t i = 0; i < count; ++i) {
+			bytes[i] ^= stream[i];
+		}
+		state[12]++;
+		bytes += count;
+		size -= count;
+	}
+}
+
+
+bool RcpChaCha20Poly1305::isVectorized() {
+#ifdef REMCON_CHACHA_SSE2
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Poly1305, with 26 bit limbs, which need no 128 bit multiplication
+
+namespace {
+
+class Poly1305 {
+public:
+	explicit Poly1305(const uint8_t* key) : leftover(0) {
+		// r is clamped
+		r[0] = (load32(key + 0)) & 0x3ffffff;
+		r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+		r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+		r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+		r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+		for (int i = 0; i < 5; ++i) {
+			h[i] = 0;
+		}
+		for (int i = 0; i < 4; ++i) {
+			pad[i] = load32(key + 16 + 4 * i);
+		}
+	}
+
+	void update(const uint8_t* data, size_t size) {
+		if (leftover > 0) {
+			size_t count = std::min(16 - leftover, size);
+			memcpy(buffer + leftover, data, count);
+			leftover += count;
+			data += count;
+			size -= count;
+			if (leftover < 16) {
+				return;
+			}
+			blocks(buffer, 16, 1 << 24);
+			leftover = 0;
+		}
+		size_t whole = size & ~size_t(15);
+		blocks(data, whole, 1 << 24);
+		memcpy(buffer, data + whole, size - whole);
+		leftover = size - whole;
+	}
+
+	/// Zeros up to the next 16 bytes.
+	void pad16() {
+		if (leftover > 0) {
+			memset(buffer + leftover, 0, 16 - leftover);
+			blocks(buffer, 16, 1 << 24);
+			leftover = 0;
+		}
+	}
+
+	void finish(uint8_t* tag) {
+		if (leftover > 0) {
+			buffer[leftover] = 1;
+			memset(buffer + leftover + 1, 0, 15 - leftover);
+			blocks(buffer, 16, 0);
+		}
+
+		// fully carry h
+		uint32_t h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4], c;
+		c = h1 >> 26; h1 &= 0x3ffffff; h2 += c;
+		c = h2 >> 26; h2 &= 0x3ffffff; h3 += c;
+		c = h3 >> 26; h3 &= 0x3ffffff; h4 += c;
+		c = h4 >> 26; h4 &= 0x3ffffff; h0 += c * 5;
+		c = h0 >> 26; h0 &= 0x3ffffff; h1 += c;
+
+		// h - p, taken if it does not go below zero
+		uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+		uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+		uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+		uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+		uint32_t g4 = h4 + c - (1u << 26);
+		uint32_t mask = (g4 >> 31) - 1;
+		h0 = (h0 & ~mask) | (g0 & mask);
+		h1 = (h1 & ~mask) | (g1 & mask);
+		h2 = (h2 & ~mask) | (g2 & mask);
+		h3 = (h3 & ~mask) | (g3 & mask);
+		h4 = (h4 & ~mask) | (g4 & mask);
+
+		// h + pad, modulo 2^128
+		uint32_t w0 = h0 | (h1 << 26);
+		uint32_t w1 = (h1 >> 6) | (h2 << 20);
+		uint32_t w2 = (h2 >> 12) | (h3 << 14);
+		uint32_t w3 = (h3 >> 18) | (h4 << 8);
+		uint64_t f;
+		f = uint64_t(w0) + pad[0]; store32(tag + 0, uint32_t(f));
+		f = uint64_t(w1) + pad[1] + (f >> 32); store32(tag + 4, uint32_t(f));
+		f = uint64_t(w2) + pad[2] + (f >> 32); store32(tag + 8, uint32_t(f));
+		f = uint64_t(w3) + pad[3] + (f >> 32); store32(tag + 12, uint32_t(f));
+	}
+private:
+	void blocks(const uint8_t* data, size_t size, uint32_t hibit) {
+		const uint32_t r0 = r[0], r1 = r[1], r2 = r[2], r3 = r[3], r4 = r[4];
+		const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+		uint32_t h0 = h[0], h1 = h[1], h2 = h[2], h3 = h[3], h4 = h[4];
+		for (; size >= 16; size -= 16, data += 16) {
+			h0 += (load32(data + 0)) & 0x3ffffff;
+			h1 += (load32(data + 3) >> 2) & 0x3ffffff;
+			h2 += (load32(data + 6) >> 4) & 0x3ffffff;
+			h3 += (load32(data + 9) >> 6) & 0x3ffffff;
+			h4 += (load32(data + 12) >> 8) | hibit;
+
+			uint64_t d0 = uint64_t(h0) * r0 + uint64_t(h1) * s4 + uint64_t(h2) * s3 + uint64_t(h3) * s2 + uint64_t(h4) * s1;
+			uint64_t d1 = uint64_t(h0) * r1 + uint64_t(h1) * r0 + uint64_t(h2) * s4 + uint64_t(h3) * s3 + uint64_t(h4) * s2;
+			uint64_t d2 = uint64_t(h0) * r2 + uint64_t(h1) * r1 + uint64_t(h2) * r0 + uint64_t(h3) * s4 + uint64_t(h4) * s3;
+			uint64_t d3 = uint64_t(h0) * r3 + uint64_t(h1) * r2 + uint64_t(h2) * r1 + uint64_t(h3) * r0 + uint64_t(h4) * s4;
+			uint64_t d4 = uint64_t(h0) * r4 + uint64_t(h1) * r3 + uint64_t(h2) * r2 + uint64_t(h3) * r1 + uint64_t(h4) * r0;
+
+			uint32_t c;
+			c = uint32_t(d0 >> 26); h0 = uint32_t(d0) & 0x3ffffff;
+			d1 += c; c = uint32_t(d1 >> 26); h1 = uint32_t(d1) & 0x3ffffff;
+			d2 += c; c = uint32_t(d2 >> 26); h2 = uint32_t(d2) & 0x3ffffff;
+			d3 += c; c = uint32_t(d3 >> 26); h3 = uint32_t(d3) & 0x3ffffff;
+			d4 += c; c = uint32_t(d4 >> 26); h4 = uint32_t(d4) & 0x3ffffff;
+			h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+			h1 += c;
+		}
+		h[0] = h0; h[1] = h1; h[2] = h2; h[3] = h3; h[4] = h4;
+	}
+private:
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+	uint8_t buffer[16];
+	size_t leftover;
+};
+
+} // namespace
+
+
+void RcpChaCha20Poly1305::poly1305(const uint8_t* key, const void* data, size_t size, uint8_t* tag) {
+	Poly1305 mac(key);
+	mac.update(static_cast<const uint8_t*>(data), size);
+	mac.finish(tag);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// AEAD
+
+// The tag of the associated data and the ciphertext, with the one-time key of block 0.
+static void computeTag(const uint8_t* key, const uint8_t* nonce,
+					   const void* associated, size_t associatedSize,
+					   const void* ciphertext, size_t size, uint8_t* tag)
+{
+	uint8_t oneTimeKey[64] = {};
+	RcpChaCha20Poly1305::chacha20(key, nonce, 0, oneTimeKey, sizeof(oneTimeKey));
+
+	Poly1305 mac(oneTimeKey);
+	mac.update(static_cast<const uint8_t*>(associated), associatedSize);
+	mac.pad16();
+	mac.update(static_cast<const uint8_t*>(ciphertext), size);
+	mac.pad16();
+	uint8_t lengths[16];
+	store64(lengths, associatedSize);
+	store64(lengths + 8, size);
+	mac.update(lengths, sizeof(lengths));
+	mac.finish(tag);
+}
+
+
+void RcpChaCha20Poly1305::seal(const uint8_t* key, const uint8_t* nonce,
+							   const void* associated, size_t associatedSize,
+							   void* data, size_t size, uint8_t* tag)
+{
+	chacha20(key, nonce, 1, data, size);
+	computeTag(key, nonce, associated, associatedSize, data, size, tag);
+}
+
+
+bool RcpChaCha20Poly1305::open(const uint8_t* key, const uint8_t* nonce,
+							   const void* associated, size_t associatedSize,
+							   void* data, size_t size, const uint8_t* tag)
+{
+	uint8_t expected[TagSize];
+	computeTag(key, nonce, associated, associatedSize, data, size, expected);
+	// the time it takes tells nothing about where the tags differ
+	uint8_t difference = 0;
+	for (size_t i = 0; i < TagSize; ++i) {
+		difference |= expected[i] ^ tag[i];
+	}
+	if (difference != 0) {
+		return false;
+	}
+	chacha20(key, nonce, 1, data, size);
+	return true;
+}
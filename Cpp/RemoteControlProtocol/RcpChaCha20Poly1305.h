@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// ChaCha20-Poly1305 authenticated encryption, RFC 8439.
+//
+// Datagrams are encrypted and decrypted where they are, in the socket's send
+// and receive buffers, so encryption adds no copies. The header goes as
+// associated data: it stays readable, but it can't be changed either.
+// ChaCha20 runs four blocks at once with SSE2 where there is SSE2, which is
+// all x86-64 processors; elsewhere, one block at a time.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpChaCha20Poly1305 {
+public:
+	static const size_t KeySize = 32;
+	static const size_t NonceSize = 12;
+	static const size_t TagSize = 16;
+
+	/// Encrypt data in place, and compute the tag of it and the associated data.
+	/// \param nonce Must not repeat with the same key.
+	static void seal(const uint8_t* key, const uint8_t* nonce,
+					 const void* associated, size_t associatedSize,
+					 void* data, size_t size, uint8_t* tag);
+
+	/// Check the tag, and decrypt data in place if it's right.
+	/// \return False if the tag is wrong, data is left as it was then.
+	static bool open(const uint8_t* key, const uint8_t* nonce,
+					 const void* associated, size_t associatedSize,
+					 void* data, size_t size, const uint8_t* tag);
+
+	/// XOR the ChaCha20 key stream into data, from the given block on.
+	static void chacha20(const uint8_t* key, const uint8_t* nonce, uint32_t counter, void* data, size_t size);
+
+	/// Compute the Poly1305 tag of a message with a one-time key.
+	static void poly1305(const uint8_t* key, const void* data, size_t size, uint8_t* tag);
+
+	/// Check if ChaCha20 runs on SIMD registers.
+	static bool isVectorized();
+};
@@ -0,0 +1,163 @@
+#include "RcpClock.h"
+
+#include <algorithm>
+
+using namespace std::chrono;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// System clock
+
+class RcpSystemClock : public RcpClock {
+public:
+	time_point now() const override {
+		return steady_clock::now();
+	}
+
+	bool waitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& condvar, time_point deadline, const std::function<bool()>& pred) override {
+		// wait_until would overflow converting max() to the system clock
+		if (deadline == time_point::max()) {
+			condvar.wait(lock, pred);
+			return true;
+		}
+		return condvar.wait_until(lock, deadline, pred);
+	}
+};
+
+
+RcpClock& RcpClock::system() {
+	static RcpSystemClock clock;
+	return clock;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Simulated clock
+
+RcpSimulatedClock::RcpSimulatedClock(time_point start) {
+	current = start;
+	generation = 0;
+	nextSleeperId = 0;
+	settleTimeout = milliseconds(500);
+}
+
+
+auto RcpSimulatedClock::now() const -> time_point {
+	std::lock_guard<std::mutex> lk(mtx);
+	return current;
+}
+
+
+// waiters sleep on the clock's own condvar, notify() wakes them up instead of the caller's
+bool RcpSimulatedClock::waitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& /*condvar*/, time_point deadline, const std::function<bool()>& pred) {
+	while (!pred()) {
+		if (now() >= deadline) {
+			return false;
+		}
+		// notifiers change the state under the lock, then call notify(), so
+		// either pred sees the change or the generation is already stale
+		uint64_t expected = getGeneration();
+		lock.unlock();
+		sleepUntil(deadline, expected);
+		lock.lock();
+	}
+	return true;
+}
+
+
+void RcpSimulatedClock::notify() {
+	std::lock_guard<std::mutex> lk(mtx);
+	generation++;
+	sleepers.clear();
+	sleepCondvar.notify_all();
+}
+
+
+void RcpSimulatedClock::sleepUntil(time_point deadline, uint64_t expected) {
+	std::unique_lock<std::mutex> lk(mtx);
+	if (expected != generation || current >= deadline) {
+		return;
+	}
+	uint64_t id = nextSleeperId++;
+	sleepers[id] = deadline;
+	idleCondvar.notify_all();
+	sleepCondvar.wait(lk, [this, id] { return sleepers.count(id) == 0; });
+}
+
+
+uint64_t RcpSimulatedClock::getGeneration() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return generation;
+}
+
+
+void RcpSimulatedClock::advance(duration time) {
+	advanceTo(now() + time);
+}
+
+
+void RcpSimulatedClock::advanceTo(time_point target) {
+	std::unique_lock<std::mutex> lk(mtx);
+	while (true) {
+		settle(lk);
+
+		// jump to the earliest event, but never backwards
+		time_point next = target;
+		for (auto& sleeper : sleepers) {
+			next = std::min(next, sleeper.second);
+		}
+		current = std::max(current, next);
+
+		// wake everyone who is due, and let them run before moving on
+		bool isAnyWoken = false;
+		for (auto it = sleepers.begin(); it != sleepers.end();) {
+			if (it->second <= current) {
+				it = sleepers.erase(it);
+				isAnyWoken = true;
+			}
+			else {
+				++it;
+			}
+		}
+		if (isAnyWoken) {
+			sleepCondvar.notify_all();
+			continue;
+		}
+		if (current >= target) {
+			break;
+		}
+	}
+}
+
+
+void RcpSimulatedClock::settle(std::unique_lock<std::mutex>& lk) {
+	idleCondvar.wait_for(lk, settleTimeout, [this] { return sleepers.size() >= participants.size(); });
+}
+
+
+void RcpSimulatedClock::setSettleTimeout(milliseconds timeout) {
+	std::lock_guard<std::mutex> lk(mtx);
+	settleTimeout = timeout;
+}
+
+
+size_t RcpSimulatedClock::getNumParticipants() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return participants.size();
+}
+
+
+void RcpSimulatedClock::enter() {
+	std::lock_guard<std::mutex> lk(mtx);
+	participants[std::this_thread::get_id()]++;
+}
+
+
+void RcpSimulatedClock::leave() {
+	std::lock_guard<std::mutex> lk(mtx);
+	auto it = participants.find(std::this_thread::get_id());
+	if (it != participants.end() && --it->second == 0) {
+		participants.erase(it);
+	}
+	idleCondvar.notify_all();
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <thread>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Time source of RcpSocket.
+//
+// Every timestamp and every timed wait of the socket goes through its clock.
+// The system clock is the steady clock, but a simulated clock can be injected
+// to run timeouts and retransmissions without actually waiting for them.
+//
+// Waits on a condition variable must go through waitUntil, and whoever
+// notifies that condition variable must call notify() as well, so that a
+// simulated clock can wake its sleepers.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpClock {
+public:
+	using time_point = std::chrono::steady_clock::time_point;
+	using duration = std::chrono::steady_clock::duration;
+
+	virtual ~RcpClock() {}
+
+	/// Get the current time.
+	virtual time_point now() const = 0;
+
+	/// Wait on condvar until pred is true or the clock reaches deadline.
+	/// \param lock Must be locked, as for std::condition_variable::wait_until.
+	/// \param deadline time_point::max() waits forever.
+	/// \return The value of pred.
+	virtual bool waitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& condvar, time_point deadline, const std::function<bool()>& pred) = 0;
+
+	/// Wake threads waiting on this clock, so that they check their conditions again.
+	virtual void notify() {}
+
+	/// A thread that waits on the clock from time to time.
+	/// Simulated clocks only advance when all participants are waiting.
+	/// Threads should only participate while they are busy with the socket.
+	/// Nesting is fine, a thread counts once.
+	class Participant {
+	public:
+		Participant(RcpClock& clock) : clock(clock) { clock.enter(); }
+		~Participant() { clock.leave(); }
+		Participant(const Participant&) = delete;
+		Participant& operator=(const Participant&) = delete;
+	private:
+		RcpClock& clock;
+	};
+
+	/// The steady clock, used by sockets by default.
+	static RcpClock& system();
+protected:
+	virtual void enter() {}
+	virtual void leave() {}
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Discrete event simulation of time.
+//
+// Time stands still until advance() is called. Advancing lets all participants
+// run until they wait on the clock again, then jumps to the earliest deadline
+// any of them is waiting for, and repeats until the target time is reached.
+// A scenario of several seconds of timeouts thus takes a few milliseconds.
+//
+// Participants doing something else than waiting on the clock, say, blocking
+// on a mutex for long, stall advance() until settleTimeout of real time passes.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpSimulatedClock : public RcpClock {
+public:
+	/// \param start Initial time. Not zero by default, as zero usually means "never".
+	RcpSimulatedClock(time_point start = time_point(std::chrono::hours(1)));
+
+	time_point now() const override;
+	bool waitUntil(std::unique_lock<std::mutex>& lock, std::condition_variable& condvar, time_point deadline, const std::function<bool()>& pred) override;
+	void notify() override;
+
+	/// Run the simulation for the given amount of simulated time.
+	void advance(duration time);
+
+	/// Run the simulation until the given point in simulated time.
+	void advanceTo(time_point time);
+
+	/// Sleep until the clock reaches deadline, or notify() is called.
+	/// \param generation Returns immediately if notify() was called since getGeneration() returned this.
+	void sleepUntil(time_point deadline, uint64_t generation);
+
+	/// Incremented by each notify().
+	uint64_t getGeneration() const;
+
+	/// The maximum real time to wait for participants to go idle before the clock moves on.
+	void setSettleTimeout(std::chrono::milliseconds timeout);
+
+	/// Get the number of threads participating right now.
+	size_t getNumParticipants() const;
+protected:
+	void enter() override;
+	void leave() override;
+private:
+	void settle(std::unique_lock<std::mutex>& lk);
+private:
+	mutable std::mutex mtx;
+	std::condition_variable sleepCondvar; // sleepers wait on this
+	std::condition_variable idleCondvar; // advance waits on this for sleepers
+	time_point current;
+	uint64_t generation;
+	std::map<std::thread::id, unsigned> participants; // thread -> nesting depth
+	uint64_t nextSleeperId;
+	std::map<uint64_t, time_point> sleepers; // id -> deadline, removed when woken
+	std::chrono::milliseconds settleTimeout;
+};
@@ -0,0 +1,160 @@
+#include "RcpClockSync.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std::chrono;
+
+
+// Drift is only estimated if the selected samples span at least this long,
+// otherwise the slope is mostly noise.
+static const int64_t MinDriftSpan = 2000000000ll; // ns
+// Any real oscillator is well within this; larger estimates are noise too.
+static const double MaxDrift = 500e-6;
+
+const size_t RcpClockSync::FilterSize;
+const size_t RcpClockSync::HistorySize;
+
+
+RcpClockSync::RcpClockSync() {
+	reset();
+}
+
+
+void RcpClockSync::reset() {
+	std::lock_guard<std::mutex> lk(mtx);
+	sampleCount = 0;
+	historyCount = 0;
+	reference = { 0, 0, 0 };
+	drift = 0.0;
+}
+
+
+void RcpClockSync::addSample(time_point t1, time_point t2, time_point t3, time_point t4) {
+	int64_t n1 = duration_cast<nanoseconds>(t1.time_since_epoch()).count();
+	int64_t n2 = duration_cast<nanoseconds>(t2.time_since_epoch()).count();
+	int64_t n3 = duration_cast<nanoseconds>(t3.time_since_epoch()).count();
+	int64_t n4 = duration_cast<nanoseconds>(t4.time_since_epoch()).count();
+
+	Sample sample;
+	sample.localTime = n1 + (n4 - n1) / 2;
+	sample.offset = ((n2 - n1) + (n3 - n4)) / 2;
+	sample.delay = (n4 - n1) - (n3 - n2);
+	if (sample.delay < 0) {
+		return; // timestamps are garbage
+	}
+
+	std::lock_guard<std::mutex> lk(mtx);
+
+	filter[sampleCount % FilterSize] = sample;
+	sampleCount++;
+
+	// select the minimum delay sample in the filter, the newest one on a tie
+	size_t filled = std::min(sampleCount, FilterSize);
+	const Sample* best = &filter[0];
+	for (size_t i = 1; i < filled; ++i) {
+		if (filter[i].delay < best->delay || (filter[i].delay == best->delay && filter[i].localTime > best->localTime)) {
+			best = &filter[i];
+		}
+	}
+
+	// a sample is only selected once, otherwise it would weigh more in the drift fit
+	if (best->localTime == reference.localTime && historyCount > 0) {
+		return;
+	}
+	reference = *best;
+	history[historyCount % HistorySize] = reference;
+	historyCount++;
+	updateDrift();
+}
+
+
+void RcpClockSync::updateDrift() {
+	size_t count = std::min(historyCount, HistorySize);
+	if (count < 2) {
+		drift = 0.0;
+		return;
+	}
+
+	// least squares fit of offset over local time, relative to the reference to keep numbers small
+	double sumX = 0, sumY = 0, sumXX = 0, sumXY = 0;
+	int64_t minTime = history[0].localTime, maxTime = history[0].localTime;
+	for (size_t i = 0; i < count; ++i) {
+		double x = double(history[i].localTime - reference.localTime);
+		double y = double(history[i].offset - reference.offset);
+		sumX += x;
+		sumY += y;
+		sumXX += x * x;
+		sumXY += x * y;
+		minTime = std::min(minTime, history[i].localTime);
+		maxTime = std::max(maxTime, history[i].localTime);
+	}
+	double denominator = count * sumXX - sumX * sumX;
+	if (maxTime - minTime < MinDriftSpan || denominator <= 0.0) {
+		drift = 0.0;
+		return;
+	}
+	double slope = (count * sumXY - sumX * sumY) / denominator;
+	drift = std::max(-MaxDrift, std::min(MaxDrift, slope));
+}
+
+
+int64_t RcpClockSync::offsetAt(int64_t localTime) const {
+	return reference.offset + (int64_t)std::llround(drift * double(localTime - reference.localTime));
+}
+
+
+bool RcpClockSync::isSynchronized() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return historyCount > 0;
+}
+
+
+size_t RcpClockSync::getSampleCount() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return sampleCount;
+}
+
+
+nanoseconds RcpClockSync::getOffset(time_point localTime) const {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (historyCount == 0) {
+		return nanoseconds(0);
+	}
+	return nanoseconds(offsetAt(duration_cast<nanoseconds>(localTime.time_since_epoch()).count()));
+}
+
+
+double RcpClockSync::getDrift() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return drift;
+}
+
+
+nanoseconds RcpClockSync::getRoundTripDelay() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return nanoseconds(reference.delay);
+}
+
+
+RcpClockSync::time_point RcpClockSync::remoteToLocal(time_point remoteTime) const {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (historyCount == 0) {
+		return remoteTime;
+	}
+	// remote = local + offset + drift*(local - ref) -> solve for local
+	int64_t remote = duration_cast<nanoseconds>(remoteTime.time_since_epoch()).count();
+	int64_t sinceReference = remote - reference.offset - reference.localTime;
+	int64_t local = reference.localTime + (int64_t)std::llround(double(sinceReference) / (1.0 + drift));
+	return time_point(duration_cast<time_point::duration>(nanoseconds(local)));
+}
+
+
+RcpClockSync::time_point RcpClockSync::localToRemote(time_point localTime) const {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (historyCount == 0) {
+		return localTime;
+	}
+	int64_t local = duration_cast<nanoseconds>(localTime.time_since_epoch()).count();
+	return time_point(duration_cast<time_point::duration>(nanoseconds(local + offsetAt(local))));
+}
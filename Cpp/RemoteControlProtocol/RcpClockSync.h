@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <mutex>
+#include <array>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Estimates the offset and drift of the remote peer's clock.
+//
+// RcpSocket periodically exchanges TIM packets with the remote peer, NTP style:
+//	t1 - request sent (local clock)
+//	t2 - request received (remote clock)
+//	t3 - response sent (remote clock)
+//	t4 - response received (local clock)
+// Each exchange gives an offset estimate ((t2-t1) + (t3-t4))/2, which is exact
+// if the path is symmetric, and a round trip delay (t4-t1) - (t3-t2).
+// Queueing only ever adds delay, so the sample with the smallest delay of
+// the last few exchanges is the most trustworthy one (NTP's clock filter).
+// Drift is the slope of a least squares fit over the selected samples.
+//
+// Methods can be called from any thread.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpClockSync {
+public:
+	using time_point = std::chrono::steady_clock::time_point;
+
+	static const size_t FilterSize = 8; // raw samples to select the min-delay one from
+	static const size_t HistorySize = 16; // selected samples used for drift estimation
+
+	RcpClockSync();
+
+	/// Add the four timestamps of an exchange.
+	void addSample(time_point t1, time_point t2, time_point t3, time_point t4);
+
+	/// Forget all samples.
+	void reset();
+
+	/// True if there's at least one sample.
+	bool isSynchronized() const;
+
+	/// Get the number of exchanges since the last reset.
+	size_t getSampleCount() const;
+
+	/// Get the offset of the remote clock (remote - local) at the given local time.
+	std::chrono::nanoseconds getOffset(time_point localTime = std::chrono::steady_clock::now()) const;
+
+	/// Get the relative rate error of the remote clock, e.g. 1e-5 if it runs 10 ppm faster.
+	double getDrift() const;
+
+	/// Get the round trip delay of the sample the estimation currently relies on.
+	std::chrono::nanoseconds getRoundTripDelay() const;
+
+	/// Convert a remote timestamp to local time.
+	/// Unless synchronized, the time is returned as is.
+	time_point remoteToLocal(time_point remoteTime) const;
+
+	/// Convert a local timestamp to the remote peer's time.
+	/// Unless synchronized, the time is returned as is.
+	time_point localToRemote(time_point localTime) const;
+private:
+	struct Sample {
+		int64_t localTime; // ns, middle of the exchange
+		int64_t offset; // ns
+		int64_t delay; // ns
+	};
+
+	void updateDrift();
+	int64_t offsetAt(int64_t localTime) const;
+
+	mutable std::mutex mtx;
+
+	std::array<Sample, FilterSize> filter; // last raw samples
+	size_t sampleCount;
+
+	std::array<Sample, HistorySize> history; // selected samples
+	size_t historyCount;
+
+	Sample reference; // the sample conversions are based on
+	double drift;
+};
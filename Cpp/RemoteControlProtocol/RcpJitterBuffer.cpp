@@ -0,0 +1,156 @@
+#include "RcpJitterBuffer.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace std::chrono;
+
+
+static const double IncreaseGain = 0.25; // of the difference to the target, per message
+static const double DecreaseGain = 1.0 / 64;
+
+
+RcpJitterBuffer::RcpJitterBuffer(RcpClock& clock) : clock(&clock) {
+	numPushes = 0;
+	percentile = 0.95;
+	minDelay = 0;
+	maxDelay = duration_cast<nanoseconds>(milliseconds(500)).count();
+	windowSize = 256;
+	capacity = 1024;
+	clear();
+}
+
+
+void RcpJitterBuffer::setPercentile(double percentile) {
+	std::lock_guard<std::mutex> lk(mtx);
+	this->percentile = std::min(std::max(percentile, 0.0), 1.0);
+}
+
+
+void RcpJitterBuffer::setDelayLimits(microseconds minDelay, microseconds maxDelay) {
+	std::lock_guard<std::mutex> lk(mtx);
+	this->minDelay = duration_cast<nanoseconds>(minDelay).count();
+	this->maxDelay = std::max(this->minDelay, (int64_t)duration_cast<nanoseconds>(maxDelay).count());
+	playoutDelay = std::min(std::max(playoutDelay, (double)this->minDelay), (double)this->maxDelay);
+}
+
+
+void RcpJitterBuffer::setWindowSize(size_t numMessages) {
+	std::lock_guard<std::mutex> lk(mtx);
+	windowSize = std::max(numMessages, size_t(1));
+}
+
+
+void RcpJitterBuffer::setCapacity(size_t capacity) {
+	std::lock_guard<std::mutex> lk(mtx);
+	this->capacity = capacity;
+}
+
+
+bool RcpJitterBuffer::push(RcpPacket packet, time_point senderTime) {
+	std::unique_lock<std::mutex> lk(mtx);
+	auto now = clock->now();
+	statistics.received++;
+
+	// the clocks' offset is in every transit, and cancels out against the base
+	int64_t transit = duration_cast<nanoseconds>(now.time_since_epoch() - senderTime.time_since_epoch()).count();
+	updateDelay(transit);
+
+	if ((isReleased && senderTime <= lastReleased) || getPlayoutTime(senderTime) < now) {
+		statistics.lateDiscards++;
+		return false;
+	}
+	if (messages.size() >= capacity) {
+		statistics.overflowDiscards++;
+		return false;
+	}
+	if (!messages.emplace(senderTime, std::move(packet)).second) {
+		return false; // a duplicate
+	}
+
+	numPushes++;
+	lk.unlock();
+	condvar.notify_all();
+	clock->notify();
+	return true;
+}
+
+
+bool RcpJitterBuffer::pop(RcpPacket& packet, int timeout) {
+	RcpClock::Participant participant(*clock);
+	std::unique_lock<std::mutex> lk(mtx);
+	auto deadline = timeout == std::numeric_limits<int>::max() ? time_point::max() : clock->now() + milliseconds(timeout);
+
+	while (true) {
+		// the delay may have changed since the last look, the due time is recomputed each time
+		time_point due = messages.empty() ? time_point::max() : getPlayoutTime(messages.begin()->first);
+		time_point now = clock->now();
+		if (due <= now) {
+			break;
+		}
+		if (now >= deadline) {
+			return false;
+		}
+		uint64_t pushes = numPushes;
+		clock->waitUntil(lk, condvar, std::min(due, deadline), [&] { return numPushes != pushes; });
+	}
+
+	auto it = messages.begin();
+	packet = std::move(it->second);
+	lastReleased = it->first;
+	isReleased = true;
+	messages.erase(it);
+	statistics.released++;
+	return true;
+}
+
+
+auto RcpJitterBuffer::getNextPlayoutTime() const -> time_point {
+	std::lock_guard<std::mutex> lk(mtx);
+	return messages.empty() ? time_point::max() : getPlayoutTime(messages.begin()->first);
+}
+
+
+void RcpJitterBuffer::clear() {
+	std::lock_guard<std::mutex> lk(mtx);
+	transits.clear();
+	baseTransit = 0;
+	playoutDelay = (double)minDelay;
+	targetDelay = minDelay;
+	messages.clear();
+	isReleased = false;
+	lastReleased = time_point();
+	statistics = Statistics();
+}
+
+
+auto RcpJitterBuffer::getStatistics() const -> Statistics {
+	std::lock_guard<std::mutex> lk(mtx);
+	Statistics result = statistics;
+	result.playoutDelay = duration_cast<microseconds>(nanoseconds((int64_t)playoutDelay));
+	result.targetDelay = duration_cast<microseconds>(nanoseconds(targetDelay));
+	return result;
+}
+
+
+auto RcpJitterBuffer::getPlayoutTime(time_point senderTime) const -> time_point {
+	return senderTime + duration_cast<time_point::duration>(nanoseconds(baseTransit + (int64_t)playoutDelay));
+}
+
+
+void RcpJitterBuffer::updateDelay(int64_t transit) {
+	transits.push_back(transit);
+	while (transits.size() > windowSize) {
+		transits.pop_front();
+	}
+	baseTransit = *std::min_element(transits.begin(), transits.end());
+
+	// the percentile of how much later than the fastest the messages came
+	std::vector<int64_t> variation(transits.begin(), transits.end());
+	size_t index = std::min(variation.size() - 1, (size_t)(percentile * variation.size()));
+	std::nth_element(variation.begin(), variation.begin() + index, variation.end());
+	targetDelay = std::min(std::max(variation[index] - baseTransit, minDelay), maxDelay);
+
+	double gain = targetDelay > playoutDelay ? IncreaseGain : DecreaseGain;
+	playoutDelay += gain * (targetDelay - playoutDelay);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <limits>
+
+#include "RcpPacket.h"
+#include "RcpClock.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Playout buffer for a periodic stream, e.g. telemetry or a command stream.
+//
+// Messages of a stream are received with the spacing the network gives them,
+// bursts on Wi-Fi, instead of the spacing they were sent with. The buffer
+// holds them back and releases them at their sender timestamp plus a delay,
+// so the output is spaced like the input, unless the network delays a
+// message by more than the buffer does.
+//
+// The delay is measured against the transit of the messages: arrival time
+// minus sender timestamp. The clocks of the two sides need not be in sync,
+// their offset is the same for all messages of a stream. The fastest transit
+// of the recent messages is the base, and the target delay is a percentile of
+// how much slower than the base the recent messages were. The playout delay
+// moves toward the target: quickly up, to stop discarding, and slowly down,
+// as to keep the spacing smooth. Messages arriving after their playout time,
+// or after a later message has been released, are discarded as late.
+//
+// Use a buffer per stream. Methods can be called from any thread.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpJitterBuffer {
+public:
+	using time_point = std::chrono::steady_clock::time_point;
+
+	struct Statistics {
+		uint64_t received = 0; // messages pushed
+		uint64_t released = 0; // messages popped
+		uint64_t lateDiscards = 0; // arrived after their playout time, or after a later message was released
+		uint64_t overflowDiscards = 0; // the buffer was full
+		std::chrono::microseconds playoutDelay = std::chrono::microseconds(0); // over the fastest transit
+		std::chrono::microseconds targetDelay = std::chrono::microseconds(0); // the percentile of transit variation
+	};
+
+	/// \param clock Must outlive the buffer. Use the socket's.
+	RcpJitterBuffer(RcpClock& clock = RcpClock::system());
+	RcpJitterBuffer(const RcpJitterBuffer&) = delete;
+	RcpJitterBuffer& operator=(const RcpJitterBuffer&) = delete;
+
+	/// Set the fraction of messages the delay should be long enough for. Default is 0.95.
+	void setPercentile(double percentile);
+
+	/// Set the range of the playout delay. Default is 0 to 500 ms.
+	void setDelayLimits(std::chrono::microseconds minDelay, std::chrono::microseconds maxDelay);
+
+	/// Set how many of the latest messages the delay is estimated from. Default is 256.
+	void setWindowSize(size_t numMessages);
+
+	/// Set how many messages may wait in the buffer. Default is 1024.
+	void setCapacity(size_t capacity);
+
+	/// Add a message when it's received.
+	/// \param senderTime When the sender stamped the message, on its own clock.
+	///		Its epoch does not matter, but it must be the same for the whole stream.
+	/// \return False if the message was discarded.
+	bool push(RcpPacket packet, time_point senderTime);
+
+	/// Take the next message if its playout time has come.
+	/// \param timeout Milliseconds to wait for it, 0 returns right away.
+	/// \return False if no message is due within the timeout.
+	bool pop(RcpPacket& packet, int timeout = 0);
+
+	/// Get the time the next message is due, time_point::max() if there's none.
+	time_point getNextPlayoutTime() const;
+
+	/// Drop all messages and estimates, e.g. when the stream restarts.
+	void clear();
+
+	Statistics getStatistics() const;
+private:
+	time_point getPlayoutTime(time_point senderTime) const; // call with mtx locked
+	void updateDelay(int64_t transit); // call with mtx locked
+private:
+	RcpClock* clock;
+	mutable std::mutex mtx;
+	std::condition_variable condvar; // notified on push
+	uint64_t numPushes;
+
+	// settings
+	double percentile;
+	int64_t minDelay, maxDelay; // ns
+	size_t windowSize;
+	size_t capacity;
+
+	// estimation, in nanoseconds
+	std::deque<int64_t> transits; // arrival minus sender time of the latest messages
+	int64_t baseTransit; // the fastest of them
+	double playoutDelay; // over the base
+	int64_t targetDelay;
+
+	std::map<time_point, RcpPacket> messages; // waiting, by sender time
+	time_point lastReleased; // sender time of the last message popped
+	bool isReleased; // lastReleased is valid
+	Statistics statistics;
+};
@@ -0,0 +1,252 @@
+#include "RcpLinkQuality.h"
+#include "RcpRealTime.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std::chrono;
+
+
+const milliseconds RcpLinkQuality::Interval(100);
+
+static const double IntervalGain = 0.25; // EWMA over intervals
+static const double RoundTripGain = 0.125; // RFC 6298 alpha
+static const double VariationGain = 0.25; // RFC 6298 beta
+static const double JitterGain = 1.0 / 16.0; // RFC 3550
+
+
+RcpLinkQuality::RcpLinkQuality() : version(0), nextThresholdId(1) {
+	reset();
+}
+
+
+void RcpLinkQuality::reset() {
+	isStarted = false;
+	highestReceived = 0;
+	receivedMask = 0;
+	intervalStart = time_point();
+	expected = lost = reordered = dropped = bytesReceived = bytesDelivered = 0;
+	estimate = Snapshot();
+	hasRoundTrip = false;
+	lastRoundTrip = 0.0;
+	publish();
+
+	// a new connection starts below every threshold
+	std::lock_guard<std::mutex> lk(thresholdMutex);
+	for (auto& threshold : thresholds) {
+		threshold.isAbove = false;
+	}
+}
+
+
+void RcpLinkQuality::addReceived(uint64_t sequenceNumber, size_t size, time_point time) {
+	update(time);
+	bytesReceived += size;
+
+	if (!isStarted) {
+		isStarted = true;
+		intervalStart = time;
+		highestReceived = sequenceNumber;
+		receivedMask = 1;
+		expected++;
+		return;
+	}
+
+	if (sequenceNumber > highestReceived) {
+		// the ones skipped are lost, unless they come late
+		uint64_t shift = sequenceNumber - highestReceived;
+		expected += shift;
+		lost += shift - 1;
+		receivedMask = shift < ReorderWindow ? (receivedMask << shift) | 1 : 1;
+		highestReceived = sequenceNumber;
+	}
+	else {
+		uint64_t age = highestReceived - sequenceNumber;
+		if (age < ReorderWindow && (receivedMask & (uint64_t(1) << age)) == 0) {
+			// it was counted lost when a newer one came first
+			receivedMask |= uint64_t(1) << age;
+			reordered++;
+			if (lost > 0) {
+				lost--;
+			}
+		}
+		// otherwise it's a duplicate, or too late to tell
+	}
+}
+
+
+void RcpLinkQuality::addRoundTrip(nanoseconds roundTrip, time_point time) {
+	update(time);
+	double sample = roundTrip.count() / 1000.0;
+	if (sample < 0.0) {
+		return;
+	}
+
+	double smoothed = (double)estimate.roundTripTime.count();
+	double variation = (double)estimate.roundTripVariation.count();
+	if (!hasRoundTrip) {
+		smoothed = sample;
+		variation = sample / 2;
+	}
+	else {
+		variation += VariationGain * (std::abs(smoothed - sample) - variation);
+		smoothed += RoundTripGain * (sample - smoothed);
+		double jitter = (double)estimate.jitter.count();
+		jitter += JitterGain * (std::abs(sample - lastRoundTrip) - jitter);
+		estimate.jitter = microseconds((int64_t)jitter);
+	}
+	estimate.roundTripTime = microseconds((int64_t)smoothed);
+	estimate.roundTripVariation = microseconds((int64_t)variation);
+	hasRoundTrip = true;
+	lastRoundTrip = sample;
+	publish();
+}
+
+
+void RcpLinkQuality::addDelivered(size_t size, time_point time) {
+	update(time);
+	bytesDelivered += size;
+}
+
+
+void RcpLinkQuality::addDropped(uint64_t count, time_point time) {
+	update(time);
+	dropped += count;
+	estimate.drops += count;
+	publish();
+}
+
+
+void RcpLinkQuality::update(time_point time) {
+	if (!isStarted) {
+		return;
+	}
+	if (time - intervalStart >= Interval) {
+		closeInterval(time);
+	}
+}
+
+
+void RcpLinkQuality::closeInterval(time_point time) {
+	// after a silence, the interval is just longer
+	double seconds = duration_cast<duration<double>>(time - intervalStart).count();
+	double gain = estimate.numIntervals == 0 ? 1.0 : IntervalGain;
+
+	// with nothing expected, there's nothing to tell about loss
+	// the drops are missing too, as far as they are the peer's numbered packets
+	if (expected > 0) {
+		uint64_t localDrops = std::min(dropped, lost);
+		double lossSample = std::min(1.0, (double)(lost - localDrops) / expected);
+		double dropSample = std::min(1.0, (double)localDrops / expected);
+		double reorderSample = std::min(1.0, (double)reordered / expected);
+		estimate.lossRate += gain * (lossSample - estimate.lossRate);
+		estimate.dropRate += gain * (dropSample - estimate.dropRate);
+		estimate.reorderRate += gain * (reorderSample - estimate.reorderRate);
+	}
+	estimate.receiveRate += gain * (bytesReceived / seconds - estimate.receiveRate);
+	estimate.deliveryRate += gain * (bytesDelivered / seconds - estimate.deliveryRate);
+	estimate.numIntervals++;
+
+	intervalStart = time;
+	expected = lost = reordered = dropped = bytesReceived = bytesDelivered = 0;
+
+	publish();
+	checkThresholds();
+}
+
+
+void RcpLinkQuality::publish() {
+	uint32_t current = version.load(std::memory_order_relaxed);
+	version.store(current + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	lossRate.store(estimate.lossRate, std::memory_order_relaxed);
+	dropRate.store(estimate.dropRate, std::memory_order_relaxed);
+	drops.store(estimate.drops, std::memory_order_relaxed);
+	reorderRate.store(estimate.reorderRate, std::memory_order_relaxed);
+	receiveRate.store(estimate.receiveRate, std::memory_order_relaxed);
+	deliveryRate.store(estimate.deliveryRate, std::memory_order_relaxed);
+	roundTripTime.store(estimate.roundTripTime.count(), std::memory_order_relaxed);
+	roundTripVariation.store(estimate.roundTripVariation.count(), std::memory_order_relaxed);
+	jitter.store(estimate.jitter.count(), std::memory_order_relaxed);
+	numIntervals.store(estimate.numIntervals, std::memory_order_relaxed);
+
+	version.store(current + 2, std::memory_order_release);
+}
+
+
+auto RcpLinkQuality::getSnapshot() const -> Snapshot {
+	Snapshot snapshot;
+	uint32_t before, after;
+	do {
+		before = version.load(std::memory_order_acquire);
+		snapshot.lossRate = lossRate.load(std::memory_order_relaxed);
+		snapshot.dropRate = dropRate.load(std::memory_order_relaxed);
+		snapshot.drops = drops.load(std::memory_order_relaxed);
+		snapshot.reorderRate = reorderRate.load(std::memory_order_relaxed);
+		snapshot.receiveRate = receiveRate.load(std::memory_order_relaxed);
+		snapshot.deliveryRate = deliveryRate.load(std::memory_order_relaxed);
+		snapshot.roundTripTime = microseconds(roundTripTime.load(std::memory_order_relaxed));
+		snapshot.roundTripVariation = microseconds(roundTripVariation.load(std::memory_order_relaxed));
+		snapshot.jitter = microseconds(jitter.load(std::memory_order_relaxed));
+		snapshot.numIntervals = numIntervals.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		after = version.load(std::memory_order_relaxed);
+	} while (before != after || (before & 1) != 0);
+	return snapshot;
+}
+
+
+double RcpLinkQuality::getValue(const Snapshot& snapshot, eMetric metric) {
+	switch (metric) {
+		case LOSS_RATE: return snapshot.lossRate;
+		case REORDER_RATE: return snapshot.reorderRate;
+		case ROUND_TRIP_TIME: return snapshot.roundTripTime.count() / 1000.0;
+		case JITTER: return snapshot.jitter.count() / 1000.0;
+		case RECEIVE_RATE: return snapshot.receiveRate;
+		case DELIVERY_RATE: return snapshot.deliveryRate;
+		case DROP_RATE: return snapshot.dropRate;
+	}
+	return 0.0;
+}
+
+
+size_t RcpLinkQuality::addThreshold(eMetric metric, double upper, double lower, ThresholdHandler handler) {
+	std::lock_guard<std::mutex> lk(thresholdMutex);
+	size_t id = nextThresholdId++;
+	thresholds.push_back({ id, metric, upper, std::min(lower, upper), std::move(handler), false });
+	return id;
+}
+
+
+void RcpLinkQuality::removeThreshold(size_t id) {
+	std::lock_guard<std::mutex> lk(thresholdMutex);
+	thresholds.erase(std::remove_if(thresholds.begin(), thresholds.end(), [id](const Threshold& threshold) { return threshold.id == id; }), thresholds.end());
+}
+
+
+void RcpLinkQuality::checkThresholds() {
+	// handlers are called outside the lock, in the order the crossings were found
+	// crossings are rare, copying and calling the user's handlers may allocate
+	RcpRealTime::AllocationScope allocation;
+	std::vector<Threshold> triggered;
+	{
+		std::lock_guard<std::mutex> lk(thresholdMutex);
+		for (auto& threshold : thresholds) {
+			double value = getValue(estimate, threshold.metric);
+			if (!threshold.isAbove && value > threshold.upper) {
+				threshold.isAbove = true;
+				triggered.push_back(threshold);
+			}
+			else if (threshold.isAbove && value < threshold.lower) {
+				threshold.isAbove = false;
+				triggered.push_back(threshold);
+			}
+		}
+	}
+	for (auto& threshold : triggered) {
+		if (threshold.handler) {
+			threshold.handler(threshold.metric, threshold.isAbove, estimate);
+		}
+	}
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <functional>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Estimates the quality of the link to the remote peer from existing traffic.
+//
+// RcpSocket feeds it on the IO thread, no probing traffic is sent:
+//	- every packet of the peer that has a sequence number of its own (data,
+//	  keepalives, clock sync requests): a window of the latest 64 numbers tells
+//	  packets that came late (reordered) from the ones that never came (lost),
+//	- the acknowledgement of reliable packets that were sent only once, and
+//	  clock sync replies, give round trip times,
+//	- the datagrams the local OS dropped for a full receive buffer: those
+//	  are missing too, but count as drops, not as the network's loss.
+// Loss, reordering and the rates are counted over intervals of 100 ms, and
+// smoothed over intervals with an EWMA of gain 1/4. The round trip time is
+// smoothed per sample like TCP's (RFC 6298), jitter is the mean difference of
+// consecutive round trips (RFC 3550).
+//
+// The latest estimates are published as a snapshot, which can be read from
+// any thread without locking. Thresholds notify handlers on the IO thread
+// when an estimate crosses them, with hysteresis, so an application can back
+// off before the link collapses.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpLinkQuality {
+public:
+	using time_point = std::chrono::steady_clock::time_point;
+
+	static const size_t ReorderWindow = 64; // packets a late one may be behind the newest
+	static const std::chrono::milliseconds Interval;
+
+	struct Snapshot {
+		double lossRate = 0.0; // fraction of the peer's packets lost on the network
+		double dropRate = 0.0; // fraction of the peer's packets the local OS dropped, the receive buffer being full
+		uint64_t drops = 0; // datagrams the local OS dropped during the connection
+		double reorderRate = 0.0; // fraction of the peer's packets received late
+		std::chrono::microseconds roundTripTime = std::chrono::microseconds(0); // smoothed
+		std::chrono::microseconds roundTripVariation = std::chrono::microseconds(0); // mean deviation of the round trip
+		std::chrono::microseconds jitter = std::chrono::microseconds(0);
+		double receiveRate = 0.0; // bytes per second received from the peer
+		double deliveryRate = 0.0; // bytes per second of reliable data acknowledged by the peer
+		uint64_t numIntervals = 0; // number of intervals the estimates are based on, 0 if none yet
+	};
+
+	/// Estimates thresholds can be set on.
+	enum eMetric {
+		LOSS_RATE, // fraction
+		REORDER_RATE, // fraction
+		ROUND_TRIP_TIME, // milliseconds
+		JITTER, // milliseconds
+		RECEIVE_RATE, // bytes per second
+		DELIVERY_RATE, // bytes per second
+		DROP_RATE, // fraction
+	};
+
+	/// Notified on the IO thread when an estimate crosses a threshold.
+	/// \param isAbove True if it went above the upper limit, false if it went back below the lower one.
+	/// Keep it short, the connection's traffic is not processed meanwhile.
+	using ThresholdHandler = std::function<void(eMetric metric, bool isAbove, const Snapshot& snapshot)>;
+
+	RcpLinkQuality();
+
+	// --- Feeding, on the IO thread --- //
+
+	/// Forget everything, for a new connection.
+	void reset();
+
+	/// Add a packet of the peer, with its extended sequence number.
+	void addReceived(uint64_t sequenceNumber, size_t size, time_point time);
+
+	/// Add the round trip of a packet and its answer.
+	void addRoundTrip(std::chrono::nanoseconds roundTrip, time_point time);
+
+	/// Add reliable data the peer acknowledged.
+	void addDelivered(size_t size, time_point time);
+
+	/// Add datagrams the OS dropped, because the receive buffer was full.
+	void addDropped(uint64_t count, time_point time);
+
+	/// Close the interval if it's over, even if nothing happens.
+	void update(time_point time);
+
+	// --- Reading, from any thread --- //
+
+	/// Get the latest estimates, without locking.
+	Snapshot getSnapshot() const;
+
+	/// Get an estimate in the unit of thresholds.
+	static double getValue(const Snapshot& snapshot, eMetric metric);
+
+	/// Notify handler when the metric goes above upper, and when it goes back below lower.
+	/// \return An id to remove the threshold with.
+	size_t addThreshold(eMetric metric, double upper, double lower, ThresholdHandler handler);
+
+	/// Remove a threshold set by addThreshold.
+	void removeThreshold(size_t id);
+private:
+	struct Threshold {
+		size_t id;
+		eMetric metric;
+		double upper, lower;
+		ThresholdHandler handler;
+		bool isAbove;
+	};
+
+	void closeInterval(time_point time);
+	void publish();
+	void checkThresholds();
+private:
+	// sequence tracking
+	bool isStarted;
+	uint64_t highestReceived; // newest sequence number
+	uint64_t receivedMask; // bit n: highestReceived - n was received
+
+	// counts of the current interval
+	time_point intervalStart;
+	uint64_t expected, lost, reordered, dropped, bytesReceived, bytesDelivered;
+
+	// estimates, only touched by the IO thread
+	Snapshot estimate;
+	bool hasRoundTrip;
+	double lastRoundTrip; // us
+
+	// published estimates: a sequence lock, odd while being written
+	std::atomic<uint32_t> version;
+	std::atomic<double> lossRate, dropRate, reorderRate, receiveRate, deliveryRate;
+	std::atomic<uint64_t> drops;
+	std::atomic<int64_t> roundTripTime, roundTripVariation, jitter; // us
+	std::atomic<uint64_t> numIntervals;
+
+	std::mutex thresholdMutex;
+	std::vector<Threshold> thresholds;
+	size_t nextThresholdId;
+};
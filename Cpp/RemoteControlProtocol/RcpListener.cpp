@@ -0,0 +1,423 @@
+#include "RcpListener.h"
+
+#include <unordered_map>
+
+#ifdef REMCON_WINDOWS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+#ifdef REMCON_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+using namespace std::chrono;
+
+
+namespace {
+
+const int HandshakeTimeout = 5000; // ms for a new session to complete its handshake
+const size_t SessionQueueSize = 4096; // datagrams waiting for a session's IO thread
+const auto WorkerPollTime = milliseconds(100); // how soon workers notice stopping
+
+// what the handshake's first datagram looks like
+bool isSyn(const uint8_t* data, size_t size) {
+	return size >= 12 && data[8] == 0 && data[9] == 0 && data[10] == 0 && data[11] == 1;
+}
+
+uint64_t getFlowKey(const sf::IpAddress& address, uint16_t port) {
+	return uint64_t(address.toInteger()) << 16 | port;
+}
+
+} // namespace
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Internals
+
+// gives access to the native handle, for SO_REUSEPORT
+class RcpListener::Socket : public sf::UdpSocket {
+public:
+	using sf::UdpSocket::create;
+	using sf::UdpSocket::getHandle;
+};
+
+
+struct RcpListener::Session {
+	struct Datagram {
+		std::vector<uint8_t> data;
+		sf::IpAddress address;
+		uint16_t port;
+	};
+
+	std::mutex mtx;
+	std::condition_variable condvar;
+	std::deque<Datagram> queue;
+	bool isClosed = false; // the socket is gone, the worker forgets the flow
+};
+
+
+struct RcpListener::Shard {
+	Socket socket;
+	uint16_t port;
+	int cpu; // pinned to, or -1
+	std::thread worker;
+
+	// the worker's own, never locked
+	std::unordered_map<uint64_t, std::shared_ptr<Session>> sessions;
+
+	std::atomic<uint64_t> received{ 0 };
+	std::atomic<uint64_t> numSessions{ 0 };
+	std::atomic<uint64_t> dropped{ 0 };
+};
+
+
+// The transport of a session's RcpSocket.
+class RcpListener::SessionTransport : public RcpTransport {
+public:
+	SessionTransport(std::shared_ptr<Shard> shard, std::shared_ptr<Session> session)
+		: shard(std::move(shard)), session(std::move(session)), isBound(true) {}
+
+	~SessionTransport() {
+		unbind();
+	}
+
+	// the session is bound to the listener's port from the start
+	bool bind(uint16_t port) override {
+		return isBound && (port == 0 || port == shard->port);
+	}
+
+	void unbind() override {
+		std::lock_guard<std::mutex> lk(session->mtx);
+		session->isClosed = true;
+		isBound = false;
+	}
+
+	uint16_t getLocalPort() const override {
+		return isBound ? shard->port : 0;
+	}
+
+	bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) override {
+		// the socket wakes itself up by sending to its own port
+		if (address == sf::IpAddress::LocalHost && port == shard->port) {
+			return push(data, size, address, port);
+		}
+		return shard->socket.send(data, size, address, port) == sf::UdpSocket::Done;
+	}
+
+	bool wait(microseconds timeout) override {
+		std::unique_lock<std::mutex> lk(session->mtx);
+		auto isReady = [this] { return !session->queue.empty(); };
+		if (timeout == microseconds::max()) {
+			session->condvar.wait(lk, isReady);
+			return true;
+		}
+		return session->condvar.wait_for(lk, timeout, isReady);
+	}
+
+	bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) override {
+		std::lock_guard<std::mutex> lk(session->mtx);
+		packet.clear();
+		if (session->queue.empty()) {
+			return false;
+		}
+		auto& datagram = session->queue.front();
+		packet.append(datagram.data.data(), datagram.data.size());
+		address = datagram.address;
+		port = datagram.port;
+		session->queue.pop_front();
+		return true;
+	}
+
+	// for the self wake-up
+	bool push(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) {
+		return push(*session, data, size, address, port);
+	}
+
+	// called by the worker
+	/// \return False if the session is closed, or its queue is full.
+	static bool push(Session& session, const void* data, size_t size, const sf::IpAddress& address, uint16_t port) {
+		{
+			std::lock_guard<std::mutex> lk(session.mtx);
+			if (session.isClosed || session.queue.size() >= SessionQueueSize) {
+				return false;
+			}
+			session.queue.push_back({ std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + size), address, port });
+		}
+		session.condvar.notify_one();
+		return true;
+	}
+private:
+	std::shared_ptr<Shard> shard; // keeps the socket open for sending
+	std::shared_ptr<Session> session;
+	bool isBound;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Listener
+
+RcpListener::RcpListener() {
+	runWorkers = false;
+	isPinning = false;
+	localPort = 0;
+	backlog = 64;
+}
+
+
+RcpListener::~RcpListener() {
+	unbind();
+}
+
+
+bool RcpListener::bind(uint16_t port, unsigned numShards) {
+	unbind();
+	if (numShards == 0) {
+		numShards = std::max(1u, std::thread::hardware_concurrency());
+	}
+	if (!isShardingSupported()) {
+		numShards = 1;
+	}
+
+	for (unsigned i = 0; i < numShards; ++i) {
+		std::shared_ptr<Shard> shard(new Shard());
+		shard->socket.create();
+		sf::SocketHandle handle = shard->socket.getHandle();
+		int enable = 1;
+#ifdef SO_REUSEPORT
+		setsockopt(handle, SOL_SOCKET, SO_REUSEPORT, (const char*)&enable, sizeof(enable));
+#endif
+		shard->cpu = -1;
+#ifdef SO_INCOMING_CPU
+		if (isPinning) {
+			shard->cpu = int(i % std::max(1u, std::thread::hardware_concurrency()));
+			setsockopt(handle, SOL_SOCKET, SO_INCOMING_CPU, (const char*)&shard->cpu, sizeof(shard->cpu));
+		}
+#endif
+
+		// the first shard picks the port if any will do, the rest join it
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(i == 0 ? port : localPort);
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		if (::bind(handle, (const sockaddr*)&address, sizeof(address)) != 0) {
+			shard->socket.unbind();
+			unbind();
+			return false;
+		}
+		shard->port = shard->socket.getLocalPort();
+		localPort = shard->port;
+		shard->socket.setBlocking(false);
+		shards.push_back(shard);
+	}
+
+	runWorkers = true;
+	for (auto& shard : shards) {
+		Shard* current = shard.get();
+		shard->worker = std::thread([this, current] { workerFunction(*current); });
+#ifdef REMCON_LINUX
+		if (current->cpu >= 0) {
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			CPU_SET(current->cpu, &cpus);
+			pthread_setaffinity_np(current->worker.native_handle(), sizeof(cpus), &cpus);
+		}
+#endif
+	}
+	return true;
+}
+
+
+void RcpListener::unbind() {
+	runWorkers = false;
+	for (auto& shard : shards) {
+		if (shard->worker.joinable()) {
+			shard->worker.join();
+		}
+		// sessions may still send through it, nothing is received anymore
+		shard->sessions.clear();
+	}
+	shards.clear();
+	localPort = 0;
+
+	std::deque<std::unique_ptr<RcpSocket>> pending;
+	{
+		std::lock_guard<std::mutex> lk(acceptMutex);
+		pending.swap(acceptQueue);
+	}
+	acceptCondvar.notify_all();
+	for (auto& socket : pending) {
+		socket->setLinger(0);
+	}
+}
+
+
+uint16_t RcpListener::getLocalPort() const {
+	return localPort;
+}
+
+
+unsigned RcpListener::getNumShards() const {
+	return (unsigned)shards.size();
+}
+
+
+void RcpListener::setFlowPinning(bool isEnabled) {
+	isPinning = isEnabled;
+}
+
+
+void RcpListener::setBacklog(size_t backlog) {
+	std::lock_guard<std::mutex> lk(acceptMutex);
+	this->backlog = backlog;
+}
+
+
+std::unique_ptr<RcpSocket> RcpListener::accept(int timeout) {
+	auto deadline = timeout == std::numeric_limits<int>::max() ? steady_clock::time_point::max() : steady_clock::now() + milliseconds(timeout);
+	while (true) {
+		std::unique_ptr<RcpSocket> socket;
+		{
+			std::unique_lock<std::mutex> lk(acceptMutex);
+			auto isReady = [this] { return !acceptQueue.empty() || !runWorkers; };
+			if (deadline == steady_clock::time_point::max()) {
+				acceptCondvar.wait(lk, isReady);
+			}
+			else if (!acceptCondvar.wait_until(lk, deadline, isReady)) {
+				return nullptr;
+			}
+			if (acceptQueue.empty()) {
+				return nullptr;
+			}
+			socket = std::move(acceptQueue.front());
+			acceptQueue.pop_front();
+		}
+
+		// the first one in the queue is not necessarily the first to connect, but it's the first to have started
+		auto now = steady_clock::now();
+		int remaining = deadline == steady_clock::time_point::max()
+			? std::numeric_limits<int>::max()
+			: (int)duration_cast<milliseconds>(std::max(deadline - now, steady_clock::duration(0))).count();
+		auto result = socket->waitHandshake(remaining);
+		if (result == RcpSocket::HANDSHAKE_SUCCESS) {
+			return socket;
+		}
+		if (result == RcpSocket::HANDSHAKE_PENDING) {
+			std::lock_guard<std::mutex> lk(acceptMutex);
+			acceptQueue.push_front(std::move(socket));
+			return nullptr;
+		}
+		// failed handshakes are just dropped
+	}
+}
+
+
+auto RcpListener::getStatistics() const -> std::vector<Statistics> {
+	std::vector<Statistics> statistics;
+	for (auto& shard : shards) {
+		Statistics current;
+		current.received = shard->received;
+		current.sessions = shard->numSessions;
+		current.dropped = shard->dropped;
+		statistics.push_back(current);
+	}
+	return statistics;
+}
+
+
+bool RcpListener::isShardingSupported() {
+#ifdef SO_REUSEPORT
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+void RcpListener::workerFunction(Shard& shard) {
+	sf::SocketSelector selector;
+	selector.add(shard.socket);
+	std::vector<uint8_t> buffer(sf::UdpSocket::MaxDatagramSize);
+	size_t size;
+	sf::IpAddress address;
+	uint16_t port;
+
+	while (runWorkers) {
+		if (!selector.wait(sf::milliseconds((int)WorkerPollTime.count()))) {
+			// forget the flows of closed sessions
+			for (auto it = shard.sessions.begin(); it != shard.sessions.end();) {
+				bool isClosed;
+				{
+					std::lock_guard<std::mutex> lk(it->second->mtx);
+					isClosed = it->second->isClosed;
+				}
+				// the session may be freed with it, so not under its lock
+				it = isClosed ? shard.sessions.erase(it) : std::next(it);
+			}
+			continue;
+		}
+
+		while (shard.socket.receive(buffer.data(), buffer.size(), size, address, port) == sf::UdpSocket::Done) {
+			shard.received++;
+			auto it = shard.sessions.find(getFlowKey(address, port));
+			if (it != shard.sessions.end()) {
+				if (SessionTransport::push(*it->second, buffer.data(), size, address, port)) {
+					continue;
+				}
+				bool isClosed;
+				{
+					std::lock_guard<std::mutex> lk(it->second->mtx);
+					isClosed = it->second->isClosed;
+				}
+				if (!isClosed) {
+					shard.dropped++;
+					continue;
+				}
+				// the peer may reconnect from the same port
+				shard.sessions.erase(it);
+			}
+
+			if (isSyn(buffer.data(), size)) {
+				startSession(shard, buffer.data(), size, address, port);
+			}
+			else {
+				shard.dropped++;
+			}
+		}
+	}
+}
+
+
+void RcpListener::startSession(Shard& shard, const uint8_t* data, size_t size, const sf::IpAddress& address, uint16_t port) {
+	std::shared_ptr<Shard> owner;
+	for (auto& current : shards) {
+		if (current.get() == &shard) {
+			owner = current;
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lk(acceptMutex);
+		if (acceptQueue.size() >= backlog) {
+			shard.dropped++;
+			return;
+		}
+	}
+
+	std::shared_ptr<Session> session(new Session());
+	SessionTransport::push(*session, data, size, address, port);
+	std::unique_ptr<RcpSocket> socket(new RcpSocket(std::unique_ptr<RcpTransport>(new SessionTransport(owner, session))));
+	socket->bind(shard.port);
+	socket->acceptAsync(HandshakeTimeout);
+	shard.sessions[getFlowKey(address, port)] = session;
+	shard.numSessions++;
+
+	{
+		std::lock_guard<std::mutex> lk(acceptMutex);
+		acceptQueue.push_back(std::move(socket));
+	}
+	acceptCondvar.notify_one();
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <limits>
+
+#include <SFML/Network.hpp>
+
+#include "RcpSocket.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Accepts many sessions on a single port, spreading their traffic over cores.
+//
+// The listener opens one UDP socket per shard, all bound to the same port
+// with SO_REUSEPORT, so the kernel hashes the flows across them. Each shard
+// has a worker thread, which owns the socket's flows: it receives their
+// datagrams and hands them to the sessions' queues, with no lock shared among
+// shards. A SYN from an unknown flow starts a new session, which accept()
+// returns once its handshake completes.
+//
+// Sessions are ordinary RcpSockets on a transport fed by their shard. They
+// send directly through the shard's socket. Destroying the socket ends the
+// session, and the flow is forgotten.
+//
+// Flow pinning binds each shard's worker to a core, and asks the kernel to
+// prefer the shard of the core the flow's packets are received on, with
+// SO_INCOMING_CPU. Without a BPF program this is only a preference: the
+// flows of an RSS queue stay on the core handling that queue, where the
+// kernel supports it, and fall back to the hash elsewhere.
+//
+// Sharding needs SO_REUSEPORT. Where it's missing, there is a single shard.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpListener {
+public:
+	struct Statistics {
+		uint64_t received = 0; // datagrams received by the shard
+		uint64_t sessions = 0; // sessions started
+		uint64_t dropped = 0; // datagrams of no session, or overflowing one's queue
+	};
+
+	RcpListener();
+	~RcpListener();
+	RcpListener(const RcpListener&) = delete;
+	RcpListener& operator=(const RcpListener&) = delete;
+
+	/// Open the shards on a port and start their workers.
+	/// \param port 0 picks any free port.
+	/// \param numShards 0 opens one per core.
+	/// \return False if the port could not be bound.
+	bool bind(uint16_t port, unsigned numShards = 0);
+
+	/// Stop the workers and close the port.
+	/// Sessions already accepted stay usable for sending, but receive nothing anymore.
+	void unbind();
+
+	/// Get the port all shards listen on, 0 if not bound.
+	uint16_t getLocalPort() const;
+
+	/// Get the number of shards opened by bind.
+	unsigned getNumShards() const;
+
+	/// Set whether to pin flows and workers to cores. Takes effect at the next bind. Off by default.
+	void setFlowPinning(bool isEnabled);
+
+	/// Set how many sessions may wait to be accepted. New SYNs are dropped beyond it. Default is 64.
+	void setBacklog(size_t backlog);
+
+	/// Wait for a new session.
+	/// \return A connected socket, or null if the timeout is over or the listener is not bound.
+	std::unique_ptr<RcpSocket> accept(int timeout = std::numeric_limits<int>::max());
+
+	/// Get the statistics of each shard.
+	std::vector<Statistics> getStatistics() const;
+
+	/// Check if the system can spread a port over several sockets.
+	static bool isShardingSupported();
+private:
+	class Socket;
+	class SessionTransport;
+	struct Session;
+	struct Shard;
+
+	void workerFunction(Shard& shard);
+	void startSession(Shard& shard, const uint8_t* data, size_t size, const sf::IpAddress& address, uint16_t port);
+private:
+	std::vector<std::shared_ptr<Shard>> shards;
+	std::atomic_bool runWorkers;
+	bool isPinning;
+	uint16_t localPort;
+
+	// sessions in handshake, or waiting for accept
+	std::mutex acceptMutex;
+	std::condition_variable acceptCondvar;
+	std::deque<std::unique_ptr<RcpSocket>> acceptQueue;
+	size_t backlog;
+};
@@ -0,0 +1,332 @@
+#include "RcpMulticast.h"
+#include "Exception.h"
+#include "RcpSerialNumber.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std::chrono;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Datagram header
+
+namespace {
+
+enum eMulticastFlags : uint16_t {
+	KEY = 1, // keyframe
+	NAK = 2, // repair request, keyframe number is the one missing
+	REP = 4, // repaired keyframe, sent by unicast
+};
+
+const size_t HeaderSize = 12;
+
+struct MulticastHeader {
+	uint32_t sequenceNumber;
+	uint32_t keyframeNumber;
+	uint16_t stream;
+	uint16_t flags;
+};
+
+void serializeHeader(const MulticastHeader& header, uint8_t* out) {
+	out[0] = uint8_t(header.sequenceNumber >> 24);
+	out[1] = uint8_t(header.sequenceNumber >> 16);
+	out[2] = uint8_t(header.sequenceNumber >> 8);
+	out[3] = uint8_t(header.sequenceNumber);
+	out[4] = uint8_t(header.keyframeNumber >> 24);
+	out[5] = uint8_t(header.keyframeNumber >> 16);
+	out[6] = uint8_t(header.keyframeNumber >> 8);
+	out[7] = uint8_t(header.keyframeNumber);
+	out[8] = uint8_t(header.stream >> 8);
+	out[9] = uint8_t(header.stream);
+	out[10] = uint8_t(header.flags >> 8);
+	out[11] = uint8_t(header.flags);
+}
+
+bool deserializeHeader(const void* data, size_t size, MulticastHeader& header) {
+	if (size < HeaderSize) {
+		return false;
+	}
+	auto in = (const uint8_t*)data;
+	header.sequenceNumber = uint32_t(in[0]) << 24 | uint32_t(in[1]) << 16 | uint32_t(in[2]) << 8 | in[3];
+	header.keyframeNumber = uint32_t(in[4]) << 24 | uint32_t(in[5]) << 16 | uint32_t(in[6]) << 8 | in[7];
+	header.stream = uint16_t(in[8] << 8 | in[9]);
+	header.flags = uint16_t(in[10] << 8 | in[11]);
+	return true;
+}
+
+} // namespace
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Publisher
+
+RcpMulticastPublisher::RcpMulticastPublisher() : RcpMulticastPublisher(std::unique_ptr<RcpTransport>(new RcpUdpTransport()), RcpClock::system()) {}
+
+RcpMulticastPublisher::RcpMulticastPublisher(std::unique_ptr<RcpTransport> transport, RcpClock& clock) : transport(std::move(transport)), clock(&clock) {
+	groupPort = 0;
+	isRepairEnabled = true;
+}
+
+
+bool RcpMulticastPublisher::bind(uint16_t port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	return transport->bind(port);
+}
+
+
+uint16_t RcpMulticastPublisher::getLocalPort() const {
+	return transport->getLocalPort();
+}
+
+
+void RcpMulticastPublisher::setGroup(const std::string& group, uint16_t port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	this->group = group;
+	groupPort = port;
+}
+
+
+void RcpMulticastPublisher::setRepair(bool isEnabled) {
+	std::lock_guard<std::mutex> lk(mtx);
+	isRepairEnabled = isEnabled;
+	if (!isEnabled) {
+		for (auto& stream : streams) {
+			stream.second.keyframe.data.clear();
+		}
+	}
+}
+
+
+bool RcpMulticastPublisher::publish(uint16_t stream, const void* data, size_t size, bool isKeyframe) {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (transport->getLocalPort() == 0 || size > sf::UdpSocket::MaxDatagramSize - HeaderSize) {
+		return false;
+	}
+	answerRepairs();
+
+	Stream& state = streams[stream];
+	state.sequenceNumber++;
+	if (isKeyframe) {
+		state.keyframeNumber++;
+	}
+
+	std::vector<uint8_t> datagram(HeaderSize + size);
+	serializeHeader({ state.sequenceNumber, state.keyframeNumber, stream, uint16_t(isKeyframe ? KEY : 0) }, datagram.data());
+	memcpy(datagram.data() + HeaderSize, data, size);
+	if (!transport->send(datagram.data(), datagram.size(), group, groupPort)) {
+		return false;
+	}
+
+	statistics.published++;
+	if (isKeyframe) {
+		statistics.keyframes++;
+		if (isRepairEnabled) {
+			state.keyframe = { state.sequenceNumber, state.keyframeNumber, std::move(datagram) };
+		}
+	}
+	return true;
+}
+
+
+size_t RcpMulticastPublisher::processRepairs(int timeout) {
+	RcpClock::Participant participant(*clock);
+	if (timeout > 0 && !transport->wait(milliseconds(timeout))) {
+		return 0;
+	}
+	std::lock_guard<std::mutex> lk(mtx);
+	return answerRepairs();
+}
+
+
+size_t RcpMulticastPublisher::answerRepairs() {
+	size_t numAnswered = 0;
+	sf::Packet packet;
+	sf::IpAddress sender;
+	uint16_t senderPort;
+	MulticastHeader header;
+	while (transport->receive(packet, sender, senderPort)) {
+		if (!deserializeHeader(packet.getData(), packet.getDataSize(), header) || header.flags != NAK) {
+			continue;
+		}
+
+		// the latest keyframe is sent, even if a newer one than requested
+		auto it = streams.find(header.stream);
+		if (!isRepairEnabled || it == streams.end() || it->second.keyframe.data.empty()) {
+			continue;
+		}
+		Keyframe& keyframe = it->second.keyframe;
+		if (RcpSerialNumber::isNewer(header.keyframeNumber, keyframe.keyframeNumber)) {
+			continue;
+		}
+		std::vector<uint8_t> repair = keyframe.data;
+		serializeHeader({ keyframe.sequenceNumber, keyframe.keyframeNumber, header.stream, uint16_t(KEY | REP) }, repair.data());
+		transport->send(repair.data(), repair.size(), sender, senderPort);
+		statistics.repairs++;
+		numAnswered++;
+	}
+	return numAnswered;
+}
+
+
+auto RcpMulticastPublisher::getStatistics() const -> Statistics {
+	std::lock_guard<std::mutex> lk(mtx);
+	return statistics;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Subscriber
+
+RcpMulticastSubscriber::RcpMulticastSubscriber() : RcpMulticastSubscriber(std::unique_ptr<RcpTransport>(new RcpUdpTransport()), RcpClock::system()) {}
+
+RcpMulticastSubscriber::RcpMulticastSubscriber(std::unique_ptr<RcpTransport> transport, RcpClock& clock) : transport(std::move(transport)), clock(&clock) {
+	repairInterval = milliseconds(50);
+}
+
+
+bool RcpMulticastSubscriber::subscribe(const std::string& group, uint16_t port) {
+	unsubscribe();
+	return transport->bindGroup(sf::IpAddress(group), port);
+}
+
+
+void RcpMulticastSubscriber::unsubscribe() {
+	transport->unbind();
+	streams.clear();
+	updates.clear();
+}
+
+
+bool RcpMulticastSubscriber::isSubscribed() const {
+	return transport->getLocalPort() != 0;
+}
+
+
+uint16_t RcpMulticastSubscriber::getLocalPort() const {
+	return transport->getLocalPort();
+}
+
+
+void RcpMulticastSubscriber::setRepairInterval(unsigned intervalMs) {
+	repairInterval = milliseconds(intervalMs);
+}
+
+
+bool RcpMulticastSubscriber::receive(RcpPacket& packet, uint16_t& stream, int timeout) {
+	if (!isSubscribed()) {
+		throw RcpInvalidCallException("must subscribe to a group to receive");
+	}
+	RcpClock::Participant participant(*clock);
+	auto deadline = timeout == std::numeric_limits<int>::max() ? RcpClock::time_point::max() : clock->now() + milliseconds(timeout);
+
+	sf::Packet datagram;
+	sf::IpAddress sender;
+	uint16_t senderPort;
+	while (true) {
+		// take everything that has arrived, so that only the latest updates remain
+		while (transport->receive(datagram, sender, senderPort)) {
+			processDatagram(datagram, sender, senderPort);
+		}
+		if (!updates.empty()) {
+			packet = std::move(updates.front().packet);
+			packet.deliveryTime = clock->now();
+			stream = updates.front().stream;
+			updates.pop_front();
+			statistics.delivered++;
+			return true;
+		}
+
+		auto now = clock->now();
+		if (now >= deadline) {
+			return false;
+		}
+		transport->wait(deadline == RcpClock::time_point::max() ? microseconds::max() : duration_cast<microseconds>(deadline - now));
+	}
+}
+
+
+void RcpMulticastSubscriber::processDatagram(const sf::Packet& datagram, const sf::IpAddress& sender, uint16_t senderPort) {
+	MulticastHeader header;
+	if (!deserializeHeader(datagram.getData(), datagram.getDataSize(), header) || (header.flags & NAK)) {
+		return;
+	}
+	statistics.received++;
+
+	Stream& state = streams[header.stream];
+	bool isKeyframe = (header.flags & KEY) != 0;
+	if (header.flags & REP) {
+		// a repair is older than the updates that made us ask for it, but it's the keyframe they need
+		if (!isKeyframe || (state.keyframeNumber != 0 && !RcpSerialNumber::isNewer(header.keyframeNumber, state.keyframeNumber))) {
+			statistics.stale++;
+			return;
+		}
+		statistics.repaired++;
+	}
+	else if (state.isStarted && !RcpSerialNumber::isNewer(header.sequenceNumber, state.sequenceNumber)) {
+		statistics.stale++;
+		return;
+	}
+
+	if (!state.isStarted || RcpSerialNumber::isNewer(header.sequenceNumber, state.sequenceNumber)) {
+		state.sequenceNumber = header.sequenceNumber;
+	}
+	state.isStarted = true;
+
+	// an update is of no use without the keyframe it builds upon
+	if (!isKeyframe && header.keyframeNumber != state.keyframeNumber) {
+		statistics.incomplete++;
+		requestRepair(header.stream, state, header.keyframeNumber, sender, senderPort);
+		return;
+	}
+	if (isKeyframe) {
+		state.keyframeNumber = header.keyframeNumber;
+	}
+
+	RcpPacket packet;
+	packet.setData((const uint8_t*)datagram.getData() + HeaderSize, datagram.getDataSize() - HeaderSize);
+	packet.sequenceNumber = header.sequenceNumber;
+	packet.reliable = isKeyframe;
+	packet.receiveTime = clock->now();
+	queueUpdate(header.stream, std::move(packet));
+}
+
+
+void RcpMulticastSubscriber::queueUpdate(uint16_t stream, RcpPacket&& packet) {
+	if (packet.isReliable()) {
+		// a keyframe makes the waiting updates of its stream obsolete
+		auto isObsolete = [stream](const Update& update) { return update.stream == stream && !update.packet.isReliable(); };
+		auto obsolete = std::remove_if(updates.begin(), updates.end(), isObsolete);
+		statistics.stale += updates.end() - obsolete;
+		updates.erase(obsolete, updates.end());
+	}
+	else {
+		// only the latest update waits
+		for (auto& update : updates) {
+			if (update.stream == stream && !update.packet.isReliable()) {
+				update.packet = std::move(packet);
+				statistics.stale++;
+				return;
+			}
+		}
+	}
+	updates.push_back({ stream, std::move(packet) });
+}
+
+
+void RcpMulticastSubscriber::requestRepair(uint16_t stream, Stream& state, uint32_t keyframeNumber, const sf::IpAddress& publisher, uint16_t publisherPort) {
+	auto now = clock->now();
+	if (repairInterval.count() == 0 || now - state.lastRequest < repairInterval) {
+		return;
+	}
+	uint8_t request[HeaderSize];
+	serializeHeader({ 0, keyframeNumber, stream, NAK }, request);
+	transport->send(request, sizeof(request), publisher, publisherPort);
+	state.lastRequest = now;
+	statistics.requests++;
+}
+
+
+auto RcpMulticastSubscriber::getStatistics() const -> Statistics {
+	return statistics;
+}
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <limits>
+
+#include <SFML/Network.hpp>
+
+#include "RcpPacket.h"
+#include "RcpClock.h"
+#include "RcpTransport.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// State distribution to many observers over multicast.
+//
+// The publisher sends each update once, to a multicast group, no matter how
+// many subscribers there are. There is no connection and no acknowledgement:
+// updates are latest-value, a subscriber that falls behind or misses one just
+// gets the next. Updates carry a stream number, each stream stands on its own.
+//
+// Keyframes are updates the following ones build upon. They are numbered, and
+// every update carries the number of the keyframe it builds upon. A subscriber
+// missing that keyframe drops the update and asks the publisher for the
+// keyframe with a NAK, which the publisher answers by unicast. Only the latest
+// keyframe of a stream is kept and repaired, older ones are of no use anymore.
+//
+// Header of the datagrams, 12 bytes, big endian:
+//	sequence number (32) - per stream, incremented for each update
+//	keyframe number (32) - the keyframe the update builds upon, 0 if none yet
+//	stream (16)
+//	flags (16) - KEY, NAK or REP
+////////////////////////////////////////////////////////////////////////////////
+
+
+class RcpMulticastPublisher {
+public:
+	struct Statistics {
+		uint64_t published = 0; // updates sent to the group
+		uint64_t keyframes = 0; // of which keyframes
+		uint64_t repairs = 0; // keyframes resent to a subscriber
+	};
+
+	/// Create a publisher on UDP.
+	RcpMulticastPublisher();
+	/// Create a publisher on a custom transport and clock, e.g. a simulated network.
+	RcpMulticastPublisher(std::unique_ptr<RcpTransport> transport, RcpClock& clock = RcpClock::system());
+	RcpMulticastPublisher(const RcpMulticastPublisher&) = delete;
+	RcpMulticastPublisher& operator=(const RcpMulticastPublisher&) = delete;
+
+	/// Bind the local port updates are sent from and repair requests arrive to.
+	bool bind(uint16_t port);
+
+	/// Get the locally used port.
+	uint16_t getLocalPort() const;
+
+	/// Set the multicast group and port to publish to.
+	void setGroup(const std::string& group, uint16_t port);
+
+	/// Set whether lost keyframes are resent to subscribers asking for them. On by default.
+	void setRepair(bool isEnabled);
+
+	/// Send an update of a stream to the group.
+	/// Repair requests that have arrived meanwhile are answered too.
+	/// \param isKeyframe Whether the following updates of the stream build upon this one.
+	/// \return False if it could not be sent, the publisher may not be bound, or the update is too large.
+	bool publish(uint16_t stream, const void* data, size_t size, bool isKeyframe = false);
+
+	/// Answer repair requests.
+	/// Call it when there's nothing to publish for a while.
+	/// \param timeout Milliseconds to wait for requests.
+	/// \return The number of keyframes resent.
+	size_t processRepairs(int timeout = 0);
+
+	Statistics getStatistics() const;
+private:
+	struct Keyframe {
+		uint32_t sequenceNumber;
+		uint32_t keyframeNumber;
+		std::vector<uint8_t> data; // header included
+	};
+	struct Stream {
+		uint32_t sequenceNumber = 0;
+		uint32_t keyframeNumber = 0;
+		Keyframe keyframe; // the latest one, if keyframeNumber is not 0
+	};
+
+	size_t answerRepairs(); // call with mtx locked
+private:
+	std::unique_ptr<RcpTransport> transport;
+	RcpClock* clock;
+	mutable std::mutex mtx;
+	sf::IpAddress group;
+	uint16_t groupPort;
+	bool isRepairEnabled;
+	std::map<uint16_t, Stream> streams;
+	Statistics statistics;
+};
+
+
+class RcpMulticastSubscriber {
+public:
+	struct Statistics {
+		uint64_t received = 0; // datagrams from the group, and repairs
+		uint64_t delivered = 0; // updates returned by receive
+		uint64_t stale = 0; // dropped, because a newer update of the stream had already arrived
+		uint64_t incomplete = 0; // dropped, because the keyframe they build upon is missing
+		uint64_t requests = 0; // NAKs sent
+		uint64_t repaired = 0; // keyframes received from the repair requests
+	};
+
+	/// Create a subscriber on UDP.
+	RcpMulticastSubscriber();
+	/// Create a subscriber on a custom transport and clock, e.g. a simulated network.
+	RcpMulticastSubscriber(std::unique_ptr<RcpTransport> transport, RcpClock& clock = RcpClock::system());
+	RcpMulticastSubscriber(const RcpMulticastSubscriber&) = delete;
+	RcpMulticastSubscriber& operator=(const RcpMulticastSubscriber&) = delete;
+
+	/// Join a multicast group and start receiving its updates.
+	/// Several subscribers on the same host can join the same group.
+	/// \return False if the group could not be joined.
+	bool subscribe(const std::string& group, uint16_t port);
+
+	/// Leave the group and forget all streams.
+	void unsubscribe();
+
+	/// Check if a group is joined.
+	bool isSubscribed() const;
+
+	/// Get the locally used port, the group's port unless the transport gives each member its own.
+	uint16_t getLocalPort() const;
+
+	/// Set how often a missing keyframe may be requested again.
+	/// \param intervalMs 0 never requests repairs. Default is 50 ms.
+	void setRepairInterval(unsigned intervalMs);
+
+	/// Receive the next update.
+	/// Of the updates of a stream waiting to be received, only the latest is returned,
+	/// except for keyframes, which are returned each.
+	/// Keyframes are reported as reliable packets, and the packet's sequence number is that of the update.
+	/// \param stream The stream the update belongs to.
+	/// \return False if nothing arrived within the timeout.
+	bool receive(RcpPacket& packet, uint16_t& stream, int timeout = std::numeric_limits<int>::max());
+
+	Statistics getStatistics() const;
+private:
+	struct Stream {
+		bool isStarted = false;
+		uint32_t sequenceNumber = 0; // of the newest update accepted
+		uint32_t keyframeNumber = 0; // of the newest keyframe accepted
+		std::chrono::steady_clock::time_point lastRequest;
+	};
+	struct Update {
+		uint16_t stream;
+		RcpPacket packet;
+	};
+
+	void processDatagram(const sf::Packet& datagram, const sf::IpAddress& sender, uint16_t senderPort);
+	void queueUpdate(uint16_t stream, RcpPacket&& packet);
+	void requestRepair(uint16_t stream, Stream& state, uint32_t keyframeNumber, const sf::IpAddress& publisher, uint16_t publisherPort);
+private:
+	std::unique_ptr<RcpTransport> transport;
+	RcpClock* clock;
+	std::map<uint16_t, Stream> streams;
+	std::deque<Update> updates; // received, waiting for the user
+	std::chrono::milliseconds repairInterval;
+	Statistics statistics;
+};
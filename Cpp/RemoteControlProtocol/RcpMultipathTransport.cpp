@@ -0,0 +1,555 @@
+#include "RcpMultipathTransport.h"
+#include "RcpSerialNumber.h"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+using namespace std::chrono;
+
+
+// the peer held the echoed copy this many microseconds per unit, 0xFFFF if longer or never
+static const int64_t EchoDelayUnit = 10;
+static const uint16_t NoEcho = 0xFFFF;
+
+// copies a loss sample is taken over
+static const uint16_t LossWindow = 16;
+
+// a lost copy counts as this much round trip when paths are compared
+static const microseconds LossPenalty = milliseconds(100);
+
+// the flags are the last byte of the RCP header: SYN, ACK, FIN and REL
+static const size_t RcpHeaderSize = 12;
+static const uint8_t RcpCriticalFlags = 1 | 2 | 4 | 16;
+
+
+static void Put16(uint8_t* p, uint16_t value) {
+	p[0] = uint8_t(value >> 8);
+	p[1] = uint8_t(value);
+}
+
+static void Put32(uint8_t* p, uint32_t value) {
+	p[0] = uint8_t(value >> 24);
+	p[1] = uint8_t(value >> 16);
+	p[2] = uint8_t(value >> 8);
+	p[3] = uint8_t(value);
+}
+
+static uint16_t Get16(const uint8_t* p) {
+	return uint16_t((p[0] << 8) | p[1]);
+}
+
+static uint32_t Get32(const uint8_t* p) {
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Setup
+
+RcpMultipathTransport::RcpMultipathTransport(RcpClock& clock) :
+	clock(clock),
+	mode(CRITICAL),
+	probeInterval(50),
+	trafficClass(CS0),
+	nextNumber(1),
+	bestPath(0),
+	window(WindowSize, 0),
+	highestNumber(0),
+	isWindowEmpty(true),
+	queue(QueueSize),
+	queueHead(0),
+	queueCount(0)
+{
+	runThreads = false;
+	queueDrops = 0;
+}
+
+
+RcpMultipathTransport::~RcpMultipathTransport() {
+	unbind();
+}
+
+
+size_t RcpMultipathTransport::addPath(std::unique_ptr<RcpTransport> transport, uint16_t localPort) {
+	std::lock_guard<std::mutex> lk(mtx);
+	std::unique_ptr<Path> path(new Path);
+	path->transport = std::move(transport);
+	path->localPort = localPort;
+	path->transport->setTrafficClass(trafficClass);
+	paths.push_back(std::move(path));
+	return paths.size() - 1;
+}
+
+
+void RcpMultipathTransport::setPeer(size_t path, const sf::IpAddress& address, uint16_t port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	paths[path]->peerAddress = address;
+	paths[path]->peerPort = port;
+}
+
+
+uint16_t RcpMultipathTransport::getPathLocalPort(size_t path) const {
+	return paths[path]->transport->getLocalPort();
+}
+
+
+size_t RcpMultipathTransport::getNumPaths() const {
+	return paths.size();
+}
+
+
+void RcpMultipathTransport::setMode(eMode mode) {
+	std::lock_guard<std::mutex> lk(mtx);
+	this->mode = mode;
+}
+
+
+void RcpMultipathTransport::setProbeInterval(milliseconds interval) {
+	std::lock_guard<std::mutex> lk(mtx);
+	probeInterval = std::max(interval, milliseconds(1));
+}
+
+
+size_t RcpMultipathTransport::getBestPath() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return paths.empty() ? 0 : selectBestPath(clock.now());
+}
+
+
+auto RcpMultipathTransport::getPathStatistics(size_t path) const -> PathStatistics {
+	std::lock_guard<std::mutex> lk(mtx);
+	PathStatistics statistics = paths[path]->statistics;
+	statistics.isUp = isUp(*paths[path], clock.now());
+	return statistics;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Binding
+
+bool RcpMultipathTransport::bind(uint16_t port) {
+	unbind();
+	if (paths.empty()) {
+		return false;
+	}
+	for (size_t i = 0; i < paths.size(); ++i) {
+		if (!paths[i]->transport->bind(i == 0 ? port : paths[i]->localPort)) {
+			for (size_t j = 0; j < i; ++j) {
+				paths[j]->transport->unbind();
+			}
+			return false;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		for (auto& path : paths) {
+			path->sequence = 0;
+			path->lastSend = RcpClock::time_point(); // probed right away
+			path->sendTimes.assign(SendRingSize, RcpClock::time_point());
+			path->highestReceived = 0;
+			path->highestReceivedTime = RcpClock::time_point();
+			path->receivedCount = 0;
+			path->lastEcho = 0;
+			path->lastEchoTime = RcpClock::time_point();
+			path->isLossBase = false;
+			path->isRoundTrip = false;
+			path->statistics = PathStatistics();
+		}
+		// numbering starts at random, so a peer that heard an earlier binding takes nothing for a copy
+		std::random_device random;
+		nextNumber = std::max(uint32_t(random()), 1u);
+		bestPath = 0;
+		std::fill(window.begin(), window.end(), 0);
+		isWindowEmpty = true;
+		queueHead = 0;
+		queueCount = 0;
+		queueDrops = 0;
+	}
+
+	runThreads = true;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		paths[i]->thread = std::thread([this, i] { pathThreadFunction(i); });
+	}
+	return true;
+}
+
+
+void RcpMultipathTransport::unbind() {
+	stopThreads();
+	for (auto& path : paths) {
+		path->transport->unbind();
+	}
+}
+
+
+uint16_t RcpMultipathTransport::getLocalPort() const {
+	return paths.empty() ? 0 : paths[0]->transport->getLocalPort();
+}
+
+
+void RcpMultipathTransport::stopThreads() {
+	runThreads = false;
+	for (auto& path : paths) {
+		if (path->thread.joinable()) {
+			// a datagram to self wakes the thread, like RcpSocket wakes its IO thread
+			uint8_t wakeup = 0;
+			path->transport->send(&wakeup, sizeof(wakeup), sf::IpAddress::LocalHost, path->transport->getLocalPort());
+			path->thread.join();
+		}
+	}
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Sending
+
+bool RcpMultipathTransport::send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) {
+	return sendCopies(data, size, address, port, -1, RcpClock::time_point());
+}
+
+
+bool RcpMultipathTransport::setTrafficClass(uint8_t dscp) {
+	std::lock_guard<std::mutex> lk(mtx);
+	trafficClass = dscp & 0x3F;
+	bool isSet = !paths.empty();
+	for (auto& path : paths) {
+		isSet = path->transport->setTrafficClass(dscp) && isSet;
+	}
+	return isSet;
+}
+
+
+bool RcpMultipathTransport::sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp) {
+	return sendCopies(data, size, address, port, dscp, RcpClock::time_point());
+}
+
+
+bool RcpMultipathTransport::setLaunchTimes(bool enable) {
+	std::lock_guard<std::mutex> lk(mtx);
+	bool isSet = !paths.empty();
+	for (auto& path : paths) {
+		isSet = path->transport->setLaunchTimes(enable) && isSet;
+	}
+	return isSet;
+}
+
+
+bool RcpMultipathTransport::sendAt(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp, steady_clock::time_point launchTime) {
+	return sendCopies(data, size, address, port, dscp, launchTime);
+}
+
+
+bool RcpMultipathTransport::sendCopies(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, int dscp, RcpClock::time_point launchTime) {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (paths.empty()) {
+		return false;
+	}
+	Path& first = *paths[0];
+	if (address != first.peerAddress || port != first.peerPort) {
+		return sendOver(*first.transport, data, size, address, port, dscp, launchTime);
+	}
+
+	uint32_t number = nextNumber++;
+	if (nextNumber == 0) {
+		nextNumber = 1;
+	}
+	auto now = clock.now();
+	bestPath = selectBestPath(now);
+	if (mode == BEST || (mode == CRITICAL && !isCritical(data, size, dscp))) {
+		return sendCopy(*paths[bestPath], number, data, size, dscp, launchTime);
+	}
+	bool isSent = false;
+	for (auto& path : paths) {
+		if (path->peerPort != 0) {
+			isSent = sendCopy(*path, number, data, size, dscp, launchTime) || isSent;
+		}
+	}
+	return isSent;
+}
+
+
+bool RcpMultipathTransport::sendCopy(Path& path, uint32_t number, const void* data, size_t size, int dscp, RcpClock::time_point launchTime) {
+	// a scheduled copy leaves at its launch time, it's measured from then
+	auto departure = std::max(clock.now(), launchTime);
+	path.sequence++;
+	path.sendTimes[path.sequence % SendRingSize] = departure;
+	path.lastSend = departure;
+	path.statistics.sent++;
+
+	uint16_t echoDelay = NoEcho;
+	if (path.highestReceivedTime != RcpClock::time_point()) {
+		int64_t delay = duration_cast<microseconds>(departure - path.highestReceivedTime).count() / EchoDelayUnit;
+		echoDelay = (uint16_t)std::min<int64_t>(delay, NoEcho);
+	}
+
+	// the buffer's capacity is reused
+	sendBuffer.resize(size + TrailerSize);
+	if (size > 0) {
+		memcpy(sendBuffer.data(), data, size);
+	}
+	uint8_t* trailer = sendBuffer.data() + size;
+	Put32(trailer, number);
+	Put16(trailer + 4, path.sequence);
+	Put16(trailer + 6, path.highestReceived);
+	Put16(trailer + 8, echoDelay);
+	Put16(trailer + 10, path.receivedCount);
+	return sendOver(*path.transport, sendBuffer.data(), sendBuffer.size(), path.peerAddress, path.peerPort, dscp, launchTime);
+}
+
+
+bool RcpMultipathTransport::sendOver(RcpTransport& transport, const void* data, size_t size, const sf::IpAddress& address, uint16_t port, int dscp, RcpClock::time_point launchTime) {
+	if (launchTime != RcpClock::time_point()) {
+		return transport.sendAt(data, size, address, port, dscp < 0 ? trafficClass : (uint8_t)dscp, launchTime);
+	}
+	if (dscp < 0) {
+		return transport.send(data, size, address, port);
+	}
+	return transport.sendMarked(data, size, address, port, (uint8_t)dscp);
+}
+
+
+bool RcpMultipathTransport::isCritical(const void* data, size_t size, int dscp) const {
+	uint8_t codePoint = dscp < 0 ? trafficClass : uint8_t(dscp & 0x3F);
+	if (codePoint >= CS5) {
+		return true;
+	}
+	return size >= RcpHeaderSize && (((const uint8_t*)data)[RcpHeaderSize - 1] & RcpCriticalFlags) != 0;
+}
+
+
+size_t RcpMultipathTransport::selectBestPath(RcpClock::time_point now) const {
+	auto cost = [](const Path& path) {
+		return path.statistics.roundTrip.count() + path.statistics.loss * LossPenalty.count();
+	};
+	// stay on the current path, unless it's down or another one is clearly better
+	size_t best = bestPath;
+	bool isBestUp = isUp(*paths[best], now);
+	for (size_t i = 0; i < paths.size(); ++i) {
+		if (i == best || !isUp(*paths[i], now)) {
+			continue;
+		}
+		if (!isBestUp || cost(*paths[i]) < 0.9 * cost(*paths[best])) {
+			best = i;
+			isBestUp = true;
+		}
+	}
+	return best;
+}
+
+
+bool RcpMultipathTransport::isFromPeer(const Path& path, const sf::IpAddress& address, uint16_t port) {
+	// the host answers from 127.0.0.1, whichever loopback address it was sent to
+	auto isLoopback = [](const sf::IpAddress& address) { return (address.toInteger() >> 24) == 127; };
+	return port == path.peerPort && (address == path.peerAddress || (isLoopback(address) && isLoopback(path.peerAddress)));
+}
+
+
+bool RcpMultipathTransport::isUp(const Path& path, RcpClock::time_point now) const {
+	return path.lastEchoTime != RcpClock::time_point() && now - path.lastEchoTime < 4 * probeInterval;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Receiving
+
+bool RcpMultipathTransport::wait(microseconds timeout) {
+	std::unique_lock<std::mutex> lk(mtx);
+	auto deadline = timeout == microseconds::max() ? RcpClock::time_point::max() : clock.now() + timeout;
+	return clock.waitUntil(lk, condvar, deadline, [this] { return queueCount > 0; });
+}
+
+
+bool RcpMultipathTransport::receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	packet.clear();
+	if (queueCount == 0) {
+		return false;
+	}
+	Arrival& arrival = queue[queueHead];
+	if (!arrival.data.empty()) {
+		packet.append(arrival.data.data(), arrival.data.size());
+	}
+	address = arrival.address;
+	port = arrival.port;
+	queueHead = (queueHead + 1) % QueueSize;
+	queueCount--;
+	return true;
+}
+
+
+bool RcpMultipathTransport::setBufferSizes(size_t receive, size_t send) {
+	bool isSet = !paths.empty();
+	for (auto& path : paths) {
+		isSet = path->transport->setBufferSizes(receive, send) && isSet;
+	}
+	return isSet;
+}
+
+
+bool RcpMultipathTransport::getBufferSizes(size_t& receive, size_t& send) const {
+	return !paths.empty() && paths[0]->transport->getBufferSizes(receive, send);
+}
+
+
+uint64_t RcpMultipathTransport::getReceiveDrops() const {
+	uint64_t drops = queueDrops;
+	for (auto& path : paths) {
+		drops += path->transport->getReceiveDrops();
+	}
+	return drops;
+}
+
+
+void RcpMultipathTransport::pathThreadFunction(size_t index) {
+	RcpClock::Participant participant(clock);
+	Path& path = *paths[index];
+	while (runThreads) {
+		// probe the path if it's been idle, and wake up for the next probe at the latest
+		microseconds timeout;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			auto now = clock.now();
+			if (path.peerPort != 0 && now >= path.lastSend + probeInterval) {
+				sendCopy(path, 0, nullptr, 0, -1, RcpClock::time_point());
+			}
+			timeout = std::max(duration_cast<microseconds>(path.lastSend + probeInterval - now), microseconds(1));
+			if (path.peerPort == 0) {
+				timeout = probeInterval;
+			}
+		}
+		if (!path.transport->wait(timeout)) {
+			continue;
+		}
+		sf::IpAddress address;
+		uint16_t port;
+		while (runThreads && path.transport->receive(path.packet, address, port)) {
+			std::lock_guard<std::mutex> lk(mtx);
+			processArrival(path, address, port);
+		}
+	}
+}
+
+
+void RcpMultipathTransport::processArrival(Path& path, const sf::IpAddress& address, uint16_t port) {
+	const uint8_t* data = (const uint8_t*)path.packet.getData();
+	size_t size = path.packet.getDataSize();
+	sf::IpAddress sender = address;
+	uint16_t senderPort = port;
+
+	// copies from the peer are unwrapped, anything else is passed on as is
+	if (isFromPeer(path, address, port) && size >= TrailerSize) {
+		auto now = clock.now();
+		const uint8_t* trailer = data + size - TrailerSize;
+		uint32_t number = Get32(trailer);
+		uint16_t sequence = Get16(trailer + 4);
+
+		path.statistics.received++;
+		path.receivedCount++;
+		if (path.highestReceivedTime == RcpClock::time_point() || int16_t(sequence - path.highestReceived) > 0) {
+			path.highestReceived = sequence;
+			path.highestReceivedTime = now;
+		}
+		processEcho(path, Get16(trailer + 6), Get16(trailer + 8), Get16(trailer + 10), now);
+
+		if (number == 0) {
+			return; // a probe
+		}
+		if (isDuplicate(number)) {
+			path.statistics.duplicates++;
+			return;
+		}
+		path.statistics.delivered++;
+		size -= TrailerSize;
+		sender = paths[0]->peerAddress;
+		senderPort = paths[0]->peerPort;
+	}
+
+	// dropped if the socket does not keep up, like on a full UDP buffer
+	if (queueCount == QueueSize) {
+		queueDrops++;
+		return;
+	}
+	Arrival& arrival = queue[(queueHead + queueCount) % QueueSize];
+	arrival.address = sender;
+	arrival.port = senderPort;
+	arrival.data.assign(data, data + size);
+	queueCount++;
+	condvar.notify_all();
+	clock.notify();
+}
+
+
+void RcpMultipathTransport::processEcho(Path& path, uint16_t echo, uint16_t echoDelay, uint16_t received, RcpClock::time_point now) {
+	// only new echoes of copies still in the ring count
+	if (echoDelay == NoEcho || uint16_t(path.sequence - echo) >= SendRingSize) {
+		return;
+	}
+	if (path.lastEchoTime != RcpClock::time_point() && int16_t(echo - path.lastEcho) <= 0) {
+		return;
+	}
+	RcpClock::time_point sendTime = path.sendTimes[echo % SendRingSize];
+	if (sendTime == RcpClock::time_point()) {
+		return;
+	}
+	path.lastEcho = echo;
+	path.lastEchoTime = now;
+
+	// the round trip less the time the peer held the echo
+	microseconds roundTrip = duration_cast<microseconds>(now - sendTime) - microseconds(echoDelay * EchoDelayUnit);
+	if (roundTrip >= microseconds(0)) {
+		path.statistics.roundTrip = path.isRoundTrip ? (7 * path.statistics.roundTrip + roundTrip) / 8 : roundTrip;
+		path.isRoundTrip = true;
+	}
+
+	// the loss of the copies sent since the last sample, as told by the peer's count
+	if (!path.isLossBase) {
+		path.lossBaseSequence = echo;
+		path.lossBaseReceived = received;
+		path.isLossBase = true;
+		return;
+	}
+	uint16_t sent = echo - path.lossBaseSequence;
+	if (sent < LossWindow) {
+		return;
+	}
+	uint16_t arrived = std::min(uint16_t(received - path.lossBaseReceived), sent);
+	double sample = 1.0 - double(arrived) / sent;
+	path.statistics.loss = 0.75 * path.statistics.loss + 0.25 * sample;
+	path.lossBaseSequence = echo;
+	path.lossBaseReceived = received;
+}
+
+
+bool RcpMultipathTransport::isDuplicate(uint32_t number) {
+	size_t slot = number % WindowSize;
+	if (isWindowEmpty) {
+		isWindowEmpty = false;
+		highestNumber = number;
+		window[slot] = number;
+		return false;
+	}
+	int32_t age = RcpSerialNumber::difference(highestNumber, number);
+	if (age >= (int32_t)WindowSize) {
+		// a straggler beyond the window is dropped, but much older ones mean the peer has started over
+		if (age < 4 * (int32_t)WindowSize) {
+			return true;
+		}
+		std::fill(window.begin(), window.end(), 0);
+		highestNumber = number;
+		window[slot] = number;
+		return false;
+	}
+	if (window[slot] == number) {
+		return true;
+	}
+	window[slot] = number;
+	if (age < 0) {
+		highestNumber = number;
+	}
+	return false;
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <SFML/Network.hpp>
+
+#include "RcpClock.h"
+#include "RcpTransport.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Transport that sends datagrams over several paths at once.
+//
+// Each path is a transport of its own, say, a UDP socket, and a peer address
+// reached through one of the interfaces, like one radio link each. The peer
+// uses a multipath transport with its paths in the same order. The socket
+// above sees a single peer: the one of the first path.
+//
+// Datagrams to the peer go over every path, only the critical ones do, or
+// each goes over the best path only, see eMode. Copies carry a trailer with
+// the number of the datagram, so the receiver passes on the first copy to
+// arrive and drops the rest. The trailer also echoes the last copy received
+// on the path and the number of copies received, which gives the sender the
+// round trip and the loss of each path. Paths that have sent nothing for a
+// while send a probe, so that the idle paths are measured too, and a path is
+// down when it has heard no echo for a few probe intervals.
+//
+// Datagrams to anyone else, including the socket to itself, go over the
+// first path as they are.
+//
+// Each path has a thread that waits for its datagrams and probes it.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpMultipathTransport : public RcpTransport {
+public:
+	enum eMode {
+		REDUNDANT, // every datagram over every path
+		CRITICAL, // critical datagrams over every path, the others over the best one
+		BEST, // every datagram over the best path
+	};
+
+	struct PathStatistics {
+		uint64_t sent = 0; // copies and probes
+		uint64_t received = 0; // copies and probes from the peer
+		uint64_t delivered = 0; // copies that arrived first
+		uint64_t duplicates = 0; // copies that arrived after another path's
+		std::chrono::microseconds roundTrip = std::chrono::microseconds(0); // smoothed, 0 until measured
+		double loss = 0.0; // of the copies sent, smoothed
+		bool isUp = false; // the peer has echoed recently
+	};
+
+	/// Size of the trailer added to each datagram to the peer.
+	static const size_t TrailerSize = 12;
+
+public:
+	RcpMultipathTransport(RcpClock& clock = RcpClock::system());
+	~RcpMultipathTransport();
+	RcpMultipathTransport(const RcpMultipathTransport&) = delete;
+	RcpMultipathTransport& operator=(const RcpMultipathTransport&) = delete;
+
+	/// Add a path, only while unbound.
+	/// \param transport Carries the path's datagrams, unbound.
+	/// \param localPort Bound along with the multipath transport, 0 picks any.
+	///		The first path is bound to the port the transport is bound to instead.
+	/// \return The index of the path.
+	size_t addPath(std::unique_ptr<RcpTransport> transport, uint16_t localPort = 0);
+
+	/// Set the peer's end of a path. The peer of the first path is the one the socket sees.
+	void setPeer(size_t path, const sf::IpAddress& address, uint16_t port);
+
+	/// \return The bound port of a path, 0 if not bound.
+	uint16_t getPathLocalPort(size_t path) const;
+
+	size_t getNumPaths() const;
+
+	/// Set which datagrams go over every path. Default is CRITICAL.
+	/// Critical are those marked CS5 or above, and RCP datagrams that are
+	/// reliable, acknowledgements, or part of the handshake.
+	void setMode(eMode mode);
+
+	/// Set how long a path may send nothing before it's probed. Default is 50 ms.
+	/// A path is down after 4 intervals without an echo from the peer.
+	void setProbeInterval(std::chrono::milliseconds interval);
+
+	/// The path non-critical datagrams are sent over, the one with the shortest
+	/// round trip, a lost copy counting as 100 ms.
+	size_t getBestPath() const;
+
+	PathStatistics getPathStatistics(size_t path) const;
+
+	bool bind(uint16_t port) override;
+	void unbind() override;
+	uint16_t getLocalPort() const override;
+	bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) override;
+	bool setTrafficClass(uint8_t dscp) override;
+	bool sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp) override;
+	bool setLaunchTimes(bool enable) override;
+	bool sendAt(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp, std::chrono::steady_clock::time_point launchTime) override;
+	bool wait(std::chrono::microseconds timeout) override;
+	bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) override;
+	bool setBufferSizes(size_t receive, size_t send) override; // of every path
+	bool getBufferSizes(size_t& receive, size_t& send) const override; // of the first path
+	uint64_t getReceiveDrops() const override; // of all paths, and those the socket did not take in time
+private:
+	static const size_t SendRingSize = 1024; // send times of the last copies of a path
+	static const size_t WindowSize = 1024; // datagram numbers remembered to drop copies
+	static const size_t QueueSize = 256; // datagrams received and not yet taken
+
+	struct Path {
+		std::unique_ptr<RcpTransport> transport;
+		uint16_t localPort;
+		sf::IpAddress peerAddress = sf::IpAddress::None;
+		uint16_t peerPort = 0;
+		std::thread thread;
+		sf::Packet packet; // the path's thread receives into it
+
+		// sending
+		uint16_t sequence = 0; // of the last copy sent on the path
+		RcpClock::time_point lastSend;
+		std::vector<RcpClock::time_point> sendTimes; // by sequence, SendRingSize of them
+
+		// receiving, echoed to the peer
+		uint16_t highestReceived = 0;
+		RcpClock::time_point highestReceivedTime; // none until the first copy
+		uint16_t receivedCount = 0;
+
+		// the peer's echoes
+		uint16_t lastEcho = 0;
+		RcpClock::time_point lastEchoTime; // none until the first echo
+		uint16_t lossBaseSequence = 0; // where the current loss sample started
+		uint16_t lossBaseReceived = 0;
+		bool isLossBase = false;
+		bool isRoundTrip = false; // statistics.roundTrip is measured
+
+		PathStatistics statistics;
+	};
+	struct Arrival {
+		sf::IpAddress address;
+		uint16_t port;
+		std::vector<uint8_t> data;
+	};
+
+	bool sendCopies(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, int dscp, RcpClock::time_point launchTime);
+	bool sendCopy(Path& path, uint32_t number, const void* data, size_t size, int dscp, RcpClock::time_point launchTime); // call with mtx locked
+	bool sendOver(RcpTransport& transport, const void* data, size_t size, const sf::IpAddress& address, uint16_t port, int dscp, RcpClock::time_point launchTime); // dscp < 0 is unmarked
+	bool isCritical(const void* data, size_t size, int dscp) const;
+	size_t selectBestPath(RcpClock::time_point now) const; // call with mtx locked
+	bool isUp(const Path& path, RcpClock::time_point now) const;
+	static bool isFromPeer(const Path& path, const sf::IpAddress& address, uint16_t port);
+	void pathThreadFunction(size_t index);
+	void processArrival(Path& path, const sf::IpAddress& address, uint16_t port); // call with mtx locked
+	void processEcho(Path& path, uint16_t echo, uint16_t echoDelay, uint16_t received, RcpClock::time_point now); // call with mtx locked
+	bool isDuplicate(uint32_t number); // call with mtx locked, remembers the number
+	void stopThreads();
+private:
+	RcpClock& clock;
+	std::vector<std::unique_ptr<Path>> paths;
+	eMode mode;
+	std::chrono::milliseconds probeInterval;
+	uint8_t trafficClass;
+	std::atomic_bool runThreads;
+
+	mutable std::mutex mtx;
+	std::condition_variable condvar; // an arrival was queued
+	uint32_t nextNumber; // of the next datagram to the peer, 0 is for probes
+	size_t bestPath;
+	std::vector<uint8_t> sendBuffer;
+
+	std::vector<uint32_t> window; // numbers of the peer's recent datagrams, by number
+	uint32_t highestNumber; // of the peer's datagrams
+	bool isWindowEmpty;
+
+	std::vector<Arrival> queue; // a ring of QueueSize, the buffers are reused
+	size_t queueHead;
+	size_t queueCount;
+	std::atomic<uint64_t> queueDrops;
+};
@@ -10,26 +10,34 @@
 RcpPacket::RcpPacket() {
 	data = nullptr;
 	size = 0;
-	sequenceNumber = std::numeric_limits<uint32_t>::max();
+	capacity = 0;
+	sequenceNumber = std::numeric_limits<uint64_t>::max();
 	reliable = false;
 }
 
 RcpPacket::RcpPacket(const RcpPacket& other) {
 	data = operator new(other.size);
 	size = other.size;
+	capacity = other.size;
 	sequenceNumber = other.sequenceNumber;
 	reliable = other.reliable;
+	receiveTime = other.receiveTime;
+	deliveryTime = other.deliveryTime;
 	memcpy(data, other.data, size);
 }
 
 RcpPacket::RcpPacket(RcpPacket&& other) {
 	data = other.data;
 	size = other.size;
+	capacity = other.capacity;
 	sequenceNumber = other.sequenceNumber;
 	reliable = other.reliable;
+	receiveTime = other.receiveTime;
+	deliveryTime = other.deliveryTime;
 
 	other.data = nullptr;
 	other.size = 0;
+	other.capacity = 0;
 }
 
 RcpPacket::~RcpPacket() {
@@ -38,18 +46,33 @@ RcpPacket::~RcpPacket() {
 
 
 RcpPacket& RcpPacket::operator=(const RcpPacket& other) {
-	this->~RcpPacket();
-	new (this) RcpPacket(other);
+	if (this == &other) {
+		return *this;
+	}
+	// the buffer is reused if it's large enough
+	setData(other.data, other.size);
+	sequenceNumber = other.sequenceNumber;
+	reliable = other.reliable;
+	receiveTime = other.receiveTime;
+	deliveryTime = other.deliveryTime;
 	return *this;
 }
 RcpPacket& RcpPacket::operator=(RcpPacket&& other) {
+	if (this == &other) {
+		return *this;
+	}
+	operator delete(data);
 	data = other.data;
 	size = other.size;
+	capacity = other.capacity;
 	sequenceNumber = other.sequenceNumber;
 	reliable = other.reliable;
+	receiveTime = other.receiveTime;
+	deliveryTime = other.deliveryTime;
 
 	other.data = nullptr;
 	other.size = 0;
+	other.capacity = 0;
 	return *this;
 }
 
@@ -57,10 +80,20 @@ RcpPacket& RcpPacket::operator=(RcpPacket&& other) {
 // Modifiers
 
 void RcpPacket::setData(const void* data, size_t size) {
-	operator delete(this->data);
-	this->data = operator new(size);
+	reserve(size);
 	this->size = size;
-	memcpy(this->data, data, size);
+	if (size > 0) {
+		memcpy(this->data, data, size);
+	}
+}
+
+void RcpPacket::reserve(size_t capacity) {
+	if (capacity <= this->capacity) {
+		return;
+	}
+	operator delete(data);
+	data = operator new(capacity);
+	this->capacity = capacity;
 }
 
 void RcpPacket::setReliable(bool isReliable) {
@@ -71,6 +104,7 @@ void RcpPacket::clear() {
 	operator delete(data);
 	data = nullptr;
 	size = 0;
+	capacity = 0;
 }
 
 
@@ -78,7 +112,7 @@ void RcpPacket::clear() {
 // Information query
 
 
-uint32_t RcpPacket::getSequenceNumber() const {
+uint64_t RcpPacket::getSequenceNumber() const {
 	return sequenceNumber;
 }
 
@@ -93,3 +127,11 @@ size_t RcpPacket::getDataSize() const {
 bool RcpPacket::isReliable() const {
 	return reliable;
 }
+
+std::chrono::steady_clock::time_point RcpPacket::getReceiveTime() const {
+	return receiveTime;
+}
+
+std::chrono::steady_clock::time_point RcpPacket::getDeliveryTime() const {
+	return deliveryTime;
+}
@@ -2,10 +2,12 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <chrono>
 
 class RcpPacket {
 	friend class RcpSocket;
 	friend class RcpTester;
+	friend class RcpMulticastSubscriber;
 public:
 	/// Create an empty packet.
 	RcpPacket();
@@ -20,6 +22,10 @@ public:
 	/// \param size The number of bytes in data.
 	void setData(const void* data, size_t size);
 
+	/// Keep room for capacity bytes of data, so that setData and copying into
+	/// this packet do not allocate up to that size.
+	void reserve(size_t capacity);
+
 	/// Set weather it's a reliable packet.
 	/// \param isReliable True is the packet is reliable.
 	void setReliable(bool isReliable);
@@ -29,8 +35,9 @@ public:
 	
 
 	/// [Deprecated] Get the sequence number of the packet.
-	/// Only valid for received and already sent packets. Otherwise numeric_limits<uint32_t>::max is returned.
-	uint32_t getSequenceNumber() const;
+	/// Only valid for received and already sent packets. Otherwise numeric_limits<uint64_t>::max is returned.
+	/// Received packets have the number extended to 64 bits, which does not wrap around.
+	uint64_t getSequenceNumber() const;
 
 	/// Get packets contents.
 	const void* getData() const;
@@ -43,9 +50,20 @@ public:
 	/// \return True if reliable.
 	bool isReliable() const;
 
+	/// Get the time the carrying datagram was read from the network.
+	/// Only valid for received packets, otherwise it's the clock's epoch.
+	std::chrono::steady_clock::time_point getReceiveTime() const;
+
+	/// Get the time the packet was handed to the user by RcpSocket::receive.
+	/// Only valid for received packets, otherwise it's the clock's epoch.
+	std::chrono::steady_clock::time_point getDeliveryTime() const;
+
 private:
 	void* data;
 	size_t size;
+	size_t capacity; // bytes allocated for data
 	bool reliable;
-	uint32_t sequenceNumber;
+	uint64_t sequenceNumber; // extended, see RcpSerialNumber
+	std::chrono::steady_clock::time_point receiveTime;
+	std::chrono::steady_clock::time_point deliveryTime;
 };
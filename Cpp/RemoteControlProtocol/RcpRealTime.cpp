@@ -0,0 +1,180 @@
+#include "RcpRealTime.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#ifdef REMCON_WINDOWS
+#include <malloc.h>
+#else
+#include <alloca.h>
+#endif
+#ifdef REMCON_LINUX
+#include <sys/mman.h>
+#endif
+
+#ifndef NDEBUG
+#define REMCON_ALLOCATION_CHECK
+#endif
+
+
+static const size_t PageSize = 4096; // the smallest there is, touching more often does no harm
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Allocation check
+
+#ifdef REMCON_ALLOCATION_CHECK
+
+static thread_local uint64_t allocationCount = 0;
+static thread_local int noAllocationDepth = 0;
+
+
+static void* CheckedAllocate(size_t size) {
+	allocationCount++;
+	assert(noAllocationDepth == 0 && "heap allocation on a real-time path");
+	void* memory = std::malloc(size == 0 ? 1 : size);
+	if (!memory) {
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+
+void* operator new(size_t size) {
+	return CheckedAllocate(size);
+}
+
+void* operator new[](size_t size) {
+	return CheckedAllocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+	try {
+		return CheckedAllocate(size);
+	}
+	catch (std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+	try {
+		return CheckedAllocate(size);
+	}
+	catch (std::bad_alloc&) {
+		return nullptr;
+	}
+}
+
+void operator delete(void* memory) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+	std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+	std::free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept {
+	std::free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept {
+	std::free(memory);
+}
+
+#endif
+
+
+bool RcpRealTime::isAllocationCheckEnabled() {
+#ifdef REMCON_ALLOCATION_CHECK
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+uint64_t RcpRealTime::getAllocationCount() {
+#ifdef REMCON_ALLOCATION_CHECK
+	return allocationCount;
+#else
+	return 0;
+#endif
+}
+
+
+RcpRealTime::NoAllocationScope::NoAllocationScope(bool isActive) : isActive(isActive) {
+#ifdef REMCON_ALLOCATION_CHECK
+	if (isActive) {
+		noAllocationDepth++;
+	}
+#endif
+}
+
+
+RcpRealTime::NoAllocationScope::~NoAllocationScope() {
+#ifdef REMCON_ALLOCATION_CHECK
+	if (isActive) {
+		noAllocationDepth--;
+	}
+#endif
+}
+
+
+RcpRealTime::AllocationScope::AllocationScope() {
+#ifdef REMCON_ALLOCATION_CHECK
+	previous = noAllocationDepth;
+	noAllocationDepth = 0;
+#else
+	previous = 0;
+#endif
+}
+
+
+RcpRealTime::AllocationScope::~AllocationScope() {
+#ifdef REMCON_ALLOCATION_CHECK
+	noAllocationDepth = previous;
+#endif
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory
+
+bool RcpRealTime::lockMemory() {
+#ifdef REMCON_LINUX
+	return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+#else
+	return false;
+#endif
+}
+
+
+void RcpRealTime::prefault(void* memory, size_t size) {
+	// volatile, so the writes are not optimized away
+	volatile uint8_t* bytes = static_cast<volatile uint8_t*>(memory);
+	for (size_t offset = 0; offset < size; offset += PageSize) {
+		bytes[offset] = bytes[offset];
+	}
+	if (size > 0) {
+		bytes[size - 1] = bytes[size - 1];
+	}
+}
+
+
+void RcpRealTime::prefaultStack(size_t size) {
+	// a frame of the given size, touched and left
+	volatile uint8_t* frame = static_cast<volatile uint8_t*>(alloca(size));
+	for (size_t offset = 0; offset < size; offset += PageSize) {
+		frame[offset] = 0;
+	}
+}
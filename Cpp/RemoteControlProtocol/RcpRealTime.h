@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Helpers for keeping latency spikes off the hot path.
+//
+// The first messages of a connection are slow: pages of the heap and the
+// stack are faulted in, pools and containers grow for the first time.
+// Real-time mode of RcpSocket and RemoteControlServer does all that up front
+// with these helpers, and then checks that the steady state does not touch
+// the heap.
+//
+// The check counts the heap allocations of each thread by replacing the
+// global operator new, in debug builds only (NDEBUG is not defined). An
+// allocation inside a NoAllocationScope fails an assertion there. In release
+// builds the scopes are empty and the counts stay 0.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpRealTime {
+public:
+	/// Lock all current and future pages of the process in memory, so they are never paged out.
+	/// Needs privileges (CAP_IPC_LOCK or a large enough RLIMIT_MEMLOCK).
+	/// \return False if not supported on the platform, or denied.
+	static bool lockMemory();
+
+	/// Touch each page of a block of memory, so the first real use does not fault.
+	static void prefault(void* memory, size_t size);
+
+	/// Touch size bytes of the calling thread's stack.
+	static void prefaultStack(size_t size = 128 * 1024);
+
+	/// True in builds where allocations are counted and checked.
+	static bool isAllocationCheckEnabled();
+
+	/// The number of heap allocations the calling thread made so far, 0 if not counted.
+	static uint64_t getAllocationCount();
+
+	/// Heap allocations of the thread fail an assertion while an instance is alive.
+	class NoAllocationScope {
+	public:
+		/// \param isActive False makes the scope do nothing, for scopes that are real-time only sometimes.
+		explicit NoAllocationScope(bool isActive = true);
+		~NoAllocationScope();
+		NoAllocationScope(const NoAllocationScope&) = delete;
+		NoAllocationScope& operator=(const NoAllocationScope&) = delete;
+	private:
+		bool isActive;
+	};
+
+	/// Allow allocations again inside a NoAllocationScope, e.g. around a user's callback.
+	class AllocationScope {
+	public:
+		AllocationScope();
+		~AllocationScope();
+		AllocationScope(const AllocationScope&) = delete;
+		AllocationScope& operator=(const AllocationScope&) = delete;
+	private:
+		int previous;
+	};
+};
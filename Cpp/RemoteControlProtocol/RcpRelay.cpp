@@ -0,0 +1,331 @@
+#include "RcpRelay.h"
+
+#include <algorithm>
+
+using namespace std::chrono;
+
+
+// the RCP header: sequence number, batch number and flags, big endian
+static const size_t RcpHeaderSize = 12;
+static const uint32_t RcpSyn = 1;
+static const uint32_t RcpAck = 2;
+static const uint32_t RcpRel = 16;
+
+// resend timeout of a leg until its round trip is measured, and the least of it after
+static const microseconds InitialResendTimeout = milliseconds(50);
+static const microseconds MinResendTimeout = milliseconds(2);
+
+// the threads wake up this often without traffic, to see if they should stop
+static const microseconds IdleWait = milliseconds(100);
+
+
+static uint32_t Get32(const uint8_t* p) {
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+
+const size_t RcpRelay::MaxBatchSize;
+const int RcpRelay::ClientTimeout;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Setup
+
+RcpRelay::RcpRelay(RcpClock& clock) :
+	RcpRelay(std::unique_ptr<RcpTransport>(new RcpUdpTransport()), std::unique_ptr<RcpTransport>(new RcpUdpTransport()), clock)
+{}
+
+
+RcpRelay::RcpRelay(std::unique_ptr<RcpTransport> clientLeg, std::unique_ptr<RcpTransport> serverLeg, RcpClock& clock) :
+	clock(clock),
+	batchSize(32),
+	rejected(0),
+	rejectedSyns(0)
+{
+	legs[CLIENT_LEG].transport = std::move(clientLeg);
+	legs[SERVER_LEG].transport = std::move(serverLeg);
+	for (auto& leg : legs) {
+		leg.isRetransmitting = false;
+	}
+	runThreads = false;
+}
+
+
+RcpRelay::~RcpRelay() {
+	stop();
+}
+
+
+bool RcpRelay::start(uint16_t port, const sf::IpAddress& serverAddress, uint16_t serverPort, uint16_t serverLegPort) {
+	stop();
+	if (!legs[CLIENT_LEG].transport->bind(port)) {
+		return false;
+	}
+	if (!legs[SERVER_LEG].transport->bind(serverLegPort)) {
+		legs[CLIENT_LEG].transport->unbind();
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		for (auto& leg : legs) {
+			leg.batch.resize(batchSize);
+			leg.peerAddress = sf::IpAddress::None;
+			leg.peerPort = 0;
+			leg.pending.clear();
+			leg.isRoundTrip = false;
+			leg.statistics = LegStatistics();
+		}
+		// the client is known from its SYN
+		legs[SERVER_LEG].peerAddress = serverAddress;
+		legs[SERVER_LEG].peerPort = serverPort;
+		rejected = 0;
+		rejectedSyns = 0;
+	}
+
+	runThreads = true;
+	legs[CLIENT_LEG].thread = std::thread([this] { legThreadFunction(CLIENT_LEG); });
+	legs[SERVER_LEG].thread = std::thread([this] { legThreadFunction(SERVER_LEG); });
+	return true;
+}
+
+
+void RcpRelay::stop() {
+	stopThreads();
+	for (auto& leg : legs) {
+		leg.transport->unbind();
+	}
+}
+
+
+bool RcpRelay::isRunning() const {
+	return runThreads;
+}
+
+
+uint16_t RcpRelay::getLocalPort(eLeg leg) const {
+	return legs[leg].transport->getLocalPort();
+}
+
+
+void RcpRelay::setLocalRetransmission(eLeg leg, bool enable) {
+	legs[leg].isRetransmitting = enable;
+}
+
+
+void RcpRelay::setBatchSize(size_t size) {
+	batchSize = std::min(std::max(size, (size_t)1), MaxBatchSize);
+}
+
+
+RcpRelay::LegStatistics RcpRelay::getStatistics(eLeg leg) const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return legs[leg].statistics;
+}
+
+
+uint64_t RcpRelay::getRejectedCount() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return rejected;
+}
+
+
+uint64_t RcpRelay::getRejectedSynCount() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return rejectedSyns;
+}
+
+
+void RcpRelay::stopThreads() {
+	runThreads = false;
+	for (auto& leg : legs) {
+		if (leg.thread.joinable()) {
+			// a datagram to self wakes the thread, like RcpSocket wakes its IO thread
+			uint8_t wakeup = 0;
+			leg.transport->send(&wakeup, sizeof(wakeup), sf::IpAddress::LocalHost, leg.transport->getLocalPort());
+			leg.thread.join();
+		}
+	}
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Forwarding
+
+void RcpRelay::legThreadFunction(eLeg from) {
+	RcpClock::Participant participant(clock);
+	Leg& in = legs[from];
+	Leg& out = legs[from == CLIENT_LEG ? SERVER_LEG : CLIENT_LEG];
+	while (runThreads) {
+		// resend what's due, and wake up for the next resend at the latest, of either leg
+		microseconds timeout = IdleWait;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			auto now = clock.now();
+			resendPending(now);
+			auto next = getNextResend();
+			if (next != RcpClock::time_point::max()) {
+				timeout = std::min(timeout, std::max(duration_cast<microseconds>(next - now), microseconds(1)));
+			}
+		}
+		if (!in.transport->wait(timeout)) {
+			continue;
+		}
+
+		size_t count = in.transport->receiveBatch(in.batch.data(), batchSize);
+		if (count == 0 || !runThreads) {
+			continue;
+		}
+		size_t forward;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			in.statistics.batches++;
+			forward = filterBatch(from, count, clock.now());
+		}
+		if (forward > 0) {
+			out.transport->sendBatch(in.batch.data(), forward);
+		}
+	}
+}
+
+
+size_t RcpRelay::filterBatch(eLeg from, size_t count, RcpClock::time_point now) {
+	Leg& in = legs[from];
+	Leg& out = legs[from == CLIENT_LEG ? SERVER_LEG : CLIENT_LEG];
+	size_t kept = 0;
+	for (size_t i = 0; i < count; ++i) {
+		RcpDatagram& datagram = in.batch[i];
+		in.statistics.received++;
+		if (datagram.data.size() < RcpHeaderSize) {
+			rejected++;
+			continue;
+		}
+		uint32_t batchNumber = Get32(&datagram.data[4]);
+		uint32_t flags = Get32(&datagram.data[8]);
+
+		// a new client, what was pending for the old one is of no use
+		// the old one must have gone quiet first, or anyone could take its connection over
+		bool isFromPeer = datagram.address == in.peerAddress && datagram.port == in.peerPort;
+		if (from == CLIENT_LEG && flags == RcpSyn && !isFromPeer) {
+			if (in.peerPort != 0 && now - in.lastHeard < milliseconds(ClientTimeout)) {
+				rejectedSyns++;
+				rejected++;
+				continue;
+			}
+			in.peerAddress = datagram.address;
+			in.peerPort = datagram.port;
+			legs[CLIENT_LEG].pending.clear();
+			legs[SERVER_LEG].pending.clear();
+			isFromPeer = true;
+		}
+		if (!isFromPeer || out.peerPort == 0) {
+			rejected++;
+			continue;
+		}
+		if (from == CLIENT_LEG) {
+			in.lastHeard = now;
+		}
+
+		// the far end acknowledged a reliable datagram sent over this leg
+		// ACKs carry the batch number of the datagram
+		if (flags == RcpAck) {
+			auto it = in.pending.find(batchNumber);
+			if (it != in.pending.end()) {
+				// the round trip is ambiguous if it was resent (Karn's algorithm)
+				if (it->second.resends == 0 && !it->second.isRepeated) {
+					addRoundTrip(in, duration_cast<microseconds>(now - it->second.send));
+				}
+				in.pending.erase(it);
+			}
+		}
+		// keep a copy of reliable datagrams going over a leg that resends them
+		else if (flags == RcpRel && out.isRetransmitting) {
+			auto it = out.pending.find(batchNumber);
+			if (it != out.pending.end()) {
+				it->second.isRepeated = true;
+			}
+			else if (out.pending.size() < MaxPending) {
+				Pending& pending = out.pending[batchNumber];
+				pending.data = datagram.data;
+				pending.send = now;
+				pending.nextResend = now + getResendTimeout(out);
+			}
+		}
+
+		// only the address changes
+		datagram.address = out.peerAddress;
+		datagram.port = out.peerPort;
+		out.statistics.forwarded++;
+		out.statistics.bytes += datagram.data.size();
+		if (kept != i) {
+			std::swap(in.batch[kept], datagram);
+		}
+		kept++;
+	}
+	return kept;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Local retransmission
+
+void RcpRelay::resendPending(RcpClock::time_point now) {
+	for (auto& leg : legs) {
+		if (!leg.isRetransmitting) {
+			leg.pending.clear();
+			continue;
+		}
+		for (auto it = leg.pending.begin(); it != leg.pending.end();) {
+			Pending& pending = it->second;
+			if (pending.nextResend > now) {
+				++it;
+				continue;
+			}
+			// the sender resends it after its own timeout
+			if (pending.resends >= MaxResends) {
+				it = leg.pending.erase(it);
+				continue;
+			}
+			leg.transport->send(pending.data.data(), pending.data.size(), leg.peerAddress, leg.peerPort);
+			leg.statistics.retransmitted++;
+			pending.resends++;
+			pending.nextResend = now + getResendTimeout(leg) * (1 << pending.resends);
+			++it;
+		}
+	}
+}
+
+
+RcpClock::time_point RcpRelay::getNextResend() const {
+	auto next = RcpClock::time_point::max();
+	for (auto& leg : legs) {
+		for (auto& item : leg.pending) {
+			next = std::min(next, item.second.nextResend);
+		}
+	}
+	return next;
+}
+
+
+microseconds RcpRelay::getResendTimeout(const Leg& leg) const {
+	if (!leg.isRoundTrip) {
+		return InitialResendTimeout;
+	}
+	return std::max({ 2 * leg.smoothedRoundTrip, leg.smoothedRoundTrip + 4 * leg.roundTripVariation, MinResendTimeout });
+}
+
+
+void RcpRelay::addRoundTrip(Leg& leg, microseconds sample) {
+	// as TCP does, RFC 6298
+	if (!leg.isRoundTrip) {
+		leg.smoothedRoundTrip = sample;
+		leg.roundTripVariation = sample / 2;
+		leg.isRoundTrip = true;
+	}
+	else {
+		microseconds difference = leg.smoothedRoundTrip > sample ? leg.smoothedRoundTrip - sample : sample - leg.smoothedRoundTrip;
+		leg.roundTripVariation = (3 * leg.roundTripVariation + difference) / 4;
+		leg.smoothedRoundTrip = (7 * leg.smoothedRoundTrip + sample) / 8;
+	}
+	leg.statistics.roundTrip = leg.smoothedRoundTrip;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include <SFML/Network.hpp>
+
+#include "RcpClock.h"
+#include "RcpTransport.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Forwards RCP datagrams between two legs, for a relay between the peers, like
+// a mast or a tethered drone between a ground station and a vehicle.
+//
+// The client leg is bound to a port the client connects to, as if the relay
+// was the server. The server leg sends to the server, as if the relay was the
+// client. The datagrams are forwarded as they are, only the addresses change:
+// the sequence numbers, acknowledgements, timeouts, authentication and
+// encryption stay between the two ends. The client is the one a SYN came
+// from, datagrams of anyone else are dropped. Another SYN only takes over
+// once the client has been silent for as long as RCP takes to consider the
+// connection lost, so a stranger can't redirect the server's replies.
+//
+// Each leg has a thread that receives a batch of datagrams, and forwards them
+// over the other leg in a batch as well, which is one system call each way
+// with the UDP transport on Linux.
+//
+// A leg with local retransmission, a lossy radio link say, keeps a copy of the
+// reliable datagrams sent over it, and resends them if the acknowledgement of
+// the far end does not come back in a few round trips of the leg. That repairs
+// the loss of the leg well before the sender's resend timeout. The far end
+// drops the copies it already has, the acknowledgement still comes from there.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpRelay {
+public:
+	enum eLeg {
+		CLIENT_LEG, // towards the client, the one that connects
+		SERVER_LEG, // towards the server
+	};
+
+	struct LegStatistics {
+		uint64_t forwarded = 0; // datagrams sent over the leg
+		uint64_t bytes = 0; // of those forwarded
+		uint64_t batches = 0; // batches received from the leg
+		uint64_t received = 0; // datagrams received from the leg, forwarded or not
+		uint64_t retransmitted = 0; // copies resent over the leg
+		std::chrono::microseconds roundTrip = std::chrono::microseconds(0); // of the leg, smoothed, 0 until measured
+	};
+
+	/// Most datagrams received and forwarded at once.
+	static const size_t MaxBatchSize = 256;
+
+public:
+	/// Relay over UDP.
+	RcpRelay(RcpClock& clock = RcpClock::system());
+	/// Relay over the transports given, unbound.
+	RcpRelay(std::unique_ptr<RcpTransport> clientLeg, std::unique_ptr<RcpTransport> serverLeg, RcpClock& clock = RcpClock::system());
+	~RcpRelay();
+	RcpRelay(const RcpRelay&) = delete;
+	RcpRelay& operator=(const RcpRelay&) = delete;
+
+	/// Bind the legs and start forwarding.
+	/// \param port The client leg is bound to it, the client connects here.
+	/// \param serverAddress, serverPort Where the server is bound.
+	/// \param serverLegPort The server leg is bound to it, 0 picks any.
+	/// \return False if a leg could not be bound.
+	bool start(uint16_t port, const sf::IpAddress& serverAddress, uint16_t serverPort, uint16_t serverLegPort = 0);
+	void stop();
+	bool isRunning() const;
+
+	/// \return The bound port of a leg, 0 if not started.
+	uint16_t getLocalPort(eLeg leg = CLIENT_LEG) const;
+
+	/// Resend the reliable datagrams sent over the leg until their acknowledgement comes back,
+	/// at most 4 times, at 2 round trips of the leg and backing off. Off by default.
+	void setLocalRetransmission(eLeg leg, bool enable);
+
+	/// Set the most datagrams received and forwarded at once, up to MaxBatchSize. Default is 32.
+	/// Only while not started.
+	void setBatchSize(size_t size);
+
+	LegStatistics getStatistics(eLeg leg) const;
+
+	/// Get the number of datagrams dropped, because they came from neither of the peers.
+	uint64_t getRejectedCount() const;
+	/// Get the number of SYNs dropped because another client was still active, of those rejected.
+	uint64_t getRejectedSynCount() const;
+private:
+	static const size_t MaxPending = 1024; // reliable datagrams kept per leg for resending
+	static const int MaxResends = 4;
+	static const int ClientTimeout = 5000; // ms of silence before another client may take over, as RcpSocket's connection loss
+
+	struct Pending {
+		std::vector<uint8_t> data;
+		RcpClock::time_point send;
+		RcpClock::time_point nextResend;
+		int resends = 0;
+		bool isRepeated = false; // the sender resent it too, there's no round trip sample
+	};
+	struct Leg {
+		std::unique_ptr<RcpTransport> transport;
+		std::thread thread;
+		std::vector<RcpDatagram> batch; // the leg's thread receives into it
+		std::atomic_bool isRetransmitting;
+
+		// the peer on the far side of the leg
+		sf::IpAddress peerAddress = sf::IpAddress::None;
+		uint16_t peerPort = 0;
+		RcpClock::time_point lastHeard; // the last datagram of the peer
+
+		// datagrams sent over the leg, waiting for their acknowledgement, by batch number
+		std::map<uint32_t, Pending> pending;
+		std::chrono::microseconds smoothedRoundTrip = std::chrono::microseconds(0);
+		std::chrono::microseconds roundTripVariation = std::chrono::microseconds(0);
+		bool isRoundTrip = false;
+
+		LegStatistics statistics;
+	};
+
+	void legThreadFunction(eLeg from);
+	size_t filterBatch(eLeg from, size_t count, RcpClock::time_point now); // call with mtx locked, returns the number to forward
+	void resendPending(RcpClock::time_point now); // call with mtx locked
+	RcpClock::time_point getNextResend() const; // call with mtx locked, max() if none
+	std::chrono::microseconds getResendTimeout(const Leg& leg) const;
+	void addRoundTrip(Leg& leg, std::chrono::microseconds sample);
+	void stopThreads();
+private:
+	RcpClock& clock;
+	Leg legs[2];
+	size_t batchSize;
+	std::atomic_bool runThreads;
+
+	mutable std::mutex mtx;
+	uint64_t rejected;
+	uint64_t rejectedSyns;
+};
@@ -0,0 +1,158 @@
+#include "RcpReplayTransport.h"
+
+#include <algorithm>
+#include <thread>
+
+using namespace std::chrono;
+
+
+RcpReplayTransport::RcpReplayTransport(std::vector<RcpCapturedDatagram> datagrams, bool isOriginalTiming) :
+	datagrams(std::move(datagrams)), isOriginalTiming(isOriginalTiming), next(0), isStarted(false), port(0) {}
+
+
+bool RcpReplayTransport::bind(uint16_t port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	// the port the capture was sent to, unless the caller picks one
+	if (port == 0) {
+		port = datagrams.empty() ? 1 : datagrams.front().destinationPort;
+	}
+	this->port = port;
+	return true;
+}
+
+
+void RcpReplayTransport::unbind() {
+	std::lock_guard<std::mutex> lk(mtx);
+	port = 0;
+}
+
+
+uint16_t RcpReplayTransport::getLocalPort() const {
+	std::lock_guard<std::mutex> lk(mtx);
+	return port;
+}
+
+
+bool RcpReplayTransport::send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (port == this->port && address == sf::IpAddress::LocalHost) {
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		loopback.emplace_back(bytes, bytes + size);
+		return true;
+	}
+	statistics.sent++;
+	statistics.bytesSent += size;
+	return true;
+}
+
+
+bool RcpReplayTransport::wait(microseconds timeout) {
+	auto now = steady_clock::now();
+	auto deadline = timeout == microseconds::max() ? steady_clock::time_point::max() : now + timeout;
+	while (true) {
+		steady_clock::time_point due;
+		{
+			std::lock_guard<std::mutex> lk(mtx);
+			if (!isStarted) {
+				start = now;
+				isStarted = true;
+			}
+			if (!loopback.empty() || isDue(now)) {
+				return true;
+			}
+			if (next < datagrams.size()) {
+				due = start + nanoseconds(datagrams[next].time - datagrams.front().time);
+			}
+			else {
+				due = steady_clock::time_point::max();
+			}
+		}
+		if (now >= deadline) {
+			return false;
+		}
+		// the socket's datagrams to itself are looked for every now and then
+		std::this_thread::sleep_until(std::min(std::min(due, deadline), now + milliseconds(10)));
+		now = steady_clock::now();
+	}
+}
+
+
+bool RcpReplayTransport::receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (!loopback.empty()) {
+		packet.clear();
+		packet.append(loopback.front().data(), loopback.front().size());
+		loopback.pop_front();
+		address = sf::IpAddress::LocalHost;
+		port = this->port;
+		return true;
+	}
+	if (!isDue(steady_clock::now())) {
+		return false;
+	}
+	const RcpCapturedDatagram& datagram = datagrams[next];
+	packet.clear();
+	packet.append(datagram.data.data(), datagram.data.size());
+	address = datagram.source;
+	port = datagram.sourcePort;
+	next++;
+	statistics.replayed++;
+	return true;
+}
+
+
+std::vector<RcpCapturedDatagram> RcpReplayTransport::selectConnection(const std::vector<RcpCapturedDatagram>& capture, uint16_t peerPort, uint32_t& sequenceNumber, uint32_t& batchNumber) {
+	// flags of RcpSocket's header, of the packets numbered in the sender's sequence
+	const uint32_t KEP = 8, REL = 16, TIM = 32;
+	auto GetNumber = [](const uint8_t* bytes) {
+		return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+	};
+
+	std::vector<RcpCapturedDatagram> selected;
+	for (const auto& datagram : capture) {
+		if (datagram.data.size() < 12) {
+			continue;
+		}
+		if (selected.empty()) {
+			uint32_t flags = GetNumber(datagram.data.data() + 8);
+			bool isNumbered = flags == 0 || flags == REL || flags == KEP || flags == TIM;
+			if (!isNumbered || (peerPort != 0 && datagram.sourcePort != peerPort)) {
+				continue;
+			}
+			// a reliable packet starts a new batch, the others carry the last one
+			sequenceNumber = GetNumber(datagram.data.data()) - 1;
+			batchNumber = GetNumber(datagram.data.data() + 4) - (flags == REL ? 1 : 0);
+			selected.push_back(datagram);
+			continue;
+		}
+		const auto& first = selected.front();
+		if (datagram.source == first.source && datagram.sourcePort == first.sourcePort
+			&& datagram.destination == first.destination && datagram.destinationPort == first.destinationPort)
+		{
+			selected.push_back(datagram);
+		}
+	}
+	return selected;
+}
+
+
+bool RcpReplayTransport::isFinished() const {
+	return next >= datagrams.size();
+}
+
+
+auto RcpReplayTransport::getStatistics() const -> Statistics {
+	std::lock_guard<std::mutex> lk(mtx);
+	return statistics;
+}
+
+
+bool RcpReplayTransport::isDue(steady_clock::time_point now) const {
+	if (next >= datagrams.size()) {
+		return false;
+	}
+	if (!isOriginalTiming) {
+		return true;
+	}
+	return isStarted && now >= start + nanoseconds(datagrams[next].time - datagrams.front().time);
+}
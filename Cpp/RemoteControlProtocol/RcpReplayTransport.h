@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#include "RcpCapture.h"
+#include "RcpTransport.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Transport that plays datagrams of a capture to a socket.
+//
+// The datagrams are received one after the other as if they came from their
+// original sender, at the original pace or as fast as the socket takes them.
+// Pacing starts when the socket first waits for traffic. What the socket
+// sends is counted and dropped, except for datagrams to itself, which the
+// socket uses to wake its IO thread up.
+// Together with RcpSocket::debug_connect, it measures the cost of decoding,
+// reordering and acknowledging recorded traffic, without the network.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpReplayTransport : public RcpTransport {
+public:
+	struct Statistics {
+		uint64_t replayed = 0; // datagrams received by the socket
+		uint64_t sent = 0; // datagrams the socket sent, acks and keepalives mostly
+		uint64_t bytesSent = 0;
+	};
+
+	/// \param datagrams To be received in this order.
+	/// \param isOriginalTiming Keep the spacing of their timestamps, or deliver them all as soon as possible.
+	RcpReplayTransport(std::vector<RcpCapturedDatagram> datagrams, bool isOriginalTiming);
+
+	bool bind(uint16_t port) override;
+	void unbind() override;
+	uint16_t getLocalPort() const override;
+	bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) override;
+	bool wait(std::chrono::microseconds timeout) override;
+	bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) override;
+
+	/// Take the datagrams one peer of a connection sent, from the first one that's numbered in sequence.
+	/// \param peerPort The sender's port, 0 picks the sender of the first such datagram.
+	/// \param sequenceNumber, batchNumber Set to the sender's numbers right before the first datagram, for RcpSocket::debug_connect.
+	static std::vector<RcpCapturedDatagram> selectConnection(const std::vector<RcpCapturedDatagram>& capture, uint16_t peerPort, uint32_t& sequenceNumber, uint32_t& batchNumber);
+
+	/// True if all datagrams have been received.
+	bool isFinished() const;
+
+	Statistics getStatistics() const;
+private:
+	bool isDue(std::chrono::steady_clock::time_point now) const; // call with mtx locked
+private:
+	std::vector<RcpCapturedDatagram> datagrams;
+	bool isOriginalTiming;
+	std::atomic<size_t> next; // index of the next datagram to receive
+	std::chrono::steady_clock::time_point start; // when the first datagram is due
+	bool isStarted;
+	uint16_t port;
+
+	mutable std::mutex mtx;
+	std::deque<std::vector<uint8_t>> loopback; // sent to itself
+	Statistics statistics;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The numbers of the datagrams received, against replays, like IPsec's
+// anti-replay window (RFC 4303).
+//
+// An authenticated datagram can still be a copy of one received before, sent
+// again by anyone who saw it. Each number is accepted once: newer than the
+// newest seen, or at most Size behind it and not seen yet. Older ones are
+// rejected, they can't be told from replays anymore. The numbers are extended
+// to 64 bits, see RcpSerialNumber, so they never wrap.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpReplayWindow {
+public:
+	/// How far behind the newest number one is still accepted, reordered.
+	static const uint64_t Size = 1024;
+
+	RcpReplayWindow() { reset(); }
+
+	/// Forget the numbers seen, for new keys.
+	void reset() {
+		for (auto& word : seen) {
+			word = 0;
+		}
+		newest = 0;
+		isStarted = false;
+	}
+
+	/// Check a number, and mark it seen if it's new.
+	/// \return False if it was seen already, or it's too old to tell.
+	bool accept(uint64_t number) {
+		if (!isStarted || number > newest) {
+			// the numbers skipped are not seen yet, those a window behind are forgotten
+			if (!isStarted || number - newest >= Size) {
+				for (auto& word : seen) {
+					word = 0;
+				}
+			}
+			else {
+				for (uint64_t skipped = newest + 1; skipped < number; ++skipped) {
+					seen[(skipped / 64) % Words] &= ~(uint64_t(1) << (skipped % 64));
+				}
+			}
+			newest = number;
+			isStarted = true;
+		}
+		else if (newest - number >= Size) {
+			return false;
+		}
+		else if (seen[(number / 64) % Words] & (uint64_t(1) << (number % 64))) {
+			return false;
+		}
+		seen[(number / 64) % Words] |= uint64_t(1) << (number % 64);
+		return true;
+	}
+private:
+	static const size_t Words = Size / 64;
+	uint64_t seen[Words]; // a bit per number, modulo Size
+	uint64_t newest;
+	bool isStarted;
+};
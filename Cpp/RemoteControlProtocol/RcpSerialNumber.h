@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Serial number arithmetic, RFC 1982.
+//
+// Sequence numbers go over the wire in 32 bits and wrap around, which takes
+// about 12 hours at 100k packets per second. They are compared by their
+// difference: a number is newer if it's less than half the range ahead.
+// Internally, the numbers are kept extended to 64 bits, which never wrap,
+// and a number from the wire is extended to the one nearest to a reference,
+// e.g. the latest number seen.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpSerialNumber {
+public:
+	/// Signed difference a - b, correct across the wraparound.
+	static int32_t difference(uint32_t a, uint32_t b) {
+		return (int32_t)(a - b);
+	}
+
+	/// Check if a comes after b.
+	static bool isNewer(uint32_t a, uint32_t b) {
+		return difference(a, b) > 0;
+	}
+
+	/// How far a and b are apart, in either direction.
+	static uint32_t distance(uint32_t a, uint32_t b) {
+		uint32_t ahead = a - b;
+		uint32_t behind = b - a;
+		return ahead < behind ? ahead : behind;
+	}
+
+	/// Extend a number of the wire to the 64 bit number nearest to reference.
+	/// Numbers start in the second wrap, so those from just before the first one
+	/// can be told apart as well.
+	static uint64_t extend(uint32_t number, uint64_t reference) {
+		return reference + (int64_t)difference(number, (uint32_t)reference);
+	}
+
+	/// Get the number to start counting from, with its low 32 bits as given.
+	static uint64_t start(uint32_t number) {
+		return (uint64_t(1) << 32) | number;
+	}
+};
@@ -0,0 +1,440 @@
+#include "RcpSharedMemoryTransport.h"
+
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <new>
+
+#ifndef REMCON_WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std::chrono;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Ring buffer
+//
+// Many senders, one receiver. Senders take turns on a spinlock, the receiver
+// needs no lock. Positions count bytes and wrap around at 2^32, the capacity
+// is a power of two, so they work modulo the capacity as well.
+// Records are 8 byte aligned: size (32), sender port (16), padding (16), data.
+// A record not fitting before the end of the buffer is preceded by a wrap
+// marker, and starts at the beginning.
+//
+// Anyone mapping the ring can write it, so the receiver checks each record
+// against the bounds before reading it, and drops what's in the ring if one is
+// off. A sender that died holding the lock would block the others forever,
+// they give up after a while and send over UDP instead.
+
+struct RcpSharedMemoryTransport::Ring {
+	uint32_t magic;
+	uint32_t capacity;
+	std::atomic<uint32_t> isOpen; // cleared when the owner unbinds
+	std::atomic<uint32_t> isSleeping; // the owner waits on its UDP socket
+	std::atomic<uint32_t> writeLock;
+	alignas(64) std::atomic<uint32_t> writePosition;
+	alignas(64) std::atomic<uint32_t> readPosition;
+
+	uint8_t* getData() { return (uint8_t*)this + sizeof(Ring); }
+	bool isEmpty() const { return readPosition.load(std::memory_order_relaxed) == writePosition.load(std::memory_order_acquire); }
+	ePushResult push(const void* data, size_t size, uint16_t senderPort);
+	bool pop(sf::Packet& packet, uint16_t& senderPort, bool& isCorrupt);
+};
+
+namespace {
+
+const uint32_t RingMagic = 0x52435052; // RCPR
+const uint32_t WrapMarker = 0xFFFFFFFF;
+const size_t RecordHeaderSize = 8;
+const size_t MinRingSize = 1 << 17; // so that the largest datagram fits anywhere
+const microseconds LockTimeout = milliseconds(10); // a sender copies a datagram in microseconds, unless it's preempted
+const milliseconds LockedRetryInterval = milliseconds(1000); // a ring found locked is not used for that long
+
+uint32_t getRecordSize(size_t size) {
+	return uint32_t((RecordHeaderSize + size + 7) & ~size_t(7));
+}
+
+} // namespace
+
+
+auto RcpSharedMemoryTransport::Ring::push(const void* data, size_t size, uint16_t senderPort) -> ePushResult {
+	uint32_t recordSize = getRecordSize(size);
+
+	if (writeLock.exchange(1, std::memory_order_acquire) != 0) {
+		auto deadline = steady_clock::now() + LockTimeout;
+		do {
+			if (steady_clock::now() >= deadline) {
+				return PUSH_LOCKED;
+			}
+			std::this_thread::yield();
+		} while (writeLock.exchange(1, std::memory_order_acquire) != 0);
+	}
+
+	uint32_t write = writePosition.load(std::memory_order_relaxed);
+	uint32_t read = readPosition.load(std::memory_order_acquire);
+	uint32_t offset = write & (capacity - 1);
+	uint32_t padding = capacity - offset < recordSize ? capacity - offset : 0;
+	if (capacity - (write - read) < padding + recordSize) {
+		writeLock.store(0, std::memory_order_release);
+		return PUSH_FULL;
+	}
+
+	uint8_t* buffer = getData();
+	if (padding != 0) {
+		memcpy(buffer + offset, &WrapMarker, sizeof(WrapMarker));
+		offset = 0;
+	}
+	uint32_t header[2] = { uint32_t(size), senderPort };
+	memcpy(buffer + offset, header, sizeof(header));
+	memcpy(buffer + offset + RecordHeaderSize, data, size);
+
+	// sequentially consistent, so that either the receiver sees it before going to sleep, or we see it sleeping
+	writePosition.store(write + padding + recordSize, std::memory_order_seq_cst);
+	writeLock.store(0, std::memory_order_release);
+	return PUSHED;
+}
+
+
+bool RcpSharedMemoryTransport::Ring::pop(sf::Packet& packet, uint16_t& senderPort, bool& isCorrupt) {
+	uint32_t read = readPosition.load(std::memory_order_relaxed);
+	uint32_t write = writePosition.load(std::memory_order_acquire);
+	uint8_t* buffer = getData();
+	isCorrupt = write - read > capacity || read % 8 != 0;
+	while (read != write && !isCorrupt) {
+		uint32_t offset = read & (capacity - 1);
+		uint32_t header[2];
+		memcpy(header, buffer + offset, sizeof(header));
+		if (header[0] == WrapMarker) {
+			isCorrupt = capacity - offset > write - read;
+			read += capacity - offset;
+			continue;
+		}
+		// the record must lie within the buffer, and within what was written
+		if (header[0] > capacity - offset - RecordHeaderSize || getRecordSize(header[0]) > write - read) {
+			isCorrupt = true;
+			break;
+		}
+		packet.clear();
+		packet.append(buffer + offset + RecordHeaderSize, header[0]);
+		senderPort = uint16_t(header[1]);
+		readPosition.store(read + getRecordSize(header[0]), std::memory_order_release);
+		return true;
+	}
+	// what's left can't be trusted, nor where the next record starts
+	readPosition.store(isCorrupt ? write : read, std::memory_order_release);
+	return false;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Shared memory objects
+
+std::string RcpSharedMemoryTransport::getName(uint16_t port) {
+	return "/remcon-rcp-" + std::to_string(port);
+}
+
+
+#ifndef REMCON_WINDOWS
+
+bool RcpSharedMemoryTransport::Mapping::create(uint16_t port, size_t capacity) {
+	// the port is ours on UDP, so an object of the same name is left over from a crashed process
+	std::string name = getName(port);
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) {
+		return false;
+	}
+	size_t mappedSize = sizeof(Ring) + capacity;
+	void* memory = MAP_FAILED;
+	if (ftruncate(fd, mappedSize) == 0) {
+		memory = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (memory == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	ring = new (memory) Ring();
+	size = mappedSize;
+	ring->capacity = uint32_t(capacity);
+	ring->isOpen = 0;
+	ring->isSleeping = 0;
+	ring->writeLock = 0;
+	ring->writePosition = 0;
+	ring->readPosition = 0;
+	ring->magic = RingMagic;
+	ring->isOpen.store(1, std::memory_order_release);
+	return true;
+}
+
+
+bool RcpSharedMemoryTransport::Mapping::open(uint16_t port) {
+	int fd = shm_open(getName(port).c_str(), O_RDWR, 0);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat info;
+	void* memory = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && size_t(info.st_size) > sizeof(Ring)) {
+		memory = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (memory == MAP_FAILED) {
+		return false;
+	}
+
+	// it may be just being created, or belong to someone else altogether
+	Ring* mapped = (Ring*)memory;
+	if (!mapped->isOpen.load(std::memory_order_acquire)
+		|| mapped->magic != RingMagic
+		|| sizeof(Ring) + mapped->capacity != size_t(info.st_size))
+	{
+		munmap(memory, info.st_size);
+		return false;
+	}
+	ring = mapped;
+	size = info.st_size;
+	return true;
+}
+
+
+RcpSharedMemoryTransport::Mapping::~Mapping() {
+	if (ring) {
+		munmap(ring, size);
+	}
+}
+
+
+bool RcpSharedMemoryTransport::isSupported() {
+	return true;
+}
+
+#else
+
+bool RcpSharedMemoryTransport::Mapping::create(uint16_t port, size_t capacity) {
+	return false;
+}
+
+bool RcpSharedMemoryTransport::Mapping::open(uint16_t port) {
+	return false;
+}
+
+RcpSharedMemoryTransport::Mapping::~Mapping() {}
+
+bool RcpSharedMemoryTransport::isSupported() {
+	return false;
+}
+
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Transport
+
+RcpSharedMemoryTransport::RcpSharedMemoryTransport(size_t ringSize) {
+	this->ringSize = MinRingSize;
+	while (this->ringSize < ringSize) {
+		this->ringSize *= 2;
+	}
+	// spinning on a single core just keeps the sender from running
+	spinTime = std::thread::hardware_concurrency() > 1 ? microseconds(50) : microseconds(0);
+}
+
+
+RcpSharedMemoryTransport::~RcpSharedMemoryTransport() {
+	unbind();
+}
+
+
+bool RcpSharedMemoryTransport::bind(uint16_t port) {
+	unbind();
+	if (!udp.bind(port)) {
+		return false;
+	}
+	// without a ring, local peers will just use UDP
+	ownRing.reset(new Mapping());
+	if (!ownRing->create(udp.getLocalPort(), ringSize)) {
+		ownRing.reset();
+	}
+	return true;
+}
+
+
+bool RcpSharedMemoryTransport::bindGroup(const sf::IpAddress& group, uint16_t port) {
+	unbind();
+	return udp.bindGroup(group, port);
+}
+
+
+void RcpSharedMemoryTransport::unbind() {
+	if (ownRing) {
+		ownRing->get()->isOpen.store(0, std::memory_order_release);
+#ifndef REMCON_WINDOWS
+		shm_unlink(getName(udp.getLocalPort()).c_str());
+#endif
+		ownRing.reset();
+	}
+	peers.clear();
+	udp.unbind();
+}
+
+
+uint16_t RcpSharedMemoryTransport::getLocalPort() const {
+	return udp.getLocalPort();
+}
+
+
+bool RcpSharedMemoryTransport::send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) {
+	uint16_t localPort = udp.getLocalPort();
+	Ring* ring = nullptr;
+	if (address == sf::IpAddress::LocalHost && ownRing && size <= sf::UdpSocket::MaxDatagramSize) {
+		ring = port == localPort ? ownRing->get() : getPeerRing(port);
+	}
+	if (ring) {
+		ePushResult result = ring->push(data, size, localPort);
+		if (result == PUSH_FULL) {
+			// or the peer has gone, look it up again next time
+			peers.erase(port);
+			return false;
+		}
+		if (result == PUSH_LOCKED) {
+			// a sender died holding the lock, the receiver still gets UDP
+			statistics.lockTimeouts++;
+			if (port != localPort) {
+				Peer& peer = peers[port];
+				peer.mapping.reset();
+				peer.retryTime = steady_clock::now() + LockedRetryInterval;
+			}
+			ring = nullptr;
+		}
+	}
+	if (!ring) {
+		statistics.sentRemote++;
+		return udp.send(data, size, address, port);
+	}
+	statistics.sentLocal++;
+	if (ring->isSleeping.load(std::memory_order_seq_cst)) {
+		static const char doorbell = 0;
+		statistics.wakeups++;
+		udp.send(&doorbell, 0, address, port);
+	}
+	return true;
+}
+
+
+bool RcpSharedMemoryTransport::setTrafficClass(uint8_t dscp) {
+	return udp.setTrafficClass(dscp);
+}
+
+
+bool RcpSharedMemoryTransport::sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp) {
+	// there is no queue to prioritize on the way through shared memory
+	if (address == sf::IpAddress::LocalHost) {
+		return send(data, size, address, port);
+	}
+	statistics.sentRemote++;
+	return udp.sendMarked(data, size, address, port, dscp);
+}
+
+
+bool RcpSharedMemoryTransport::wait(microseconds timeout) {
+	if (!ownRing) {
+		return udp.wait(timeout);
+	}
+	Ring* ring = ownRing->get();
+
+	auto start = steady_clock::now();
+	auto spinDeadline = start + std::min(spinTime, timeout);
+	do {
+		if (!ring->isEmpty()) {
+			return true;
+		}
+	} while (steady_clock::now() < spinDeadline);
+
+	microseconds remaining = timeout;
+	if (timeout != microseconds::max()) {
+		remaining = std::max(microseconds(0), timeout - duration_cast<microseconds>(steady_clock::now() - start));
+	}
+	// sequentially consistent both, against the store of the write position and the load of isSleeping in send
+	ring->isSleeping.store(1, std::memory_order_seq_cst);
+	bool isReady = ring->writePosition.load(std::memory_order_seq_cst) != ring->readPosition.load(std::memory_order_relaxed)
+		|| udp.wait(remaining);
+	ring->isSleeping.store(0, std::memory_order_relaxed);
+	return isReady || !ring->isEmpty();
+}
+
+
+bool RcpSharedMemoryTransport::receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) {
+	bool isCorrupt = false;
+	if (ownRing && ownRing->get()->pop(packet, port, isCorrupt)) {
+		address = sf::IpAddress::LocalHost;
+		return true;
+	}
+	if (isCorrupt) {
+		statistics.corruptRings++;
+	}
+	while (udp.receive(packet, address, port)) {
+		// empty ones just wake us up
+		if (packet.getDataSize() != 0) {
+			return true;
+		}
+	}
+	packet.clear();
+	return false;
+}
+
+
+bool RcpSharedMemoryTransport::setBufferSizes(size_t receive, size_t send) {
+	return udp.setBufferSizes(receive, send);
+}
+
+
+bool RcpSharedMemoryTransport::getBufferSizes(size_t& receive, size_t& send) const {
+	return udp.getBufferSizes(receive, send);
+}
+
+
+uint64_t RcpSharedMemoryTransport::getReceiveDrops() const {
+	return udp.getReceiveDrops();
+}
+
+
+void RcpSharedMemoryTransport::setSpinTime(microseconds spinTime) {
+	this->spinTime = spinTime;
+}
+
+
+auto RcpSharedMemoryTransport::getStatistics() const -> Statistics {
+	return statistics;
+}
+
+
+RcpSharedMemoryTransport::Ring* RcpSharedMemoryTransport::getPeerRing(uint16_t port) {
+	auto now = steady_clock::now();
+	auto it = peers.find(port);
+	if (it != peers.end()) {
+		Peer& peer = it->second;
+		if (peer.mapping && peer.mapping->get()->isOpen.load(std::memory_order_acquire)) {
+			return peer.mapping->get();
+		}
+		if (!peer.mapping && now < peer.retryTime) {
+			return nullptr;
+		}
+	}
+
+	// the peer may not use this transport, don't look for it at every datagram then
+	Peer& peer = peers[port];
+	peer.mapping.reset(new Mapping());
+	if (!peer.mapping->open(port)) {
+		peer.mapping.reset();
+		peer.retryTime = now + milliseconds(100);
+		return nullptr;
+	}
+	return peer.mapping->get();
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <memory>
+
+#include <SFML/Network.hpp>
+
+#include "RcpTransport.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Transport for peers on the same host.
+//
+// Datagrams to peers addressed as localhost, that use this transport too, are
+// carried through shared memory instead of the network stack. Every other
+// datagram goes over UDP, so the transport can be used for any socket, local
+// peers are picked automatically.
+//
+// Each bound transport owns a ring buffer in a POSIX shared memory object
+// named after its port. The port itself is bound on UDP as well, which keeps
+// the port numbers unique, and carries the traffic of remote peers. Senders
+// map the ring of the receiver and copy the datagram right into it.
+//
+// A receiver first spins on its ring for a short while, then it goes to sleep
+// on its UDP socket, having marked the ring as sleeping. Senders finding it
+// so wake it with an empty UDP datagram, which is filtered out. Thus a busy
+// receiver costs the sender no system call, while waiting for local and
+// remote peers at the same time still takes one select.
+//
+// The ring is checked as it's read, a corrupt one is emptied. A ring whose
+// lock is not released in 10 ms, by a sender that died holding it, is not
+// used for a second, the datagrams go over UDP meanwhile.
+//
+// Only available on POSIX systems. Elsewhere everything goes over UDP.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpSharedMemoryTransport : public RcpTransport {
+public:
+	struct Statistics {
+		uint64_t sentLocal = 0; // through shared memory
+		uint64_t sentRemote = 0; // over UDP
+		uint64_t wakeups = 0; // sleeping receivers woken up
+		uint64_t lockTimeouts = 0; // rings found locked for too long, sent over UDP
+		uint64_t corruptRings = 0; // corrupt records found in the own ring, which was emptied then
+	};
+
+	/// \param ringSize Bytes of the receiving ring, rounded up to a power of two, at least 128 KiB.
+	///		Datagrams that don't fit are dropped, as on a full UDP buffer.
+	RcpSharedMemoryTransport(size_t ringSize = 1 << 20);
+	~RcpSharedMemoryTransport();
+
+	bool bind(uint16_t port) override;
+	bool bindGroup(const sf::IpAddress& group, uint16_t port) override;
+	void unbind() override;
+	uint16_t getLocalPort() const override;
+	bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) override;
+	bool setTrafficClass(uint8_t dscp) override; // marks remote datagrams only
+	bool sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp) override;
+	bool wait(std::chrono::microseconds timeout) override;
+	bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) override;
+	bool setBufferSizes(size_t receive, size_t send) override; // of the UDP socket, the ring is sized at construction
+	bool getBufferSizes(size_t& receive, size_t& send) const override;
+	uint64_t getReceiveDrops() const override; // of the UDP socket
+
+	/// Set how long wait spins on the ring before going to sleep. Default is 50 us, 0 on a single core.
+	/// Spinning takes a local datagram the quickest, but burns a core meanwhile.
+	/// Remote datagrams are only noticed once asleep.
+	void setSpinTime(std::chrono::microseconds spinTime);
+
+	/// Check if the shared memory path is available on this system.
+	static bool isSupported();
+
+	/// Not thread safe against send and receive.
+	Statistics getStatistics() const;
+private:
+	struct Ring;
+	enum ePushResult {
+		PUSHED,
+		PUSH_FULL,
+		PUSH_LOCKED, // by someone else for too long
+	};
+
+	// a ring in shared memory, the own one or a peer's
+	class Mapping {
+	public:
+		Mapping() : ring(nullptr), size(0) {}
+		~Mapping();
+		Mapping(const Mapping&) = delete;
+		Mapping& operator=(const Mapping&) = delete;
+
+		bool create(uint16_t port, size_t capacity);
+		bool open(uint16_t port);
+		Ring* get() const { return ring; }
+	private:
+		Ring* ring;
+		size_t size;
+	};
+	struct Peer {
+		std::unique_ptr<Mapping> mapping; // none if the peer has no ring
+		std::chrono::steady_clock::time_point retryTime; // when to look for its ring again
+	};
+
+	Ring* getPeerRing(uint16_t port); // nullptr if the peer has no ring
+	static std::string getName(uint16_t port);
+private:
+	RcpUdpTransport udp;
+	size_t ringSize;
+	std::unique_ptr<Mapping> ownRing;
+	std::unordered_map<uint16_t, Peer> peers; // by port, all on localhost
+	std::chrono::microseconds spinTime;
+	Statistics statistics;
+};
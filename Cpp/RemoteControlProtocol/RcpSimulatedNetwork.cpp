@@ -0,0 +1,228 @@
+#include "RcpSimulatedNetwork.h"
+
+#include <algorithm>
+
+using namespace std::chrono;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Transport
+
+class RcpSimulatedTransport : public RcpTransport {
+public:
+	RcpSimulatedTransport(RcpSimulatedNetwork& network) : network(network), port(0), isLaunchTimes(false) {}
+	~RcpSimulatedTransport() {
+		unbind();
+	}
+
+	bool bind(uint16_t port) override {
+		unbind();
+		if (!network.bindEndpoint(port)) {
+			return false;
+		}
+		this->port = port;
+		return true;
+	}
+	void unbind() override {
+		if (port != 0) {
+			network.unbindEndpoint(port);
+			port = 0;
+		}
+	}
+	bool bindGroup(const sf::IpAddress& group, uint16_t groupPort) override {
+		// members don't share the port like on a real host, each gets one of its own
+		if (!bind(0)) {
+			return false;
+		}
+		network.joinGroup(port, group, groupPort);
+		return true;
+	}
+	uint16_t getLocalPort() const override {
+		return port;
+	}
+	bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t toPort) override {
+		return port != 0 && network.send(port, data, size, address, toPort);
+	}
+	bool setLaunchTimes(bool enable) override {
+		isLaunchTimes = enable;
+		return true;
+	}
+	bool sendAt(const void* data, size_t size, const sf::IpAddress& address, uint16_t toPort, uint8_t /*dscp*/, RcpClock::time_point launchTime) override {
+		return port != 0 && network.send(port, data, size, address, toPort, isLaunchTimes ? launchTime : RcpClock::time_point());
+	}
+	bool wait(microseconds timeout) override {
+		return network.wait(port, timeout);
+	}
+	bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& fromPort) override {
+		RcpSimulatedNetwork::Datagram datagram;
+		if (port == 0 || !network.receive(port, datagram)) {
+			return false;
+		}
+		packet.clear();
+		packet.append(datagram.data.data(), datagram.data.size());
+		address = sf::IpAddress::LocalHost;
+		fromPort = datagram.fromPort;
+		return true;
+	}
+private:
+	RcpSimulatedNetwork& network;
+	uint16_t port;
+	bool isLaunchTimes;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Network
+
+RcpSimulatedNetwork::RcpSimulatedNetwork(RcpSimulatedClock& clock, uint32_t seed) : clock(clock), random(seed) {
+	nextPort = 40000;
+	nextOrder = 0;
+}
+
+
+std::unique_ptr<RcpTransport> RcpSimulatedNetwork::createTransport() {
+	return std::unique_ptr<RcpTransport>(new RcpSimulatedTransport(*this));
+}
+
+
+void RcpSimulatedNetwork::setLinkParameters(const LinkParameters& parameters) {
+	std::lock_guard<std::mutex> lk(mtx);
+	defaultLink = parameters;
+}
+
+
+void RcpSimulatedNetwork::setLinkParameters(uint16_t fromPort, uint16_t toPort, const LinkParameters& parameters) {
+	std::lock_guard<std::mutex> lk(mtx);
+	links[{ fromPort, toPort }] = parameters;
+}
+
+
+auto RcpSimulatedNetwork::getStatistics() const -> Statistics {
+	std::lock_guard<std::mutex> lk(mtx);
+	return statistics;
+}
+
+
+RcpSimulatedClock& RcpSimulatedNetwork::getClock() {
+	return clock;
+}
+
+
+bool RcpSimulatedNetwork::bindEndpoint(uint16_t& port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	if (port == 0) {
+		while (endpoints.count(nextPort) > 0 || nextPort == 0) {
+			nextPort++;
+		}
+		port = nextPort++;
+	}
+	return endpoints.insert({ port, QueueT() }).second;
+}
+
+
+void RcpSimulatedNetwork::unbindEndpoint(uint16_t port) {
+	std::lock_guard<std::mutex> lk(mtx);
+	endpoints.erase(port);
+	for (auto& group : groups) {
+		group.second.erase(port);
+	}
+}
+
+
+void RcpSimulatedNetwork::joinGroup(uint16_t port, const sf::IpAddress& group, uint16_t groupPort) {
+	std::lock_guard<std::mutex> lk(mtx);
+	groups[{ group.toInteger(), groupPort }].insert(port);
+}
+
+
+bool RcpSimulatedNetwork::send(uint16_t fromPort, const void* data, size_t size, const sf::IpAddress& address, uint16_t toPort, RcpClock::time_point launchTime) {
+	if (size > sf::UdpSocket::MaxDatagramSize) {
+		return false;
+	}
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		statistics.sent++;
+		auto departure = std::max(clock.now(), launchTime);
+
+		auto groupIt = groups.find({ address.toInteger(), toPort });
+		if (groupIt != groups.end()) {
+			for (uint16_t member : groupIt->second) {
+				enqueue(fromPort, member, data, size, departure);
+			}
+		}
+		else if (address == sf::IpAddress::LocalHost) {
+			enqueue(fromPort, toPort, data, size, departure);
+		}
+		else {
+			statistics.dropped++;
+		}
+	}
+	clock.notify();
+	return true; // the sender can't tell if it's dropped, like with UDP
+}
+
+
+void RcpSimulatedNetwork::enqueue(uint16_t fromPort, uint16_t toPort, const void* data, size_t size, RcpClock::time_point departure) {
+	auto linkIt = links.find({ fromPort, toPort });
+	const LinkParameters& link = linkIt != links.end() ? linkIt->second : defaultLink;
+
+	// draw the random numbers even if they don't matter, so that one
+	// datagram's fate doesn't depend on the link parameters of another
+	double lossDraw = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+	double jitterDraw = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+
+	auto endpointIt = endpoints.find(toPort);
+	if (endpointIt == endpoints.end() || lossDraw < link.loss) {
+		statistics.dropped++;
+		return;
+	}
+	auto arrival = departure + link.delay + microseconds((long long)(jitterDraw * link.jitter.count()));
+	Datagram datagram{ fromPort, std::vector<uint8_t>((const uint8_t*)data, (const uint8_t*)data + size) };
+	endpointIt->second.insert({ { arrival, nextOrder++ }, std::move(datagram) });
+}
+
+
+bool RcpSimulatedNetwork::receive(uint16_t port, Datagram& datagram) {
+	std::lock_guard<std::mutex> lk(mtx);
+	auto endpointIt = endpoints.find(port);
+	if (endpointIt == endpoints.end() || endpointIt->second.empty()) {
+		return false;
+	}
+	auto first = endpointIt->second.begin();
+	if (first->first.first > clock.now()) {
+		return false;
+	}
+	datagram = std::move(first->second);
+	endpointIt->second.erase(first);
+	statistics.received++;
+	return true;
+}
+
+
+bool RcpSimulatedNetwork::isDue(uint16_t port, RcpClock::time_point& nextArrival) const {
+	std::lock_guard<std::mutex> lk(mtx);
+	nextArrival = RcpClock::time_point::max();
+	auto endpointIt = endpoints.find(port);
+	if (endpointIt == endpoints.end() || endpointIt->second.empty()) {
+		return false;
+	}
+	nextArrival = endpointIt->second.begin()->first.first;
+	return nextArrival <= clock.now();
+}
+
+
+bool RcpSimulatedNetwork::wait(uint16_t port, microseconds timeout) {
+	auto deadline = timeout == microseconds::max() ? RcpClock::time_point::max() : clock.now() + std::max(timeout, microseconds(1));
+	while (true) {
+		// senders queue the datagram, then notify, so either it is seen or the generation is stale
+		uint64_t generation = clock.getGeneration();
+		RcpClock::time_point nextArrival;
+		if (isDue(port, nextArrival)) {
+			return true;
+		}
+		if (clock.now() >= deadline) {
+			return false;
+		}
+		clock.sleepUntil(std::min(deadline, nextArrival), generation);
+	}
+}
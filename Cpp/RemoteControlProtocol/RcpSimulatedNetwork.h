@@ -0,0 +1,94 @@
+#pragma once
+
+#include "RcpClock.h"
+#include "RcpTransport.h"
+
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <chrono>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// A network of datagram endpoints that only exists in memory.
+//
+// Datagrams are delivered in simulated time: they become receivable when the
+// clock reaches their arrival time. Links can lose, delay and reorder them,
+// driven by a seeded random generator, so a scenario plays out the same way
+// every time.
+// All endpoints are on the loopback address, datagrams to other addresses
+// are dropped, just like those to unbound ports. Multicast groups are the
+// exception: a datagram to a group goes to each member, over its own link.
+// Transports can schedule datagrams like SO_TXTIME does: one sent with a
+// launch time goes on the link at that time.
+//
+// The network must outlive its transports.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpSimulatedNetwork {
+public:
+	/// Impairment of the datagrams going over a link.
+	struct LinkParameters {
+		double loss = 0.0; // probability of dropping a datagram
+		std::chrono::microseconds delay = std::chrono::microseconds(0);
+		std::chrono::microseconds jitter = std::chrono::microseconds(0); // extra delay up to this, reorders datagrams
+	};
+
+	struct Statistics {
+		uint64_t sent = 0; // a datagram to a multicast group counts once
+		uint64_t dropped = 0;
+		uint64_t received = 0;
+	};
+
+public:
+	RcpSimulatedNetwork(RcpSimulatedClock& clock, uint32_t seed = 1);
+	RcpSimulatedNetwork(const RcpSimulatedNetwork&) = delete;
+	RcpSimulatedNetwork& operator=(const RcpSimulatedNetwork&) = delete;
+
+	/// Create an endpoint on this network, to be passed to an RcpSocket.
+	std::unique_ptr<RcpTransport> createTransport();
+
+	/// Set the impairment of all links that have no parameters of their own.
+	void setLinkParameters(const LinkParameters& parameters);
+
+	/// Set the impairment of a link in one direction.
+	void setLinkParameters(uint16_t fromPort, uint16_t toPort, const LinkParameters& parameters);
+
+	Statistics getStatistics() const;
+
+	RcpSimulatedClock& getClock();
+private:
+	friend class RcpSimulatedTransport;
+
+	struct Datagram {
+		uint16_t fromPort;
+		std::vector<uint8_t> data;
+	};
+	// ordered by arrival time, then by sending order
+	using QueueT = std::map<std::pair<RcpClock::time_point, uint64_t>, Datagram>;
+
+	bool bindEndpoint(uint16_t& port);
+	void unbindEndpoint(uint16_t port);
+	void joinGroup(uint16_t port, const sf::IpAddress& group, uint16_t groupPort);
+	void enqueue(uint16_t fromPort, uint16_t toPort, const void* data, size_t size, RcpClock::time_point departure); // call with mtx locked
+	bool send(uint16_t fromPort, const void* data, size_t size, const sf::IpAddress& address, uint16_t toPort, RcpClock::time_point launchTime = RcpClock::time_point());
+	bool receive(uint16_t port, Datagram& datagram);
+	bool isDue(uint16_t port, RcpClock::time_point& nextArrival) const;
+	bool wait(uint16_t port, std::chrono::microseconds timeout);
+private:
+	RcpSimulatedClock& clock;
+	mutable std::mutex mtx;
+	std::map<uint16_t, QueueT> endpoints; // bound ports and their incoming datagrams
+	std::map<std::pair<uint32_t, uint16_t>, std::set<uint16_t>> groups; // group address and port -> member endpoints
+	uint16_t nextPort;
+	uint64_t nextOrder;
+
+	LinkParameters defaultLink;
+	std::map<std::pair<uint16_t, uint16_t>, LinkParameters> links;
+	std::mt19937 random;
+	Statistics statistics;
+};
@@ -0,0 +1,86 @@
+#include "RcpSipHash.h"
+
+
+static inline uint64_t rotl(uint64_t x, int b) {
+	return (x << b) | (x >> (64 - b));
+}
+
+static inline void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+	v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+	v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+	v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+	v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+}
+
+static inline uint64_t load64(const uint8_t* p) {
+	// little endian, as in the reference implementation
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; --i) {
+		value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+
+uint64_t RcpSipHash::hash(const Key& key, const void* data, size_t size) {
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	uint64_t v0 = 0x736f6d6570736575ull ^ key.k0;
+	uint64_t v1 = 0x646f72616e646f6dull ^ key.k1;
+	uint64_t v2 = 0x6c7967656e657261ull ^ key.k0;
+	uint64_t v3 = 0x7465646279746573ull ^ key.k1;
+
+	// 2 rounds per 8 byte word
+	const uint8_t* end = bytes + (size & ~size_t(7));
+	for (; bytes != end; bytes += 8) {
+		uint64_t m = load64(bytes);
+		v3 ^= m;
+		sipRound(v0, v1, v2, v3);
+		sipRound(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+
+	// the last word holds the remaining bytes and the length
+	uint64_t last = uint64_t(size) << 56;
+	for (size_t i = 0; i < (size & 7); ++i) {
+		last |= uint64_t(bytes[i]) << (8 * i);
+	}
+	v3 ^= last;
+	sipRound(v0, v1, v2, v3);
+	sipRound(v0, v1, v2, v3);
+	v0 ^= last;
+
+	// 4 finalization rounds
+	v2 ^= 0xFF;
+	sipRound(v0, v1, v2, v3);
+	sipRound(v0, v1, v2, v3);
+	sipRound(v0, v1, v2, v3);
+	sipRound(v0, v1, v2, v3);
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+auto RcpSipHash::makeKey(const void* secret, size_t size) -> Key {
+	// two hashes of the secret under fixed keys, which are not secret
+	Key first, second;
+	first.k0 = 0x5243502d6b657930ull; // "RCP-key0"
+	second.k0 = 0x5243502d6b657931ull; // "RCP-key1"
+	Key key;
+	key.k0 = hash(first, secret, size);
+	key.k1 = hash(second, secret, size);
+	return key;
+}
+
+
+auto RcpSipHash::deriveKey(const Key& secret, uint64_t localNonce, uint64_t remoteNonce, uint8_t purpose) -> Key {
+	uint8_t input[17];
+	for (int i = 0; i < 8; ++i) {
+		input[i] = uint8_t(localNonce >> (8 * i));
+		input[8 + i] = uint8_t(remoteNonce >> (8 * i));
+	}
+	Key key;
+	input[16] = uint8_t(2 * purpose);
+	key.k0 = hash(secret, input, sizeof(input));
+	input[16] = uint8_t(2 * purpose + 1);
+	key.k1 = hash(secret, input, sizeof(input));
+	return key;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// SipHash-2-4, a keyed hash of short messages, fast enough to authenticate
+// every datagram.
+//
+// Its 64 bit output serves as the MAC of RCP datagrams: without the key,
+// forging one takes about 2^63 tries. Keys are derived from a secret and
+// the nonces of a handshake, so each connection and direction has its own.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpSipHash {
+public:
+	struct Key {
+		uint64_t k0 = 0;
+		uint64_t k1 = 0;
+	};
+
+	/// Hash size bytes of data.
+	static uint64_t hash(const Key& key, const void* data, size_t size);
+
+	/// Make a key of a secret of any length, e.g. a passphrase.
+	static Key makeKey(const void* secret, size_t size);
+
+	/// Derive the key of a connection of the secret's key and the nonces of the handshake.
+	/// Swapping the nonces gives the key of the other direction.
+	/// \param purpose Different purposes get unrelated keys, e.g. the halves of a cipher's key.
+	static Key deriveKey(const Key& secret, uint64_t localNonce, uint64_t remoteNonce, uint8_t purpose = 0);
+};
@@ -5,6 +5,9 @@
 #include <iomanip>
 #include <cassert>
 #include <cstring>
+#include <future>
+#include <algorithm>
+#include <random>
 
 // needed for colored console text while debugging
 #ifdef _MSC_VER
@@ -19,80 +22,100 @@ using namespace std::chrono; // long names were unreadable :(
 ////////////////////////////////////////////////////////////////////////////////
 // Constructors and Destructor
 
-RcpSocket::RcpSocket() {
+RcpSocket::RcpSocket() : RcpSocket(std::unique_ptr<RcpTransport>(new RcpUdpTransport()), RcpClock::system()) {}
+
+RcpSocket::RcpSocket(std::unique_ptr<RcpTransport> transport, RcpClock& clock) :
+	transport(new RcpCaptureTransport(std::move(transport), capture, clock)),
+	clock(&clock)
+{
 	state = CLOSED;
-	socket.setBlocking(false);
 	isBlocking = true;
+	realTime = false;
+	realTimeCapacity = realTimeMessageSize = 0;
+	trafficClass = RcpTransport::CS0;
+	kernelPacing = false;
+	retransmitPacing = 0;
+	authentication = false;
+	encryption = false;
+	sendCounter = 0;
+	localNonce = remoteNonce = 0;
+	rejectedCount = 0;
+	bufferAutoTuning = false;
+	maxReceiveBuffer = 0;
+	lastReceiveDrops = 0;
 	localSeqNum = localBatchNum = 0;
+	initialSeqNum = initialBatchNum = 0;
 	remoteSeqNum = remoteBatchNum = 0;
 	remoteBatchNumReserved = remoteBatchNum;
 	runIoThread = false;
+	isIoThreadDone = true;
+	clockSyncInterval = 0;
+	handshakeResult = HANDSHAKE_FAILED;
+	linger = TIMEOUT_TOTAL;
+	closeResult = CLOSE_GRACEFUL;
 
 	cancelCallId = 896345; // any number will suffice
 	cancelNotify = cancelCallId;
+	session = new (&sessionStorage) Session(arena);
 
 	initDebug(); // DEBUG
 }
 
 RcpSocket::~RcpSocket() {
+	// the close goes on in the background for at most the linger time
 	disconnect();
-	if (ioThread.joinable()) {
-		ioThread.join();
-	}
+	joinIoThread();
+	session->~Session();
 }
 
+RcpSocket::Session::Session(RcpArena& arena) :
+	recvQueue(RecvQueueT::container_type(RcpArenaAllocator<RecvQueueT::value_type>(arena))),
+	recvReserved(RcpArenaAllocator<ReservedMapT::value_type>(arena)),
+	recentPackets(0, RecentPacketMapT::hasher(), RecentPacketMapT::key_equal(), RcpArenaAllocator<RecentPacketMapT::value_type>(arena)),
+	scheduled(ScheduledMapT::key_compare(), RcpArenaAllocator<ScheduledMapT::value_type>(arena))
+{}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Modifiers
 
 bool RcpSocket::bind(uint16_t port) {
-	if (state == CONNECTED) {
-		return false;
-	}
-	if (port == AnyPort) {
-		port = sf::UdpSocket::AnyPort;
-	}
-	bool success = socket.bind(port) == sf::UdpSocket::Done;
-	if (success) {
-		selector.add(socket);
-		return true;
-	}
-	else {
+	if (state == CONNECTED || state == FIN_WAIT) {
 		return false;
 	}
+	return transport->bind(port); // AnyPort is 0 for transports as well
 }
 
 void RcpSocket::unbind() {
-	if (state != CONNECTED) {
-		socket.unbind();
-		selector.remove(socket);
+	if (state != CONNECTED && state != FIN_WAIT) {
+		transport->unbind();
 	}
 }
 
 bool RcpSocket::isBound() const {
-	return socket.getLocalPort() != 0;
+	return transport->getLocalPort() != 0;
 }
 
 void RcpSocket::cancel() {
 	std::lock_guard<std::mutex> lk(socketMutex);
 
 	// send a cancel packet to self
-	RcpHeader header;
-	header.sequenceNumber = cancelCallId;
-	header.batchNumber = cancelCallId;
-	header.flags = CANCEL;
-	auto rawData = makePacket(header, nullptr, 0);
-	socket.send(rawData.data(), rawData.size(), "localhost", getLocalPort());
+	wakeIoThread();
 
 	// notify condvar
 	cancelNotify = cancelCallId;
-	recvCondvar.notify_all();
+	notifyReceivers();
 }
 
 bool RcpSocket::isConnected() const {
 	return state == CONNECTED || state == CLOSING;
 }
 
+bool RcpSocket::isConnecting() const {
+	eState current = state;
+	return current == SYN_WAIT || current == SYN_SENT || current == SYN_ACK_SENT || current == SYN_SIMOULTANEOUS;
+}
+
 std::string RcpSocket::getRemoteAddress() const {
 	return remoteAddress.toString();
 }
@@ -110,380 +133,338 @@ bool RcpSocket::getBlocking() const {
 }
 
 uint16_t RcpSocket::getLocalPort() const {
-	return socket.getLocalPort();
+	return transport->getLocalPort();
 }
 
-void RcpSocket::setTiming(long long totalMs, long long shortMs) {
-	if (shortMs == 0) {
-		shortMs = TIMEOUT_SHORT;
+void RcpSocket::setClockSyncInterval(unsigned intervalMs) {
+	clockSyncInterval = intervalMs;
+}
+
+const RcpClockSync& RcpSocket::getClockSync() const {
+	return clockSync;
+}
+
+RcpClock& RcpSocket::getClock() const {
+	return *clock;
+}
+
+RcpLinkQuality& RcpSocket::getLinkQuality() {
+	return linkQuality;
+}
+
+const RcpLinkQuality& RcpSocket::getLinkQuality() const {
+	return linkQuality;
+}
+
+bool RcpSocket::setBufferSizes(size_t receive, size_t send) {
+	return transport->setBufferSizes(receive, send);
+}
+
+bool RcpSocket::getBufferSizes(size_t& receive, size_t& send) const {
+	return transport->getBufferSizes(receive, send);
+}
+
+void RcpSocket::setBufferAutoTuning(bool enable, size_t maxReceive) {
+	maxReceiveBuffer = maxReceive;
+	bufferAutoTuning = enable;
+}
+
+bool RcpSocket::isBufferAutoTuning() const {
+	return bufferAutoTuning;
+}
+
+uint64_t RcpSocket::getReceiveDropCount() const {
+	return transport->getReceiveDrops();
+}
+
+void RcpSocket::checkReceiveDrops(RcpClock::time_point now) {
+	// the count starts over at binding
+	uint64_t drops = transport->getReceiveDrops();
+	if (drops == lastReceiveDrops) {
+		return;
 	}
-	if (totalMs < shortMs) {
-		totalMs = shortMs + 1;
+	uint64_t newDrops = drops > lastReceiveDrops ? drops - lastReceiveDrops : drops;
+	lastReceiveDrops = drops;
+	linkQuality.addDropped(newDrops, now);
+
+	// the drops of one burst only grow it once
+	if (!bufferAutoTuning || now - lastBufferGrowth < RcpLinkQuality::Interval) {
+		return;
+	}
+	size_t receive, send;
+	if (transport->getBufferSizes(receive, send) && receive < maxReceiveBuffer) {
+		transport->setBufferSizes(std::min(receive * 2, (size_t)maxReceiveBuffer), 0);
+		lastBufferGrowth = now;
 	}
-	TIMEOUT_TOTAL = totalMs;
-	TIMEOUT_SHORT = shortMs;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// Connection setup
+void RcpSocket::setMemoryBudget(size_t bytes) {
+	arena.setBudget(bytes);
+}
 
-void RcpSocket::accept(int timeout) {
-	cancelCallId++;
-	auto timeoutStart = steady_clock::now();
+RcpArena::Usage RcpSocket::getMemoryUsage() const {
+	return arena.getUsage();
+}
 
-	if (state != CLOSED) {
-		throw RcpInvalidCallException("already connected");
-	}
-	if (!isBound()) {
-		throw RcpInvalidCallException("must bind the socket first");
+void RcpSocket::resetMemoryPeak() {
+	arena.resetPeak();
+}
+
+void RcpSocket::setRealTime(bool enable, size_t capacity, size_t messageSize) {
+	std::lock_guard<std::mutex> lk(socketMutex);
+	realTime = enable;
+	realTimeCapacity = enable ? capacity : 0;
+	realTimeMessageSize = enable ? messageSize : 0;
+	if (!enable) {
+		packetPool = std::vector<RcpPacket>();
+		return;
 	}
+	prepareSession();
+}
 
-	// set local parameters
-	localSeqNum = 70000;
-	localBatchNum = 10000;
+bool RcpSocket::isRealTime() const {
+	return realTime;
+}
 
-	// do handshake
-	// - wait for SYN
-	// - send SYN-ACK
-	// - wait for ACK
-	RcpHeader header;
-	std::array<uint8_t, 12> headerSer;
-	sf::Packet packet;
-	sf::IpAddress responseAddress;
-	uint16_t responsePort;
+void RcpSocket::setLinger(unsigned lingerMs) {
+	linger = lingerMs;
+}
 
-	// - wait for SYN
-	bool isData = false;
-	while (!isData) {
-		long long timeoutLeft = duration_cast<milliseconds>(timeoutStart - steady_clock::now()).count() + timeout;
-		sf::Time waitTime =
-			timeout == std::numeric_limits<int>::max() ? sf::Time::Zero : sf::milliseconds(timeoutLeft);
-		if (timeoutLeft <= 0 || !selector.wait(waitTime)) {
-			throw RcpTimeoutException("requested timeout is over");
-		}
+unsigned RcpSocket::getLinger() const {
+	return linger;
+}
 
-		// receive packet
-		socket.receive(packet, remoteAddress, remotePort); // intentionally read into remoteWhatever
+bool RcpSocket::setTrafficClass(uint8_t dscp) {
+	std::lock_guard<std::mutex> lk(socketMutex);
+	trafficClass = dscp;
+	return transport->setTrafficClass(dscp);
+}
 
-		// decode header
-		if (!header.deserialize(packet.getData(), packet.getDataSize())) {
-			continue;
-		}
-		debugPrintMsg(header, RECV);
+uint8_t RcpSocket::getTrafficClass() const {
+	return trafficClass;
+}
 
-		// react to header
-		if (header.flags == CANCEL && cancelCallId == header.sequenceNumber) {
-			throw RcpInterruptedException("function call was cancelled");
-		}
-		else if (header.flags == SYN) {
-			isData = true;
-		}
-	}
+bool RcpSocket::setKernelPacing(bool enable) {
+	std::lock_guard<std::mutex> lk(socketMutex);
+	bool isScheduling = transport->setLaunchTimes(enable);
+	kernelPacing = enable && isScheduling;
+	return isScheduling || !enable;
+}
 
-	remoteSeqNum = header.sequenceNumber;
-	remoteBatchNum = header.batchNumber;
-	remoteBatchNumReserved = remoteBatchNum;
+bool RcpSocket::isKernelPacing() const {
+	return kernelPacing;
+}
 
-	// - send SYN-ACK
-	header.sequenceNumber = localSeqNum++;
-	header.batchNumber = localBatchNum;
-	header.flags = SYN | ACK;
-	headerSer = header.serialize();
-	socket.send(headerSer.data(), headerSer.size(), remoteAddress, remotePort);
-	debugPrintMsg(header, SEND); // DEBUG
+void RcpSocket::setRetransmitPacing(unsigned intervalUs) {
+	retransmitPacing = intervalUs;
+}
+
+bool RcpSocket::startCapture(const std::string& path) {
+	return capture.open(path);
+}
 
-	// - wait for ACK
-	auto waitBegin = steady_clock::now();
-	long long timeLeft; // milliseconds
-	bool isAck;
-	do {
-		// how much time is left to get get a packet
-		timeLeft = duration_cast<milliseconds>(waitBegin - steady_clock::now()).count() + TIMEOUT_TOTAL;
-		long long timeoutLeft = duration_cast<milliseconds>(timeoutStart - steady_clock::now()).count() + timeout;
-		timeLeft = min(timeoutLeft, timeLeft);
+void RcpSocket::stopCapture() {
+	capture.close();
+}
 
-		// wait for a packet
-		if (timeLeft <= 0 || !selector.wait(sf::milliseconds(timeLeft))) {
-			throw RcpNetworkException("client's response timed out");
-		}
-		socket.receive(packet, responseAddress, responsePort);
+void RcpSocket::setAuthentication(bool enable, const std::string& secret) {
+	std::lock_guard<std::mutex> lk(socketMutex);
+	authentication = enable;
+	authenticationSecret = RcpSipHash::makeKey(secret.data(), secret.size());
+}
 
-		// decode packet
-		if (header.deserialize(packet.getData(), packet.getDataSize()) || remoteAddress != responseAddress || remotePort != responsePort) {
-			continue;
-		}
-		debugPrintMsg(header, RECV);
+bool RcpSocket::isAuthentication() const {
+	return authentication;
+}
 
-		// react to packet
-		if (header.flags == CANCEL && header.sequenceNumber == cancelCallId) {
-			throw RcpInterruptedException("function call was cancelled");
-		}
-		else if (header.flags == ACK && header.sequenceNumber == remoteSeqNum + 1 && header.batchNumber == remoteBatchNum) {
-			isAck = true;
-			break;
-		}
-	} while (timeLeft > 0);
+void RcpSocket::setEncryption(bool enable, const std::string& secret) {
+	std::lock_guard<std::mutex> lk(socketMutex);
+	encryption = enable;
+	authentication = enable || authentication;
+	authenticationSecret = RcpSipHash::makeKey(secret.data(), secret.size());
+}
+
+bool RcpSocket::isEncryption() const {
+	return encryption;
+}
+
+uint64_t RcpSocket::getRejectedCount() const {
+	return rejectedCount;
+}
 
-	if (!isAck) {
-		throw RcpNetworkException("ACK was expected, received other packet");
+void RcpSocket::setTiming(long long totalMs, long long shortMs) {
+	if (shortMs == 0) {
+		shortMs = TIMEOUT_SHORT;
+	}
+	if (totalMs < shortMs) {
+		totalMs = shortMs + 1;
 	}
+	TIMEOUT_TOTAL = totalMs;
+	TIMEOUT_SHORT = shortMs;
+}
 
-	remoteSeqNum = header.sequenceNumber;
-	remoteBatchNum = header.batchNumber;
-	remoteBatchNumReserved = remoteBatchNum;
+////////////////////////////////////////////////////////////////////////////////
+// Connection setup
 
-	// succesful connection
-	// finalize connection states, fire up IO thread
-	timeLastSend = ::steady_clock::now();
-	state = CONNECTED;
-	startIoThread();
+void RcpSocket::accept(int timeout) {
+	acceptAsync(timeout);
+	throwHandshakeError(waitHandshake());
 }
 
 void RcpSocket::connect(std::string address, uint16_t port, int timeout) {
-	cancelCallId++;
+	connectAsync(address, port, timeout);
+	throwHandshakeError(waitHandshake());
+}
 
-	if (state != CLOSED) {
-		throw RcpInvalidCallException("already connected");
-	}
-	if (!isBound()) {
-		throw RcpInvalidCallException("must bind the socket first");
-	}
+void RcpSocket::acceptAsync(int timeout, HandshakeHandler handler) {
+	beginHandshake(SYN_WAIT, timeout, std::move(handler));
+}
 
+void RcpSocket::connectAsync(std::string address, uint16_t port, int timeout, HandshakeHandler handler) {
 	// set remote parameters
 	remoteAddress = address;
 	remotePort = port;
+	beginHandshake(SYN_SENT, timeout, std::move(handler));
+}
 
-	// set local parameters
-	localSeqNum = 10000;
-	localBatchNum = 100;
+auto RcpSocket::waitHandshake(int timeout) -> eHandshakeResult {
+	RcpClock::Participant participant(*clock);
+	std::unique_lock<std::mutex> lk(socketMutex);
+	auto deadline = timeout == std::numeric_limits<int>::max() ? RcpClock::time_point::max() : clock->now() + milliseconds(timeout);
+	clock->waitUntil(lk, handshakeCondvar, deadline, [this] { return handshakeResult != HANDSHAKE_PENDING; });
+	return handshakeResult;
+}
 
-	// do handshake
-	// - send SYN
-	// - wait for SYN-ACK
-	// - send ACK
-	RcpHeader header;
-	std::array<uint8_t, 12> headerSer;
-	sf::Packet packet;
-	sf::IpAddress responseAddress;
-	uint16_t responsePort;
+void RcpSocket::beginHandshake(eState initialState, int timeout, HandshakeHandler handler) {
+	cancelCallId++;
 
-	// - send SYN
-	header.sequenceNumber = localSeqNum++; // initial local sequence number
-	header.batchNumber = localBatchNum; // initial local batch number
-	header.flags = SYN;
+	// the previous connection may still be closing in the background
+	waitDisconnect();
 
-	headerSer = header.serialize();
-	socket.send(headerSer.data(), headerSer.size(), remoteAddress, remotePort);
-	debugPrintMsg(header, SEND); // DEBUG
+	if (state != CLOSED) {
+		throw RcpInvalidCallException("already connected");
+	}
+	if (!isBound()) {
+		throw RcpInvalidCallException("must bind the socket first");
+	}
 
-	// - wait for SYN-ACK
-	auto waitBegin = steady_clock::now();
-	long long timeLeft;
-	bool isSynAck = false;
-	do {
-		// how much time is left to get get a packet
-		timeLeft = duration_cast<milliseconds>(waitBegin - steady_clock::now()).count() + min((unsigned)timeout, TIMEOUT_TOTAL);
+	// the IO thread of a failed handshake may still be finishing
+	stopIoThread();
 
-		// wait for a packet
-		if (timeLeft <= 0 || !selector.wait(sf::milliseconds(timeLeft))) {
-			throw RcpNetworkException("client's response timed out");
+	{
+		std::lock_guard<std::mutex> lk(socketMutex);
+
+		// set local parameters
+		uint32_t seqNum = initialState == SYN_WAIT ? 70000 : 10000;
+		uint32_t batchNum = initialState == SYN_WAIT ? 10000 : 100;
+		if (initialSeqNum != 0) {
+			seqNum = initialSeqNum;
+			batchNum = initialBatchNum;
 		}
-		socket.receive(packet, responseAddress, responsePort);
-
-		// decode packet
-		if (!header.deserialize(packet.getData(), packet.getDataSize()) || remoteAddress != responseAddress || remotePort != responsePort) {
-			continue;
+		localSeqNum = RcpSerialNumber::start(seqNum);
+		localBatchNum = RcpSerialNumber::start(batchNum);
+
+		// the keys of the last connection are no good for this one
+		keys.isAuthenticated = keys.isEncrypted = false;
+		sendCounter = 0; // the keys are new with the nonce, a simultaneous open may derive them twice
+		if (authentication) {
+			std::random_device random;
+			localNonce = (uint64_t(random()) << 32) | random();
 		}
-		debugPrintMsg(header, RECV);
 
-		// react to packet
-		if (header.flags == CANCEL && header.sequenceNumber == cancelCallId) {
-			throw RcpInterruptedException("function call was cancelled");
+		auto now = clock->now();
+		handshakeDeadline = timeout == std::numeric_limits<int>::max() ? RcpClock::time_point::max() : now + milliseconds(timeout);
+		handshakeResult = HANDSHAKE_PENDING;
+		handshakeHandler = std::move(handler);
+		state = initialState;
+		if (state == SYN_SENT) {
+			sendHandshakePacket(SYN);
 		}
-		else if (header.flags == (SYN | ACK)) {
-			isSynAck = true;
-			break;
-		}
-	} while (timeLeft > 0);
-
-	if (!isSynAck) {
-		throw RcpNetworkException("SYN/ACK was expected, received other packet");
 	}
 
-	remoteSeqNum = header.sequenceNumber;
-	remoteBatchNum = header.batchNumber;
-	remoteBatchNumReserved = remoteBatchNum;
-
-	// - send ACK
-	header.sequenceNumber = localSeqNum++;
-	header.batchNumber = localBatchNum;
-	header.flags = ACK;
-
-	headerSer = header.serialize();
-	socket.send(headerSer.data(), headerSer.size(), remoteAddress, remotePort);
-	debugPrintMsg(header, SEND); // DEBUG
-
-	// succesful connection
-	// note that the other party will drop connection soon if he did not receive our last ACK
-	// finalize connection states, fire up IO thread
-	timeLastSend = ::steady_clock::now();
-	state = CONNECTED;
 	startIoThread();
 }
 
-
-void RcpSocket::disconnect2() {
-	stopIoThread();
-
-	// we are initiating the shutdown
-	if (state == CONNECTED) {
-		
-	}
-	// the other party has initiated the shutdown
-	else if (state == CLOSE_WAIT) {
-
+void RcpSocket::throwHandshakeError(eHandshakeResult result) {
+	switch (result) {
+		case HANDSHAKE_SUCCESS:
+			return;
+		case HANDSHAKE_TIMEOUT:
+			throw RcpTimeoutException("requested timeout is over");
+		case HANDSHAKE_CANCELLED:
+			throw RcpInterruptedException("function call was cancelled");
+		default:
+			throw RcpNetworkException("remote peer did not respond");
 	}
 }
 
 
-// ISSUE:
-// This doesn't push pending reliable packets, just kills the connection. Not really good...
-void RcpSocket::disconnect1() {
-	// This whole method is only to be performed when state is CONNECTED.
-	// However, on must still call disconnect if the other peer cancelled the connection.
-	// In this case, the socket falls into CLOSING state. All communication is ceased, but
-	// the internal structure remains intact, holding pending messages.
-	// This is to allow receiving pending messages even if the connection is dead by then.
-	if (state == CLOSING) {
-		reset();
-		state = CLOSED;
-		return;
+void RcpSocket::disconnectAsync(CloseHandler handler) {
+	// Abort the handshake, unless it has just finished.
+	if (isConnecting()) {
+		stopIoThread();
 	}
-	// Closing state is handled above. If that was not the case, but CONNECTED instead,
-	// go on with the method.
-	if (state != CONNECTED) {
-		return;
-	}
-
-	// stop io thread
-	stopIoThread();
 
-	// try to push pending reliable packets
-	// WARNING: this loop has not been tested, and is not expected to work!
-	while (recentPackets.size() > 0) {
-		// set to true if timeout is fatal
-		bool timedOut = false;
-
-		// select the one with shortest expiration
-		RecentPacketInfo* resendThis = nullptr;
-		auto now = steady_clock::now();
-		microseconds sleepTime(2 * TIMEOUT_TOTAL * 1000);
-		for (auto& v : recentPackets) {
-			microseconds timeRemainingTotal = duration_cast<microseconds>(v.second.send - now + chrono::milliseconds(TIMEOUT_SHORT));
-			microseconds timeRemainingResend = duration_cast<microseconds>(v.second.lastResend - now + chrono::milliseconds(TIMEOUT_SHORT));
-			if (timeRemainingTotal < sleepTime) {
-				timedOut = true;
-				sleepTime = timeRemainingTotal;
-				resendThis = &v.second;
-			}
-			if (timeRemainingResend < sleepTime) {
-				timedOut = false;
-				sleepTime = timeRemainingResend;
-				resendThis = &v.second;
-			}
-		}
-
-		// try to receive
-		if (!selector.wait(sf::microseconds(sleepTime.count()))) {
-			if (timedOut) {
-				// connection timed out: reset socket
-				reset();
-				state = CLOSED;
-				return;
+	std::unique_lock<std::mutex> lk(socketMutex);
+	switch (state) {
+		case CONNECTED: {
+			// the IO thread delivers pending reliable packets, then performs the closing procedure
+			state = FIN_WAIT;
+			closeDeadline = clock->now() + milliseconds(linger);
+			closeResult = CLOSE_PENDING;
+			closeHandler = std::move(handler);
+			notifyReceivers();
+			if (runIoThread) {
+				wakeIoThread();
 			}
 			else {
-				// just resend that packet
-				auto rawData = makePacket(resendThis->header, resendThis->data.data(), resendThis->data.size());
-				socket.send(rawData.data(), rawData.size(), remoteAddress, remotePort);
+				// the handshake completed just as it was stopped
+				lk.unlock();
+				startIoThread();
 			}
+			return;
 		}
-		else {
-			// decode packet and erase if it matches any pending packet
-			sf::Packet packet;
-			sf::IpAddress responseAddress;
-			uint16_t responsePort;
-			socket.receive(packet, responseAddress, responsePort);
-			RcpHeader header;
-			if (responseAddress == remoteAddress && remotePort == responsePort && header.deserialize(packet.getData(), packet.getDataSize())) {
-				RecentPacketMapT::iterator it;
-				if (header.flags == ACK && (it = recentPackets.find(header.batchNumber)) != recentPackets.end()) {
-					recentPackets.erase(it);
-				}
+		case CLOSE_WAIT:
+		case FIN_WAIT: {
+			// already closing in the background, the handler is notified along with the others
+			if (handler && closeHandler) {
+				CloseHandler first = std::move(closeHandler);
+				closeHandler = [first, handler](eCloseResult result) {
+					first(result);
+					handler(result);
+				};
 			}
+			else if (handler) {
+				closeHandler = std::move(handler);
+			}
+			closeResult = CLOSE_PENDING;
+			return;
 		}
-	}
-
-	// perform closing procedure
-	// - send FIN
-	// - wait for FIN/ACK
-	// - send ACK and hope the server gets it
-	RcpHeader header;
-	std::array<uint8_t, 12> headerSer;
-	sf::Packet packet;
-	sf::IpAddress responseAddress;
-	uint16_t responsePort;
-
-	// - send FIN and wait for FIN/ACK
-	header.sequenceNumber = localSeqNum++;
-	header.batchNumber = localBatchNum;
-	header.flags = FIN;
-
-	headerSer = header.serialize();
-
-	long long waitTotal = 0;
-	bool finAckownledged = false;
-	while (!finAckownledged) {
-		// repeatedly send FIN until it's answered
-		do {
-			socket.send(headerSer.data(), headerSer.size(), remoteAddress, remotePort);
-			debugPrintMsg(header, SEND); // DEBUG
-			waitTotal += TIMEOUT_SHORT;
-		} while (waitTotal <= TIMEOUT_TOTAL && !selector.wait(sf::milliseconds(TIMEOUT_SHORT)));
-
-		// look what we received
-		if (sf::UdpSocket::Done != socket.receive(packet, responseAddress, responsePort)) {
-			// nothing received
+		case CLOSING: {
+			// The other peer has closed the connection, and the socket only kept
+			// pending messages to be received. Nothing is left to do in the background.
+			reset();
+			state = CLOSED;
+			closeResult = CLOSE_GRACEFUL;
 			break;
 		}
-		else if (responseAddress != remoteAddress || responsePort != remotePort || packet.getDataSize() < 12) {
-			// invalid remote address
-			continue;
-		}
-		else {
-			// valid packet received
-			header.deserialize(packet.getData(), packet.getDataSize());
-			debugPrintMsg(header, RECV);
-			if (header.flags & (FIN | ACK)) {
-				finAckownledged = true;
-
-				// - Send back ACK for FIN/ACK
-				header.sequenceNumber = localSeqNum++;
-				header.batchNumber = localBatchNum;
-				header.flags = ACK;
-				headerSer = header.serialize();
-				socket.send(headerSer.data(), headerSer.size(), remoteAddress, remotePort);
-				debugPrintMsg(header, SEND);
-			}
-		}
+		default:
+			break;
 	}
 
+	eCloseResult result = closeResult;
+	lk.unlock();
+	if (handler) {
+		handler(result);
+	}
+}
 
-	// set disconnected state
-	reset();
-	state = CLOSED;
-
-	// interrupt pending receives
-	recvCondvar.notify_all();
+auto RcpSocket::waitDisconnect(int timeout) -> eCloseResult {
+	RcpClock::Participant participant(*clock);
+	std::unique_lock<std::mutex> lk(socketMutex);
+	auto deadline = timeout == std::numeric_limits<int>::max() ? RcpClock::time_point::max() : clock->now() + milliseconds(timeout);
+	clock->waitUntil(lk, closeCondvar, deadline, [this] { return closeResult != CLOSE_PENDING; });
+	return closeResult;
 }
 
 
@@ -495,58 +476,97 @@ void RcpSocket::send(const void * data, size_t size, bool reliable) {
 	return sendEx(data, size, reliable ? (uint32_t)REL : 0);
 }
 
+void RcpSocket::send(const void* data, size_t size, bool reliable, uint8_t dscp) {
+	return sendEx(data, size, reliable ? (uint32_t)REL : 0, dscp);
+}
+
 void RcpSocket::send(RcpPacket& packet) {
 	return send(packet.getData(), packet.getDataSize(), packet.isReliable());
 }
 
+void RcpSocket::sendAt(const void* data, size_t size, bool reliable, RcpClock::time_point launchTime) {
+	return sendEx(data, size, reliable ? (uint32_t)REL : 0, -1, launchTime);
+}
+
 // data does NOT include header
-void RcpSocket::sendEx(const void* data, size_t size, uint32_t flags) {
+void RcpSocket::sendEx(const void* data, size_t size, uint32_t flags, int dscp, RcpClock::time_point launchTime) {
 	// check errors
 	if (state != CONNECTED) {
 		throw RcpInvalidCallException("socket must be connected to send");
 	}
+	if (size > (size_t)MaxDatagramSize) {
+		throw RcpInvalidArgumentException("message is larger than MaxDatagramSize");
+	}
+	// the peer would give up on a reliable message this late
+	if (launchTime > clock->now() + milliseconds(TIMEOUT_TOTAL)) {
+		throw RcpInvalidArgumentException("launch time is further than the total timeout");
+	}
+	// a reliable message is kept until it's acknowledged, it must fit in the budget
+	if ((flags & REL) != 0 && isOverBudget(size)) {
+		throw RcpBudgetException("memory budget of the connection is used up, wait for the peer to acknowledge");
+	}
 	// create socket header + data block
 	RcpHeader header;
-	header.sequenceNumber = ++localSeqNum;
-	header.batchNumber = (flags & REL) ? ++localBatchNum : localBatchNum;
+	uint64_t batchNum = (flags & REL) ? ++localBatchNum : localBatchNum;
+	header.sequenceNumber = (uint32_t)++localSeqNum;
+	header.batchNumber = (uint32_t)batchNum;
 	header.flags = flags;
 
-	auto rawData = makePacket(header, data, size);
-	if (rawData.size() > sf::UdpSocket::MaxDatagramSize) {
-		false;
-	}
-
 	// only one thread can access the socket and other variables at the same time
 	std::lock_guard<std::mutex> lk(socketMutex);
 
-	// send data on socket
-	auto sfStatus = socket.send(rawData.data(), rawData.size(), remoteAddress, remotePort);
+	// send data on socket, or schedule it
+	makePacket(header, data, size, sendBuffer);
+	auto sendTime = clock->now();
+	bool isSent;
+	if (launchTime <= sendTime) {
+		isSent = sendDatagram(sendBuffer, dscp);
+	}
+	else if (kernelPacing) {
+		isSent = sendDatagram(sendBuffer, dscp, launchTime);
+		sendTime = launchTime;
+	}
+	else {
+		// the IO thread sends it, wake it up if it's sleeping past the launch time
+		isSent = sendBuffer.size() <= sf::UdpSocket::MaxDatagramSize;
+		if (isSent) {
+			session->scheduled.insert(ScheduledMapT::value_type(
+				launchTime,
+				{ { sendBuffer.begin(), sendBuffer.end(), RcpArenaAllocator<uint8_t>(arena) }, dscp })
+				);
+			if (session->scheduled.begin()->first == launchTime) {
+				wakeIoThread();
+			}
+		}
+		sendTime = launchTime;
+	}
 	debugPrintMsg(header, SEND); // DEBUG
-	if (sfStatus != sf::Socket::Done) {
+	if (!isSent) {
 		throw RcpInvalidArgumentException("packet could not be sent, might be to big");
 	}
 
-	// add packet to list of ack waiting packets
-	auto sendTime = steady_clock::now();
+	// add packet to list of ack waiting packets, from the time it goes out
 	if ((flags & REL) != 0) {
-		recentPackets.insert(RecentPacketMapT::value_type(
-			header.batchNumber,
-			{ header, std::vector<uint8_t>((const char*)data, size + (const char*)data), sendTime, sendTime })
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		session->recentPackets.insert(RecentPacketMapT::value_type(
+			batchNum,
+			{ header, { bytes, bytes + size, RcpArenaAllocator<uint8_t>(arena) }, sendTime, sendTime, dscp })
 			);
 	}
 
 	// set last sending time to manage timeouts
-	timeLastSend = steady_clock::now();
+	timeLastSend = clock->now();
 }
 
 
 bool RcpSocket::receive(RcpPacket& packet, int timeout) {
 	cancelCallId++;
 
-	// check errors
-	if (state != CONNECTED && state != CLOSING) {
+	// check errors, packets received before the remote peer's FIN can still be taken
+	if (state != CONNECTED && state != CLOSE_WAIT && state != CLOSING) {
 		throw RcpInvalidCallException("socket must be connected to receive");
 	}
+	RcpClock::Participant participant(*clock);
 
 	// wait for packet queue to have data
 
@@ -563,7 +583,7 @@ bool RcpSocket::receive(RcpPacket& packet, int timeout) {
 	};
 	atomic<eReasonForWakeUp> reasonForWakeUp;
 	auto NotifyPredicate = [this, &reasonForWakeUp] {
-		if (recvQueue.size() > 0 && recvQueue.front().second == true) {
+		if (session->recvQueue.size() > 0 && session->recvQueue.front().second == true) {
 			// there's a valid incoming packet
 			reasonForWakeUp = AVAILABLE_DATA;
 			return true;
@@ -573,7 +593,7 @@ bool RcpSocket::receive(RcpPacket& packet, int timeout) {
 			reasonForWakeUp = CANCELLED;
 			return true;
 		}
-		else if (recvQueue.size() == 0 && state != CONNECTED) {
+		else if (session->recvQueue.size() == 0 && state != CONNECTED) {
 			// connection is closing, but there's no data
 			reasonForWakeUp = CONNECTION_CLOSING;
 			return true;
@@ -584,7 +604,7 @@ bool RcpSocket::receive(RcpPacket& packet, int timeout) {
 	};
 
 	if (isBlocking) {
-		if (!recvCondvar.wait_for(lk, milliseconds(timeout), NotifyPredicate)) {
+		if (!clock->waitUntil(lk, recvCondvar, clock->now() + milliseconds(timeout), NotifyPredicate)) {
 			return false;
 		}
 		switch (reasonForWakeUp) {
@@ -598,7 +618,7 @@ bool RcpSocket::receive(RcpPacket& packet, int timeout) {
 		}
 	}
 	else {
-		isData = (recvQueue.size() > 0 && recvQueue.front().second == true);
+		isData = (session->recvQueue.size() > 0 && session->recvQueue.front().second == true);
 	}
 
 	if (!isData) {
@@ -606,16 +626,21 @@ bool RcpSocket::receive(RcpPacket& packet, int timeout) {
 	}
 
 	// now we have the mutex again, modifying queue is safe
-	assert(recvQueue.size() > 0); // failure means a bug in code, as this should never happen
-	packet = recvQueue.front().first;
-	recvQueue.pop();
+	assert(session->recvQueue.size() > 0); // failure means a bug in code, as this should never happen
+	packet = session->recvQueue.front().first;
+	packet.deliveryTime = clock->now();
+	arena.discharge(packet.getDataSize());
+	if (packetPool.size() < packetPool.capacity()) {
+		packetPool.push_back(std::move(session->recvQueue.front().first));
+	}
+	session->recvQueue.pop();
 
 	// this seems like utter bullshit, but it looks so confident I dare only comment it
 	// remove packet from reserved list if it's contained
 	// recvReserved.erase(packet.sequenceNumber);
 
 	// decrease all indices of reserved spaces
-	for (auto& it : recvReserved) {
+	for (auto& it : session->recvReserved) {
 		it.second.index--;
 	}
 
@@ -631,39 +656,138 @@ void RcpSocket::startIoThread() {
 		ioThread.join();
 	}
 	runIoThread = true;
-	ioThread = std::thread([this] {
+	isIoThreadDone = false;
+
+	// new session, the old peer's clock and link are no longer relevant
+	clockSync.reset();
+	timeLastSync = steady_clock::time_point();
+	linkQuality.reset();
+
+	// a simulated clock must not move on before the IO thread takes part
+	std::promise<void> started;
+	std::future<void> isStarted = started.get_future();
+	ioThread = std::thread([this, &started] {
+		RcpClock::Participant participant(*clock);
+		started.set_value();
+
+		// finish connecting first, if the socket is not connected yet
+		if (isConnecting()) {
+			eHandshakeResult result = handshakeFunction();
+			HandshakeHandler handler;
+			{
+				lock_guard<mutex> lk(socketMutex);
+				if (result == HANDSHAKE_SUCCESS) {
+					timeLastSend = clock->now();
+				}
+				else {
+					state = CLOSED;
+					runIoThread = false;
+				}
+				handshakeResult = result;
+				std::swap(handler, handshakeHandler);
+				handshakeCondvar.notify_all();
+				clock->notify();
+			}
+			if (handler) {
+				handler(result);
+			}
+		}
+
 		// ioThreadFunction returns true if it got a FIN, false otherwise
-		if (ioThreadFunction()) {
+		eCloseResult closed = CLOSE_PENDING;
+		bool isSession = state == CONNECTED || state == FIN_WAIT;
+		if (isSession && ioThreadFunction()) {
 			replyClose();
 
-			// clean up message queue
 			lock_guard<mutex> lk(socketMutex);
+			if (closeResult == CLOSE_PENDING) {
+				// disconnect has been called meanwhile, nothing is to be received anymore
+				closed = session->recentPackets.empty() ? CLOSE_GRACEFUL : CLOSE_FAILED;
+			}
+			else {
+				// clean up message queue, pending packets can still be received
+				state = CLOSING;
 
-			decltype(recvQueue) cleanRecvQueue;
-			while (recvQueue.size() > 0) {
-				if (recvQueue.front().second == true) {
-					cleanRecvQueue.push(std::move(recvQueue.front()));
+				RecvQueueT cleanRecvQueue{ RecvQueueT::container_type(RcpArenaAllocator<RecvQueueT::value_type>(arena)) };
+				while (session->recvQueue.size() > 0) {
+					if (session->recvQueue.front().second == true) {
+						cleanRecvQueue.push(std::move(session->recvQueue.front()));
+					}
+					session->recvQueue.pop();
 				}
-				recvQueue.pop();
+				session->recvQueue = std::move(cleanRecvQueue);
+
+				// notify receive calls
+				notifyReceivers();
 			}
-			recvQueue = std::move(cleanRecvQueue);
+		}
+		else if (isSession && state == FIN_WAIT && runIoThread) {
+			// pending packets are delivered, or the linger time is over
+			bool isFlushed;
+			{
+				lock_guard<mutex> lk(socketMutex);
+				isFlushed = session->recentPackets.empty();
+			}
+			closed = closeFunction(isFlushed);
+		}
+		else if (isSession && closeResult == CLOSE_PENDING) {
+			// lost the connection while closing
+			closed = state == FIN_WAIT ? CLOSE_TIMEOUT : CLOSE_FAILED;
+		}
 
-			// notify receive calls
-			recvCondvar.notify_all();
+		// release resources of the closed connection
+		if (closed != CLOSE_PENDING) {
+			CloseHandler handler;
+			{
+				lock_guard<mutex> lk(socketMutex);
+				reset();
+				state = CLOSED;
+				closeResult = closed;
+				std::swap(handler, closeHandler);
+				closeCondvar.notify_all();
+				notifyReceivers();
+			}
+			if (handler) {
+				handler(closed);
+			}
 		}
 
 		runIoThread = false;
+		lock_guard<mutex> lk(socketMutex);
+		isIoThreadDone = true;
+		ioThreadCondvar.notify_all();
+		clock->notify();
 	});
+	isStarted.wait();
 }
 
 
 void RcpSocket::stopIoThread() {
 	runIoThread = false;
+	// the IO thread notices within a wait on the clock, which may be a simulated one
+	joinIoThread();
+}
+
+void RcpSocket::joinIoThread() {
+	{
+		unique_lock<mutex> lk(socketMutex);
+		clock->waitUntil(lk, ioThreadCondvar, RcpClock::time_point::max(), [this] { return isIoThreadDone; });
+	}
 	if (ioThread.joinable()) {
 		ioThread.join();
 	}
 }
 
+void RcpSocket::wakeIoThread() {
+	// a cancel packet to self, which is otherwise ignored while connected
+	RcpHeader header;
+	header.sequenceNumber = cancelCallId;
+	header.batchNumber = cancelCallId;
+	header.flags = CANCEL;
+	auto rawData = header.serialize();
+	transport->send(rawData.data(), rawData.size(), sf::IpAddress::LocalHost, getLocalPort());
+}
+
 bool RcpSocket::ioThreadFunction() {
 	// This function in brief:
 	// 1. Select the event closest in time, and wait that time
@@ -673,13 +797,24 @@ bool RcpSocket::ioThreadFunction() {
 	//			- [3] Check outbound rel. packets without remote's acknowledgement -> lost connection
 	//			- [4] Keep connection alive (timeLastSend) -> send a keepalive
 	//			- [5] Total timeout (connection not kept alive by remote) -> lost connection
+	//			- [6] Sample remote peer's clock (timeLastSync) -> send a clock sync request
+	//			- [7] Linger time of closing (closeDeadline) -> stop
+	//			- [8] Launch time of a scheduled message -> send it
 	// 2.1. Process incoming message if wait was interrupted
 	//			- pump the incoming message to the queue
 	// 2.2. Act according to what event timed out 
 
-	timeLastreceived = steady_clock::now();
+	timeLastreceived = clock->now();
 
 	while (runIoThread) {
+		// When closing, stop as soon as all reliable packets are acknowledged
+		if (state == FIN_WAIT) {
+			std::lock_guard<std::mutex> lk(socketMutex);
+			if (session->recentPackets.empty() || clock->now() >= closeDeadline) {
+				return false;
+			}
+		}
+
 		// ------------------------------------ //
 		// --- Select event closest in time --- //
 		// ------------------------------------ //
@@ -696,7 +831,8 @@ bool RcpSocket::ioThreadFunction() {
 		usSleep = std::max(usSleep, 1ll); // for SFML, 0 means infinity, hence the "1"
 
 		// Wait on the socket for incoming UDP traffic
-		bool isData = selector.wait(sf::microseconds(usSleep));
+		bool isData = transport->wait(microseconds(usSleep));
+		linkQuality.update(clock->now()); // estimates go on in silence as well
 
 		// ------------------------------------- //
 		// --- Process incoming data, if any --- //
@@ -705,33 +841,51 @@ bool RcpSocket::ioThreadFunction() {
 		// No data, perform timeout action described above
 		if (!isData) {
 			std::lock_guard<std::mutex> lk(socketMutex); // lock mutex (guarded)
+			RcpRealTime::NoAllocationScope noAllocation(realTime && state == CONNECTED);
 
 			switch (eventType)
 			{
 				case RELOOP:
 					continue;
 				case ACK_RESEND: {
-					// don't use the send function: it cannot lock the mutex, performs other unneeded stuff, etc...
-					auto rawData = makePacket(eventArgs.resendInfo->header, eventArgs.resendInfo->data.data(), eventArgs.resendInfo->data.size());
-					socket.send(rawData.data(), rawData.size(), remoteAddress, remotePort);
-					debugPrintMsg(eventArgs.resendInfo->header, SEND); // DEBUG
-					timeLastSend = steady_clock::now();
-					eventArgs.resendInfo->lastResend = timeLastSend;
+					auto now = clock->now();
+					microseconds pacing(retransmitPacing);
+					if (kernelPacing && pacing.count() > 0) {
+						// all that are due go to the transport at once, spaced by the pacing interval
+						auto launchTime = std::max(now, nextRetransmit);
+						for (auto& item : session->recentPackets) {
+							if (item.second.lastResend + milliseconds(TIMEOUT_SHORT) <= now) {
+								resendPacket(item.second, launchTime);
+								launchTime += pacing;
+							}
+						}
+						nextRetransmit = launchTime;
+					}
+					else {
+						resendPacket(*eventArgs.resendInfo, now);
+						nextRetransmit = now + pacing;
+					}
+					break;
+				}
+				case SCHEDULED_SEND: {
+					sendScheduled();
 					break;
 				}
 				case KEEPALIVE: {
 					RcpHeader header;
-					header.sequenceNumber = localSeqNum;
-					header.batchNumber = localBatchNum;
+					header.sequenceNumber = (uint32_t)localSeqNum;
+					header.batchNumber = (uint32_t)localBatchNum;
 					header.flags = KEP;
 					localSeqNum++;
-					auto hseq = header.serialize();
-					socket.send(hseq.data(), hseq.size(), remoteAddress, remotePort);
-					debugPrintMsg(header, SEND); // DEBUG
-					timeLastSend = steady_clock::now();
+					sendHeader(header);
+					timeLastSend = clock->now();
 
 					break;
 				}
+				case CLOCK_SYNC: {
+					sendClockSyncRequest();
+					break;
+				}
 				case RESERVE_TIMEOUT:
 				case ACK_TIMEOUT:
 				case RECV_TIMEOUT: {
@@ -746,24 +900,36 @@ bool RcpSocket::ioThreadFunction() {
 		else {
 			// lock mutex (guarded)
 			std::lock_guard<std::mutex> lk(socketMutex);
+			RcpRealTime::NoAllocationScope noAllocation(realTime && state == CONNECTED);
+
+			// a busy link would keep the scheduled datagrams waiting
+			sendScheduled();
 
 			// extract data from socket
-			sf::Packet rawPacket;
+			sf::Packet& rawPacket = receiveBuffer;
 			sf::IpAddress sender;
 			uint16_t senderPort;
-			socket.receive(rawPacket, sender, senderPort);
+			transport->receive(rawPacket, sender, senderPort);
+			auto receiveTime = clock->now();
+			checkReceiveDrops(receiveTime);
 
 			// extract rcp header and payload from packet
 			RcpHeader header;
-			RcpPacket packet;
+			RcpPacket& packet = receivePacket;
 			bool isValid = decodeDatagram(rawPacket, sender, senderPort, header, packet);
 			debugPrintMsg(header, RECV);
 			if (!isValid) {
 				continue;
 			}
+			packet.receiveTime = receiveTime;
 
 			// set time of last valid packet
-			timeLastreceived = steady_clock::now();
+			timeLastreceived = clock->now();
+
+			// the packets having sequence numbers of their own tell about loss and reordering
+			if (header.flags == 0 || header.flags == REL || header.flags == KEP || header.flags == TIM) {
+				linkQuality.addReceived(packet.sequenceNumber, rawPacket.getDataSize(), receiveTime);
+			}
 
 			// handle special packets
 			switch (header.flags) {
@@ -772,32 +938,62 @@ bool RcpSocket::ioThreadFunction() {
 				}
 				case ACK: {
 					// remove the packet from the recent ack list
-					auto it = recentPackets.find(header.batchNumber); // ack packets batch number contains the acknowledged packet's b.n.
-					if (it != recentPackets.end()) {
-						recentPackets.erase(it);
+					// ack packets batch number contains the acknowledged packet's b.n.
+					auto it = session->recentPackets.find(RcpSerialNumber::extend(header.batchNumber, localBatchNum));
+					if (it != session->recentPackets.end()) {
+						// the round trip is ambiguous if the packet was resent (Karn's algorithm)
+						if (it->second.lastResend == it->second.send) {
+							linkQuality.addRoundTrip(receiveTime - it->second.send, receiveTime);
+						}
+						linkQuality.addDelivered(it->second.data.size(), receiveTime);
+						session->recentPackets.erase(it);
 					}
 
 					continue;
 				}
 				case REL: {
+					// over the budget, a new message is left unacknowledged, the peer resends it later
+					// duplicates are acknowledged still, the peer may have missed the first ACK
+					if (isOverBudget(packet.getDataSize()) && RcpSerialNumber::extend(header.batchNumber, remoteBatchNumReserved) > remoteBatchNumReserved) {
+						continue;
+					}
+
 					// send an acknowledgement
 					RcpHeader ackHeader;
 					ackHeader.sequenceNumber = header.sequenceNumber;
 					ackHeader.batchNumber = header.batchNumber;
 					ackHeader.flags = ACK;
-					auto ackData = ackHeader.serialize();
-					socket.send(ackData.data(), ackData.size(), remoteAddress, remotePort);
-					debugPrintMsg(ackHeader, SEND);
+					sendHeader(ackHeader);
 
 					break;
 				}
-				case FIN: {
-					state = CLOSE_WAIT;
-					return true;
+				case FIN: {
+					state = CLOSE_WAIT;
+					return true;
+				}
+				case TIM: {
+					replyClockSync(header, packet);
+					continue;
+				}
+				case TIM | ACK: {
+					processClockSyncReply(packet);
+					continue;
+				}
+				case SYN | ACK: {
+					// the remote peer is still waiting for the handshake's last ACK
+					if (handshakePacket.flags == ACK) {
+						transport->send(handshakeDatagram.data(), handshakeDatagram.size(), remoteAddress, remotePort);
+						debugPrintMsg(handshakePacket, SEND);
+					}
+					continue;
 				}
 				case CANCEL:
 					continue;
 				case 0: {
+					// unreliable messages are dropped over the budget
+					if (isOverBudget(packet.getDataSize())) {
+						continue;
+					}
 					break;
 				}
 				default:
@@ -805,22 +1001,25 @@ bool RcpSocket::ioThreadFunction() {
 			}
 
 			// reserve spaces in queue if batch number references a late packet
-			long long numSpacesReserve = (long long)header.batchNumber - (long long)remoteBatchNumReserved;
+			uint64_t batchNum = RcpSerialNumber::extend(header.batchNumber, remoteBatchNumReserved);
+			uint64_t seqNum = RcpSerialNumber::extend(header.sequenceNumber, remoteSeqNum);
+			long long numSpacesReserve = (long long)(batchNum - remoteBatchNumReserved);
 			for (long long i = 0; i < numSpacesReserve; ++i) {
 				remoteBatchNumReserved++;
-				recvReserved.insert({ remoteBatchNumReserved,{ recvQueue.size(), steady_clock::now() } });
-				recvQueue.push({ RcpPacket(), false });
+				session->recvReserved.insert({ remoteBatchNumReserved,{ session->recvQueue.size(), clock->now() } });
+				session->recvQueue.push({ RcpPacket(), false });
 			}
 
 			// fill space if there's one reserved for this packet
 			// reliable packets always have their space reserved because of the above lines!
 			// if they don't, then they must be duplicates, and will be silently dropped
 			if (header.flags & REL) {
-				auto it = recvReserved.find(header.batchNumber);
-				if (it != recvReserved.end()) {
-					recvQueue[it->second.index].first = std::move(packet); // don't use this packet again; moving for performance reasons
-					recvQueue[it->second.index].second = true;
-					recvReserved.erase(it);
+				auto it = session->recvReserved.find(batchNum);
+				if (it != session->recvReserved.end()) {
+					arena.charge(packet.getDataSize());
+					session->recvQueue[it->second.index].first = std::move(packet); // don't use this packet again; moving for performance reasons
+					session->recvQueue[it->second.index].second = true;
+					session->recvReserved.erase(it);
 				}
 				else {
 					cout << "duplicate: " << header << endl;;
@@ -828,17 +1027,24 @@ bool RcpSocket::ioThreadFunction() {
 				}
 			}
 			else {
-				recvQueue.push({ packet, true });
+				arena.charge(packet.getDataSize());
+				session->recvQueue.push({ std::move(packet), true });
+			}
+
+			// the packet went to the queue, the next one is decoded into a buffer of the pool
+			if (!packetPool.empty()) {
+				receivePacket = std::move(packetPool.back());
+				packetPool.pop_back();
 			}
 
 
 			// set parameters for remote peer
-			remoteSeqNum = std::max(remoteSeqNum, header.sequenceNumber);
-			remoteBatchNum = header.flags & REL ? std::max(remoteBatchNum, header.batchNumber) : remoteBatchNum;
+			remoteSeqNum = std::max(remoteSeqNum, seqNum);
+			remoteBatchNum = header.flags & REL ? std::max(remoteBatchNum, batchNum) : remoteBatchNum;
 
 
 			// unlock mutex (lock_guard) and notify
-			recvCondvar.notify_all();
+			notifyReceivers();
 		}
 	}
 	return false;
@@ -851,19 +1057,152 @@ bool RcpSocket::ioThreadFunction() {
 // Internal helper functions
 
 void RcpSocket::reset() {
-	// reset data structures
-	recvQueue = decltype(recvQueue)();
-	recentPackets.clear();
-	recvReserved.clear();
+	// the buffers of packets not received are kept
+	for (auto& item : session->recvQueue) {
+		if (packetPool.size() < packetPool.capacity() && item.second) {
+			packetPool.push_back(std::move(item.first));
+		}
+	}
+
+	// tear down the session's data structures, and rewind the arena they were in
+	session->~Session();
+	arena.recycle();
+	session = new (&sessionStorage) Session(arena);
+
+	if (realTime) {
+		prepareSession();
+	}
+}
+
+void RcpSocket::prepareSession() {
+	RcpRealTime::AllocationScope allocation; // this is the place for it
+
+	size_t capacity = realTimeCapacity;
+	size_t messageSize = realTimeMessageSize;
+
+	// buffers of datagrams, the largest there can be
+	sendBuffer.reserve(sf::UdpSocket::MaxDatagramSize);
+	sendBuffer.assign(sf::UdpSocket::MaxDatagramSize, 0);
+	RcpRealTime::prefault(sendBuffer.data(), sendBuffer.size());
+	receiveBuffer.clear();
+	receiveBuffer.append(sendBuffer.data(), sendBuffer.size());
+	receiveBuffer.clear();
+	receivePacket.reserve(messageSize);
+
+	// payload buffers of received packets
+	packetPool.reserve(capacity);
+	while (packetPool.size() < capacity) {
+		RcpPacket packet;
+		packet.reserve(messageSize);
+		RcpRealTime::prefault(packet.data, messageSize);
+		packetPool.push_back(std::move(packet));
+	}
+
+	// the arena, with room for the messages waiting for acknowledgement and the bookkeeping
+	arena.reserve(capacity * (messageSize + 256));
+
+	// Fill the containers of the session as far as capacity, and empty them.
+	// The nodes and blocks they need are cut from the arena, and kept on its free lists.
+	// The containers may be in use if the socket is connected, that can do without the warm-up.
+	if (state == CLOSED && session->recvQueue.empty() && session->recentPackets.empty()) {
+		session->recentPackets.reserve(capacity);
+		for (size_t i = 0; i < capacity; ++i) {
+			RecentPacketInfo info{ RcpHeader(), decltype(RecentPacketInfo::data)(RcpArenaAllocator<uint8_t>(arena)), {}, {}, -1 };
+			info.data.reserve(messageSize);
+			session->recentPackets.insert(RecentPacketMapT::value_type(i, std::move(info)));
+			session->recvReserved.insert({ i, { i, {} } });
+			session->recvQueue.push({ RcpPacket(), false });
+		}
+		session->recentPackets.clear();
+		session->recvReserved.clear();
+		while (!session->recvQueue.empty()) {
+			session->recvQueue.pop();
+		}
+
+		// and a pass over the way of a datagram
+		RcpHeader header((uint32_t)localSeqNum, (uint32_t)localBatchNum, REL);
+		makePacket(header, nullptr, 0, sendBuffer);
+		header.deserialize(sendBuffer.data(), sendBuffer.size());
+	}
+	sendBuffer.clear();
+}
+
+bool RcpSocket::isOverBudget(size_t size) const {
+	return arena.isOverBudget(size);
+}
+
+void RcpSocket::notifyReceivers() {
+	recvCondvar.notify_all();
+	clock->notify();
+}
+
+auto RcpSocket::closeFunction(bool isFlushed) -> eCloseResult {
+	// perform closing procedure
+	// - send FIN, repeat it with exponential backoff
+	// - wait for FIN/ACK
+	// - send ACK and hope the peer gets it
+	// If the peer is closing at the same time, it sends a FIN instead of FIN/ACK.
+	// That is answered with FIN/ACK, and the peer's ACK finishes the close as well.
+	RcpHeader finHeader;
+	{
+		std::lock_guard<std::mutex> lk(socketMutex);
+		finHeader = RcpHeader((uint32_t)localSeqNum++, (uint32_t)localBatchNum, FIN);
+	}
+
+	sf::Packet packet;
+	size_t size;
+	sf::IpAddress sender;
+	uint16_t senderPort;
+	RcpHeader header;
+	bool isPeerClosing = false;
+	milliseconds retransmitInterval(TIMEOUT_SHORT);
+	auto now = clock->now();
+	auto retransmitTime = now;
+	while (true) {
+		if (now >= retransmitTime) {
+			sendHeader(finHeader);
+			retransmitTime = now + retransmitInterval;
+			retransmitInterval *= 2;
+		}
+		if (now >= closeDeadline) {
+			return CLOSE_TIMEOUT;
+		}
+
+		auto sleepTime = duration_cast<microseconds>(std::min(retransmitTime, closeDeadline) - now);
+		if (transport->wait(std::max(sleepTime, microseconds(1)))
+			&& transport->receive(packet, sender, senderPort)
+			&& decodeHeader(packet, header)
+			&& sender == remoteAddress && senderPort == remotePort
+			&& openDatagram(packet, size))
+		{
+			debugPrintMsg(header, RECV);
+			eCloseResult result = isFlushed ? CLOSE_GRACEFUL : CLOSE_TIMEOUT;
+			if (header.flags == (FIN | ACK)) {
+				sendHeader(RcpHeader((uint32_t)localSeqNum++, (uint32_t)localBatchNum, ACK));
+				return result;
+			}
+			else if (header.flags == FIN) {
+				sendHeader(RcpHeader((uint32_t)localSeqNum++, (uint32_t)localBatchNum, FIN | ACK));
+				isPeerClosing = true;
+			}
+			else if (header.flags == ACK && isPeerClosing) {
+				return result;
+			}
+			else if (header.flags == REL) {
+				// the peer is still delivering its own packets
+				sendHeader(RcpHeader(header.sequenceNumber, header.batchNumber, ACK));
+			}
+		}
+		now = clock->now();
+	}
 }
 
 void RcpSocket::replyClose() {
 	// assemble FIN/ACK reply packet
 	RcpHeader replyHeader;
 	replyHeader.flags = FIN | ACK;
-	replyHeader.batchNumber = localBatchNum;
-	replyHeader.sequenceNumber = localSeqNum++;
-	auto replyHeaderSer = replyHeader.serialize();
+	replyHeader.batchNumber = (uint32_t)localBatchNum;
+	replyHeader.sequenceNumber = (uint32_t)localSeqNum++;
 
 	// response data
 	sf::Packet packet;
@@ -871,21 +1210,24 @@ void RcpSocket::replyClose() {
 	uint16_t responsePort;
 
 	// start off with a reply, since we just got an ack
-	socket.send(replyHeaderSer.data(), replyHeaderSer.size(), remoteAddress, remotePort);
-	debugPrintMsg(replyHeader, SEND); // DEBUG
+	sendHeader(replyHeader);
 
 	// wait for last ACK response
 	bool isLastFinAcked = false;
 	long long waitTimeout = 0;
 	while (!isLastFinAcked && waitTimeout < TIMEOUT_TOTAL) {
 		// receive a packet
-		if (selector.wait(sf::milliseconds(TIMEOUT_SHORT))) {
-			socket.receive(packet, responseAddress, responsePort);
+		if (transport->wait(milliseconds(TIMEOUT_SHORT))) {
+			transport->receive(packet, responseAddress, responsePort);
 
 			// drop false packets
 			if (responseAddress != remoteAddress || responsePort != remotePort || packet.getDataSize() < 12) {
 				continue;
 			}
+			size_t size;
+			if (!openDatagram(packet, size)) {
+				continue;
+			}
 
 			// reply accordingly
 			RcpHeader header;
@@ -895,8 +1237,7 @@ void RcpSocket::replyClose() {
 				break;
 			}
 			else if (header.flags == FIN) {
-				socket.send(replyHeaderSer.data(), replyHeaderSer.size(), remoteAddress, remotePort);
-				debugPrintMsg(replyHeader, SEND); // DEBUG
+				sendHeader(replyHeader);
 			}
 		}
 		waitTimeout += TIMEOUT_SHORT;
@@ -904,23 +1245,149 @@ void RcpSocket::replyClose() {
 }
 
 
-std::vector<uint8_t> RcpSocket::makePacket(const RcpHeader& header, const void* data, size_t size) {
+// Clock sync packets carry steady clock timestamps as big endian nanoseconds.
+// Request payload: t1. Reply payload: t1, t2, t3.
+static void serializeTimestamp(steady_clock::time_point time, uint8_t* out) {
+	uint64_t value = (uint64_t)duration_cast<nanoseconds>(time.time_since_epoch()).count();
+	for (int i = 7; i >= 0; --i) {
+		out[i] = uint8_t(value);
+		value >>= 8;
+	}
+}
+
+static steady_clock::time_point deserializeTimestamp(const uint8_t* in) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i) {
+		value = (value << 8) | in[i];
+	}
+	return steady_clock::time_point(duration_cast<steady_clock::duration>(nanoseconds((int64_t)value)));
+}
+
+void RcpSocket::sendClockSyncRequest() {
+	RcpHeader header;
+	header.sequenceNumber = (uint32_t)localSeqNum++;
+	header.batchNumber = (uint32_t)localBatchNum;
+	header.flags = TIM;
+
+	uint8_t payload[8];
+	timeLastSync = clock->now();
+	serializeTimestamp(timeLastSync, payload);
+	makePacket(header, payload, sizeof(payload), sendBuffer);
+	transport->send(sendBuffer.data(), sendBuffer.size(), remoteAddress, remotePort);
+	debugPrintMsg(header, SEND); // DEBUG
+	timeLastSend = timeLastSync; // serves as a keepalive as well
+}
+
+void RcpSocket::replyClockSync(const RcpHeader& header, const RcpPacket& packet) {
+	if (packet.getDataSize() < 8) {
+		return;
+	}
+
+	// like ACKs, the reply carries the request's numbers
+	RcpHeader replyHeader;
+	replyHeader.sequenceNumber = header.sequenceNumber;
+	replyHeader.batchNumber = header.batchNumber;
+	replyHeader.flags = TIM | ACK;
+
+	uint8_t payload[24];
+	memcpy(payload, packet.getData(), 8);
+	serializeTimestamp(packet.getReceiveTime(), payload + 8);
+	serializeTimestamp(clock->now(), payload + 16);
+	makePacket(replyHeader, payload, sizeof(payload), sendBuffer);
+	transport->send(sendBuffer.data(), sendBuffer.size(), remoteAddress, remotePort);
+	debugPrintMsg(replyHeader, SEND); // DEBUG
+	timeLastSend = clock->now();
+}
+
+void RcpSocket::processClockSyncReply(const RcpPacket& packet) {
+	if (packet.getDataSize() < 24) {
+		return;
+	}
+	const uint8_t* payload = (const uint8_t*)packet.getData();
+	auto t1 = deserializeTimestamp(payload), t2 = deserializeTimestamp(payload + 8), t3 = deserializeTimestamp(payload + 16), t4 = packet.getReceiveTime();
+	clockSync.addSample(t1, t2, t3, t4);
+	linkQuality.addRoundTrip((t4 - t1) - (t3 - t2), t4);
+}
+
+
+// Tags go over the wire big endian, like the header.
+static void writeBigEndian64(uint64_t value, uint8_t* out) {
+	for (int i = 7; i >= 0; --i) {
+		out[i] = uint8_t(value);
+		value >>= 8;
+	}
+}
+
+static uint64_t readBigEndian64(const uint8_t* in) {
+	uint64_t value = 0;
+	for (int i = 0; i < 8; ++i) {
+		value = (value << 8) | in[i];
+	}
+	return value;
+}
+
+void RcpSocket::makePacket(const RcpHeader& header, const void* data, size_t size, std::vector<uint8_t>& datagram) {
+	// the buffer's capacity is reused
 	auto headerSer = header.serialize();
-	vector<uint8_t> v(size + headerSer.size());
-	memcpy(v.data(), headerSer.data(), headerSer.size());
-	memcpy(v.data() + headerSer.size(), data, size);
-	return v;
+	datagram.resize(size + headerSer.size() + (keys.isAuthenticated ? SealSize : 0));
+	memcpy(datagram.data(), headerSer.data(), headerSer.size());
+	if (size > 0) {
+		memcpy(datagram.data() + headerSer.size(), data, size);
+	}
+	if (keys.isAuthenticated) {
+		datagram.resize(sealDatagram(datagram.data(), size + headerSer.size()));
+	}
+}
+
+
+
+bool RcpSocket::sendDatagram(const std::vector<uint8_t>& rawData, int dscp, RcpClock::time_point launchTime) {
+	if (launchTime != RcpClock::time_point()) {
+		return transport->sendAt(rawData.data(), rawData.size(), remoteAddress, remotePort, dscp < 0 ? trafficClass.load() : (uint8_t)dscp, launchTime);
+	}
+	if (dscp < 0) {
+		return transport->send(rawData.data(), rawData.size(), remoteAddress, remotePort);
+	}
+	return transport->sendMarked(rawData.data(), rawData.size(), remoteAddress, remotePort, (uint8_t)dscp);
+}
+
+void RcpSocket::resendPacket(RecentPacketInfo& info, RcpClock::time_point launchTime) {
+	// don't use the send function: it cannot lock the mutex, performs other unneeded stuff, etc...
+	auto now = clock->now();
+	makePacket(info.header, info.data.data(), info.data.size(), sendBuffer);
+	sendDatagram(sendBuffer, info.dscp, launchTime > now ? launchTime : RcpClock::time_point());
+	debugPrintMsg(info.header, SEND); // DEBUG
+	timeLastSend = now;
+	info.lastResend = std::max(now, launchTime);
 }
 
+void RcpSocket::sendScheduled() {
+	// all that are due, the wait may have been late
+	auto now = clock->now();
+	auto& scheduled = session->scheduled;
+	while (!scheduled.empty() && scheduled.begin()->first <= now) {
+		auto& info = scheduled.begin()->second;
+		sendBuffer.assign(info.data.begin(), info.data.end());
+		sendDatagram(sendBuffer, info.dscp);
+		timeLastSend = now;
+		scheduled.erase(scheduled.begin());
+	}
+}
 
 
-bool RcpSocket::decodeDatagram(const sf::Packet& packet, const sf::IpAddress& sender, uint16_t port, RcpHeader& rcpHeader, RcpPacket& rcpPacket) {
+bool RcpSocket::decodeDatagram(sf::Packet& packet, const sf::IpAddress& sender, uint16_t port, RcpHeader& rcpHeader, RcpPacket& rcpPacket) {
 	// size must be at least 12 to contain the RCP header
-	if (packet.getDataSize() < 12) {
+	size_t size = packet.getDataSize();
+	if (size < 12) {
 		return false;
 	}
 	// sender and port must match remote peer's
-	if (sender != remoteAddress && port != remotePort) {
+	if (sender != remoteAddress || port != remotePort) {
+		return false;
+	}
+	// so must the tag, before anything of the connection is looked at
+	if (!openDatagram(packet, size)) {
+		rejectedCount++;
 		return false;
 	}
 
@@ -928,32 +1395,39 @@ bool RcpSocket::decodeDatagram(const sf::Packet& packet, const sf::IpAddress& se
 	RcpHeader header;
 	header.deserialize(packet.getData(), packet.getDataSize());
 
-	// batch number and sequence number must be within a reasonable range
-	if (header.flags & ACK) {
-		if (abs((ptrdiff_t)localBatchNum - (ptrdiff_t)header.batchNumber) > 1000) {
+	// batch number and sequence number must be within a reasonable range, either way around the wrap
+	// ACKs carry our numbers, except for SYN/ACK
+	if ((header.flags & ACK) && header.flags != (SYN | ACK)) {
+		if (RcpSerialNumber::distance((uint32_t)localBatchNum, header.batchNumber) > SerialWindow) {
 			return false;
 		}
-		if (abs((ptrdiff_t)localSeqNum - (ptrdiff_t)header.sequenceNumber) > 5000) {
+		if (RcpSerialNumber::distance((uint32_t)localSeqNum, header.sequenceNumber) > SerialWindow) {
 			return false;
 		}
 	}
 	else {
-		if (abs((ptrdiff_t)remoteBatchNum - (ptrdiff_t)header.batchNumber) > 1000) {
+		if (RcpSerialNumber::distance((uint32_t)remoteBatchNum, header.batchNumber) > SerialWindow) {
 			return false;
 		}
-		if (abs((ptrdiff_t)remoteSeqNum - (ptrdiff_t)header.sequenceNumber) > 5000) {
+		if (RcpSerialNumber::distance((uint32_t)remoteSeqNum, header.sequenceNumber) > SerialWindow) {
 			return false;
 		}
 	}
 
-	// all fine, get the data and form a packet
-	RcpPacket tmp;
-	tmp.setData((char*)packet.getData() + 12, packet.getDataSize() - 12);
-	tmp.sequenceNumber = header.sequenceNumber;
-	tmp.reliable = (header.flags & REL) != 0;
+	// a copy of an authenticated datagram is just as valid, see SessionKeys, openDatagram checks the counters of encrypted ones
+	if (keys.isAuthenticated && !keys.isEncrypted && (header.flags == 0 || header.flags == KEP || header.flags == TIM)
+		&& !keys.replayWindow.accept(RcpSerialNumber::extend(header.sequenceNumber, remoteSeqNum)))
+	{
+		rejectedCount++;
+		return false;
+	}
+
+	// all fine, get the data and form a packet, in the buffer the packet has
+	rcpPacket.setData((char*)packet.getData() + 12, size - 12);
+	rcpPacket.sequenceNumber = RcpSerialNumber::extend(header.sequenceNumber, remoteSeqNum);
+	rcpPacket.reliable = (header.flags & REL) != 0;
 
 	// set output parameters
-	rcpPacket = std::move(tmp);
 	rcpHeader = header;
 
 	return true;
@@ -965,7 +1439,7 @@ bool RcpSocket::decodeHeader(const sf::Packet& packet, RcpHeader& header) {
 	if (packet.getDataSize() < 12) {
 		return false;
 	}
-	header.deserialize(packet.getData(), packet.getDataSize());
+	return header.deserialize(packet.getData(), packet.getDataSize());
 }
 
 
@@ -973,11 +1447,11 @@ auto RcpSocket::getNextEvent(EventArgs& args) -> eClosestEventType {
 	microseconds eventRemaining(TIMEOUT_SHORT * 1000);
 	eClosestEventType eventType = RELOOP;
 
-	steady_clock::time_point now = steady_clock::now();
+	steady_clock::time_point now = clock->now();
 
 	steady_clock::time_point oldestResend = now;
 	steady_clock::time_point oldestSend = now;
-	uint32_t resendBatchnum = 0; // this reliable packet has to be resent
+	uint64_t resendBatchnum = 0; // this reliable packet has to be resent
 	RecentPacketInfo* resendInfo = nullptr; // information about the packet to be resent
 	bool isAckResend = false; // resend packet waiting for ack
 	bool isAckTimedout = false; // packet waiting for ack timed out
@@ -986,7 +1460,7 @@ auto RcpSocket::getNextEvent(EventArgs& args) -> eClosestEventType {
 	socketMutex.lock();
 
 	// [1] Check if any reliable packet should be resent
-	for (auto item : recentPackets) {
+	for (const auto& item : session->recentPackets) {
 		if (item.second.lastResend <= oldestResend) {
 			oldestResend = item.second.lastResend;
 			resendBatchnum = item.first;
@@ -998,16 +1472,16 @@ auto RcpSocket::getNextEvent(EventArgs& args) -> eClosestEventType {
 		}
 	}
 	if (isAckResend) {
-		auto it = recentPackets.find(resendBatchnum);
+		auto it = session->recentPackets.find(resendBatchnum);
 		resendInfo = &it->second;
-		eventRemaining = duration_cast<microseconds>(oldestResend + milliseconds(TIMEOUT_SHORT) - now);
+		eventRemaining = duration_cast<microseconds>(std::max(oldestResend + milliseconds(TIMEOUT_SHORT), nextRetransmit) - now);
 		eventType = ACK_RESEND;
 	}
 
 	// [2] Check recvQueue reserved places
 	microseconds reservedRemaining(2 * TIMEOUT_TOTAL * 1000);
 	bool isReservedTimeout = false;
-	for (auto it : recvReserved) {
+	for (const auto& it : session->recvReserved) {
 		microseconds rem = duration_cast<microseconds>(it.second.timestamp - now + milliseconds(TIMEOUT_TOTAL));
 		reservedRemaining = duration_cast<milliseconds>(reservedRemaining < rem ? reservedRemaining : rem);
 		isReservedTimeout = true;
@@ -1017,6 +1491,15 @@ auto RcpSocket::getNextEvent(EventArgs& args) -> eClosestEventType {
 		eventType = RESERVE_TIMEOUT;
 	}
 
+	// [8] Send messages scheduled for later
+	if (!session->scheduled.empty()) {
+		microseconds scheduledRemaining = duration_cast<microseconds>(session->scheduled.begin()->first - now);
+		if (scheduledRemaining < eventRemaining) {
+			eventRemaining = scheduledRemaining;
+			eventType = SCHEDULED_SEND;
+		}
+	}
+
 	// unlock mutex
 	socketMutex.unlock();
 
@@ -1041,6 +1524,28 @@ auto RcpSocket::getNextEvent(EventArgs& args) -> eClosestEventType {
 		eventType = RECV_TIMEOUT;
 	}
 
+	// [6] Sample remote peer's clock, more often until the filter fills up
+	unsigned syncInterval = clockSyncInterval;
+	if (syncInterval > 0) {
+		if (clockSync.getSampleCount() < RcpClockSync::FilterSize) {
+			syncInterval = std::max(syncInterval / 8, 1u);
+		}
+		microseconds syncRemaining = duration_cast<microseconds>(timeLastSync + milliseconds(syncInterval) - now);
+		if (syncRemaining < eventRemaining) {
+			eventRemaining = syncRemaining;
+			eventType = CLOCK_SYNC;
+		}
+	}
+
+	// [7] Stop waiting for ACKs when the linger time of closing is over
+	if (state == FIN_WAIT) {
+		microseconds closeRemaining = duration_cast<microseconds>(closeDeadline - now);
+		if (closeRemaining < eventRemaining) {
+			eventRemaining = closeRemaining;
+			eventType = RELOOP;
+		}
+	}
+
 	args.remaining = eventRemaining;
 	args.resendInfo = resendInfo;
 	return eventType;
@@ -1053,274 +1558,307 @@ auto RcpSocket::getNextEvent(EventArgs& args) -> eClosestEventType {
 
 
 ////////////////////////////////////////////////////////////////////////////////
-// New architecture
-
-void RcpSocket::ioThreadFunction2() {
-	switch (state)
-	{
-		case RcpSocket::CLOSED: {
-			break;
-		}
-
-		case RcpSocket::INITIATE: {
-
-		}
-
-		case RcpSocket::SYN_SENT: {
-			sf::Packet packet;
-			sf::IpAddress responseAddress;
-			uint16_t responsePort;
-			RcpHeader header;
-
-			// Flood with SYN until SYN_ACK or SYN or ACK is received.
-			steady_clock::time_point start = steady_clock::now();
-			RcpHeader synHeader{ localSeqNum++, localBatchNum++, eFlags::SYN };
-			auto data = synHeader.serialize();
+// Handshake
+
+const RcpSocket::HandshakeTransition RcpSocket::handshakeTable[] = {
+	// state				incoming		action
+	{ SYN_WAIT,				SYN,			&RcpSocket::onSynReceived },
+	{ SYN_SENT,				SYN | ACK,		&RcpSocket::onSynAck },
+	{ SYN_SENT,				SYN,			&RcpSocket::onSimultaneousSyn },
+	{ SYN_ACK_SENT,			ACK,			&RcpSocket::onAck },
+	{ SYN_ACK_SENT,			SYN,			&RcpSocket::onRepeatedSyn },
+	{ SYN_SIMOULTANEOUS,	SYN | ACK,		&RcpSocket::onSynAck },
+	{ SYN_SIMOULTANEOUS,	ACK,			&RcpSocket::onAck },
+	{ SYN_SIMOULTANEOUS,	SYN,			&RcpSocket::onRepeatedSyn },
+};
+
+
+auto RcpSocket::handshakeFunction() -> eHandshakeResult {
+	sf::Packet packet;
+	sf::IpAddress sender;
+	uint16_t senderPort;
+	RcpHeader header;
 
-			do {
-				if (!socket.send(data.data(), data.size(), remoteAddress, remotePort)) {
-					state = CLOSED;
-					break;
-				}
-				if (selector.wait(sf::milliseconds(TIMEOUT_SHORT))) {
-					// Get and decode the datagram.
-					socket.receive(packet, responseAddress, responsePort);
-					if (!decodeHeader(packet, header) || responseAddress != remoteAddress || responsePort != remotePort) {
-						continue;
-					}
-					// Handle different flags.
-					if (header.flags & CANCEL && cancelCallId == header.sequenceNumber) {
-						state = CLOSED;
-					}
-					else if (header.flags == (SYN|ACK)) {
-						break;
-					}
-					else if (header.flags == SYN) {
-						state = SYN_SIMOULTANEOUS;
-					}
-					else if (header.flags == ACK) {
-						state = SYN_SIMOULTANEOUS_ACKED;
-					}
-				}
-			} while (steady_clock::now() - start > milliseconds(TIMEOUT_TOTAL));
-
-			// Normal connecting procedure.
-			if (header.flags == (SYN | ACK)) {
-				// We're under friendly SYN|ACK flood.
-				// Reply with an ACK for every SYN|ACK.
-				// Wait for 2*TIMEOUT_SHORT of silence to ensure remote peer received our ACK.				
-				bool isData = false;
-				milliseconds waitTime(2 * TIMEOUT_SHORT);
-				steady_clock::time_point totalStart = steady_clock::now();
-				do {
-					auto ackData = RcpHeader{ localSeqNum++, localBatchNum++, ACK }.serialize();
-					socket.send(ackData.data(), ackData.size(), remoteAddress, remotePort);
-					steady_clock::time_point start = steady_clock::now();
-					isData = selector.wait(sf::milliseconds(waitTime.count()));
-					if (isData) {
-						socket.receive(packet, responseAddress, responsePort);
-						RcpHeader nheader;
-						bool isHeaderOk = nheader.deserialize(packet.getData(), packet.getDataSize());
-						if (isHeaderOk
-							&& nheader.flags == SYN | ACK
-							&& responseAddress == remoteAddress
-							&& responsePort == responsePort)
-						{
-							waitTime = milliseconds(2 * TIMEOUT_SHORT);
-						}
-						else if (isHeaderOk && nheader.flags == CANCEL && cancelCallId == nheader.sequenceNumber) {
-							break;
-						}
-						else {
-							// false wake-up packets cause a reduced consequent wait time.
-							waitTime -= duration_cast<milliseconds>(start-steady_clock::now());
-						}
-					}
-				} while (isData && (totalStart - steady_clock::now() < milliseconds(TIMEOUT_TOTAL)));
-				if (!isData) {
-					state = CONNECTED;
-				}
-				else {
-					state = CLOSED;
-				}
+	while (runIoThread) {
+		// check the timers, wake up regularly to see if the thread is stopped
+		microseconds sleepTime(TIMEOUT_SHORT * 1000);
+		{
+			std::lock_guard<std::mutex> lk(socketMutex);
+			auto now = clock->now();
+			if (now >= handshakeDeadline) {
+				return HANDSHAKE_TIMEOUT;
 			}
-			break;
-		}	
-
-		case RcpSocket::SYN_ACK_SENT: {
-			sf::Packet packet;			
-			sf::IpAddress responseAddress;
-			uint16_t responsePort;
-			RcpHeader header{ 0,0,0 };
-
-			// Flood with SYN|ACK until and ACK is received.
-			steady_clock::time_point start = steady_clock::now();
-			RcpHeader synAckHeader{ localSeqNum++, localBatchNum++, eFlags::SYN | eFlags::ACK };
-			auto data = synAckHeader.serialize();
+			sleepTime = std::min(sleepTime, duration_cast<microseconds>(handshakeDeadline - now));
 
-			do {
-				if (!socket.send(data.data(), data.size(), remoteAddress, remotePort)) {
-					state = CLOSED;
-					break;
+			if (state != SYN_WAIT) {
+				if (now >= handshakePhaseDeadline) {
+					return HANDSHAKE_FAILED;
 				}
-				if (selector.wait(sf::milliseconds(TIMEOUT_SHORT))) {
-					// Get and decode the datagram.
-					socket.receive(packet, responseAddress, responsePort);
-					if (!decodeHeader(packet, header) || responseAddress != remoteAddress || responsePort != remotePort) {
-						continue;
-					}
-					// Handle different flags.
-					if (header.flags & CANCEL && cancelCallId == header.sequenceNumber) {
-						state = CLOSED;
-					}
-					else if (header.flags == ACK) {
-						state = CONNECTED;
-					}
+				if (now >= handshakeRetransmitTime) {
+					transport->send(handshakeDatagram.data(), handshakeDatagram.size(), remoteAddress, remotePort);
+					debugPrintMsg(handshakePacket, SEND); // DEBUG
+					handshakeRetransmitInterval *= 2;
+					handshakeRetransmitTime = now + handshakeRetransmitInterval;
 				}
-			} while (steady_clock::now() - start > milliseconds(TIMEOUT_TOTAL));
-
-			break;
-		}
-
-		case RcpSocket::SYN_WAIT: {
-			sf::Packet packet;
-			RcpHeader header;
-			// Wait for an incoming SYN to initiate connection.
-			socket.receive(packet, remoteAddress, remotePort);
-
-			// Decode packet.
-			if (!header.deserialize(packet.getData(), packet.getDataSize())) {
-				state = eState::CLOSED;
-				break;
-			}
-			if (header.flags & eFlags::CANCEL && cancelCallId == header.sequenceNumber) {
-				state = eState::CLOSED;
-				break;
+				sleepTime = std::min(sleepTime, duration_cast<microseconds>(handshakePhaseDeadline - now));
+				sleepTime = std::min(sleepTime, duration_cast<microseconds>(handshakeRetransmitTime - now));
 			}
+		}
 
-			state = eState::SYN_ACK_SENT;
-			break;
+		// wait for a packet
+		if (!transport->wait(std::max(sleepTime, microseconds(1)))) {
+			continue;
 		}
-		case RcpSocket::SYN_SIMOULTANEOUS: {
-			sf::Packet packet;
-			sf::IpAddress responseAddress;
-			uint16_t responsePort;
-			RcpHeader header{ 0,0,0 };
-
-			// We wait for the ACK and keep flooding the remote bitch with SYNs.
-			steady_clock::time_point start = steady_clock::now();
-
-			do {
-				if (selector.wait(sf::milliseconds(TIMEOUT_SHORT))) {
-					socket.receive(packet, responseAddress, responsePort);
-					if (!decodeHeader(packet, header)) {
-						continue;
-					}
-					else if (remotePort = responsePort && remoteAddress == responseAddress && header.flags == ACK) {
-						state = CONNECTED;
-						break;
-					}
-					else if (header.flags & CANCEL && cancelCallId == header.sequenceNumber) {
-						state = CLOSED;
-						break;
-					}
-				}
-				// send another syn
-				auto synData = RcpHeader{ localSeqNum, localBatchNum, SYN }.serialize();
-				socket.send(synData.data(), synData.size(), remoteAddress, remotePort);
-			} while (steady_clock::now() - start < milliseconds(TIMEOUT_TOTAL));
+		transport->receive(packet, sender, senderPort);
+		if (!decodeHeader(packet, header)) {
+			continue;
+		}
+		debugPrintMsg(header, RECV);
 
-			if (state != CONNECTED) {
-				state = CLOSED;
+		if (header.flags == CANCEL) {
+			if (header.sequenceNumber == cancelCallId) {
+				return HANDSHAKE_CANCELLED;
 			}
+			continue;
+		}
 
-			break;
+		// let the state machine handle the packet
+		std::lock_guard<std::mutex> lk(socketMutex);
+		if (state != SYN_WAIT && (sender != remoteAddress || senderPort != remotePort)) {
+			continue;
 		}
-		case RcpSocket::SYN_SIMOULTANEOUS_ACKED: {
-			sf::Packet packet;
-			sf::IpAddress responseAddress;
-			uint16_t responsePort;
-			RcpHeader header{ 0,0,0 };
-
-			steady_clock::time_point totalStart = steady_clock::now();
-			milliseconds waitTime(TIMEOUT_TOTAL);
-
-			// We wait for SYN and reply with ACK.
-						
-
-			// Each ACK must be followed by a 2*TIMEOUT_SHORT wait for another SYN.
-			bool isData = false;
-			waitTime = milliseconds(2 * TIMEOUT_SHORT);
-			
-			do {
-				auto ackData = RcpHeader{ localSeqNum++, localBatchNum++, ACK }.serialize();
-				socket.send(ackData.data(), ackData.size(), remoteAddress, remotePort);
-				steady_clock::time_point start = steady_clock::now();
-				isData = selector.wait(sf::milliseconds(waitTime.count()));
-				if (isData) {
-					socket.receive(packet, responseAddress, responsePort);
-					RcpHeader nheader;
-					bool isHeaderOk = nheader.deserialize(packet.getData(), packet.getDataSize());
-					if (isHeaderOk
-						&& nheader.flags == SYN
-						&& responseAddress == remoteAddress
-						&& responsePort == responsePort)
-					{
-						waitTime = milliseconds(2 * TIMEOUT_SHORT);
-					}
-					else if (isHeaderOk && nheader.flags == CANCEL && cancelCallId == nheader.sequenceNumber) {
-						break;
-					}
-					else {
-						// false wake-up packets cause a reduced consequent wait time.
-						waitTime -= duration_cast<milliseconds>(start - steady_clock::now());
-					}
-				}
-			} while (isData && (totalStart - steady_clock::now() < milliseconds(TIMEOUT_TOTAL)));
-			if (!isData) {
-				state = CONNECTED;
-			}
-			else {
-				state = CLOSED;
+		if (!checkHandshakeAuthentication(packet, header)) {
+			continue;
+		}
+		for (auto& transition : handshakeTable) {
+			if (transition.state == state && transition.flags == header.flags) {
+				state = (this->*transition.action)(header, sender, senderPort);
+				break;
 			}
 		}
+		if (state == CONNECTED) {
+			return HANDSHAKE_SUCCESS;
+		}
+	}
 
-		case RcpSocket::CONNECTED: {
-			break;
+	return HANDSHAKE_CANCELLED;
+}
+
+
+void RcpSocket::sendHandshakePacket(uint32_t flags) {
+	handshakePacket = RcpHeader((uint32_t)localSeqNum++, (uint32_t)localBatchNum, flags);
+
+	// the SYN and SYN/ACK of an authenticated handshake carry the nonce
+	uint8_t nonce[NonceSize];
+	size_t nonceSize = 0;
+	if (authentication && (flags & SYN)) {
+		for (size_t i = 0; i < NonceSize; ++i) {
+			nonce[i] = uint8_t(localNonce >> (8 * (NonceSize - 1 - i)));
 		}
-		case RcpSocket::CLOSE_WAIT:
-			break;
-		case RcpSocket::FIN_WAIT:
-			break;
-		case RcpSocket::CLOSING:
-			break;
-		default:
-			break;
+		nonceSize = NonceSize;
 	}
+	makePacket(handshakePacket, nonce, nonceSize, handshakeDatagram);
+	transport->send(handshakeDatagram.data(), handshakeDatagram.size(), remoteAddress, remotePort);
+	debugPrintMsg(handshakePacket, SEND); // DEBUG
+
+	// the remote peer has TIMEOUT_TOTAL to answer, retransmit until then
+	auto now = clock->now();
+	handshakeRetransmitInterval = milliseconds(TIMEOUT_SHORT);
+	handshakeRetransmitTime = now + handshakeRetransmitInterval;
+	handshakePhaseDeadline = now + milliseconds(TIMEOUT_TOTAL);
+}
+
+
+void RcpSocket::setRemoteSequence(const RcpHeader& header) {
+	remoteSeqNum = RcpSerialNumber::start(header.sequenceNumber);
+	remoteBatchNum = RcpSerialNumber::start(header.batchNumber);
+	remoteBatchNumReserved = remoteBatchNum;
+}
 
 
+auto RcpSocket::onSynReceived(const RcpHeader& header, const sf::IpAddress& sender, uint16_t senderPort) -> eState {
+	// the sender of the first SYN becomes the remote peer
+	remoteAddress = sender;
+	remotePort = senderPort;
+	setRemoteSequence(header);
+	if (authentication) {
+		deriveKeys(remoteNonce);
+	}
+	sendHandshakePacket(SYN | ACK);
+	return SYN_ACK_SENT;
+}
 
 
+auto RcpSocket::onSimultaneousSyn(const RcpHeader& header, const sf::IpAddress& /*sender*/, uint16_t /*senderPort*/) -> eState {
+	// the remote peer is connecting to us too, answer as if we were accepting
+	setRemoteSequence(header);
+	if (authentication) {
+		deriveKeys(remoteNonce);
+	}
+	sendHandshakePacket(SYN | ACK);
+	return SYN_SIMOULTANEOUS;
 }
 
 
+auto RcpSocket::onSynAck(const RcpHeader& header, const sf::IpAddress& /*sender*/, uint16_t /*senderPort*/) -> eState {
+	// if this ACK is lost, the remote peer repeats its SYN/ACK, and the IO thread repeats the ACK
+	setRemoteSequence(header);
+	sendHandshakePacket(ACK);
+	return CONNECTED;
+}
+
 
+auto RcpSocket::onAck(const RcpHeader& header, const sf::IpAddress& /*sender*/, uint16_t /*senderPort*/) -> eState {
+	// must come after the SYN we answered
+	if (header.batchNumber != (uint32_t)remoteBatchNum || !RcpSerialNumber::isNewer(header.sequenceNumber, (uint32_t)remoteSeqNum)) {
+		return state;
+	}
+	setRemoteSequence(header);
+	return CONNECTED;
+}
 
 
+auto RcpSocket::onRepeatedSyn(const RcpHeader& /*header*/, const sf::IpAddress& /*sender*/, uint16_t /*senderPort*/) -> eState {
+	// our SYN/ACK was lost, repeat it without waiting for the retransmission
+	transport->send(handshakeDatagram.data(), handshakeDatagram.size(), remoteAddress, remotePort);
+	debugPrintMsg(handshakePacket, SEND); // DEBUG
+	return state;
+}
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Authentication
+
+void RcpSocket::deriveKeys(uint64_t remoteNonce) {
+	// each direction has its own key, so a datagram can't be reflected to its sender
+	keys.send = RcpSipHash::deriveKey(authenticationSecret, localNonce, remoteNonce);
+	keys.receive = RcpSipHash::deriveKey(authenticationSecret, remoteNonce, localNonce);
+	if (encryption) {
+		for (uint8_t half = 0; half < 2; ++half) {
+			RcpSipHash::Key send = RcpSipHash::deriveKey(authenticationSecret, localNonce, remoteNonce, 1 + half);
+			RcpSipHash::Key receive = RcpSipHash::deriveKey(authenticationSecret, remoteNonce, localNonce, 1 + half);
+			writeBigEndian64(send.k0, keys.cipherSend + 16 * half);
+			writeBigEndian64(send.k1, keys.cipherSend + 16 * half + 8);
+			writeBigEndian64(receive.k0, keys.cipherReceive + 16 * half);
+			writeBigEndian64(receive.k1, keys.cipherReceive + 16 * half + 8);
+		}
+	}
+	keys.isAuthenticated = true;
+	keys.isEncrypted = encryption;
+	keys.replayWindow.reset();
+}
 
 
+bool RcpSocket::checkHandshakeAuthentication(sf::Packet& packet, const RcpHeader& header) {
+	// the nonce of a peer offering authentication is ignored, and our SYN/ACK fails its check
+	if (!authentication) {
+		return true;
+	}
+	const uint8_t* data = static_cast<const uint8_t*>(packet.getData());
+	size_t size = packet.getDataSize();
+	switch (header.flags) {
+		case SYN: {
+			// the first packet, there's no key yet
+			if (size < 12 + NonceSize) {
+				return false;
+			}
+			remoteNonce = readBigEndian64(data + 12);
+			return true;
+		}
+		case SYN | ACK: {
+			// sealed with the keys derived from the nonce in it, the ones of a simultaneous SYN are kept if it's not
+			if (size < 12 + NonceSize || (state != SYN_SENT && state != SYN_SIMOULTANEOUS)) {
+				return false;
+			}
+			SessionKeys previous = keys;
+			uint64_t nonce = readBigEndian64(data + 12);
+			deriveKeys(nonce);
+			if (!openDatagram(packet, size)) {
+				keys = previous;
+				rejectedCount++;
+				return false;
+			}
+			remoteNonce = nonce;
+			return true;
+		}
+		default: {
+			if (!keys.isAuthenticated || !openDatagram(packet, size)) {
+				rejectedCount++;
+				return false;
+			}
+			return true;
+		}
+	}
+}
 
 
+size_t RcpSocket::sealDatagram(uint8_t* datagram, size_t size) {
+	if (!keys.isEncrypted) {
+		writeBigEndian64(RcpSipHash::hash(keys.send, datagram, size), datagram + size);
+		return size + TagSize;
+	}
 
+	// the counter goes in the nonce, it's authenticated by that
+	uint8_t nonce[RcpChaCha20Poly1305::NonceSize] = {};
+	writeBigEndian64(sendCounter++, nonce + 4);
+	memcpy(datagram + size, nonce + 4, CounterSize);
 
+	// the payload of SYN and SYN/ACK is the nonce of the handshake, which must be readable
+	size_t associatedSize = (datagram[11] & SYN) ? size : 12;
+	RcpChaCha20Poly1305::seal(keys.cipherSend, nonce,
+							  datagram, associatedSize,
+							  datagram + associatedSize, size - associatedSize,
+							  datagram + size + CounterSize);
+	return size + SealSize;
+}
 
 
+bool RcpSocket::openDatagram(sf::Packet& packet, size_t& size) {
+	// the received datagram is the socket's own buffer, it's decrypted right there
+	uint8_t* datagram = (uint8_t*)packet.getData();
+	size = packet.getDataSize();
+	if (!keys.isAuthenticated) {
+		return true;
+	}
+	if (!keys.isEncrypted) {
+		if (size < 12 + TagSize) {
+			return false;
+		}
+		size -= TagSize;
+		return RcpSipHash::hash(keys.receive, datagram, size) == readBigEndian64(datagram + size);
+	}
 
+	if (size < 12 + SealSize) {
+		return false;
+	}
+	size -= SealSize;
+	uint8_t nonce[RcpChaCha20Poly1305::NonceSize] = {};
+	memcpy(nonce + 4, datagram + size, CounterSize);
+	size_t associatedSize = (datagram[11] & SYN) ? size : 12;
+	if (!RcpChaCha20Poly1305::open(keys.cipherReceive, nonce,
+								   datagram, associatedSize,
+								   datagram + associatedSize, size - associatedSize,
+								   datagram + size + CounterSize))
+	{
+		return false;
+	}
+	// each counter is taken once, but for the SYN/ACK, which is repeated as it was until our ACK arrives
+	return (datagram[11] & SYN) || keys.replayWindow.accept(readBigEndian64(datagram + size));
+}
 
 
+void RcpSocket::sendHeader(const RcpHeader& header) {
+	uint8_t datagram[12 + SealSize];
+	auto headerSer = header.serialize();
+	memcpy(datagram, headerSer.data(), headerSer.size());
+	size_t size = headerSer.size();
+	if (keys.isAuthenticated) {
+		size = sealDatagram(datagram, size);
+	}
+	transport->send(datagram, size, remoteAddress, remotePort);
+	debugPrintMsg(header, SEND); // DEBUG
+}
 
 
 
@@ -1349,13 +1887,11 @@ std::array<unsigned char, 12> RcpSocket::RcpHeader::serialize() const {
 
 
 bool RcpSocket::RcpHeader::deserialize(const void* data, size_t size) {
-	RcpHeader h;
-	h.sequenceNumber = h.batchNumber = h.flags = 0;
-
 	if (size < 12) {
 		return false;
 	}
 	auto cdata = (unsigned char*)data;
+	sequenceNumber = batchNumber = flags = 0;
 
 	sequenceNumber |= (cdata[0] << 24);
 	sequenceNumber |= (cdata[1] << 16);
@@ -1410,22 +1946,22 @@ std::string RcpSocket::debug_PrintState() {
 	ss << "reserved b.n. = " << remoteBatchNumReserved << std::endl;
 
 	// recv queue
-	ss << "recv queue (" << recvQueue.size() << ") \t\t= {";
-	for (size_t i = 0; i < recvQueue.size(); i++) {
-		ss << (int)recvQueue[i].second << " ";
+	ss << "recv queue (" << session->recvQueue.size() << ") \t\t= {";
+	for (size_t i = 0; i < session->recvQueue.size(); i++) {
+		ss << (int)session->recvQueue[i].second << " ";
 	}
 	ss << "}\n";
 
 	// reserved spaces in queue
-	ss << "reserved places (" << recvReserved.size() << ") \t= {";
-	for (auto it = recvReserved.begin(); it != recvReserved.end(); ++it) {
+	ss << "reserved places (" << session->recvReserved.size() << ") \t= {";
+	for (auto it = session->recvReserved.begin(); it != session->recvReserved.end(); ++it) {
 		ss << it->first << ":" << it->second.index << " ";
 	}
 	ss << "}\n";
 
 	// packets waiting for ack
-	ss << "waiting for ack (" << recentPackets.size() << ") \t= {";
-	for (auto it = recentPackets.begin(); it != recentPackets.end(); ++it) {
+	ss << "waiting for ack (" << session->recentPackets.size() << ") \t= {";
+	for (auto it = session->recentPackets.begin(); it != session->recentPackets.end(); ++it) {
 		ss << it->first << " ";
 	}
 	ss << "}";
@@ -1433,7 +1969,7 @@ std::string RcpSocket::debug_PrintState() {
 	return ss.str();
 }
 
-void RcpSocket::debug_connect(std::string address, uint16_t port) {
+void RcpSocket::debug_connect(std::string address, uint16_t port, uint32_t remoteSequenceNumber, uint32_t remoteBatchNumber) {
 	// only if not connected
 	if (state != CLOSED) {
 		return;
@@ -1444,20 +1980,26 @@ void RcpSocket::debug_connect(std::string address, uint16_t port) {
 	remotePort = port;
 
 	// set local parameters
-	localSeqNum = 0;
-	localBatchNum = 0;
-	remoteSeqNum = 0;
-	remoteBatchNum = 0;
+	localSeqNum = RcpSerialNumber::start(0);
+	localBatchNum = RcpSerialNumber::start(0);
+	remoteSeqNum = RcpSerialNumber::start(remoteSequenceNumber);
+	remoteBatchNum = RcpSerialNumber::start(remoteBatchNumber);
 	remoteBatchNumReserved = remoteBatchNum;
+	keys.isAuthenticated = keys.isEncrypted = false;
 
 	// succesful connection
 	// note that the other party will drop connection soon if he did not receive our last ACK
 	// finalize connection states, fire up IO thread
-	timeLastSend = ::steady_clock::now();
+	timeLastSend = clock->now();
 	state = CONNECTED;
 	startIoThread();
 }
 
+void RcpSocket::debug_setInitialSequence(uint32_t sequenceNumber, uint32_t batchNumber) {
+	initialSeqNum = sequenceNumber;
+	initialBatchNum = batchNumber;
+}
+
 void RcpSocket::debug_kill() {
 	stopIoThread();
 	reset();
@@ -1503,6 +2045,12 @@ std::ostream& operator<<(std::ostream& os, RcpSocket::RcpHeader header) {
 		flags += "FIN";
 		isFirst = false;
 	}
+	if (header.flags & RcpSocket::TIM) {
+		if (!isFirst)
+			flags += " | ";
+		flags += "TIM";
+		isFirst = false;
+	}
 	if (header.flags & RcpSocket::CANCEL) {
 		if (!isFirst)
 			flags += " | ";
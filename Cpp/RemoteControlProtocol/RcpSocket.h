@@ -10,11 +10,26 @@
 #include <atomic>
 #include <unordered_map>
 #include <map>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <type_traits>
 #include "random_access_queue.h"
 
 #include <SFML/Network.hpp>
 
 #include "RcpPacket.h"
+#include "RcpClockSync.h"
+#include "RcpLinkQuality.h"
+#include "RcpArena.h"
+#include "RcpRealTime.h"
+#include "RcpClock.h"
+#include "RcpTransport.h"
+#include "RcpCapture.h"
+#include "RcpSipHash.h"
+#include "RcpChaCha20Poly1305.h"
+#include "RcpSerialNumber.h"
+#include "RcpReplayWindow.h"
 #include "Exception.h"
 
 
@@ -28,8 +43,11 @@
 //	function are done. Nothing unusual.
 //	The second thread is responsible for timing and tasks that need to be performed
 //	even if there's no explicit user interaction (such as keepalives).
-//	This threading scheme comes alive after the connection is established via either
-//	accept or connect, and lives until disconnect is called.
+//	This threading scheme comes alive when accept or connect starts the handshake,
+//	which the second thread performs as well, and lives until the connection is closed.
+//	The blocking accept and connect just wait for the handshake to complete.
+//	Closing happens in the background too: after disconnect, the second thread
+//	still delivers pending reliable packets, then exchanges FINs with the peer.
 //	
 //	*Data flow*
 //	Sending messages is done directly in send, nothing special.
@@ -67,6 +85,7 @@ private:
 		FIN = 4, // no more messages
 		KEP = 8, // keep alive
 		REL = 16, // reliable packet, send back ack
+		TIM = 32, // clock sync request, send back timestamps with TIM | ACK
 		CANCEL = 1u << 31, // special packet used to wake up selectors and cause cancellation of pending operation
 	};
 
@@ -77,6 +96,8 @@ private:
 		KEEPALIVE,
 		RECV_TIMEOUT,
 		RESERVE_TIMEOUT,
+		CLOCK_SYNC,
+		SCHEDULED_SEND,
 		RELOOP,
 	};
 
@@ -89,24 +110,52 @@ private:
 	// Internal states of the socket.
 	enum eState {
 		CLOSED,
-		INITIATE,
-		SYN_SENT,
-		SYN_WAIT,
-		SYN_SIMOULTANEOUS,
-		SYN_SIMOULTANEOUS_ACKED,
+		SYN_SENT, // connecting, waiting for SYN/ACK
+		SYN_WAIT, // accepting, waiting for SYN
+		SYN_SIMOULTANEOUS, // both peers are connecting, waiting for SYN/ACK or ACK
 		CONNECTED,
 		CLOSE_WAIT,
 		FIN_WAIT,
 		CLOSING,
-		SYN_ACK_SENT,
+		SYN_ACK_SENT, // accepting, got SYN, waiting for ACK
 	};
 
 public:
+	/// Outcome of a connection handshake.
+	enum eHandshakeResult {
+		HANDSHAKE_PENDING, // still in progress
+		HANDSHAKE_SUCCESS, // connected
+		HANDSHAKE_TIMEOUT, // the timeout given to accept or connect is over
+		HANDSHAKE_FAILED, // the remote peer stopped responding, or the network failed
+		HANDSHAKE_CANCELLED, // cancel() or disconnect() was called
+	};
+
+	/// Notified on the IO thread when a handshake completes.
+	/// Keep it short, the connection's traffic is not processed meanwhile.
+	/// Must not start another handshake on the same socket.
+	using HandshakeHandler = std::function<void(eHandshakeResult)>;
+
+	/// Outcome of closing a connection.
+	enum eCloseResult {
+		CLOSE_PENDING, // pending reliable packets are being flushed, or the FIN is not answered yet
+		CLOSE_GRACEFUL, // everything was delivered and the remote peer confirmed, or there was nothing to close
+		CLOSE_TIMEOUT, // the linger time is over first, the rest was dropped
+		CLOSE_FAILED, // the remote peer stopped responding
+	};
+
+	/// Notified when a close completes, on the IO thread if it happened in the background.
+	/// Must not start another handshake on the same socket.
+	using CloseHandler = std::function<void(eCloseResult)>;
+
 	static const int AnyPort = 0;
-	static const int MaxDatagramSize = sf::UdpSocket::MaxDatagramSize - 12;
+	/// Largest message that can be sent: a datagram less the header, and the counter and tag of an encrypted one.
+	static const int MaxDatagramSize = sf::UdpSocket::MaxDatagramSize - 12 - 8 - RcpChaCha20Poly1305::TagSize;
 
 	// --- Custructors & Destructor --- //
 	RcpSocket();
+	/// Create a socket on a custom transport and clock, e.g. a simulated network.
+	/// \param clock Must outlive the socket.
+	RcpSocket(std::unique_ptr<RcpTransport> transport, RcpClock& clock = RcpClock::system());
 	RcpSocket(const RcpSocket&) = delete;
 	~RcpSocket();
 
@@ -133,6 +182,9 @@ public:
 	/// Check if the socket is connected.
 	bool isConnected() const;
 
+	/// Check if a handshake is in progress.
+	bool isConnecting() const;
+
 	/// Get IP address of remote peer.
 	std::string getRemoteAddress() const;
 
@@ -168,10 +220,51 @@ public:
 	/// \throws RcpNetworkException Internal network or protocol problem happened.
 	void connect(std::string address, uint16_t port, int timeout = std::numeric_limits<int>::max());
 
-	/// Close current connection.
-	void disconnect() { disconnect1(); }
-	void disconnect1();
-	void disconnect2();
+	/// Start waiting for an incoming connection request, without blocking.
+	/// The handshake runs on the IO thread, completion is reported to handler and waitHandshake().
+	/// \throws RcpInvalidCallException The current state of the socket does not allow calling accept().
+	void acceptAsync(int timeout = std::numeric_limits<int>::max(), HandshakeHandler handler = nullptr);
+
+	/// Start connecting to remote peer, without blocking.
+	/// The handshake runs on the IO thread, completion is reported to handler and waitHandshake().
+	/// If the remote peer connects to this socket at the same time, the two requests make one connection.
+	/// \throws RcpInvalidCallException The current state of the socket does not allow calling connect().
+	void connectAsync(std::string address, uint16_t port, int timeout = std::numeric_limits<int>::max(), HandshakeHandler handler = nullptr);
+
+	/// Wait for the handshake started by acceptAsync() or connectAsync() to complete.
+	/// \return The result of the last handshake, or HANDSHAKE_PENDING if the timeout is over first.
+	eHandshakeResult waitHandshake(int timeout = std::numeric_limits<int>::max());
+
+	/// Close current connection, without blocking.
+	/// Pending reliable packets are delivered, then the FIN exchange is performed on the IO thread,
+	/// for at most the linger time. A new accept or connect waits for this to complete.
+	/// A handshake in progress is cancelled.
+	void disconnect() { disconnectAsync(); }
+
+	/// Close current connection, without blocking.
+	/// \param handler Called when the close completes, right away if there is nothing to do in the background.
+	void disconnectAsync(CloseHandler handler = nullptr);
+
+	/// Wait for the close started by disconnect() to complete.
+	/// \return The result of the last close, or CLOSE_PENDING if the timeout is over first.
+	eCloseResult waitDisconnect(int timeout = std::numeric_limits<int>::max());
+
+	/// Set how long a close may take to deliver pending reliable packets and exchange FINs.
+	/// \param lingerMs 0 sends a single FIN and drops pending packets. Default is the total timeout.
+	void setLinger(unsigned lingerMs);
+
+	/// Get how long a close may take.
+	unsigned getLinger() const;
+
+	// traffic class
+
+	/// Set the DiffServ code point the socket's datagrams are marked with, e.g. RcpTransport::EF for control.
+	/// Applies to everything sent, including acks and keepalives, except messages sent with their own.
+	/// \return False if the transport can't mark datagrams, they are sent unmarked then.
+	bool setTrafficClass(uint8_t dscp);
+
+	/// Get the code point set for the socket. Default is RcpTransport::CS0.
+	uint8_t getTrafficClass() const;
 
 	// --- Traffic --- //
 	/// Send raw packet over network.
@@ -182,6 +275,13 @@ public:
 	/// \throws RcpInvalidArgumentException Could not send the packet over the network, it may have been too large.
 	void send(const void* data, size_t size, bool reliable);
 
+	/// Send raw packet over network, with its own traffic class.
+	/// Retransmissions keep the class, but acks are marked with the socket's.
+	/// \param dscp The DiffServ code point of this message, e.g. RcpTransport::CS1 for bulk.
+	/// \throws RcpInvalidCallException Cannot call send() in the current state of the socket.
+	/// \throws RcpInvalidArgumentException Could not send the packet over the network, it may have been too large.
+	void send(const void* data, size_t size, bool reliable, uint8_t dscp);
+
 	/// Send packet over network.
 	/// \param packet The packet to send.
 	/// \throws RcpInvalidCallException Cannot call send() in the current state of the socket.
@@ -195,69 +295,300 @@ public:
 	/// \throws RcpInterruptedException The function has been cancelled by a cancel() call.
 	bool receive(RcpPacket& packet, int timeout = std::numeric_limits<int>::max());
 	
+	// --- Pacing --- //
+	/// Send raw packet over network at a given time, without waiting for it, e.g. the frames of a periodic stream.
+	/// The message is numbered now: a reliable one holds up the reliable messages sent after it at the receiver.
+	/// \param launchTime When the message goes out, on the socket's clock. In the past, it's sent right away.
+	/// \throws RcpInvalidCallException Cannot call send() in the current state of the socket.
+	/// \throws RcpInvalidArgumentException Could not send the packet, it may have been too large, or
+	///		the launch time is further than the total timeout.
+	void sendAt(const void* data, size_t size, bool reliable, RcpClock::time_point launchTime);
+
+	/// Have the transport release messages sent with sendAt and paced retransmissions at their time.
+	/// The UDP transport uses SO_TXTIME, which needs the fq qdisc on the interface, and the system clock.
+	/// It's precise to microseconds, and the IO thread does not wake up for each datagram.
+	/// \return False if the transport can't, the IO thread paces the datagrams then, as precise as its wakeups.
+	bool setKernelPacing(bool enable);
+	bool isKernelPacing() const;
+
+	/// Space the retransmissions at least interval apart, so that a burst of losses is not resent in a burst.
+	/// \param intervalUs 0 resends each as soon as it's due (default).
+	void setRetransmitPacing(unsigned intervalUs);
+
+
+	// --- Clock synchronization --- //
+	/// Set how often the remote peer's clock is sampled while connected.
+	/// The first few samples are taken at 8 times this rate.
+	/// \param intervalMs Time between two samples, 0 turns sampling off (default).
+	void setClockSyncInterval(unsigned intervalMs);
+
+	/// Get the estimate of the remote peer's clock.
+	/// Use it to convert timestamps the peer sent to local time.
+	const RcpClockSync& getClockSync() const;
+
+	/// Get the clock all timestamps and timeouts of the socket are measured with.
+	RcpClock& getClock() const;
+
+	// --- Link quality --- //
+	/// Get the estimates of loss, reordering, round trip time, jitter and throughput.
+	/// They are updated from the connection's traffic, and reset by a new connection.
+	/// Snapshots can be taken from any thread, thresholds can be set on it to get notified.
+	RcpLinkQuality& getLinkQuality();
+	const RcpLinkQuality& getLinkQuality() const;
+
+	// --- Socket buffers --- //
+	/// Set the size of the transport's OS buffers, in bytes. Kept across binding.
+	/// The receive buffer holds the bursts that come while the IO thread is busy. The OS drops the
+	/// datagrams that don't fit, which the link quality tells apart from the network's loss, on
+	/// transports that count them (UDP on Linux).
+	/// \param receive, send 0 leaves that one as it is.
+	/// \return False if the transport has no such buffers, or the OS capped the size.
+	bool setBufferSizes(size_t receive, size_t send);
+	bool getBufferSizes(size_t& receive, size_t& send) const;
+
+	/// Double the receive buffer when the OS drops datagrams, at most once per link quality interval.
+	/// \param maxReceive The buffer does not grow beyond this. The OS may cap it lower:
+	///		Linux at net.core.rmem_max, unless the process has CAP_NET_ADMIN.
+	void setBufferAutoTuning(bool enable, size_t maxReceive = 4 << 20);
+	bool isBufferAutoTuning() const;
+
+	/// Get the number of datagrams the OS dropped since binding, because the receive buffer was full.
+	uint64_t getReceiveDropCount() const;
+
+	// --- Memory --- //
+	/// Limit the memory a connection may use for its messages and their bookkeeping.
+	/// Over the budget, sending reliable messages throws RcpBudgetException, and messages of
+	/// the peer are dropped without acknowledgement until receive makes room: the peer resends them.
+	/// It's a soft limit, the message that crosses it and the growth of containers can go over a little.
+	/// \param bytes The limit, 0 for none (default).
+	void setMemoryBudget(size_t bytes);
+
+	/// Get the memory in use by the connection, its peak and the budget.
+	/// The memory is recycled for the next connection, the peak is kept until resetMemoryPeak.
+	RcpArena::Usage getMemoryUsage() const;
+
+	/// Start measuring the peak of memory usage from now.
+	void resetMemoryPeak();
+
+	// --- Real-time mode --- //
+	/// Prepare all a connection needs up front, so the first messages are as fast as the rest.
+	/// Buffers, pools and containers are allocated for capacity messages in flight each way,
+	/// of messageSize bytes, and their pages faulted in, again for each new connection.
+	/// In debug builds, the IO thread asserts that it does not allocate while processing the
+	/// traffic of a connection, see RcpRealTime. Lock the process's memory with
+	/// RcpRealTime::lockMemory to keep it from being paged out.
+	void setRealTime(bool enable, size_t capacity = 256, size_t messageSize = 512);
+	bool isRealTime() const;
+
+	// --- Authentication --- //
+	/// Tag the datagrams of the connections with a MAC, and drop those of the peer's address that don't carry
+	/// a valid one, before they touch the connection. Spoofed and stray datagrams cost a hash then, they don't
+	/// reserve places in the queue or draw acknowledgements. Takes effect at the next handshake, which fails
+	/// unless both peers enable it. Each connection has its own keys, derived from nonces of the handshake
+	/// and the secret: without a secret, only those who see the handshake can forge datagrams.
+	/// \param secret Known to both peers, of any length, empty for none.
+	void setAuthentication(bool enable, const std::string& secret = std::string());
+	bool isAuthentication() const;
+
+	/// Encrypt the payloads too, with ChaCha20-Poly1305, in place in the socket's buffers.
+	/// The keys come from the handshake of setAuthentication, which this turns on with the secret given.
+	/// Headers stay readable, but can't be changed. Both peers must enable it, like authentication.
+	void setEncryption(bool enable, const std::string& secret = std::string());
+	bool isEncryption() const;
+
+	/// Get the number of datagrams dropped because their MAC was wrong or missing, or they were replayed.
+	uint64_t getRejectedCount() const;
+
+	// --- Capture --- //
+	/// Write all datagrams the socket sends and receives to a pcapng file, until stopCapture.
+	/// They're framed as UDP over IPv4, the file opens in Wireshark. See RcpReplayTransport to play them back.
+	/// \return False if the file could not be created.
+	bool startCapture(const std::string& path);
+	void stopCapture();
 
 	// --- Miscellaneous --- //
 	void setTiming(long long totalMs, long long shortMs = 0);
 
 	// --- DEBUG!!! --- //
 	std::string debug_PrintState();
-	void debug_connect(std::string address, uint16_t port);
+	void debug_connect(std::string address, uint16_t port, uint32_t remoteSequenceNumber = 0, uint32_t remoteBatchNumber = 0); // connected without a handshake, the peer's last numbers as given
 	void debug_kill();
 	void debug_enableLog(bool value);
+	void debug_setInitialSequence(uint32_t sequenceNumber, uint32_t batchNumber); // for the next handshake, to test wraparound
 private:
 	// --- Network resources --- //
 
-	sf::UdpSocket socket; // communication socket
-	sf::SocketSelector selector; // allows to wait for a certain time for this socket
+	RcpCaptureWriter capture; // the datagrams of the transport are written here when it's open
+	std::unique_ptr<RcpTransport> transport; // carries the datagrams, UDP by default, wrapped to be captured
+	RcpClock* clock; // time source of all timeouts
 
 	// --- IO thread --- //
 
 	// This thread performs background socket communication
 	std::thread ioThread;
 	std::atomic_bool runIoThread;
+	bool isIoThreadDone; // guarded by socketMutex, notified on ioThreadCondvar
+	std::condition_variable ioThreadCondvar;
 
 	void startIoThread();
 	void stopIoThread();
+	void joinIoThread(); // wait for the IO thread to finish on its own
+	void wakeIoThread(); // interrupt the IO thread's wait for traffic
 	bool ioThreadFunction(); // returns true if it returns because it got a FIN, false otherwise
 
+	// --- Handshake --- //
 
-	void ioThreadFunction2();
-	eState HandleConnected();
+	// The handshake is a state machine running on the IO thread before ioThreadFunction.
+	// Incoming packets are looked up in handshakeTable by state and flags, the matching
+	// action handles the packet and returns the next state. Unmatched packets are dropped.
+	// The last packet sent is retransmitted with exponential backoff until the state changes.
+	struct HandshakeTransition {
+		eState state;
+		uint32_t flags;
+		eState (RcpSocket::*action)(const RcpHeader& header, const sf::IpAddress& sender, uint16_t senderPort);
+	};
+	static const HandshakeTransition handshakeTable[];
+
+	eHandshakeResult handshakeFunction(); // runs the state machine until it reaches CONNECTED or fails
+	void beginHandshake(eState initialState, int timeout, HandshakeHandler handler);
+	void sendHandshakePacket(uint32_t flags); // send and set up retransmission of a new handshake packet
+	void setRemoteSequence(const RcpHeader& header);
+	void throwHandshakeError(eHandshakeResult result);
+	eState onSynReceived(const RcpHeader& header, const sf::IpAddress& sender, uint16_t senderPort);
+	eState onSimultaneousSyn(const RcpHeader& header, const sf::IpAddress& sender, uint16_t senderPort);
+	eState onSynAck(const RcpHeader& header, const sf::IpAddress& sender, uint16_t senderPort);
+	eState onAck(const RcpHeader& header, const sf::IpAddress& sender, uint16_t senderPort);
+	eState onRepeatedSyn(const RcpHeader& header, const sf::IpAddress& sender, uint16_t senderPort);
+
+	RcpHeader handshakePacket; // last packet sent during the handshake, the ACK is repeated when connected
+	std::vector<uint8_t> handshakeDatagram; // and the datagram it went in
+	std::chrono::steady_clock::time_point handshakeDeadline; // the user's timeout
+	std::chrono::steady_clock::time_point handshakePhaseDeadline; // the remote peer must answer by this
+	std::chrono::steady_clock::time_point handshakeRetransmitTime;
+	std::chrono::milliseconds handshakeRetransmitInterval; // doubled for each retransmission
+	eHandshakeResult handshakeResult; // guarded by socketMutex, notified on handshakeCondvar
+	HandshakeHandler handshakeHandler;
+	std::condition_variable handshakeCondvar;
+
+	// --- Authentication --- //
+
+	// Authenticated datagrams end in the SipHash of the rest of them, keyed for the direction.
+	// Encrypted ones end in a counter and the Poly1305 tag instead: the counter makes the nonce,
+	// the payload is encrypted in place, and the header goes as associated data. SYN and SYN/ACK
+	// carry the nonces of the peers in clear, which the keys are derived from.
+	// The SYN/ACK and the ACK of the handshake are sealed already.
+	// A valid datagram may still be replayed. Encrypted, each counter is taken once, a resend
+	// is sealed anew. Authenticated, the sequence numbers of unreliable datagrams, keepalives
+	// and clock syncs are taken once. Reliable ones are resent as they were, the receive queue
+	// drops their copies, and ACKs carry the numbers of the acknowledged.
+	static const size_t TagSize = 8;
+	static const size_t CounterSize = 8;
+	static const size_t SealSize = CounterSize + RcpChaCha20Poly1305::TagSize; // the most a seal adds, MaxDatagramSize leaves room for it
+	static const size_t NonceSize = 8;
+	struct SessionKeys {
+		bool isAuthenticated = false; // the datagrams of the connection are sealed
+		bool isEncrypted = false; // with the cipher, not the MAC
+		RcpSipHash::Key send, receive;
+		uint8_t cipherSend[RcpChaCha20Poly1305::KeySize];
+		uint8_t cipherReceive[RcpChaCha20Poly1305::KeySize];
+		RcpReplayWindow replayWindow; // of the counters received with these keys, or the sequence numbers if not encrypted
+	};
+	std::atomic_bool authentication; // offered in the next handshake
+	std::atomic_bool encryption;
+	RcpSipHash::Key authenticationSecret; // guarded by socketMutex
+	SessionKeys keys; // set by the handshake
+	std::atomic<uint64_t> sendCounter; // of encrypted datagrams, never repeats with the keys
+	uint64_t localNonce, remoteNonce; // of the current handshake
+	std::atomic<uint64_t> rejectedCount;
+
+	void deriveKeys(uint64_t remoteNonce); // and seal from now on
+	bool checkHandshakeAuthentication(sf::Packet& packet, const RcpHeader& header); // call with socketMutex locked
+	size_t sealDatagram(uint8_t* datagram, size_t size); // size is header and payload, there must be room for SealSize more; returns the new size
+	bool openDatagram(sf::Packet& packet, size_t& size); // check and decrypt in place, size is set to the header and payload; true if not sealed
+	void sendHeader(const RcpHeader& header); // a datagram of the header only, sealed if need be
+
+	// --- Close --- //
+
+	// In FIN_WAIT, ioThreadFunction goes on retransmitting and acknowledging packets
+	// until recentPackets is empty or closeDeadline passes, then closeFunction sends the FIN.
+	eCloseResult closeFunction(bool isFlushed); // performs the FIN exchange
+	void finishClose(eCloseResult result); // releases resources and notifies, call with socketMutex locked
+
+	std::atomic<unsigned> linger; // ms a close may take
+	std::chrono::steady_clock::time_point closeDeadline; // the close is given up by this
+	eCloseResult closeResult; // guarded by socketMutex, notified on closeCondvar
+	CloseHandler closeHandler;
+	std::condition_variable closeCondvar;
 
 	// --- Traffic data structures --- //
 
+	// All of the connection's data structures are allocated from the arena.
+	// They are torn down as a whole at the end of the connection, and the arena is
+	// rewound for the next one, see reset. The arena's use is guarded by socketMutex.
+	RcpArena arena;
+
 	// Incoming packets	
-	random_access_queue<std::pair<RcpPacket, bool>> recvQueue; // received valid packets are put here
-	std::condition_variable recvCondvar;	// notified when stuff is received
+	using RecvQueueT = random_access_queue<std::pair<RcpPacket, bool>, RcpArenaAllocator<std::pair<RcpPacket, bool>>>;
 
 	// Incoming packet place reservation
 	struct ReservedInfo {
 		size_t index;
 		std::chrono::steady_clock::time_point timestamp;
 	};
-	using ReservedMapT = std::map<uint32_t, ReservedInfo>;
-	ReservedMapT recvReserved; // batch number and index-in-recvQueue of reserved places
-	uint32_t remoteBatchNumReserved; // reliable packets having this or smaller batch number have space reserved or been already committed
+	using ReservedMapT = std::map<uint64_t, ReservedInfo, std::less<uint64_t>, RcpArenaAllocator<std::pair<const uint64_t, ReservedInfo>>>;
 
 	// Packets waiting to be ACK'd
 	struct RecentPacketInfo {
 		RcpHeader header;
-		std::vector<uint8_t> data;
+		std::vector<uint8_t, RcpArenaAllocator<uint8_t>> data;
 		std::chrono::steady_clock::time_point send;
 		std::chrono::steady_clock::time_point lastResend;
+		int dscp; // own traffic class of the message, -1 for the socket's
+	};
+	using RecentPacketMapT = std::unordered_map<uint64_t, RecentPacketInfo, std::hash<uint64_t>, std::equal_to<uint64_t>, RcpArenaAllocator<std::pair<const uint64_t, RecentPacketInfo>>>; // extended batch num, info
+
+	// Datagrams the IO thread sends later, without kernel pacing
+	struct ScheduledInfo {
+		std::vector<uint8_t, RcpArenaAllocator<uint8_t>> data; // with the header
+		int dscp; // own traffic class of the message, -1 for the socket's
+	};
+	using ScheduledMapT = std::multimap<std::chrono::steady_clock::time_point, ScheduledInfo, std::less<std::chrono::steady_clock::time_point>, RcpArenaAllocator<std::pair<const std::chrono::steady_clock::time_point, ScheduledInfo>>>; // launch time, info
+
+	struct Session {
+		explicit Session(RcpArena& arena);
+		RecvQueueT recvQueue; // received valid packets are put here
+		ReservedMapT recvReserved; // extended batch number and index-in-recvQueue of reserved places
+		RecentPacketMapT recentPackets; // set of recently sent reliable packets waiting to be ACKed
+		ScheduledMapT scheduled; // messages waiting for their launch time
 	};
-	using RecentPacketMapT = std::unordered_map < uint32_t, RecentPacketInfo> ; // batch num, info
-	RecentPacketMapT recentPackets; // set of recently sent reliable packets waiting to be ACKed
+	std::aligned_storage<sizeof(Session), alignof(Session)>::type sessionStorage; // no heap for the session either
+	Session* session; // lives in sessionStorage
+
+	// Buffers reused for each datagram
+	sf::Packet receiveBuffer; // the IO thread's
+	RcpPacket receivePacket; // the IO thread's, decoded into before going to recvQueue
+	std::vector<uint8_t> sendBuffer; // the datagram being sent, guarded by socketMutex
+	std::vector<RcpPacket> packetPool; // payload buffers of received packets in real-time mode, guarded by socketMutex
+
+	std::condition_variable recvCondvar;	// notified when stuff is received
+	uint64_t remoteBatchNumReserved; // reliable packets having this or smaller batch number have space reserved or been already committed
 
 	// --- Session description --- //
+	// Sequence and batch numbers are extended to 64 bits, see RcpSerialNumber.
+	// Headers carry their low 32 bits, incoming ones are extended to the nearest of the latest.
+	// Numbers further than the window from the latest are dropped. It holds a retransmission
+	// for the total timeout at 100k packets per second, and is far below half the range.
+	static const uint32_t SerialWindow = 1 << 20;
+
 	// Local state
 	eState state; // current state of the connection
-	uint32_t localSeqNum; // keeps track of the local sequence number, increase for each packet
-	uint32_t localBatchNum; // keeps track of the local batch number, refresh for each reliable packet sent
+	uint64_t localSeqNum; // keeps track of the local sequence number, increase for each packet
+	uint64_t localBatchNum; // keeps track of the local batch number, refresh for each reliable packet sent
+	uint32_t initialSeqNum, initialBatchNum; // where the next handshake starts counting, 0 for the defaults
 
 	// Remote partner's state
-	uint32_t remoteSeqNum; // keeps track of the latest incoming packet's seqnum
-	uint32_t remoteBatchNum; // keeps track of the latest reliable packet's batch num
+	uint64_t remoteSeqNum; // keeps track of the latest incoming packet's seqnum
+	uint64_t remoteBatchNum; // keeps track of the latest reliable packet's batch num
 	sf::IpAddress remoteAddress; // ip address of the remote partner
 	uint16_t remotePort; // port of the remote partner
 	
@@ -266,18 +597,45 @@ private:
 	std::chrono::steady_clock::time_point timeLastSend; // the time of last packet send, including ACKs & KEPs
 	std::chrono::steady_clock::time_point timeLastreceived;
 
+	RcpClockSync clockSync; // estimate of remote peer's clock, fed by TIM exchanges
+	std::atomic<unsigned> clockSyncInterval; // ms between TIM requests, 0 is off
+	std::chrono::steady_clock::time_point timeLastSync; // the time of the last TIM request
+
+	RcpLinkQuality linkQuality; // fed by the IO thread
+
+	std::atomic_bool bufferAutoTuning;
+	std::atomic<size_t> maxReceiveBuffer;
+	uint64_t lastReceiveDrops; // the transport's count the IO thread has seen
+	std::chrono::steady_clock::time_point lastBufferGrowth;
+	void checkReceiveDrops(std::chrono::steady_clock::time_point now); // feed new drops to the link quality, grow the buffer; IO thread only
+
 	bool isBlocking; // sets if calls block caller or return immediatly
+	std::atomic_bool realTime; // preallocate for each connection, check there are no allocations
+	size_t realTimeCapacity, realTimeMessageSize; // guarded by socketMutex
+	std::atomic<uint8_t> trafficClass; // DSCP set for the socket
+	std::atomic_bool kernelPacing; // the transport holds datagrams until their launch time
+	std::atomic<unsigned> retransmitPacing; // us between two retransmissions
+	std::chrono::steady_clock::time_point nextRetransmit; // no retransmission before this, IO thread only
 
 	// Well, remove this shit from here and make it configurable and tidy
 	unsigned TIMEOUT_TOTAL = 5000; // connection lost if no message for % ms
 	unsigned TIMEOUT_SHORT = 200; // resend packet, resend kep, granularity of longer operations
 
 	// --- Internal helper functions --- //
-	void sendEx(const void* data, size_t size, uint32_t flags); // send message with management of internal structures
+	void sendEx(const void* data, size_t size, uint32_t flags, int dscp = -1, RcpClock::time_point launchTime = RcpClock::time_point()); // send message with management of internal structures
+	bool sendDatagram(const std::vector<uint8_t>& rawData, int dscp, RcpClock::time_point launchTime = RcpClock::time_point()); // send on the transport, marked unless dscp is -1, scheduled if there's a launch time
+	void resendPacket(RecentPacketInfo& info, RcpClock::time_point launchTime); // retransmit a reliable packet, call with socketMutex locked
+	void sendScheduled(); // send the scheduled datagrams that are due, call with socketMutex locked
 	void reset(); // clean up data structures after a session
+	void prepareSession(); // preallocate and warm up for real-time mode, call with socketMutex locked
+	bool isOverBudget(size_t size) const; // a message of size would take the connection over its memory budget
 	void replyClose(); // perform closing procedure after getting a FIN
-	std::vector<uint8_t> makePacket(const RcpHeader& header, const void* data, size_t size);
-	bool decodeDatagram(const sf::Packet& packet, const sf::IpAddress& sender, uint16_t port, RcpHeader& rcpHeader, RcpPacket& rcpPacket);
+	void notifyReceivers(); // wake receive calls waiting on recvCondvar
+	void sendClockSyncRequest(); // send a TIM packet with current time
+	void replyClockSync(const RcpHeader& header, const RcpPacket& packet); // answer a TIM packet
+	void processClockSyncReply(const RcpPacket& packet); // feed clockSync with TIM | ACK
+	void makePacket(const RcpHeader& header, const void* data, size_t size, std::vector<uint8_t>& datagram);
+	bool decodeDatagram(sf::Packet& packet, const sf::IpAddress& sender, uint16_t port, RcpHeader& rcpHeader, RcpPacket& rcpPacket); // decrypts packet in place
 	bool decodeHeader(const sf::Packet& packet, RcpHeader& header);
 	eClosestEventType getNextEvent(EventArgs& args);
 
@@ -315,6 +673,7 @@ public:
 		FIN = 4, // no more messages
 		KEP = 8, // keep alive
 		REL = 16, // reliable packet, send back ack
+		TIM = 32, // clock sync request
 	};
 
 	RcpTester();
@@ -0,0 +1,481 @@
+#include "RcpTransport.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef REMCON_WINDOWS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#endif
+#ifdef REMCON_LINUX
+#include <linux/net_tstamp.h>
+#include <time.h>
+#endif
+#if defined(REMCON_LINUX) && defined(SO_TXTIME)
+#define REMCON_TXTIME
+#endif
+#if defined(REMCON_LINUX) && defined(SO_RXQ_OVFL)
+#define REMCON_RXQ_OVFL
+#endif
+
+using namespace std::chrono;
+
+
+const size_t RcpUdpTransport::BatchChunk;
+
+
+size_t RcpTransport::receiveBatch(RcpDatagram* datagrams, size_t count) {
+	sf::Packet packet;
+	size_t received = 0;
+	while (received < count && receive(packet, datagrams[received].address, datagrams[received].port)) {
+		const uint8_t* data = (const uint8_t*)packet.getData();
+		datagrams[received].data.assign(data, data + packet.getDataSize());
+		received++;
+	}
+	return received;
+}
+
+
+size_t RcpTransport::sendBatch(const RcpDatagram* datagrams, size_t count) {
+	size_t sent = 0;
+	for (size_t i = 0; i < count; ++i) {
+		sent += send(datagrams[i].data.data(), datagrams[i].data.size(), datagrams[i].address, datagrams[i].port);
+	}
+	return sent;
+}
+
+
+RcpUdpTransport::RcpUdpTransport() : trafficClass(CS0), isLaunchTimes(false), receiveBufferSize(0), sendBufferSize(0) {
+	socket.setBlocking(false);
+	receiveDrops = 0;
+#ifdef REMCON_RXQ_OVFL
+	receiveBuffer.resize(sf::UdpSocket::MaxDatagramSize);
+#endif
+}
+
+
+bool RcpUdpTransport::bind(uint16_t port) {
+	if (socket.bind(port == 0 ? (uint16_t)sf::UdpSocket::AnyPort : port) != sf::UdpSocket::Done) {
+		return false;
+	}
+	applyTrafficClass();
+	isLaunchTimes = applyLaunchTimes() && isLaunchTimes;
+	applyBufferSizes();
+	applyDropCounting();
+	selector.add(socket);
+	return true;
+}
+
+
+bool RcpUdpTransport::bindGroup(const sf::IpAddress& group, uint16_t port) {
+	// SFML binds right after creating the socket, but the address must be reusable
+	// before binding, so that the members on the same host can share the port
+	unbind();
+	socket.create();
+	sf::SocketHandle handle = socket.getHandle();
+
+	int reuse = 1;
+	setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (::bind(handle, (const sockaddr*)&address, sizeof(address)) != 0) {
+		socket.unbind();
+		return false;
+	}
+
+	ip_mreq request = {};
+	request.imr_multiaddr.s_addr = htonl(group.toInteger());
+	request.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (setsockopt(handle, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&request, sizeof(request)) != 0) {
+		socket.unbind();
+		return false;
+	}
+
+	applyTrafficClass();
+	isLaunchTimes = applyLaunchTimes() && isLaunchTimes;
+	applyBufferSizes();
+	applyDropCounting();
+	selector.add(socket);
+	return true;
+}
+
+
+void RcpUdpTransport::unbind() {
+	socket.unbind();
+	selector.remove(socket);
+}
+
+
+uint16_t RcpUdpTransport::getLocalPort() const {
+	return socket.getLocalPort();
+}
+
+
+bool RcpUdpTransport::send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) {
+	return socket.send(data, size, address, port) == sf::UdpSocket::Done;
+}
+
+
+bool RcpUdpTransport::setTrafficClass(uint8_t dscp) {
+	trafficClass = dscp & 0x3F;
+	// the socket only exists once bound, then it's set at binding
+	return socket.getLocalPort() == 0 || applyTrafficClass();
+}
+
+
+bool RcpUdpTransport::sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp) {
+	dscp &= 0x3F;
+	if (dscp == trafficClass) {
+		return send(data, size, address, port);
+	}
+	if (size > sf::UdpSocket::MaxDatagramSize) {
+		return false;
+	}
+
+	sockaddr_in target = {};
+	target.sin_family = AF_INET;
+	target.sin_port = htons(port);
+	target.sin_addr.s_addr = htonl(address.toInteger());
+	sf::SocketHandle handle = socket.getHandle();
+
+#ifdef REMCON_LINUX
+	// the ToS of a single datagram goes as ancillary data, the socket's stays as it is
+	iovec buffer;
+	buffer.iov_base = const_cast<void*>(data);
+	buffer.iov_len = size;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+	msghdr message = {};
+	message.msg_name = &target;
+	message.msg_namelen = sizeof(target);
+	message.msg_iov = &buffer;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	cmsghdr* tos = CMSG_FIRSTHDR(&message);
+	tos->cmsg_level = IPPROTO_IP;
+	tos->cmsg_type = IP_TOS;
+	tos->cmsg_len = CMSG_LEN(sizeof(int));
+	int value = dscp << 2;
+	memcpy(CMSG_DATA(tos), &value, sizeof(value));
+	return sendmsg(handle, &message, 0) == (ssize_t)size;
+#else
+	// no ancillary ToS here: switch the socket's for the datagram, sends are serialized anyway
+	int value = dscp << 2;
+	setsockopt(handle, IPPROTO_IP, IP_TOS, (const char*)&value, sizeof(value));
+	bool isSent = sendto(handle, (const char*)data, (int)size, 0, (const sockaddr*)&target, sizeof(target)) == (int)size;
+	applyTrafficClass();
+	return isSent;
+#endif
+}
+
+
+bool RcpUdpTransport::setLaunchTimes(bool enable) {
+	isLaunchTimes = enable;
+	// unlike the traffic class, support is only known by trying, so the socket is made now
+	socket.create();
+	isLaunchTimes = applyLaunchTimes() && enable;
+	return isLaunchTimes;
+}
+
+
+bool RcpUdpTransport::sendAt(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp, steady_clock::time_point launchTime) {
+#ifdef REMCON_TXTIME
+	dscp &= 0x3F;
+	// the qdisc may drop datagrams that are late already
+	if (!isLaunchTimes || launchTime <= steady_clock::now()) {
+		return sendMarked(data, size, address, port, dscp);
+	}
+	if (size > sf::UdpSocket::MaxDatagramSize) {
+		return false;
+	}
+
+	sockaddr_in target = {};
+	target.sin_family = AF_INET;
+	target.sin_port = htons(port);
+	target.sin_addr.s_addr = htonl(address.toInteger());
+	iovec buffer;
+	buffer.iov_base = const_cast<void*>(data);
+	buffer.iov_len = size;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(int))] = {};
+	msghdr message = {};
+	message.msg_name = &target;
+	message.msg_namelen = sizeof(target);
+	message.msg_iov = &buffer;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+
+	// the launch time in nanoseconds of CLOCK_MONOTONIC, which is the steady clock's
+	cmsghdr* txtime = CMSG_FIRSTHDR(&message);
+	txtime->cmsg_level = SOL_SOCKET;
+	txtime->cmsg_type = SCM_TXTIME;
+	txtime->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+	uint64_t time = (uint64_t)duration_cast<nanoseconds>(launchTime.time_since_epoch()).count();
+	memcpy(CMSG_DATA(txtime), &time, sizeof(time));
+	size_t controlSize = CMSG_SPACE(sizeof(uint64_t));
+
+	if (dscp != trafficClass) {
+		cmsghdr* tos = CMSG_NXTHDR(&message, txtime);
+		tos->cmsg_level = IPPROTO_IP;
+		tos->cmsg_type = IP_TOS;
+		tos->cmsg_len = CMSG_LEN(sizeof(int));
+		int value = dscp << 2;
+		memcpy(CMSG_DATA(tos), &value, sizeof(value));
+		controlSize += CMSG_SPACE(sizeof(int));
+	}
+	message.msg_controllen = controlSize;
+	return sendmsg(socket.getHandle(), &message, 0) == (ssize_t)size;
+#else
+	return sendMarked(data, size, address, port, dscp);
+#endif
+}
+
+
+bool RcpUdpTransport::wait(microseconds timeout) {
+	// for SFML, zero means infinity
+	sf::Time waitTime = timeout == microseconds::max() ? sf::Time::Zero : sf::microseconds(std::max<long long>(timeout.count(), 1));
+	return selector.wait(waitTime);
+}
+
+
+bool RcpUdpTransport::receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) {
+#ifdef REMCON_RXQ_OVFL
+	// the drop count comes as ancillary data, which SFML does not read
+	packet.clear();
+	sockaddr_in source = {};
+	iovec buffer;
+	buffer.iov_base = receiveBuffer.data();
+	buffer.iov_len = receiveBuffer.size();
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint32_t))];
+	msghdr message = {};
+	message.msg_name = &source;
+	message.msg_namelen = sizeof(source);
+	message.msg_iov = &buffer;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = sizeof(control);
+	ssize_t size = recvmsg(socket.getHandle(), &message, MSG_DONTWAIT);
+	if (size < 0) {
+		return false;
+	}
+	for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+		if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SO_RXQ_OVFL) {
+			uint32_t drops;
+			memcpy(&drops, CMSG_DATA(header), sizeof(drops));
+			receiveDrops = drops;
+		}
+	}
+	if (size > 0) {
+		packet.append(receiveBuffer.data(), (size_t)size);
+	}
+	address = sf::IpAddress(ntohl(source.sin_addr.s_addr));
+	port = ntohs(source.sin_port);
+	return true;
+#else
+	return socket.receive(packet, address, port) == sf::UdpSocket::Done;
+#endif
+}
+
+
+bool RcpUdpTransport::setBufferSizes(size_t receive, size_t send) {
+	if (receive > 0) {
+		receiveBufferSize = receive;
+	}
+	if (send > 0) {
+		sendBufferSize = send;
+	}
+	// the socket only exists once bound, then they're set at binding
+	return socket.getLocalPort() == 0 || applyBufferSizes();
+}
+
+
+bool RcpUdpTransport::getBufferSizes(size_t& receive, size_t& send) const {
+	if (socket.getLocalPort() == 0) {
+		return false;
+	}
+	int receiveValue = 0, sendValue = 0;
+	socklen_t length = sizeof(int);
+	if (getsockopt(socket.getHandle(), SOL_SOCKET, SO_RCVBUF, (char*)&receiveValue, &length) != 0) {
+		return false;
+	}
+	length = sizeof(int);
+	if (getsockopt(socket.getHandle(), SOL_SOCKET, SO_SNDBUF, (char*)&sendValue, &length) != 0) {
+		return false;
+	}
+#ifdef REMCON_LINUX
+	// Linux doubles the size asked for, for its bookkeeping, and reports that
+	receiveValue /= 2;
+	sendValue /= 2;
+#endif
+	receive = (size_t)receiveValue;
+	send = (size_t)sendValue;
+	return true;
+}
+
+
+uint64_t RcpUdpTransport::getReceiveDrops() const {
+	return receiveDrops;
+}
+
+
+size_t RcpUdpTransport::receiveBatch(RcpDatagram* datagrams, size_t count) {
+#ifdef REMCON_LINUX
+	const size_t slotSize = sf::UdpSocket::MaxDatagramSize;
+	if (batchBuffer.empty()) {
+		batchBuffer.resize(BatchChunk * slotSize);
+	}
+	size_t received = 0;
+	while (received < count) {
+		size_t chunk = std::min(count - received, BatchChunk);
+		mmsghdr messages[BatchChunk];
+		iovec buffers[BatchChunk];
+		sockaddr_in sources[BatchChunk];
+		alignas(cmsghdr) char controls[BatchChunk][CMSG_SPACE(sizeof(uint32_t))];
+		memset(messages, 0, sizeof(messages));
+		for (size_t i = 0; i < chunk; ++i) {
+			buffers[i].iov_base = &batchBuffer[i * slotSize];
+			buffers[i].iov_len = slotSize;
+			messages[i].msg_hdr.msg_name = &sources[i];
+			messages[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+			messages[i].msg_hdr.msg_iov = &buffers[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+			messages[i].msg_hdr.msg_control = controls[i];
+			messages[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+		}
+		int result = recvmmsg(socket.getHandle(), messages, (unsigned)chunk, MSG_DONTWAIT, nullptr);
+		if (result <= 0) {
+			break;
+		}
+		for (int i = 0; i < result; ++i) {
+#ifdef REMCON_RXQ_OVFL
+			msghdr& message = messages[i].msg_hdr;
+			for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+				if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SO_RXQ_OVFL) {
+					uint32_t drops;
+					memcpy(&drops, CMSG_DATA(header), sizeof(drops));
+					receiveDrops = drops;
+				}
+			}
+#endif
+			RcpDatagram& datagram = datagrams[received + i];
+			const uint8_t* data = &batchBuffer[i * slotSize];
+			datagram.data.assign(data, data + messages[i].msg_len);
+			datagram.address = sf::IpAddress(ntohl(sources[i].sin_addr.s_addr));
+			datagram.port = ntohs(sources[i].sin_port);
+		}
+		received += result;
+		// fewer than asked for, there's no more waiting
+		if ((size_t)result < chunk) {
+			break;
+		}
+	}
+	return received;
+#else
+	return RcpTransport::receiveBatch(datagrams, count);
+#endif
+}
+
+
+size_t RcpUdpTransport::sendBatch(const RcpDatagram* datagrams, size_t count) {
+#ifdef REMCON_LINUX
+	size_t sent = 0;
+	size_t offset = 0;
+	while (offset < count) {
+		size_t chunk = std::min(count - offset, BatchChunk);
+		mmsghdr messages[BatchChunk];
+		iovec buffers[BatchChunk];
+		sockaddr_in destinations[BatchChunk];
+		memset(messages, 0, sizeof(messages));
+		memset(destinations, 0, sizeof(destinations));
+		for (size_t i = 0; i < chunk; ++i) {
+			const RcpDatagram& datagram = datagrams[offset + i];
+			destinations[i].sin_family = AF_INET;
+			destinations[i].sin_addr.s_addr = htonl(datagram.address.toInteger());
+			destinations[i].sin_port = htons(datagram.port);
+			buffers[i].iov_base = (void*)datagram.data.data();
+			buffers[i].iov_len = datagram.data.size();
+			messages[i].msg_hdr.msg_name = &destinations[i];
+			messages[i].msg_hdr.msg_namelen = sizeof(destinations[i]);
+			messages[i].msg_hdr.msg_iov = &buffers[i];
+			messages[i].msg_hdr.msg_iovlen = 1;
+		}
+		// sendmmsg stops at the first that fails, and reports it on the next call: skip it and go on
+		int result = sendmmsg(socket.getHandle(), messages, (unsigned)chunk, 0);
+		if (result <= 0) {
+			offset++;
+			continue;
+		}
+		sent += result;
+		offset += result;
+	}
+	return sent;
+#else
+	return RcpTransport::sendBatch(datagrams, count);
+#endif
+}
+
+
+bool RcpUdpTransport::applyTrafficClass() {
+	// the DSCP is the upper 6 bits of the ToS byte, the ECN bits are left to the stack
+	int value = trafficClass << 2;
+	return setsockopt(socket.getHandle(), IPPROTO_IP, IP_TOS, (const char*)&value, sizeof(value)) == 0;
+}
+
+
+bool RcpUdpTransport::applyBufferSizes() {
+	sf::SocketHandle handle = socket.getHandle();
+	size_t receive = 0, send = 0;
+	if (receiveBufferSize > 0) {
+		int value = (int)receiveBufferSize;
+		setsockopt(handle, SOL_SOCKET, SO_RCVBUF, (const char*)&value, sizeof(value));
+#ifdef REMCON_LINUX
+		// beyond net.core.rmem_max only with CAP_NET_ADMIN
+		if (getBufferSizes(receive, send) && receive < receiveBufferSize) {
+			setsockopt(handle, SOL_SOCKET, SO_RCVBUFFORCE, &value, sizeof(value));
+		}
+#endif
+	}
+	if (sendBufferSize > 0) {
+		int value = (int)sendBufferSize;
+		setsockopt(handle, SOL_SOCKET, SO_SNDBUF, (const char*)&value, sizeof(value));
+#ifdef REMCON_LINUX
+		if (getBufferSizes(receive, send) && send < sendBufferSize) {
+			setsockopt(handle, SOL_SOCKET, SO_SNDBUFFORCE, &value, sizeof(value));
+		}
+#endif
+	}
+	return getBufferSizes(receive, send) && receive >= receiveBufferSize && send >= sendBufferSize;
+}
+
+
+void RcpUdpTransport::applyDropCounting() {
+	receiveDrops = 0;
+#ifdef REMCON_RXQ_OVFL
+	int enable = 1;
+	setsockopt(socket.getHandle(), SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+#endif
+}
+
+
+bool RcpUdpTransport::applyLaunchTimes() {
+#ifdef REMCON_TXTIME
+	// switching it off is not possible, sendAt just stops attaching launch times
+	if (!isLaunchTimes) {
+		return true;
+	}
+	sock_txtime config = {};
+	config.clockid = CLOCK_MONOTONIC;
+	config.flags = 0;
+	return setsockopt(socket.getHandle(), SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == 0;
+#else
+	return false;
+#endif
+}
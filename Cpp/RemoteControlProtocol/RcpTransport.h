@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+#include <atomic>
+#include <vector>
+
+#include <SFML/Network.hpp>
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Datagram service RcpSocket runs on.
+//
+// The default is a UDP socket. Other implementations can carry datagrams
+// differently, for example through a simulated network in tests.
+// send may be called from several threads, but only under the socket's lock;
+// wait and receive are only called from one thread at a time.
+//
+// Datagrams can be marked with a DiffServ code point, so that switches and
+// access points queue the traffic classes separately (on Wi-Fi, WMM maps
+// them to its access categories). Transports that can't mark just send.
+//
+// Datagrams can also be handed over with a launch time, for the transport to
+// release them at that instant, without the caller waking up for each. The
+// UDP transport does it with SO_TXTIME on Linux, where the fq qdisc of
+// the interface holds the datagrams until then. Transports that can't
+// schedule report it, and the caller paces the datagrams itself.
+//
+// When datagrams come faster than they are taken, the OS drops those that
+// don't fit in the receive buffer. Transports that can tell count them, so
+// they are not mistaken for the network's loss, and their buffers can be
+// sized for the bursts expected.
+//
+// Datagrams can also be sent and received in batches, which the UDP transport
+// does with a single system call on Linux, for those forwarding many at once.
+////////////////////////////////////////////////////////////////////////////////
+
+/// A datagram and its peer, for sending and receiving in batches.
+struct RcpDatagram {
+	std::vector<uint8_t> data;
+	sf::IpAddress address;
+	uint16_t port = 0;
+};
+
+class RcpTransport {
+public:
+	/// Common DiffServ code points, RFC 4594. Any 6 bit value can be used.
+	enum eDscp : uint8_t {
+		CS0 = 0, // best effort, the default
+		CS1 = 8, // bulk transfers, below best effort
+		AF11 = 10, // high throughput data
+		AF21 = 18, // low latency data
+		AF31 = 26, // multimedia streaming
+		AF41 = 34, // interactive video, telemetry
+		CS5 = 40, // signaling
+		EF = 46, // expedited forwarding, control commands
+		CS6 = 48, // network control
+	};
+
+	virtual ~RcpTransport() {}
+
+	/// Bind to a local port.
+	/// \param port 0 picks any free port.
+	virtual bool bind(uint16_t port) = 0;
+	virtual void unbind() = 0;
+
+	/// Bind to a port shared by the members of a multicast group, and join the group.
+	/// Datagrams sent to group:port are received by all members. Unbinding leaves the group.
+	/// \return False if it failed, or the transport does not support multicast.
+	virtual bool bindGroup(const sf::IpAddress& /*group*/, uint16_t /*port*/) { return false; }
+
+	/// \return The bound port, 0 if not bound.
+	virtual uint16_t getLocalPort() const = 0;
+
+	/// Send a datagram.
+	/// \return False if it could not be sent, it may have been too large.
+	virtual bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) = 0;
+
+	/// Set the code point of the datagrams sent, unless a single datagram is marked otherwise.
+	/// Kept across binding. Default is CS0.
+	/// \return False if the transport can't mark datagrams.
+	virtual bool setTrafficClass(uint8_t /*dscp*/) { return false; }
+
+	/// Send a datagram with its own code point, instead of the one set for the transport.
+	/// Falls back to an unmarked send if the transport can't mark single datagrams.
+	virtual bool sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t /*dscp*/) {
+		return send(data, size, address, port);
+	}
+
+	/// Have datagrams sent with sendAt released at their launch time.
+	/// Kept across binding. Off by default.
+	/// \return False if the transport can't schedule datagrams, sendAt sends right away then.
+	virtual bool setLaunchTimes(bool /*enable*/) { return false; }
+
+	/// Send a datagram to be released at launchTime, on the steady clock, marked with dscp.
+	/// A launch time in the past, or launch times turned off, send right away.
+	virtual bool sendAt(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp, std::chrono::steady_clock::time_point /*launchTime*/) {
+		return sendMarked(data, size, address, port, dscp);
+	}
+
+	/// Wait until a datagram can be received.
+	/// \param timeout microseconds::max() waits forever.
+	/// \return False if the timeout is over.
+	virtual bool wait(std::chrono::microseconds timeout) = 0;
+
+	/// Receive a datagram without waiting.
+	/// \return False if there was nothing to receive.
+	virtual bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) = 0;
+
+	/// Set the size of the OS buffers of the transport. Kept across binding.
+	/// \param receive, send Bytes, 0 leaves that one as it is.
+	/// \return False if the transport has no such buffers, or the OS capped the size.
+	virtual bool setBufferSizes(size_t /*receive*/, size_t /*send*/) { return false; }
+
+	/// Get the size of the OS buffers, as they would be set.
+	/// \return False if the transport has no such buffers, or it's not bound.
+	virtual bool getBufferSizes(size_t& /*receive*/, size_t& /*send*/) const { return false; }
+
+	/// Number of datagrams the OS dropped since binding, because the receive buffer was full.
+	/// Updated as datagrams are received: drops after the last one show with the next. 0 if the transport can't tell.
+	virtual uint64_t getReceiveDrops() const { return 0; }
+
+	/// Receive the datagrams waiting, at most count of them, without waiting.
+	/// The buffers of the datagrams are reused.
+	/// \return The number of datagrams received.
+	virtual size_t receiveBatch(RcpDatagram* datagrams, size_t count);
+
+	/// Send several datagrams, each to its own peer.
+	/// \return The number of datagrams sent, the others failed like send does.
+	virtual size_t sendBatch(const RcpDatagram* datagrams, size_t count);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// UDP transport, the default.
+////////////////////////////////////////////////////////////////////////////////
+
+class RcpUdpTransport : public RcpTransport {
+public:
+	RcpUdpTransport();
+
+	bool bind(uint16_t port) override;
+	bool bindGroup(const sf::IpAddress& group, uint16_t port) override;
+	void unbind() override;
+	uint16_t getLocalPort() const override;
+	bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) override;
+	bool setTrafficClass(uint8_t dscp) override;
+	bool sendMarked(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp) override;
+	bool setLaunchTimes(bool enable) override;
+	bool sendAt(const void* data, size_t size, const sf::IpAddress& address, uint16_t port, uint8_t dscp, std::chrono::steady_clock::time_point launchTime) override;
+	bool wait(std::chrono::microseconds timeout) override;
+	bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) override;
+	bool setBufferSizes(size_t receive, size_t send) override;
+	bool getBufferSizes(size_t& receive, size_t& send) const override;
+	uint64_t getReceiveDrops() const override; // counted on Linux with SO_RXQ_OVFL
+	size_t receiveBatch(RcpDatagram* datagrams, size_t count) override; // recvmmsg on Linux
+	size_t sendBatch(const RcpDatagram* datagrams, size_t count) override; // sendmmsg on Linux
+private:
+	static const size_t BatchChunk = 16; // datagrams per system call
+	bool applyTrafficClass(); // set IP_TOS on the native socket
+	bool applyLaunchTimes(); // set SO_TXTIME on the native socket
+	bool applyBufferSizes(); // set SO_RCVBUF and SO_SNDBUF on the native socket
+	void applyDropCounting(); // set SO_RXQ_OVFL on the native socket
+
+	// gives access to the native handle, for the socket options SFML does not know
+	class Socket : public sf::UdpSocket {
+	public:
+		using sf::UdpSocket::create;
+		using sf::UdpSocket::getHandle;
+	};
+
+	Socket socket;
+	sf::SocketSelector selector; // allows to wait for a certain time for this socket
+	uint8_t trafficClass; // DSCP of the socket
+	bool isLaunchTimes; // SO_TXTIME requested
+	size_t receiveBufferSize, sendBufferSize; // requested, 0 for the OS default
+	std::atomic<uint64_t> receiveDrops; // the count of the last datagram received
+	std::vector<uint8_t> receiveBuffer; // recvmsg reads into it, for the ancillary data
+	std::vector<uint8_t> batchBuffer; // recvmmsg reads into it, BatchChunk datagrams of the largest size, allocated on first use
+};
@@ -2,45 +2,50 @@
 
 #include <queue>
 #include <deque>
+#include <memory>
 
 
-template <class T>
-class random_access_queue : public std::queue < T, std::deque<T> > {
+template <class T, class Allocator = std::allocator<T>>
+class random_access_queue : public std::queue < T, std::deque<T, Allocator> > {
+public:
+	using container_type = std::deque<T, Allocator>;
 private:
-	using queue_type = std::queue < T, std::deque<T> > ;
+	using queue_type = std::queue < T, container_type > ;
 public:
 	// constructors
-	explicit random_access_queue(const typename std::deque<T>& cont) : queue_type(cont) {};
+	random_access_queue() {};
+
+	explicit random_access_queue(const container_type& cont) : queue_type(cont) {};
 
-	explicit random_access_queue(typename std::deque<T>&& cont = std::deque<T>()) : queue_type(cont) {};
+	explicit random_access_queue(container_type&& cont) : queue_type(std::move(cont)) {};
 
 	random_access_queue(const random_access_queue& other) : queue_type(other) {};
 
-	random_access_queue(random_access_queue&& other) : queue_type(other) {};
+	random_access_queue(random_access_queue&& other) : queue_type(std::move(other)) {};
 
 	template< class Alloc >
 	explicit random_access_queue(const Alloc& alloc) : queue_type(alloc) {};
 
 	template< class Alloc >
-	random_access_queue(const typename std::deque<T>& cont, const Alloc& alloc) : queue_type(cont, alloc) {};
+	random_access_queue(const container_type& cont, const Alloc& alloc) : queue_type(cont, alloc) {};
 
 	template< class Alloc >
-	random_access_queue(typename std::deque<T>&& cont, const Alloc& alloc) : queue_type(cont, alloc) {};
+	random_access_queue(container_type&& cont, const Alloc& alloc) : queue_type(std::move(cont), alloc) {};
 
 	template< class Alloc >
 	random_access_queue(const random_access_queue& other, const Alloc& alloc) : queue_type(other, alloc) {};
 
 	template< class Alloc >
-	random_access_queue(random_access_queue&& other, const Alloc& alloc) : queue_type(other, alloc) {};
+	random_access_queue(random_access_queue&& other, const Alloc& alloc) : queue_type(std::move(other), alloc) {};
 
 	// assignement operators
-	random_access_queue<T>& operator=(const random_access_queue<T>& other) {
+	random_access_queue& operator=(const random_access_queue& other) {
 		queue_type::operator=(other);
 		return *this;
 	}
 
-	random_access_queue<T>& operator=(random_access_queue<T>&& other) {
-		queue_type::operator=(other);
+	random_access_queue& operator=(random_access_queue&& other) {
+		queue_type::operator=(std::move(other));
 		return *this;
 	}
 
@@ -53,8 +58,8 @@ public:
 	}
 
 	// iterators
-	using iterator = typename std::deque<T>::iterator;
-	using const_iterator = typename std::deque<T>::const_iterator;
+	using iterator = typename container_type::iterator;
+	using const_iterator = typename container_type::const_iterator;
 
 	iterator begin() {
 		return queue_type::c.begin();
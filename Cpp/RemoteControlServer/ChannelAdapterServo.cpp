@@ -30,6 +30,7 @@ bool ChannelAdapterServo::ProcessCommand(const ServoMessage& message, ServoMessa
 			reply.action = ServoMessage::REPLY;
 			reply.state = manager->GetState(message.channel);
 			reply.channel = message.channel;
+			reply.requestId = message.requestId;
 			return true;
 		default:
 			return false;
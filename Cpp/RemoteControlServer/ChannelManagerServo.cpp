@@ -1,13 +1,16 @@
 #include "ChannelManagerServo.h"
 #include "IServoProvider.h"
+#include "LatencyTrace.h"
 
 
 void ChannelManagerServo::SetState(float state, int channel) {
+	TraceScope::Record(eTraceStage::CHANNEL_SET);
 	IServoProvider* provider;
 	int port;
 	bool isValid = FindChannel(channel, provider, port);
 	if (isValid) {
 		provider->SetState(state, port);
+		TraceScope::Record(eTraceStage::PROVIDER_LATCHED);
 	}
 }
 
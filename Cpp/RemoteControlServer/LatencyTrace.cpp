@@ -0,0 +1,113 @@
+#include "LatencyTrace.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TraceRing
+
+TraceRing::TraceRing(size_t capacity) {
+	size_t roundedCapacity = 1;
+	while (roundedCapacity < capacity) {
+		roundedCapacity <<= 1;
+	}
+
+	slots.reset(new Slot[roundedCapacity]);
+	for (size_t i = 0; i < roundedCapacity; i++) {
+		slots[i].sequence = 0;
+	}
+	mask = roundedCapacity - 1;
+	writeIndex = 0;
+	readIndex = 0;
+}
+
+
+void TraceRing::Push(uint64_t traceId, eTraceStage stage, int64_t timestamp) {
+	uint64_t index = writeIndex.fetch_add(1, std::memory_order_relaxed);
+	Slot& slot = slots[index & mask];
+
+	// seqlock-style write: readers discard the slot if the sequence changes under them
+	slot.sequence.store(2 * index + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.traceId.store(traceId, std::memory_order_relaxed);
+	slot.timestamp.store(timestamp, std::memory_order_relaxed);
+	slot.stage.store((uint8_t)stage, std::memory_order_relaxed);
+	slot.sequence.store(2 * index + 2, std::memory_order_release);
+}
+
+
+size_t TraceRing::Drain(std::vector<TraceRecord>& records) {
+	uint64_t end = writeIndex.load(std::memory_order_acquire);
+	size_t lost = 0;
+
+	// skip what has surely been overwritten
+	if (end - readIndex > mask + 1) {
+		lost += (size_t)(end - readIndex - (mask + 1));
+		readIndex = end - (mask + 1);
+	}
+
+	for (; readIndex < end; ++readIndex) {
+		Slot& slot = slots[readIndex & mask];
+		uint64_t expected = 2 * readIndex + 2;
+
+		if (slot.sequence.load(std::memory_order_acquire) != expected) {
+			// still being written, or already overwritten by a faster writer
+			lost++;
+			continue;
+		}
+		TraceRecord record;
+		record.traceId = slot.traceId.load(std::memory_order_relaxed);
+		record.timestamp = slot.timestamp.load(std::memory_order_relaxed);
+		record.stage = (eTraceStage)slot.stage.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) != expected) {
+			lost++;
+			continue;
+		}
+		records.push_back(record);
+	}
+
+	return lost;
+}
+
+
+void TraceRing::Dump(std::ostream& os) {
+	std::vector<TraceRecord> records;
+	Drain(records);
+	for (auto& record : records) {
+		os << record.traceId << "," << (int)record.stage << "," << record.timestamp << "\n";
+	}
+	os.flush();
+}
+
+
+size_t TraceRing::GetCapacity() const {
+	return mask + 1;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// TraceScope
+
+static thread_local TraceScope* currentTraceScope = nullptr;
+
+
+TraceScope::TraceScope(TraceRing* ring, uint64_t traceId) : ring(ring), traceId(traceId) {
+	previous = currentTraceScope;
+	currentTraceScope = ring ? this : previous;
+}
+
+TraceScope::~TraceScope() {
+	if (currentTraceScope == this) {
+		currentTraceScope = previous;
+	}
+}
+
+void TraceScope::Record(eTraceStage stage, int64_t timestamp) {
+	TraceScope* scope = currentTraceScope;
+	if (scope) {
+		scope->ring->Push(scope->traceId, stage, timestamp);
+	}
+}
+
+bool TraceScope::IsActive() {
+	return currentTraceScope != nullptr;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <ostream>
+
+////////////////////////////////////////////////////////////////////////////////
+/// Latency tracing of individual commands from the client's send call to the
+/// moment the provider latches the new output.
+/// A traced command carries a trace ID and the client's send timestamp in a
+/// TraceMessage wrapper. The server stamps the command at each stage of its
+/// journey and pushes the stamps into a TraceRing, which can be drained at any
+/// time without stopping the server. The TraceReport tool turns the dumped
+/// records into per-stage latency histograms.
+////////////////////////////////////////////////////////////////////////////////
+
+
+/// Stages a traced command passes through, in order.
+enum class eTraceStage : uint8_t {
+	CLIENT_SEND = 0, // client's clock!
+	DATAGRAM_RECEIVED = 1,
+	PACKET_DELIVERED = 2,
+	MESSAGE_DISPATCHED = 3,
+	CHANNEL_SET = 4,
+	PROVIDER_LATCHED = 5,
+};
+
+
+/// One timestamp of one traced command.
+struct TraceRecord {
+	uint64_t traceId;
+	int64_t timestamp; // nanoseconds, steady clock
+	eTraceStage stage;
+};
+
+
+/// Convert a steady clock time point to the nanosecond timestamps used in traces.
+inline int64_t TraceTimestamp(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+/// Current time as a trace timestamp.
+inline int64_t TraceTimestamp() {
+	return TraceTimestamp(std::chrono::steady_clock::now());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Fixed size, lock-free ring of trace records.
+/// Any number of threads may push concurrently, pushing never blocks and never
+/// allocates. When the ring is full, the oldest records are overwritten.
+/// Draining should be done from one thread at a time.
+////////////////////////////////////////////////////////////////////////////////
+
+class TraceRing {
+public:
+	/// Create a ring.
+	/// \param capacity Number of records kept, rounded up to a power of two.
+	explicit TraceRing(size_t capacity = 65536);
+	TraceRing(const TraceRing&) = delete;
+	TraceRing& operator=(const TraceRing&) = delete;
+
+	/// Store a record, overwriting the oldest one if the ring is full.
+	void Push(uint64_t traceId, eTraceStage stage, int64_t timestamp);
+
+	/// Move all records pushed since the last drain to the end of a vector.
+	/// \return The number of records that were overwritten before they could be drained.
+	size_t Drain(std::vector<TraceRecord>& records);
+
+	/// Drain the ring and write records as "traceId,stage,timestamp" lines.
+	/// This is the input format of the TraceReport tool.
+	void Dump(std::ostream& os);
+
+	/// Get the number of records the ring can hold.
+	size_t GetCapacity() const;
+private:
+	struct Slot {
+		std::atomic<uint64_t> sequence; // 2*index+1 while written, 2*index+2 when complete
+		std::atomic<uint64_t> traceId;
+		std::atomic<int64_t> timestamp;
+		std::atomic<uint8_t> stage;
+	};
+	std::unique_ptr<Slot[]> slots;
+	size_t mask;
+	std::atomic<uint64_t> writeIndex;
+	uint64_t readIndex;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+/// Marks the traced command currently processed by this thread.
+/// Code deep in the call chain (channel managers, providers) does not know about
+/// trace IDs, it just calls TraceScope::Record, which is a no-op when no traced
+/// command is being processed.
+////////////////////////////////////////////////////////////////////////////////
+
+class TraceScope {
+public:
+	TraceScope(TraceRing* ring, uint64_t traceId);
+	~TraceScope();
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	/// Record a stage for the current thread's traced command, if any.
+	static void Record(eTraceStage stage, int64_t timestamp);
+	static void Record(eTraceStage stage) { if (IsActive()) Record(stage, TraceTimestamp()); }
+
+	/// True if there's a traced command being processed on this thread.
+	static bool IsActive();
+private:
+	TraceScope* previous;
+	TraceRing* ring;
+	uint64_t traceId;
+};
@@ -1,10 +1,16 @@
 #include "Message.h"
 #include "Serializer.h"
+#include "LatencyTrace.h"
+
+#include <RemoteControlProtocol/RcpSipHash.h>
 
 
 ////////////////////////////////////////////////////////////////////////////////
 // MessageDecoder
 
+MessageDecoder::MessageDecoder() : traceRing(nullptr) {
+}
+
 
 void MessageDecoder::SetHandler(eMessageType type, HandlerType handler) {
 	handlers[type] = handler;
@@ -18,17 +24,84 @@ void MessageDecoder::Clear() {
 	handlers.clear();
 }
 
-void MessageDecoder::ProcessMessage(const void* message, size_t length) {
+void MessageDecoder::SetTraceRing(TraceRing* ring) {
+	traceRing = ring;
+}
+
+void MessageDecoder::ProcessMessage(const void* message, size_t length, const TransportTimes* times) {
 	// extract message type: first 1 byte of message
 	if (length == 0) {
 		return;
 	}
 	eMessageType type = (eMessageType)*reinterpret_cast<const uint8_t*>(message);
+
+	// unwrap traced messages, and process the wrapped message in its trace scope
+	if (type == eMessageType::TRACE) {
+		if (length < TraceMessage::HeaderSize) {
+			return;
+		}
+		uint64_t traceId;
+		int64_t sendTime;
+		Serializer ser;
+		ser.Set(message, TraceMessage::HeaderSize);
+		ser >> sendTime;
+		ser >> traceId;
+
+		const uint8_t* wrapped = (const uint8_t*)message + TraceMessage::HeaderSize;
+		size_t wrappedLength = length - TraceMessage::HeaderSize;
+		if (wrappedLength > 0 && (eMessageType)*wrapped == eMessageType::TRACE) {
+			return; // nesting traces is pointless
+		}
+
+		TraceScope scope(traceRing, traceId);
+		if (TraceScope::IsActive()) {
+			TraceScope::Record(eTraceStage::CLIENT_SEND, sendTime);
+			if (times) {
+				TraceScope::Record(eTraceStage::DATAGRAM_RECEIVED, times->datagramReceived);
+				TraceScope::Record(eTraceStage::PACKET_DELIVERED, times->packetDelivered);
+			}
+		}
+		ProcessMessage(wrapped, wrappedLength, nullptr);
+		return;
+	}
+
+	// process batched messages one by one, in order
+	if (type == eMessageType::BATCH) {
+		if (length < BatchMessage::HeaderSize) {
+			return;
+		}
+		uint16_t count;
+		Serializer ser;
+		ser.Set((const uint8_t*)message + 1, 2);
+		ser >> count;
+
+		const uint8_t* current = (const uint8_t*)message + BatchMessage::HeaderSize;
+		const uint8_t* end = (const uint8_t*)message + length;
+		for (; count > 0; count--) {
+			if (end - current < 2) {
+				return;
+			}
+			uint16_t messageLength;
+			ser.Set(current, 2);
+			ser >> messageLength;
+			current += 2;
+			if (end - current < messageLength) {
+				return;
+			}
+			if (messageLength > 0 && (eMessageType)*current != eMessageType::BATCH) {
+				ProcessMessage(current, messageLength, times);
+			}
+			current += messageLength;
+		}
+		return;
+	}
+
 	// find and call appropriate handler, if any
 	auto it = handlers.find(type);
 	if (it == handlers.end()) {
 		return;
 	}
+	TraceScope::Record(eTraceStage::MESSAGE_DISPATCHED);
 	it->second(message, length);
 }
 
@@ -45,6 +118,9 @@ std::vector<uint8_t> ServoMessage::Serialize() const {
 	ser << (uint8_t)action;
 	ser << channel;
 	ser << state;
+	if (action == QUERY || action == REPLY) {
+		ser << requestId;
+	}
 	return ser.Get();
 }
 
@@ -53,10 +129,21 @@ bool ServoMessage::Deserlialize(const void* data, size_t size) {
 		return false;
 	}
 
+	uint8_t rawAction = ((const uint8_t*)data)[1];
+	bool hasRequestId = rawAction == QUERY || rawAction == REPLY;
+	size_t serializedSize = SerializedSize() + (hasRequestId ? sizeof(requestId) : 0);
+	if (size < serializedSize) {
+		return false;
+	}
+
 	Serializer ser;
-	ser.Set(data, SerializedSize());
+	ser.Set(data, serializedSize);
 
 	eMessageType type;
+	requestId = 0;
+	if (hasRequestId) {
+		ser >> requestId;
+	}
 	ser >> state;
 	ser >> channel;
 	ser >> (uint8_t&)action;
@@ -68,6 +155,7 @@ bool ServoMessage::Deserlialize(const void* data, size_t size) {
 	return true;
 }
 
+// size without the request ID
 constexpr size_t ServoMessage::SerializedSize() {
 	return sizeof(eMessageType) + sizeof(action) + sizeof(channel) + sizeof(state);
 }
@@ -75,6 +163,25 @@ constexpr size_t ServoMessage::SerializedSize() {
 
 // Authentication message
 
+// the token keys a MAC, the purpose keeps the ID and the proofs apart
+static uint64_t TokenMac(uint64_t token, uint8_t purpose, uint64_t value) {
+	Serializer key;
+	key << token;
+	auto keyData = key.Get();
+	Serializer message;
+	message << value << purpose;
+	auto messageData = message.Get();
+	return RcpSipHash::hash(RcpSipHash::makeKey(keyData.data(), keyData.size()), messageData.data(), messageData.size());
+}
+
+uint64_t ConnectionMessage::GetSessionId(uint64_t token) {
+	return TokenMac(token, 1, 0);
+}
+
+uint64_t ConnectionMessage::GetResumeProof(uint64_t token, uint64_t challenge) {
+	return TokenMac(token, 2, challenge);
+}
+
 std::vector<uint8_t> ConnectionMessage::Serialize() const {
 	Serializer ser;
 	ser << (uint8_t)eMessageType::CONNECTION;
@@ -82,6 +189,14 @@ std::vector<uint8_t> ConnectionMessage::Serialize() const {
 	switch (action) {
 		case ConnectionMessage::CONNECTION_REPLY:
 			ser << isOk;
+			ser << session;
+			break;
+		case ConnectionMessage::RESUME_REQUEST:
+			ser << session;
+			break;
+		case ConnectionMessage::RESUME_CHALLENGE:
+		case ConnectionMessage::RESUME_PROOF:
+			ser << challenge;
 			break;
 		case ConnectionMessage::PASSWORD_REPLY:
 			ser << (uint32_t)password.size();
@@ -115,9 +230,32 @@ bool ConnectionMessage::Deserlialize(const void* data, size_t size) {
 			if (size < 3) {
 				return false;
 			}
-			ser.Set((uint8_t*)data + 2, 1);
+			// servers before sessions only sent isOk
+			session = 0;
+			if (size < 11) {
+				ser.Set((uint8_t*)data + 2, 1);
+			}
+			else {
+				ser.Set((uint8_t*)data + 2, 9);
+				ser >> session;
+			}
 			ser >> isOk;
 			break;
+		case ConnectionMessage::RESUME_REQUEST:
+			if (size < 10) {
+				return false;
+			}
+			ser.Set((uint8_t*)data + 2, 8);
+			ser >> session;
+			break;
+		case ConnectionMessage::RESUME_CHALLENGE:
+		case ConnectionMessage::RESUME_PROOF:
+			if (size < 10) {
+				return false;
+			}
+			ser.Set((uint8_t*)data + 2, 8);
+			ser >> challenge;
+			break;
 		case ConnectionMessage::PASSWORD_REPLY:
 			if (size < 6) {
 				return false;
@@ -138,44 +276,212 @@ bool ConnectionMessage::Deserlialize(const void* data, size_t size) {
 	return true;
 }
 
+// Trace wrapper
+
+std::vector<uint8_t> TraceMessage::Serialize() const {
+	Serializer ser(HeaderSize + message.size());
+	ser << (uint8_t)eMessageType::TRACE;
+	ser << traceId;
+	ser << sendTime;
+	std::vector<uint8_t> data = ser.Get();
+	data.insert(data.end(), message.begin(), message.end());
+	return data;
+}
+
+bool TraceMessage::Deserlialize(const void* data, size_t size) {
+	if (size < HeaderSize) {
+		return false;
+	}
+
+	eMessageType type;
+	Serializer ser;
+	ser.Set(data, HeaderSize);
+	ser >> sendTime;
+	ser >> traceId;
+	ser >> (uint8_t&)type;
+
+	if (type != eMessageType::TRACE) {
+		return false;
+	}
+
+	message.assign((const uint8_t*)data + HeaderSize, (const uint8_t*)data + size);
+	return true;
+}
+
+
+// Batch
+
+size_t BatchMessage::GetSize() const {
+	size_t size = HeaderSize;
+	for (auto& message : messages) {
+		size += 2 + message.size();
+	}
+	return size;
+}
+
+std::vector<uint8_t> BatchMessage::Serialize() const {
+	Serializer ser(HeaderSize);
+	ser << (uint8_t)eMessageType::BATCH;
+	ser << (uint16_t)messages.size();
+	std::vector<uint8_t> data = ser.Get();
+	data.reserve(GetSize());
+	for (auto& message : messages) {
+		ser.Clear();
+		ser << (uint16_t)message.size();
+		data.insert(data.end(), ser.Get().begin(), ser.Get().end());
+		data.insert(data.end(), message.begin(), message.end());
+	}
+	return data;
+}
+
+bool BatchMessage::Deserlialize(const void* data, size_t size) {
+	if (size < HeaderSize) {
+		return false;
+	}
+
+	eMessageType type;
+	uint16_t count;
+	Serializer ser;
+	ser.Set(data, HeaderSize);
+	ser >> count;
+	ser >> (uint8_t&)type;
+
+	if (type != eMessageType::BATCH) {
+		return false;
+	}
+
+	const uint8_t* current = (const uint8_t*)data + HeaderSize;
+	const uint8_t* end = (const uint8_t*)data + size;
+	messages.resize(count);
+	for (auto& message : messages) {
+		uint16_t messageLength;
+		if (end - current < 2) {
+			return false;
+		}
+		ser.Set(current, 2);
+		ser >> messageLength;
+		current += 2;
+		if (end - current < messageLength) {
+			return false;
+		}
+		message.assign(current, current + messageLength);
+		current += messageLength;
+	}
+
+	return true;
+}
+
+
+// Replication
+
+size_t ReplicationMessage::GetSize() const {
+	return HeaderSize + GetChangesSize() + sessions.size() * (8 + 1);
+}
+
+size_t ReplicationMessage::GetChangesSize() const {
+	size_t size = changes.size() * 4;
+	for (auto& v : changes) {
+		size += Serializer::VarintSize(v.channel);
+	}
+	return size;
+}
+
+std::vector<uint8_t> ReplicationMessage::Serialize() const {
+	Serializer ser(GetSize());
+	ser << (uint8_t)eMessageType::REPLICATION;
+	ser << flags;
+	ser << time;
+	ser << (uint32_t)changes.size();
+	ser << (uint32_t)sessions.size();
+	ser << (uint32_t)GetChangesSize();
+	for (auto& v : changes) {
+		ser << Serializer::Varint(v.channel);
+		ser << v.state;
+	}
+	for (auto& v : sessions) {
+		ser << v.token;
+		ser << v.isOpen;
+	}
+	return ser.Get();
+}
+
+bool ReplicationMessage::Deserlialize(const void* data, size_t size) {
+	if (size < HeaderSize) {
+		return false;
+	}
+
+	eMessageType type;
+	uint32_t numChanges, numSessions, changesSize;
+	Serializer ser;
+	ser.Set(data, HeaderSize);
+	ser >> changesSize;
+	ser >> numSessions;
+	ser >> numChanges;
+	ser >> time;
+	ser >> flags;
+	ser >> (uint8_t&)type;
+
+	// a change takes 5 bytes at least
+	size_t sessionsSize = (size_t)numSessions * (8 + 1);
+	if (type != eMessageType::REPLICATION || size != HeaderSize + changesSize + sessionsSize || changesSize < (size_t)numChanges * (1 + 4)) {
+		return false;
+	}
+
+	const uint8_t* current = (const uint8_t*)data + HeaderSize;
+	ser.Set(current, changesSize);
+	changes.resize(numChanges);
+	for (; numChanges > 0; numChanges--) {
+		ser >> changes[numChanges - 1].state;
+		ser >> Serializer::Varint(changes[numChanges - 1].channel);
+	}
+	if (ser.IsFailed() || ser.Size() != 0) {
+		return false;
+	}
+	ser.Set(current + changesSize, sessionsSize);
+	sessions.resize(numSessions);
+	for (; numSessions > 0; numSessions--) {
+		ser >> sessions[numSessions - 1].isOpen;
+		ser >> sessions[numSessions - 1].token;
+	}
+
+	return true;
+}
+
+
 // Device enumeration
 
 std::vector<uint8_t> EnumDevicesMessage::Serialize() const {
 	Serializer ser;
 	ser << (uint8_t)eMessageType::ENUM_DEVICES;
-	ser << (uint32_t)devices.size();
 	for (auto v : devices) {
 		ser << (uint8_t)v.type;
-		ser << v.channelCount;
+		ser << Serializer::Varint(v.channelCount);
 	}
+	ser << Serializer::Varint((uint32_t)devices.size());
 	return ser.Get();
 }
 
 bool EnumDevicesMessage::Deserlialize(const void* data, size_t size) {
-	if (size < 5) {
-		return false;
-	}
-
 	eMessageType type;
-	uint32_t numDevs;
+	uint32_t numDevs = 0;
 
 	Serializer ser;
-	ser.Set(data, 5);
-	ser >> numDevs;
-	ser >> (uint8_t&)type;
+	ser.Set(data, size);
+	ser >> Serializer::Varint(numDevs);
 
-	if (type != eMessageType::ENUM_DEVICES || size < 5 + numDevs*(sizeof(DeviceInfo::type) + sizeof(DeviceInfo::channelCount))) {
+	// a device takes 2 bytes at least, the type 1
+	if (ser.IsFailed() || ser.Size() < 1 || numDevs > (ser.Size() - 1) / 2) {
 		return false;
 	}
 
-	ser.Set((uint8_t*)data + 5, size - 5);
 	devices.resize(numDevs);
 	for (; numDevs > 0; numDevs--) {
-		ser >> devices[numDevs - 1].channelCount;
+		ser >> Serializer::Varint(devices[numDevs - 1].channelCount);
 		ser >> (uint8_t&)devices[numDevs - 1].type;
 	}
+	ser >> (uint8_t&)type;
 
-	return true;
+	return !ser.IsFailed() && ser.Size() == 0 && type == eMessageType::ENUM_DEVICES;
 }
 
 
@@ -186,38 +492,34 @@ std::vector<uint8_t> EnumChannelsMessage::Serialize() const {
 	Serializer ser;
 	ser << (uint8_t)eMessageType::ENUM_CHANNELS;
 	ser << (uint8_t)type;
-	ser << (uint32_t)channels.size();
 	for (auto v : channels) {
-		ser << v;
+		ser << Serializer::Varint(v);
 	}
+	ser << Serializer::Varint((uint32_t)channels.size());
 	return ser.Get();
 }
 
 bool EnumChannelsMessage::Deserlialize(const void* data, size_t size) {
-	if (size < 6) {
-		return false;
-	}
-
 	eMessageType msgType;
-	uint32_t numChannels;
+	uint32_t numChannels = 0;
 
 	Serializer ser;
-	ser.Set(data, 6);
-	ser >> numChannels;
-	ser >> (uint8_t&)type;
-	ser >> (uint8_t&)msgType;
+	ser.Set(data, size);
+	ser >> Serializer::Varint(numChannels);
 
-	if (msgType != eMessageType::ENUM_CHANNELS || size < 6 + numChannels*sizeof(int32_t)) {
+	// a channel takes a byte at least, the types 2
+	if (ser.IsFailed() || ser.Size() < 2 || numChannels > ser.Size() - 2) {
 		return false;
 	}
 
-	ser.Set((uint8_t*)data + 6, size - 6);
 	channels.resize(numChannels);
 	for (; numChannels > 0; numChannels--) {
-		ser >> channels[numChannels - 1];
+		ser >> Serializer::Varint(channels[numChannels - 1]);
 	}
+	ser >> (uint8_t&)type;
+	ser >> (uint8_t&)msgType;
 
-	return true;
+	return !ser.IsFailed() && ser.Size() == 0 && msgType == eMessageType::ENUM_CHANNELS;
 }
 
 
@@ -231,7 +533,12 @@ bool operator==(const ConnectionMessage& lhs, const ConnectionMessage& rhs) {
 	}
 	switch (lhs.action) {
 		case ConnectionMessage::CONNECTION_REPLY:
-			return lhs.isOk == rhs.isOk;
+			return lhs.isOk == rhs.isOk && lhs.session == rhs.session;
+		case ConnectionMessage::RESUME_REQUEST:
+			return lhs.session == rhs.session;
+		case ConnectionMessage::RESUME_CHALLENGE:
+		case ConnectionMessage::RESUME_PROOF:
+			return lhs.challenge == rhs.challenge;
 		case ConnectionMessage::CONNECTION_REQUEST:
 			return true;
 		case ConnectionMessage::PASSWORD_REPLY:
@@ -5,6 +5,8 @@
 #include <functional>
 #include <map>
 
+class TraceRing;
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // All the network messages and commands that are required for the remote control
@@ -24,6 +26,9 @@ enum class eMessageType : uint8_t {
 	CONNECTION = 1,
 	ENUM_DEVICES = 2,
 	ENUM_CHANNELS = 3,
+	TRACE = 4,
+	BATCH = 5,
+	REPLICATION = 6,
 	DEVICE_SERVO = 10,
 	DEVICE_PWM = 11,
 	DEVICE_ADJUSTABLE_PWM = 12,
@@ -31,16 +36,33 @@ enum class eMessageType : uint8_t {
 
 
 /// Stores handlers to decode and process different message types.
+/// Traced messages are unwrapped here and their stages are recorded into the
+/// trace ring, if one is set. Batches are unwrapped and their messages are
+/// processed one by one, in order.
 class MessageDecoder {
 public:
 	using HandlerType = std::function<void(const void*, size_t)>;
+
+	/// Timestamps of the network stages the message went through, in trace format.
+	/// Only used for traced messages.
+	struct TransportTimes {
+		int64_t datagramReceived;
+		int64_t packetDelivered;
+	};
+
+	MessageDecoder();
+
 	void SetHandler(eMessageType type, HandlerType handler);
 	void ClearHandler(eMessageType type);
 	void Clear();
 
-	void ProcessMessage(const void* message, size_t length);
+	/// Set where to record the stages of traced messages. Null disables tracing.
+	void SetTraceRing(TraceRing* ring);
+
+	void ProcessMessage(const void* message, size_t length, const TransportTimes* times = nullptr);
 private:
 	std::map<eMessageType, HandlerType> handlers;
+	TraceRing* traceRing;
 };
 
 
@@ -56,6 +78,8 @@ struct MessageBase {
 };
 
 /// Command for servo providers.
+/// Queries carry a request ID which the server copies into the reply, so that
+/// a client can have any number of queries in flight. SET commands don't have it.
 struct ServoMessage : public MessageBase {
 	enum eAction : uint8_t {
 		SET = 1,
@@ -65,6 +89,7 @@ struct ServoMessage : public MessageBase {
 	eAction action;
 	int32_t channel;
 	float state;
+	uint32_t requestId = 0;
 
 	std::vector<uint8_t> Serialize() const override;
 	bool Deserlialize(const void* data, size_t size) override;
@@ -73,6 +98,13 @@ struct ServoMessage : public MessageBase {
 
 
 /// Authentication messages.
+/// An accepting CONNECTION_REPLY carries the session's token, which a client can
+/// later resume the session with, on the same server or its standby, without
+/// authenticating again.
+/// The token itself never goes back to the server: a RESUME_REQUEST names the
+/// session by its ID, the server answers with a RESUME_CHALLENGE of a random
+/// nonce, and the client proves it holds the token by a RESUME_PROOF, the MAC of
+/// the nonce keyed with the token.
 struct ConnectionMessage : public MessageBase {
 	enum eAction : uint8_t {
 		CONNECTION_REQUEST = 1,
@@ -80,10 +112,15 @@ struct ConnectionMessage : public MessageBase {
 		PASSWORD_REQUEST = 3,
 		PASSWORD_REPLY = 4,
 		DISCONNECT = 5,
+		RESUME_REQUEST = 6,
+		RESUME_CHALLENGE = 7,
+		RESUME_PROOF = 8,
 	};
 	eAction action;
 	bool isOk;
 	std::vector<uint8_t> password;
+	uint64_t session = 0; // CONNECTION_REPLY: the token, RESUME_REQUEST: its ID
+	uint64_t challenge = 0; // RESUME_CHALLENGE: the nonce, RESUME_PROOF: its MAC
 
 	ConnectionMessage() = default;
 	ConnectionMessage(eAction action, bool isOk = false) : action(action), isOk(isOk) {
@@ -95,12 +132,93 @@ struct ConnectionMessage : public MessageBase {
 	{
 	}
 
+	/// Get the ID a session is resumed by, which does not reveal its token.
+	static uint64_t GetSessionId(uint64_t token);
+	/// Get the proof of holding the session's token, for the server's challenge.
+	static uint64_t GetResumeProof(uint64_t token, uint64_t challenge);
+
+	std::vector<uint8_t> Serialize() const override;
+	bool Deserlialize(const void* data, size_t size) override;
+};
+
+
+/// Wraps another message with a trace context.
+/// Layout: type, trace ID, client's send time, then the wrapped message as is.
+struct TraceMessage : public MessageBase {
+	static const size_t HeaderSize = 1 + 8 + 8;
+
+	uint64_t traceId;
+	int64_t sendTime; // nanoseconds, client's steady clock
+	std::vector<uint8_t> message; // the serialized wrapped message
+
+	TraceMessage() = default;
+	TraceMessage(uint64_t traceId, int64_t sendTime, const MessageBase& wrapped)
+		: traceId(traceId), sendTime(sendTime), message(wrapped.Serialize())
+	{
+	}
+
+	std::vector<uint8_t> Serialize() const override;
+	bool Deserlialize(const void* data, size_t size) override;
+};
+
+
+/// Several messages in a single packet.
+/// Layout: type, message count, then the length and content of each message.
+/// Batches can't be nested.
+struct BatchMessage : public MessageBase {
+	static const size_t HeaderSize = 1 + 2;
+	static const size_t MaxMessages = 0xFFFF;
+
+	std::vector<std::vector<uint8_t>> messages; // serialized messages
+
+	BatchMessage() = default;
+
+	/// Append a message to the batch.
+	void Add(const MessageBase& message) { messages.push_back(message.Serialize()); }
+	/// Get the serialized size of the batch.
+	size_t GetSize() const;
+
+	std::vector<uint8_t> Serialize() const override;
+	bool Deserlialize(const void* data, size_t size) override;
+};
+
+
+/// State changes a primary server streams to its standby, see StateReplicator.
+/// Layout: type, flags, time, change count, session count, byte size of the changes,
+/// then the changes, a varint channel and the state each, and the sessions.
+struct ReplicationMessage : public MessageBase {
+	static const size_t HeaderSize = 1 + 1 + 8 + 4 + 4 + 4;
+
+	enum eFlags : uint8_t {
+		SNAPSHOT = 1, // the changes are all channels, not only the changed ones
+	};
+
+	struct ChannelState {
+		int32_t channel;
+		float state;
+	};
+	struct Session {
+		uint64_t token;
+		bool isOpen; // false if the client has disconnected
+	};
+
+	uint8_t flags = 0;
+	int64_t time = 0; // nanoseconds, primary's steady clock, when the oldest change was applied
+	std::vector<ChannelState> changes;
+	std::vector<Session> sessions;
+
+	/// Get the serialized size of the message.
+	size_t GetSize() const;
+
 	std::vector<uint8_t> Serialize() const override;
 	bool Deserlialize(const void* data, size_t size) override;
+private:
+	size_t GetChangesSize() const;
 };
 
 
 /// Device and channel enumeration, other global parameters.
+/// Layout: type, then type and varint channel count per device, varint device count.
 struct EnumDevicesMessage : public MessageBase {
 	enum eDeviceType : uint8_t {
 		SERVO = 1,
@@ -119,6 +237,7 @@ struct EnumDevicesMessage : public MessageBase {
 	bool Deserlialize(const void* data, size_t size) override;
 };
 
+/// Layout: type, device type, varint channels, varint channel count.
 struct EnumChannelsMessage : public MessageBase {
 	enum eDeviceType : uint8_t {
 		SERVO = 1,
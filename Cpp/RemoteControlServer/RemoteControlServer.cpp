@@ -9,9 +9,12 @@ using namespace std::chrono;
 ////////////////////////////////////////////////////////////////////////////////
 // Constructor and destructor
 
-RemoteControlServer::RemoteControlServer() {
+RemoteControlServer::RemoteControlServer() : socket(new RcpSocket()) {
 	// set initial state
 	state = DISCONNECTED;
+	session = 0;
+	isResumed = false;
+	servoAdapter.SetManager(&servoManager);
 
 
 	// register handlers
@@ -26,6 +29,8 @@ RemoteControlServer::RemoteControlServer() {
 
 RemoteControlServer::~RemoteControlServer() {
 	Disconnect();
+	StopMessageThread(); // the client may have closed the connection, but the thread is still to be joined
+	replicator.Stop(); // a standby's thread sets the channels
 }
 
 
@@ -36,31 +41,152 @@ RemoteControlServer::~RemoteControlServer() {
 bool RemoteControlServer::Listen(int timeout) {
 	// try accepting a connection on the socket
 	try {
-		RcpPacket packet;
-		socket.accept();
-		if (!socket.receive(packet)) {
-			socket.disconnect();
+		socket->accept();
+		return ReceiveConnectionRequest();
+	}
+	catch (RcpException& e) {
+		std::cout << e.what() << std::endl;
+		socket->disconnect(); // whatever state it is in, just close it
+		return false;
+	}
+}
+
+bool RemoteControlServer::Listen(RcpListener& listener, int timeout) {
+	if (state != DISCONNECTED) {
+		return false;
+	}
+	auto session = listener.accept(timeout);
+	if (!session) {
+		return false;
+	}
+	// the message thread of the last session may still be finishing with the old socket
+	if (messageThread.joinable()) {
+		messageThread.join();
+	}
+	socket = std::move(session);
+	if (realTime) {
+		socket->setRealTime(true);
+	}
+	try {
+		return ReceiveConnectionRequest();
+	}
+	catch (RcpException& e) {
+		std::cout << e.what() << std::endl;
+		socket->disconnect();
+		return false;
+	}
+}
+
+bool RemoteControlServer::ReceiveConnectionRequest() {
+	RcpPacket packet;
+	if (!socket->receive(packet)) {
+		socket->disconnect();
+		return false;
+	}
+	ConnectionMessage msg;
+	bool isGood = msg.Deserlialize(packet.getData(), packet.getDataSize());
+	if (!isGood || (msg.action != ConnectionMessage::CONNECTION_REQUEST && msg.action != ConnectionMessage::RESUME_REQUEST)) {
+		socket->disconnect();
+		return false;
+	}
+
+	// a standby serves no clients while its primary is alive, but the client may have noticed it's lost first
+	if (replicator.GetRole() == StateReplicator::STANDBY && !replicator.WaitTakeover(replicator.GetTakeoverInterval())) {
+		Decline();
+		return false;
+	}
+
+	session = 0;
+	isResumed = false;
+	if (msg.action == ConnectionMessage::RESUME_REQUEST) {
+		uint64_t token = FindSession(msg.session);
+		if (token == 0 || !ProveResume(token)) {
+			Decline();
 			return false;
 		}
-		ConnectionMessage msg;
-		bool isGood = msg.Deserlialize(packet.getData(), packet.getDataSize());
-		if (isGood && msg.action == ConnectionMessage::CONNECTION_REQUEST) {
-			state = HALF_OPEN;
-			return true;
-		}
-		else {
-			socket.disconnect();
-			return false;
+		// it was authenticated when it was opened
+		session = token;
+		isResumed = true;
+		state = AUTHENTICATED;
+		return true;
+	}
+	state = HALF_OPEN;
+	return true;
+}
+
+uint64_t RemoteControlServer::FindSession(uint64_t id) const {
+	std::lock_guard<std::mutex> lk(sessionLock);
+	for (auto token : sessions) {
+		if (ConnectionMessage::GetSessionId(token) == id) {
+			return token;
 		}
 	}
-	catch (RcpException& e) {
-		std::cout << e.what() << std::endl;
-		socket.disconnect(); // whatever state it is in, just close it
+	return 0;
+}
+
+bool RemoteControlServer::ProveResume(uint64_t token) {
+	std::random_device random;
+	ConnectionMessage challenge{ ConnectionMessage::RESUME_CHALLENGE };
+	challenge.challenge = ((uint64_t)random() << 32) | random();
+	auto data = challenge.Serialize();
+	socket->send(data.data(), data.size(), true);
+
+	// only the client the token was given to can answer
+	RcpPacket packet;
+	ConnectionMessage proof;
+	if (!socket->receive(packet, ResumeTimeout)
+		|| !proof.Deserlialize(packet.getData(), packet.getDataSize())
+		|| proof.action != ConnectionMessage::RESUME_PROOF
+		|| proof.challenge != ConnectionMessage::GetResumeProof(token, challenge.challenge)) {
 		return false;
 	}
+	// the client may have disconnected from the primary meanwhile
+	std::lock_guard<std::mutex> lk(sessionLock);
+	return sessions.count(token) > 0;
+}
+
+void RemoteControlServer::Decline() {
+	try {
+		ConnectionMessage reply{ ConnectionMessage::CONNECTION_REPLY, false };
+		auto data = reply.Serialize();
+		socket->send(data.data(), data.size(), true);
+	}
+	catch (RcpException&) {}
+	state = DISCONNECTED;
+	socket->disconnect();
+}
+
+void RemoteControlServer::OpenSession() {
+	// tokens are credentials, so each is 64 fresh bits of the system's random source
+	std::random_device random;
+	uint64_t token;
+	{
+		std::lock_guard<std::mutex> lk(sessionLock);
+		do {
+			token = ((uint64_t)random() << 32) | random();
+		} while (token == 0 || sessions.count(token) > 0);
+		sessions.insert(token);
+	}
+	session = token;
+	replicator.RecordSession(token, true);
+}
+
+void RemoteControlServer::CloseSession() {
+	uint64_t token = session.exchange(0);
+	if (token == 0) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lk(sessionLock);
+		sessions.erase(token);
+	}
+	replicator.RecordSession(token, false);
 }
 
 bool RemoteControlServer::Authenticate(int timeout) {
+	if (state == AUTHENTICATED && isResumed) {
+		return true;
+	}
 	if (state != HALF_OPEN) {
 		return false;
 	}
@@ -70,11 +196,11 @@ bool RemoteControlServer::Authenticate(int timeout) {
 		RcpPacket packet;
 		msg.action = ConnectionMessage::PASSWORD_REQUEST;
 		auto data = msg.Serialize();
-		socket.send(data.data(), data.size(), true);
+		socket->send(data.data(), data.size(), true);
 
 		// wait for client's response:
 		// it must be a PASSWORD_REPLY with the correct password
-		socket.receive(packet);
+		socket->receive(packet);
 		if (!msg.Deserlialize(packet.getData(), packet.getDataSize())) {
 			return false;
 		}
@@ -89,7 +215,7 @@ bool RemoteControlServer::Authenticate(int timeout) {
 		return isCorrect;
 	}
 	catch (RcpException e) {
-		if (!socket.isConnected()) {
+		if (!socket->isConnected()) {
 			state = DISCONNECTED;
 		}
 		return false;
@@ -103,10 +229,16 @@ bool RemoteControlServer::Reply(bool accept, int timeout) {
 	}
 
 	ConnectionMessage message{ ConnectionMessage::CONNECTION_REPLY, accept };
+	if (accept) {
+		if (!isResumed) {
+			OpenSession();
+		}
+		message.session = session;
+	}
 	
 	auto data = message.Serialize();
 	try {
-		socket.send(data.data(), data.size(), true);
+		socket->send(data.data(), data.size(), true);
 
 		if (accept == true) {
 			state = CONNECTED;
@@ -114,14 +246,14 @@ bool RemoteControlServer::Reply(bool accept, int timeout) {
 		}
 		else {
 			state = DISCONNECTED;
-			socket.disconnect();
+			socket->disconnect();
 		}
 		return accept;
 	}
 	catch (RcpException& e) {
 		std::cout << e.what() << std::endl;
 		state = DISCONNECTED;
-		socket.disconnect();
+		socket->disconnect();
 		return false;
 	}
 }
@@ -129,61 +261,24 @@ bool RemoteControlServer::Reply(bool accept, int timeout) {
 void RemoteControlServer::Disconnect() {
 	if (state == HALF_OPEN || state == AUTHENTICATED || state == CONNECTED) {
 		ConnectionMessage msg;
-		RcpPacket packet;
 		msg.action = ConnectionMessage::DISCONNECT;
 		auto data = msg.Serialize();
 
-		high_resolution_clock::time_point start, end; // DEBUG
-		high_resolution_clock::time_point start2, end2; // DEBUG
-
 		try {
 			// shut down message thread
 			StopMessageThread();
 
-			// send a disconnect indication
-			socket.send(data.data(), data.size(), true);
-
-			// receive a disconnect response
-			int timeout = 5000;
-			auto startTime = steady_clock::now();
-			int timeLeft;
-			do {
-				timeLeft = duration_cast<milliseconds>(steady_clock::now() - startTime).count() + timeout;
-				std::cout << timeLeft << std::endl;
-				start = high_resolution_clock::now();
-				if (!socket.receive(packet, timeLeft)) {
-					//std::cout << "did not get disconnect response";
-					continue;
-				}
-				end = high_resolution_clock::now();
-				eMessageType type = *(eMessageType*)packet.getData();
-				if (type == eMessageType::CONNECTION) {
-					bool p = msg.Deserlialize(packet.getData(), packet.getDataSize());
-					if (p && msg.action == ConnectionMessage::DISCONNECT) {
-						//std::cout << "got proper disconnect response" << std::endl;
-						break;
-					}
-					else {
-						continue;
-					}
-				}
-				else {
-					messageDecoder.ProcessMessage(packet.getData(), packet.getDataSize());
-				}
-			} while (timeLeft > 0);
+			// send a disconnect indication, the socket delivers it before closing
+			socket->send(data.data(), data.size(), true);
 		}
 		catch (RcpException& e) {
 			std::cout << e.what() << std::endl;
 		}
 
+		// the connection closes in the background, the client's response is not waited for
+		CloseSession();
 		state = DISCONNECTED;
-		start2 = high_resolution_clock::now();
-		socket.disconnect();
-		end2 = high_resolution_clock::now();
-
-		std::cout << (double)duration_cast<microseconds>(end - start).count() * 0.001 << " ms" << std::endl; // DEBUG
-		std::cout << (double)duration_cast<microseconds>(end2 - start2).count() * 0.001 << " ms" << std::endl; // DEBUG
-
+		socket->disconnect();
 	}
 }
 
@@ -202,11 +297,11 @@ const std::vector<uint8_t>& RemoteControlServer::GetPassword() const {
 }
 
 bool RemoteControlServer::SetLocalPort(uint16_t port) {
-	return socket.bind(port);
+	return socket->bind(port);
 }
 
 uint16_t RemoteControlServer::GetLocalPort() const {
-	return socket.getLocalPort();
+	return socket->getLocalPort();
 }
 
 bool RemoteControlServer::IsConnected() const {
@@ -218,11 +313,142 @@ auto RemoteControlServer::GetConnectionState() const -> eConnectionState {
 }
 
 uint16_t RemoteControlServer::GetRemotePort() const {
-	return socket.getRemotePort();
+	return socket->getRemotePort();
 }
 
 std::string RemoteControlServer::GetRemoteAddress() const {
-	return socket.getRemoteAddress();
+	return socket->getRemoteAddress();
+}
+
+uint64_t RemoteControlServer::GetSession() const {
+	return session;
+}
+
+bool RemoteControlServer::IsResumed() const {
+	return isResumed;
+}
+
+ChannelManagerServo& RemoteControlServer::GetManagerServo() {
+	return servoManager;
+}
+
+const ChannelManagerServo& RemoteControlServer::GetManagerServo() const {
+	return servoManager;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Diagnostics
+
+void RemoteControlServer::SetTracing(bool enable, size_t capacity) {
+	if (enable) {
+		traceRing.reset(new TraceRing(capacity));
+	}
+	else {
+		traceRing.reset();
+	}
+	messageDecoder.SetTraceRing(traceRing.get());
+}
+
+TraceRing* RemoteControlServer::GetTraceRing() const {
+	return traceRing.get();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Hot standby
+
+bool RemoteControlServer::StartReplication(const std::string& address, uint16_t port, int timeout) {
+	std::vector<ReplicationMessage::ChannelState> snapshot;
+	for (auto it = servoManager.ChannelBegin(); it != servoManager.ChannelEnd(); ++it) {
+		snapshot.push_back({ it->channel, servoManager.GetState(it->channel) });
+	}
+	std::vector<uint64_t> openSessions;
+	{
+		std::lock_guard<std::mutex> lk(sessionLock);
+		openSessions.assign(sessions.begin(), sessions.end());
+	}
+	return replicator.Connect(address, port, snapshot, openSessions, timeout);
+}
+
+bool RemoteControlServer::SetReplicationPort(uint16_t port) {
+	return replicator.Bind(port);
+}
+
+uint16_t RemoteControlServer::GetReplicationPort() const {
+	return replicator.GetLocalPort();
+}
+
+bool RemoteControlServer::StartStandby(int timeout) {
+	auto changeHandler = [this](int32_t channel, float state) {
+		servoManager.SetState(state, channel);
+	};
+	auto sessionHandler = [this](uint64_t token, bool isOpen) {
+		std::lock_guard<std::mutex> lk(sessionLock);
+		if (isOpen) {
+			sessions.insert(token);
+		}
+		else {
+			sessions.erase(token);
+		}
+	};
+	return replicator.Accept(changeHandler, sessionHandler, timeout);
+}
+
+void RemoteControlServer::StopReplication() {
+	replicator.Stop();
+}
+
+void RemoteControlServer::SetReplicationTiming(unsigned batchMs, unsigned takeoverMs) {
+	replicator.SetTiming(batchMs, takeoverMs);
+}
+
+bool RemoteControlServer::IsStandby() const {
+	return replicator.GetRole() == StateReplicator::STANDBY;
+}
+
+bool RemoteControlServer::WaitTakeover(int timeout) {
+	return replicator.WaitTakeover(timeout);
+}
+
+StateReplicator::Statistics RemoteControlServer::GetReplicationStatistics() const {
+	return replicator.GetStatistics();
+}
+
+void RemoteControlServer::DBG_Crash() {
+	replicator.DBG_Kill();
+	// the message thread must not touch the socket as it's torn down
+	StopMessageThread();
+	socket->debug_kill();
+	state = DISCONNECTED;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Real-time
+
+bool RemoteControlServer::SetRealTime(bool enable, bool lockMemory) {
+	realTime = enable;
+	socket->setRealTime(enable);
+	if (!enable) {
+		return true;
+	}
+	WarmUp();
+	return !lockMemory || RcpRealTime::lockMemory();
+}
+
+bool RemoteControlServer::IsRealTime() const {
+	return realTime;
+}
+
+void RemoteControlServer::WarmUp() {
+	// a query changes nothing, and its reply cannot be sent without a connection
+	ServoMessage query;
+	query.action = ServoMessage::QUERY;
+	query.channel = 0;
+	query.state = 0.0f;
+	auto data = query.Serialize();
+	messageDecoder.ProcessMessage(data.data(), data.size());
 }
 
 
@@ -241,6 +467,15 @@ void RemoteControlServer::MH_Authentication(const void* message, size_t length)
 		case ConnectionMessage::CONNECTION_REQUEST:
 			// handled explicitly
 			break;
+		case ConnectionMessage::RESUME_REQUEST:
+			// handled explicitly
+			break;
+		case ConnectionMessage::RESUME_CHALLENGE:
+			// server should never get this
+			break;
+		case ConnectionMessage::RESUME_PROOF:
+			// handled explicitly
+			break;
 		case ConnectionMessage::PASSWORD_REQUEST:
 			// server should never get this
 			break;
@@ -253,44 +488,118 @@ void RemoteControlServer::MH_Authentication(const void* message, size_t length)
 		case ConnectionMessage::DISCONNECT:
 			// send a disconnect response to client
 			try {
-				socket.send(message, length, true);
+				socket->send(message, length, true);
 			}
 			catch (...) {}
-			// close connection
+			// close connection, the session ends with it
+			CloseSession();
 			state = DISCONNECTED;
-			socket.disconnect();
+			socket->disconnect();
 			// stop message thread
 			runMessageThread = false;
 	}
 }
 
 void RemoteControlServer::MH_Servo(const void* message, size_t length) {
+	ServoMessage msg;
+	ServoMessage reply;
+	bool isReply;
+	{
+		// commands are the steady state of a connection
+		RcpRealTime::NoAllocationScope noAllocation(realTime);
+		if (!msg.Deserlialize(message, length)) {
+			return;
+		}
+		isReply = servoAdapter.ProcessCommand(msg, reply);
+	}
+	if (msg.action == ServoMessage::SET) {
+		replicator.RecordChange(msg.channel, msg.state);
+	}
 
+	if (isReply) {
+		try {
+			auto data = reply.Serialize();
+			socket->send(data.data(), data.size(), true);
+		}
+		catch (RcpException&) {}
+	}
 }
 
 void RemoteControlServer::MH_DeviceEnum(const void* message, size_t length) {
+	EnumDevicesMessage msg;
+	if (!msg.Deserlialize(message, length)) {
+		return;
+	}
 
+	// servos are the only device type implemented so far
+	EnumDevicesMessage reply;
+	reply.devices.push_back({ EnumDevicesMessage::SERVO, (uint32_t)servoManager.GetNumChannels() });
+	try {
+		auto data = reply.Serialize();
+		socket->send(data.data(), data.size(), true);
+	}
+	catch (RcpException&) {}
 }
 
 void RemoteControlServer::MH_ChannelEnum(const void* message, size_t length) {
+	EnumChannelsMessage msg;
+	if (!msg.Deserlialize(message, length)) {
+		return;
+	}
 
+	EnumChannelsMessage reply;
+	reply.type = msg.type;
+	if (msg.type == EnumChannelsMessage::SERVO) {
+		for (auto it = servoManager.ChannelBegin(); it != servoManager.ChannelEnd(); ++it) {
+			reply.channels.push_back(it->channel);
+		}
+	}
+	try {
+		auto data = reply.Serialize();
+		socket->send(data.data(), data.size(), true);
+	}
+	catch (RcpException&) {}
 }
 
 
 
 void RemoteControlServer::MessageThreadFunc() {
+	// the same packet for all messages, its buffer is reused
+	RcpPacket packet;
+	if (realTime) {
+		RcpRealTime::prefaultStack();
+		packet.reserve(512);
+	}
+
 	while (runMessageThread) {
 		try {
-			RcpPacket packet;
-			socket.receive(packet);
-			messageDecoder.ProcessMessage(packet.getData(), packet.getDataSize());
+			if (!socket->receive(packet)) {
+				// the client closed without a DISCONNECT, and all it sent is processed
+				ConnectionLost();
+				return;
+			}
+			MessageDecoder::TransportTimes times{
+				TraceTimestamp(packet.getReceiveTime()),
+				TraceTimestamp(packet.getDeliveryTime())
+			};
+			messageDecoder.ProcessMessage(packet.getData(), packet.getDataSize(), &times);
 		}
-		catch (RcpException& e) {
-			
+		catch (RcpException&) {
+			// the connection timed out; spinning on a closed socket would eat a core
+			if (!socket->isConnected()) {
+				ConnectionLost();
+				return;
+			}
 		}
 	}
 }
 
+void RemoteControlServer::ConnectionLost() {
+	state = DISCONNECTED;
+	socket->disconnect();
+	runMessageThread = false;
+}
+
 void RemoteControlServer::StartMessageThread() {
 	if (!runMessageThread) {
 		// join old thread, if not done yet
@@ -308,7 +617,7 @@ void RemoteControlServer::StartMessageThread() {
 
 void RemoteControlServer::StopMessageThread() {
 	runMessageThread = false;
-	socket.cancel();
+	socket->cancel();
 	if (messageThread.joinable()) {
 		messageThread.join();
 	}
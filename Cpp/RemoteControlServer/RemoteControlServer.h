@@ -3,15 +3,22 @@
 #include "ChannelManagerServo.h"
 #include "ChannelAdapterServo.h"
 #include "Message.h"
+#include "LatencyTrace.h"
+#include "StateReplicator.h"
 
 #include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpListener.h>
 #include <RemoteControlProtocol/RcpPacket.h>
+#include <RemoteControlProtocol/RcpRealTime.h>
 
 #include <cstdint>
 #include <vector>
 #include <thread>
 #include <mutex>
 #include <atomic>
+#include <memory>
+#include <set>
+#include <random>
 
 class RemoteControlServer {
 public:
@@ -25,6 +32,9 @@ public:
 		CONNECTED,
 	};
 
+	/// Milliseconds a resuming client has to answer the challenge of its session's token.
+	static const int ResumeTimeout = 5000;
+
 public:
 	// --- --- ctor & dtor --- --- //
 	RemoteControlServer();
@@ -39,8 +49,15 @@ public:
 	/// occured and no connection was opened.
 	bool Listen(int timeout = std::numeric_limits<int>::max());
 
+	/// Take the next session of a listener shared by several servers, instead of listening on the own port.
+	/// The session's socket replaces the own one until the next Listen.
+	/// \return True if a client is waiting for further action.
+	bool Listen(RcpListener& listener, int timeout = std::numeric_limits<int>::max());
+
 	/// Optionally ask a client for password.
 	/// Can only be called on a half open connection resulting after Listen completed.
+	/// A resumed session is authenticated already, by the client proving it holds the
+	/// session's token while listening, it's not asked again.
 	/// \return True if the client has given the correct password.
 	bool Authenticate(int timeout = std::numeric_limits<int>::max());
 
@@ -70,17 +87,81 @@ public:
 	uint16_t GetRemotePort() const;
 	std::string GetRemoteAddress() const;
 
+	/// Get the token of the current session, 0 before it's accepted.
+	uint64_t GetSession() const;
+	/// Check if the client resumed a session, on this server or on the primary this one stood by for.
+	bool IsResumed() const;
+
 
 	// --- --- manage hardware interfaces --- --- //
 
 	ChannelManagerServo& GetManagerServo();
 	const ChannelManagerServo& GetManagerServo() const;
 
+
+	// --- --- diagnostics --- --- //
+
+	/// Enable or disable recording of traced commands.
+	/// Only call when there's no connection, the message thread reads this.
+	/// \param enable True to start recording.
+	/// \param capacity Number of trace records kept in the ring.
+	void SetTracing(bool enable, size_t capacity = 65536);
+	/// Get the ring where traced commands are recorded, null if tracing is disabled.
+	/// The ring can be drained or dumped while the server is running.
+	TraceRing* GetTraceRing() const;
+
+
+	// --- --- hot standby --- --- //
+
+	/// Stream the channels' state and the sessions to a standby server, see StateReplicator.
+	/// Only call when there's no connection.
+	/// \return False if the standby could not be reached.
+	bool StartReplication(const std::string& address, uint16_t port, int timeout = 5000);
+
+	/// Set the port a standby takes its primary's connection on.
+	bool SetReplicationPort(uint16_t port);
+	uint16_t GetReplicationPort() const;
+
+	/// Become the standby of a primary server: wait for it to connect, then mirror its state.
+	/// Until the primary is lost, Listen declines clients, after waiting a takeover interval for it to happen.
+	/// \return False if no primary connected.
+	bool StartStandby(int timeout = std::numeric_limits<int>::max());
+
+	/// Stop streaming to the standby, which then takes over, or stop standing by, and serve clients.
+	void StopReplication();
+
+	/// Set how long state changes are batched, and how long a standby waits for its primary before taking over.
+	/// Only call when not replicating. See StateReplicator::SetTiming.
+	void SetReplicationTiming(unsigned batchMs, unsigned takeoverMs);
+
+	/// Check if the server mirrors a primary, and has not taken over yet.
+	bool IsStandby() const;
+
+	/// Wait until the server, a standby, takes over from its primary.
+	/// \return True if it has.
+	bool WaitTakeover(int timeout);
+
+	StateReplicator::Statistics GetReplicationStatistics() const;
+
+
+	// --- --- real-time --- --- //
+
+	/// Prepare the server for commands as fast from the first one as from the rest.
+	/// The sockets of connections preallocate and prefault what they need (see RcpSocket::setRealTime),
+	/// the decoding and dispatching of commands is warmed up, and the message thread faults its stack in.
+	/// In debug builds, executing servo commands asserts that it does not allocate, providers included.
+	/// Only call when there's no connection.
+	/// \param lockMemory Lock the process's memory as well, see RcpRealTime::lockMemory.
+	/// \return False if the memory could not be locked, the rest is done anyway.
+	bool SetRealTime(bool enable, bool lockMemory = false);
+	bool IsRealTime() const;
+
 	// DEBUG
 	eConnectionState DBG_State() const { return state; }
 	const std::thread& DBG_MessageThread() const { return messageThread; }
 	const std::atomic_bool& DBG_RunMessageThread() const { return runMessageThread; }
-	const RcpSocket& DBG_Socket() const { return socket; }
+	const RcpSocket& DBG_Socket() const { return *socket; }
+	void DBG_Crash(); // stop all traffic at once, without closing, as if the process died
 
 private:
 	// --- --- message handlers --- --- //
@@ -89,20 +170,38 @@ private:
 	void MH_DeviceEnum(const void* message, size_t length);
 	void MH_ChannelEnum(const void* message, size_t length);
 
+	bool ReceiveConnectionRequest(); // the first message of an accepted connection
+	uint64_t FindSession(uint64_t id) const; // the token of a session ID, 0 if unknown
+	bool ProveResume(uint64_t token); // challenge the resuming client to prove it holds the token
+	void Decline(); // refuse the connection request
+	void OpenSession(); // of an accepted connection that did not resume one
+	void CloseSession(); // the client or the server disconnected on purpose
+
 	// message processor thread
 	void MessageThreadFunc();
 	void StartMessageThread();
 	void StopMessageThread();
+	void ConnectionLost(); // called by the message thread when the client is gone
+	void WarmUp(); // pass a command through decoding and dispatching, without a connection
 private:
 	// connection
 	std::vector<uint8_t> password;
 	std::atomic<eConnectionState> state;
-	RcpSocket socket;
+	std::unique_ptr<RcpSocket> socket;
 
 	// processing
 	std::thread messageThread;
 	std::atomic_bool runMessageThread = false;
 	MessageDecoder messageDecoder;
+	std::unique_ptr<TraceRing> traceRing;
+	bool realTime = false;
+
+	// sessions, the ones of this server and those replicated from the primary
+	mutable std::mutex sessionLock;
+	std::set<uint64_t> sessions; // open, can be resumed
+	std::atomic<uint64_t> session; // of the current connection
+	std::atomic_bool isResumed;
+	StateReplicator replicator;
 
 	// answers to the client
 	std::mutex answerQueueLock;
@@ -3,8 +3,8 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 // General stuff
-Serializer::Serializer(size_t initialSize) {
-	byteStream.reserve(initialSize);
+Serializer::Serializer(size_t initialSize) : view(nullptr), viewSize(0), initialSize(initialSize), failed(false) {
+	// reserved lazily, a serializer that only reads never allocates
 }
 
 const std::vector<uint8_t>& Serializer::Get() const {
@@ -12,7 +12,119 @@ const std::vector<uint8_t>& Serializer::Get() const {
 }
 
 void Serializer::Set(const void* data, size_t size) {
-	byteStream.assign((uint8_t*)data, (uint8_t*)data + size);
+	byteStream.clear();
+	view = (const uint8_t*)data;
+	viewSize = size;
+	failed = false;
+}
+
+void Serializer::PrepareWrite() {
+	if (view) {
+		byteStream.assign(view, view + viewSize);
+		view = nullptr;
+		viewSize = 0;
+	}
+	if (byteStream.capacity() == 0) {
+		byteStream.reserve(initialSize);
+	}
+}
+
+const uint8_t* Serializer::Pop(size_t count) {
+	// values are read from the back, the bytes stay valid until the next write
+	if (view) {
+		if (viewSize < count) {
+			failed = true;
+			return nullptr;
+		}
+		viewSize -= count;
+		return view + viewSize;
+	}
+	if (byteStream.size() < count) {
+		failed = true;
+		return nullptr;
+	}
+	byteStream.resize(byteStream.size() - count);
+	return byteStream.data() + byteStream.size();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Varints
+//
+// A varint is the LEB128 encoding reversed: read from the back, the bytes come
+// in LEB128 order, the lowest 7 bits first, the top bit set on all but the
+// last. The bytes before the varint are never looked at to find where it ends.
+
+void Serializer::PushVarint(uint64_t value) {
+	PrepareWrite();
+	uint8_t bytes[10];
+	size_t length = 0;
+	do {
+		bytes[length++] = uint8_t(value & 0x7F) | 0x80;
+		value >>= 7;
+	} while (value != 0);
+	bytes[length - 1] &= 0x7F;
+	while (length > 0) {
+		byteStream.push_back(bytes[--length]);
+	}
+}
+
+bool Serializer::PopVarint(uint64_t& value) {
+	// with 8 bytes to read, the varints up to 56 bits are decoded at once
+	const uint8_t* end = view ? view + viewSize : byteStream.data() + byteStream.size();
+	if (Size() >= 8) {
+		// the 8 bytes before the end, the last one lowest, which puts the varint's bytes in LEB128 order
+		uint64_t word = 0;
+		for (int i = 1; i <= 8; ++i) {
+			word |= (uint64_t)end[-i] << (8 * (i - 1));
+		}
+		uint64_t last = ~word & 0x8080808080808080ULL;
+		if (last != 0) {
+			// the lowest byte without the top bit ends it, its index comes from a multiplication
+			uint64_t lowest = last & (~last + 1);
+			size_t length = size_t(((lowest >> 7) * 0x0102030405060708ULL) >> 56);
+			if (length < 8) {
+				word &= (1ULL << (8 * length)) - 1;
+			}
+			// squeeze out the top bits: pairs of bytes to 14 bits, those to 28, then to 56
+			word &= 0x7F7F7F7F7F7F7F7FULL;
+			word = ((word & 0x7F007F007F007F00ULL) >> 1) | (word & 0x007F007F007F007FULL);
+			word = ((word & 0x3FFF00003FFF0000ULL) >> 2) | (word & 0x00003FFF00003FFFULL);
+			word = ((word & 0x0FFFFFFF00000000ULL) >> 4) | (word & 0x000000000FFFFFFFULL);
+			Pop(length);
+			value = word;
+			return true;
+		}
+	}
+
+	// byte by byte near the front, and above 56 bits
+	uint64_t result = 0;
+	for (int i = 0; i < 10; ++i) {
+		const uint8_t* byte = Pop(1);
+		if (!byte) {
+			return false;
+		}
+		// the 10th byte has room for the 64th bit only
+		if (i == 9 && *byte > 1) {
+			break;
+		}
+		result |= (uint64_t)(*byte & 0x7F) << (7 * i);
+		if ((*byte & 0x80) == 0) {
+			value = result;
+			return true;
+		}
+	}
+	failed = true;
+	return false;
+}
+
+size_t Serializer::EncodedVarintSize(uint64_t value) {
+	size_t length = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		length++;
+	}
+	return length;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -20,11 +132,13 @@ void Serializer::Set(const void* data, size_t size) {
 
 
 Serializer& Serializer::operator<<(int8_t input) {
+	PrepareWrite();
 	byteStream.push_back(reinterpret_cast<uint8_t&>(input));
 	return *this;
 }
 
 Serializer& Serializer::operator<<(uint8_t input) {
+	PrepareWrite();
 	byteStream.push_back(input);
 	return *this;
 }
@@ -35,6 +149,7 @@ Serializer& Serializer::operator<<(int16_t input) {
 }
 
 Serializer& Serializer::operator<<(uint16_t input) {
+	PrepareWrite();
 	byteStream.push_back(input >> 8);
 	byteStream.push_back(input & 0xFF);
 	return *this;
@@ -46,7 +161,7 @@ Serializer& Serializer::operator<<(int32_t input) {
 }
 
 Serializer& Serializer::operator<<(uint32_t input) {
-	byteStream.reserve(sizeof(input));
+	PrepareWrite();
 	byteStream.push_back((input >> 24) & 0xFF);
 	byteStream.push_back((input >> 16) & 0xFF);
 	byteStream.push_back((input >> 8) & 0xFF);
@@ -60,7 +175,7 @@ Serializer& Serializer::operator<<(int64_t input) {
 }
 
 Serializer& Serializer::operator<<(uint64_t input) {
-	byteStream.reserve(sizeof(input));
+	PrepareWrite();
 	byteStream.push_back((input >> 56) & 0xFF);
 	byteStream.push_back((input >> 48) & 0xFF);
 	byteStream.push_back((input >> 40) & 0xFF);
@@ -95,6 +210,7 @@ Serializer& Serializer::operator<<(double input) {
 }
 
 Serializer& Serializer::operator<<(bool input) {
+	PrepareWrite();
 	byteStream.push_back(reinterpret_cast<uint8_t&>(input));
 	return *this;
 }
@@ -114,9 +230,8 @@ Serializer& Serializer::operator>>(int8_t& input) {
 }
 
 Serializer& Serializer::operator>>(uint8_t& input) {
-	if (byteStream.size() >= sizeof(input)) {
-		input = byteStream[byteStream.size() - 1];
-		byteStream.resize(byteStream.size() - sizeof(input));
+	if (const uint8_t* bytes = Pop(sizeof(input))) {
+		input = bytes[0];
 	}
 	return *this;
 }
@@ -127,10 +242,9 @@ Serializer& Serializer::operator>>(int16_t& input) {
 }
 
 Serializer& Serializer::operator>>(uint16_t& input) {
-	if (byteStream.size() >= sizeof(input)) {
-		input = (uint16_t)byteStream[byteStream.size() - 1];
-		input |= (uint16_t)byteStream[byteStream.size() - 2] << 8;
-		byteStream.resize(byteStream.size() - sizeof(input));
+	if (const uint8_t* bytes = Pop(sizeof(input))) {
+		input = (uint16_t)bytes[1];
+		input |= (uint16_t)bytes[0] << 8;
 	}
 	return *this;
 }
@@ -141,12 +255,11 @@ Serializer& Serializer::operator>>(int32_t& input) {
 }
 
 Serializer& Serializer::operator>>(uint32_t& input) {
-	if (byteStream.size() >= sizeof(input)) {
-		input = (uint32_t)byteStream[byteStream.size() - 1];
-		input |= (uint32_t)byteStream[byteStream.size() - 2] << 8;
-		input |= (uint32_t)byteStream[byteStream.size() - 3] << 16;
-		input |= (uint32_t)byteStream[byteStream.size() - 4] << 24;
-		byteStream.resize(byteStream.size() - sizeof(input));
+	if (const uint8_t* bytes = Pop(sizeof(input))) {
+		input = (uint32_t)bytes[3];
+		input |= (uint32_t)bytes[2] << 8;
+		input |= (uint32_t)bytes[1] << 16;
+		input |= (uint32_t)bytes[0] << 24;
 	}
 	return *this;
 }
@@ -157,16 +270,15 @@ Serializer& Serializer::operator>>(int64_t& input) {
 }
 
 Serializer& Serializer::operator>>(uint64_t& input) {
-	if (byteStream.size() >= sizeof(input)) {
-		input = (uint64_t)byteStream[byteStream.size() - 1];
-		input |= (uint64_t)byteStream[byteStream.size() - 2] << 8;
-		input |= (uint64_t)byteStream[byteStream.size() - 3] << 16;
-		input |= (uint64_t)byteStream[byteStream.size() - 4] << 24;
-		input |= (uint64_t)byteStream[byteStream.size() - 5] << 32;
-		input |= (uint64_t)byteStream[byteStream.size() - 6] << 40;
-		input |= (uint64_t)byteStream[byteStream.size() - 7] << 48;
-		input |= (uint64_t)byteStream[byteStream.size() - 8] << 56;
-		byteStream.resize(byteStream.size() - sizeof(input));
+	if (const uint8_t* bytes = Pop(sizeof(input))) {
+		input = (uint64_t)bytes[7];
+		input |= (uint64_t)bytes[6] << 8;
+		input |= (uint64_t)bytes[5] << 16;
+		input |= (uint64_t)bytes[4] << 24;
+		input |= (uint64_t)bytes[3] << 32;
+		input |= (uint64_t)bytes[2] << 40;
+		input |= (uint64_t)bytes[1] << 48;
+		input |= (uint64_t)bytes[0] << 56;
 	}
 	return *this;
 }
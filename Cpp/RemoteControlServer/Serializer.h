@@ -1,17 +1,62 @@
 #pragma once
 
 #include <cstdint>
+#include <cstddef>
 #include <vector>
+#include <limits>
 #include <type_traits>
 
+/// Values are written at the back, and read from the back, in reverse order.
+/// Fixed-width integers are big endian. Fields can opt in to variable-length
+/// encoding with Varint(), which shrinks small values:
+///		ser << Serializer::Varint(count);
+///		ser >> Serializer::Varint(count);
 class Serializer {
 public:
+	/// An integer field written in as few bytes as its value needs, see Varint().
+	template <class T>
+	struct VarintField {
+		T& value;
+	};
+
+	/// \param initialSize Bytes reserved at the first write.
 	Serializer(size_t initialSize = 32);
 
 	const std::vector<uint8_t>& Get() const;
+	/// Set data to read. It's read in place, without a copy, so it must stay valid while reading.
+	/// Writing copies it into the serializer first.
 	void Set(const void* data, size_t size);
-	inline void Clear() { byteStream.clear(); }
-	inline size_t Size() const { return byteStream.size(); }
+	inline void Clear() { byteStream.clear(); view = nullptr; viewSize = 0; failed = false; }
+	inline size_t Size() const { return view ? viewSize : byteStream.size(); }
+	/// A read found fewer bytes than it needed, or a malformed or too large varint.
+	/// The value read is left as it was. Cleared by Set and Clear.
+	inline bool IsFailed() const { return failed; }
+
+	/// Opt a field in to variable-length encoding. Unsigned values take 7 bits per byte,
+	/// like LEB128, 1 byte up to 127. Signed ones are zigzag encoded first, so that small
+	/// magnitudes of either sign are short, 1 byte from -64 to 63.
+	template <class T>
+	static VarintField<T> Varint(T& value) { static_assert(std::is_integral<T>::value, "varints are integers"); return{ value }; }
+	template <class T>
+	static VarintField<const T> Varint(const T& value) { static_assert(std::is_integral<T>::value, "varints are integers"); return{ value }; }
+
+	/// Bytes a value takes as a varint, 1 to 10.
+	template <class T>
+	static size_t VarintSize(T value) { return EncodedVarintSize(ToVarint(value)); }
+
+	template <class T>
+	Serializer& operator<<(VarintField<T> field) {
+		PushVarint(ToVarint(field.value));
+		return *this;
+	}
+	template <class T>
+	Serializer& operator>>(VarintField<T> field) {
+		uint64_t encoded;
+		if (PopVarint(encoded)) {
+			FromVarint(encoded, field.value);
+		}
+		return *this;
+	}
 
 	Serializer& operator<<(int8_t input);
 	Serializer& operator<<(uint8_t input);
@@ -39,6 +84,43 @@ public:
 	Serializer& operator>>(bool&);
 	Serializer& operator>>(const void*&);
 	Serializer& operator>>(void*&);
+private:
+	void PrepareWrite(); // reserve, and take over data set for reading
+	const uint8_t* Pop(size_t count); // remove the last count bytes, null and failed if there are not as many
+	void PushVarint(uint64_t value);
+	bool PopVarint(uint64_t& value); // false and failed if malformed
+	static size_t EncodedVarintSize(uint64_t value);
+
+	// zigzag maps signed values to unsigned ones: 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+	template <class T>
+	static typename std::enable_if<std::is_signed<T>::value, uint64_t>::type ToVarint(T value) {
+		return ((uint64_t)(int64_t)value << 1) ^ (uint64_t)((int64_t)value >> 63);
+	}
+	template <class T>
+	static typename std::enable_if<!std::is_signed<T>::value, uint64_t>::type ToVarint(T value) {
+		return (uint64_t)value;
+	}
+	template <class T>
+	typename std::enable_if<std::is_signed<T>::value>::type FromVarint(uint64_t encoded, T& value) {
+		int64_t decoded = (int64_t)(encoded >> 1) ^ -(int64_t)(encoded & 1);
+		if (decoded < std::numeric_limits<T>::min() || decoded > std::numeric_limits<T>::max()) {
+			failed = true;
+			return;
+		}
+		value = (T)decoded;
+	}
+	template <class T>
+	typename std::enable_if<!std::is_signed<T>::value>::type FromVarint(uint64_t encoded, T& value) {
+		if (encoded > (uint64_t)std::numeric_limits<T>::max()) {
+			failed = true;
+			return;
+		}
+		value = (T)encoded;
+	}
 private:
 	std::vector<uint8_t> byteStream;
+	const uint8_t* view; // data set for reading in place, null if byteStream is read
+	size_t viewSize;
+	size_t initialSize;
+	bool failed;
 };
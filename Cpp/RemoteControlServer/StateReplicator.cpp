@@ -0,0 +1,399 @@
+#include "StateReplicator.h"
+
+#include <algorithm>
+
+using namespace std::chrono;
+
+
+// the keepalive interval of RCP sockets
+static const unsigned DefaultTakeoverMs = 200;
+
+// a message fits in one datagram of a typical MTU, more are sent in several
+static const size_t MaxChangesPerMessage = 128;
+static const size_t MaxSessionsPerMessage = 32;
+
+
+static int64_t ToNanoseconds(steady_clock::time_point time) {
+	return duration_cast<nanoseconds>(time.time_since_epoch()).count();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Constructor and destructor
+
+StateReplicator::StateReplicator() :
+	batchInterval(5),
+	takeoverInterval(DefaultTakeoverMs),
+	totalLag(0),
+	lagSamples(0)
+{
+	role = NONE;
+	runThread = false;
+	isThreadDone = true;
+}
+
+
+StateReplicator::~StateReplicator() {
+	Stop();
+}
+
+
+void StateReplicator::SetTiming(unsigned batchMs, unsigned takeoverMs) {
+	batchInterval = milliseconds(batchMs);
+	takeoverInterval = milliseconds(std::max(takeoverMs, 4u));
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Primary
+
+bool StateReplicator::Connect(const std::string& address, uint16_t port, const std::vector<ReplicationMessage::ChannelState>& snapshot,
+							  const std::vector<uint64_t>& sessions, int timeout)
+{
+	Stop();
+	if (!socket.isBound() && !socket.bind(RcpSocket::AnyPort)) {
+		return false;
+	}
+	try {
+		socket.connect(address, port, timeout);
+	}
+	catch (RcpException&) {
+		socket.disconnect();
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lk(statisticsMutex);
+		statistics = Statistics();
+	}
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		pendingChanges.clear();
+		pendingSessions.clear();
+		// room for a batch of changes to all channels, recording them does not allocate then
+		pendingChanges.reserve(std::max<size_t>(snapshot.size(), MaxChangesPerMessage));
+	}
+
+	ReplicationMessage message;
+	message.flags = ReplicationMessage::SNAPSHOT;
+	message.time = ToNanoseconds(steady_clock::now());
+	message.changes = snapshot;
+	for (auto token : sessions) {
+		message.sessions.push_back({ token, true });
+	}
+	replicated.clear();
+	for (auto& change : snapshot) {
+		replicated[change.channel] = change.state;
+	}
+	if (!Send(message)) {
+		socket.disconnect();
+		return false;
+	}
+
+	role = PRIMARY;
+	runThread = true;
+	isThreadDone = false;
+	thread = std::thread([this] { PrimaryThreadFunc(); });
+	return true;
+}
+
+
+void StateReplicator::RecordChange(int32_t channel, float state) {
+	if (role != PRIMARY) {
+		return;
+	}
+	std::lock_guard<std::mutex> lk(mtx);
+	if (pendingChanges.empty() && pendingSessions.empty()) {
+		oldestPending = steady_clock::now();
+		condvar.notify_one();
+	}
+	pendingChanges.push_back({ channel, state });
+}
+
+
+void StateReplicator::RecordSession(uint64_t token, bool isOpen) {
+	if (role != PRIMARY) {
+		return;
+	}
+	std::lock_guard<std::mutex> lk(mtx);
+	if (pendingChanges.empty() && pendingSessions.empty()) {
+		oldestPending = steady_clock::now();
+		condvar.notify_one();
+	}
+	pendingSessions.push_back({ token, isOpen });
+}
+
+
+void StateReplicator::PrimaryThreadFunc() {
+	std::vector<ReplicationMessage::ChannelState> changes;
+	std::map<int32_t, float> latest;
+	changes.reserve(MaxChangesPerMessage);
+	steady_clock::time_point lastSend = steady_clock::now();
+
+	while (runThread) {
+		ReplicationMessage message;
+		{
+			// sleep until the oldest change has waited a batch interval, or a heartbeat is due
+			std::unique_lock<std::mutex> lk(mtx);
+			bool isPending = !pendingChanges.empty() || !pendingSessions.empty();
+			steady_clock::time_point due = isPending ? oldestPending + batchInterval : lastSend + takeoverInterval / 4;
+			if (steady_clock::now() < due) {
+				condvar.wait_until(lk, due);
+				continue;
+			}
+			message.time = ToNanoseconds(isPending ? oldestPending : steady_clock::now());
+			changes.swap(pendingChanges);
+			message.sessions.swap(pendingSessions);
+		}
+
+		// only the last state of a channel, and only if the standby does not have it yet
+		for (auto& change : changes) {
+			latest[change.channel] = change.state;
+		}
+		for (auto& change : latest) {
+			auto it = replicated.find(change.first);
+			if (it != replicated.end() && it->second == change.second) {
+				continue;
+			}
+			replicated[change.first] = change.second;
+			message.changes.push_back({ change.first, change.second });
+		}
+		{
+			std::lock_guard<std::mutex> lk(statisticsMutex);
+			statistics.coalesced += changes.size() - message.changes.size();
+		}
+		changes.clear();
+		latest.clear();
+
+		// the standby is gone, the primary carries on alone
+		if (!Send(message)) {
+			break;
+		}
+		lastSend = steady_clock::now();
+	}
+	isThreadDone = true;
+}
+
+
+bool StateReplicator::Send(ReplicationMessage& message) {
+	ReplicationMessage part;
+	part.flags = message.flags;
+	part.time = message.time;
+	size_t changeIndex = 0;
+	size_t sessionIndex = 0;
+	do {
+		size_t numChanges = std::min(MaxChangesPerMessage, message.changes.size() - changeIndex);
+		size_t numSessions = std::min(MaxSessionsPerMessage, message.sessions.size() - sessionIndex);
+		part.changes.assign(message.changes.begin() + changeIndex, message.changes.begin() + changeIndex + numChanges);
+		part.sessions.assign(message.sessions.begin() + sessionIndex, message.sessions.begin() + sessionIndex + numSessions);
+		changeIndex += numChanges;
+		sessionIndex += numSessions;
+
+		auto data = part.Serialize();
+		try {
+			socket.send(data.data(), data.size(), true);
+		}
+		catch (RcpException&) {
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lk(statisticsMutex);
+		statistics.messages++;
+		statistics.changes += numChanges;
+		statistics.bytes += data.size();
+	} while (changeIndex < message.changes.size() || sessionIndex < message.sessions.size());
+	return true;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Standby
+
+bool StateReplicator::Accept(ChangeHandler changeHandler, SessionHandler sessionHandler, int timeout) {
+	Stop();
+	try {
+		socket.accept(timeout);
+	}
+	catch (RcpException&) {
+		socket.disconnect();
+		return false;
+	}
+	// the primary's timestamps are converted to local time with it, to measure the lag
+	socket.setClockSyncInterval(1000);
+
+	this->changeHandler = std::move(changeHandler);
+	this->sessionHandler = std::move(sessionHandler);
+	{
+		std::lock_guard<std::mutex> lk(statisticsMutex);
+		statistics = Statistics();
+		statistics.lastReceived = steady_clock::now();
+		totalLag = nanoseconds(0);
+		lagSamples = 0;
+	}
+
+	role = STANDBY;
+	runThread = true;
+	isThreadDone = false;
+	thread = std::thread([this] { StandbyThreadFunc(); });
+	return true;
+}
+
+
+bool StateReplicator::WaitTakeover(int timeout) {
+	std::unique_lock<std::mutex> lk(mtx);
+	takeoverCondvar.wait_for(lk, milliseconds(timeout), [this] { return role != STANDBY; });
+	return role == TAKEN_OVER;
+}
+
+
+void StateReplicator::StandbyThreadFunc() {
+	RcpPacket packet;
+	while (runThread) {
+		bool isReceived = false;
+		try {
+			isReceived = socket.receive(packet, (int)takeoverInterval.count());
+		}
+		catch (RcpInterruptedException&) {
+			continue; // cancelled by Stop
+		}
+		catch (RcpException&) {
+			// the connection is lost
+		}
+		if (!runThread) {
+			break;
+		}
+		// nothing for a takeover interval, or the primary closed the link
+		if (!isReceived) {
+			TakeOver();
+			break;
+		}
+
+		ReplicationMessage message;
+		if (message.Deserlialize(packet.getData(), packet.getDataSize())) {
+			Apply(message);
+			std::lock_guard<std::mutex> lk(statisticsMutex);
+			statistics.bytes += packet.getDataSize();
+		}
+	}
+	isThreadDone = true;
+}
+
+
+void StateReplicator::Apply(const ReplicationMessage& message) {
+	for (auto& change : message.changes) {
+		changeHandler(change.channel, change.state);
+	}
+	for (auto& session : message.sessions) {
+		sessionHandler(session.token, session.isOpen);
+	}
+	steady_clock::time_point now = steady_clock::now();
+
+	std::lock_guard<std::mutex> lk(statisticsMutex);
+	statistics.messages++;
+	statistics.changes += message.changes.size();
+	statistics.lastReceived = now;
+
+	// a snapshot is as old as the connection, heartbeats carry no changes
+	if (message.changes.empty() || (message.flags & ReplicationMessage::SNAPSHOT)) {
+		return;
+	}
+	// the timestamp is as is on the same host, until the clocks are synchronized
+	steady_clock::time_point applied{ nanoseconds(message.time) };
+	const RcpClockSync& clockSync = socket.getClockSync();
+	if (clockSync.isSynchronized()) {
+		applied = clockSync.remoteToLocal(applied);
+	}
+	nanoseconds lag = std::max(duration_cast<nanoseconds>(now - applied), nanoseconds(0));
+	statistics.lastLag = lag;
+	statistics.maxLag = std::max(statistics.maxLag, lag);
+	totalLag += lag;
+	lagSamples++;
+	statistics.meanLag = totalLag / lagSamples;
+}
+
+
+void StateReplicator::TakeOver() {
+	{
+		std::lock_guard<std::mutex> lk(statisticsMutex);
+		statistics.takeoverTime = steady_clock::now();
+	}
+	// the primary is not waited for
+	socket.setLinger(0);
+	socket.disconnect();
+
+	std::lock_guard<std::mutex> lk(mtx);
+	role = TAKEN_OVER;
+	takeoverCondvar.notify_all();
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// General
+
+void StateReplicator::Stop() {
+	StopThread();
+	// a primary's standby takes over on the close
+	socket.disconnect();
+	std::lock_guard<std::mutex> lk(mtx);
+	role = NONE;
+	takeoverCondvar.notify_all();
+}
+
+
+void StateReplicator::StopThread() {
+	runThread = false;
+	{
+		std::lock_guard<std::mutex> lk(mtx);
+		condvar.notify_all();
+	}
+	// a cancel may slip in between two receive calls and get lost, so repeat it
+	while (!isThreadDone) {
+		socket.cancel();
+		std::this_thread::sleep_for(milliseconds(1));
+	}
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
+
+
+auto StateReplicator::GetRole() const -> eRole {
+	return role;
+}
+
+
+auto StateReplicator::GetStatistics() const -> Statistics {
+	std::lock_guard<std::mutex> lk(statisticsMutex);
+	return statistics;
+}
+
+
+bool StateReplicator::Bind(uint16_t port) {
+	return socket.bind(port);
+}
+
+
+uint16_t StateReplicator::GetLocalPort() const {
+	return socket.getLocalPort();
+}
+
+
+unsigned StateReplicator::GetTakeoverInterval() const {
+	return (unsigned)takeoverInterval.count();
+}
+
+
+RcpSocket& StateReplicator::GetSocket() {
+	return socket;
+}
+
+
+void StateReplicator::DBG_Kill() {
+	StopThread();
+	socket.debug_kill();
+	std::lock_guard<std::mutex> lk(mtx);
+	role = NONE;
+}
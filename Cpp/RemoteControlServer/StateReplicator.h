@@ -0,0 +1,145 @@
+#pragma once
+
+#include "Message.h"
+
+#include <RemoteControlProtocol/RcpSocket.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+
+////////////////////////////////////////////////////////////////////////////////
+/// StateReplicator keeps a hot standby server in sync with a primary one.
+/// The primary records every channel state it applies and every session it
+/// opens or closes. These are streamed to the standby over a reliable RCP
+/// connection of their own. Changes are collected for a batch interval, and
+/// only the last state of a channel goes out, and only if it differs from
+/// what the standby already has. The first message is a snapshot of all
+/// channels.
+/// When there's nothing to send, the primary sends heartbeats. If the standby
+/// hears nothing for a takeover interval, one RCP keepalive interval by
+/// default, or the link closes, it takes over. From then on it serves clients,
+/// who resume their sessions on it.
+////////////////////////////////////////////////////////////////////////////////
+
+class StateReplicator {
+public:
+	enum eRole {
+		NONE,
+		PRIMARY, // streaming to a standby
+		STANDBY, // mirroring a primary
+		TAKEN_OVER, // was a standby, and the primary is lost
+	};
+
+	struct Statistics {
+		uint64_t messages = 0; // sent or received, heartbeats included
+		uint64_t changes = 0; // channel states sent or applied
+		uint64_t coalesced = 0; // recorded changes not sent, a newer one or an equal state made them moot
+		uint64_t bytes = 0;
+		// standby only: from the primary applying a change to the standby applying it
+		std::chrono::nanoseconds lastLag = std::chrono::nanoseconds(0);
+		std::chrono::nanoseconds maxLag = std::chrono::nanoseconds(0);
+		std::chrono::nanoseconds meanLag = std::chrono::nanoseconds(0);
+		std::chrono::steady_clock::time_point lastReceived; // the last message from the primary
+		std::chrono::steady_clock::time_point takeoverTime; // when the primary was declared lost
+	};
+
+	using ChangeHandler = std::function<void(int32_t channel, float state)>;
+	using SessionHandler = std::function<void(uint64_t token, bool isOpen)>;
+
+public:
+	StateReplicator();
+	~StateReplicator();
+	StateReplicator(const StateReplicator&) = delete;
+	StateReplicator& operator=(const StateReplicator&) = delete;
+
+	/// Set how long changes are collected before they are sent, and how long the standby waits for the primary.
+	/// Heartbeats go at a quarter of the takeover interval. Only call when not replicating.
+	/// \param batchMs 0 sends each change right away.
+	/// \param takeoverMs Default is the keepalive interval of RCP sockets.
+	void SetTiming(unsigned batchMs, unsigned takeoverMs);
+
+	// --- --- primary --- --- //
+
+	/// Connect to a standby and start streaming to it, beginning with the state given.
+	/// \return False if the standby could not be reached.
+	bool Connect(const std::string& address, uint16_t port, const std::vector<ReplicationMessage::ChannelState>& snapshot,
+				 const std::vector<uint64_t>& sessions, int timeout = 5000);
+
+	/// Record a channel state the primary applied. Does nothing unless streaming.
+	void RecordChange(int32_t channel, float state);
+
+	/// Record a session the primary opened or closed. Does nothing unless streaming.
+	void RecordSession(uint64_t token, bool isOpen);
+
+	// --- --- standby --- --- //
+
+	/// Wait for a primary to connect, then mirror it in the background.
+	/// The handlers are called on the replicator's thread until it takes over.
+	/// \return False if no primary connected, or the replicator is not bound.
+	bool Accept(ChangeHandler changeHandler, SessionHandler sessionHandler, int timeout = std::numeric_limits<int>::max());
+
+	/// Wait until the standby takes over.
+	/// \return True if it has, false if the timeout is over, or it's not a standby.
+	bool WaitTakeover(int timeout);
+
+	// --- --- both --- --- //
+
+	/// Bind the link's socket, a standby must be before accepting. A primary binds any port if it's not.
+	bool Bind(uint16_t port);
+	uint16_t GetLocalPort() const;
+
+	/// Stop streaming or mirroring, and close the link. A standby does not take over.
+	void Stop();
+
+	eRole GetRole() const;
+	Statistics GetStatistics() const;
+	unsigned GetTakeoverInterval() const;
+
+	/// The socket of the link, e.g. for its link quality.
+	RcpSocket& GetSocket();
+
+	// DEBUG
+	void DBG_Kill(); // stop sending anything, as if the process died
+private:
+	void PrimaryThreadFunc();
+	void StandbyThreadFunc();
+	bool Send(ReplicationMessage& message); // split it if needed
+	void Apply(const ReplicationMessage& message);
+	void TakeOver();
+	void StopThread();
+private:
+	RcpSocket socket;
+	std::atomic<eRole> role;
+	std::thread thread;
+	std::atomic_bool runThread;
+	std::atomic_bool isThreadDone;
+	std::chrono::milliseconds batchInterval;
+	std::chrono::milliseconds takeoverInterval;
+
+	// primary: changes waiting for the next batch
+	std::mutex mtx;
+	std::condition_variable condvar;
+	std::vector<ReplicationMessage::ChannelState> pendingChanges;
+	std::vector<ReplicationMessage::Session> pendingSessions;
+	std::chrono::steady_clock::time_point oldestPending;
+	std::map<int32_t, float> replicated; // what the standby has, primary thread only
+
+	// standby
+	ChangeHandler changeHandler;
+	SessionHandler sessionHandler;
+	std::condition_variable takeoverCondvar;
+
+	mutable std::mutex statisticsMutex;
+	Statistics statistics;
+	std::chrono::nanoseconds totalLag;
+	uint64_t lagSamples;
+};
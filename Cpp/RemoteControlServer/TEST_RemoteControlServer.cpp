@@ -136,6 +136,7 @@ TEST_F(TEST_RemoteControlServer, Reply_Positive) {
 	fut = async([&] {return server.Reply(true);});
 
 	ASSERT_TRUE(fut.get());
+	replyMsg.session = server.GetSession(); // the accepted session, for resuming it
 
 	ConnectionMessage reply;
 	ASSERT_TRUE(Recv(reply));
@@ -214,6 +215,7 @@ TEST_F(TEST_RemoteControlServer, Disconnect_Normal) {
 	fut = async([&] {return server.Reply(true);});
 
 	ASSERT_TRUE(fut.get());
+	replyMsg.session = server.GetSession(); // the accepted session, for resuming it
 
 	ConnectionMessage reply;
 	ASSERT_TRUE(Recv(reply));
@@ -231,10 +233,11 @@ TEST_F(TEST_RemoteControlServer, Disconnect_Normal) {
 
 	ASSERT_TRUE(Recv(reply));
 	ASSERT_TRUE(reply == discMsg);
-	ASSERT_TRUE(Send(discMsg));
+	// the server does not wait for the response, its socket may be closed already
+	Send(discMsg);
 	Disconnect();
 
-	discFut.wait();
+	ASSERT_EQ(discFut.wait_for(std::chrono::seconds(1)), std::future_status::ready);
 
 	ASSERT_EQ(server.DBG_State(), server.DISCONNECTED);
 	ASSERT_FALSE(server.DBG_Socket().isConnected());
@@ -269,7 +272,7 @@ bool TEST_RemoteControlServer::RCS_Listen_Okay() {
 	// check server internal state
 	if (server.runMessageThread == true
 		|| server.messageThread.joinable()
-		|| !server.socket.isConnected()
+		|| !server.socket->isConnected()
 		|| server.state != server.HALF_OPEN
 		|| !result)
 	{
@@ -294,7 +297,7 @@ bool TEST_RemoteControlServer::RCS_Listen_SocketFailure() {
 	// check server internal state
 	if (server.runMessageThread == true
 		|| server.messageThread.joinable()
-		|| server.socket.isConnected()
+		|| server.socket->isConnected()
 		|| server.state != server.DISCONNECTED
 		|| result != false)
 	{
@@ -319,7 +322,7 @@ bool TEST_RemoteControlServer::RCS_Listen_ProtocolVoilation() {
 	// check server internal state
 	if (server.runMessageThread == true
 		|| server.messageThread.joinable()
-		|| server.socket.isConnected()
+		|| server.socket->isConnected()
 		|| server.state != server.DISCONNECTED
 		|| result != false)
 	{
@@ -0,0 +1,93 @@
+#include <RemoteControlServer/LatencyTrace.h>
+#include <RemoteControlServer/Message.h>
+#include <RemoteControlServer/ChannelManagerServo.h>
+#include <RemoteControlServer/ChannelAdapterServo.h>
+#include <RemoteControlServer/ServoProviderDummy.h>
+
+#include <sstream>
+#include <gtest/gtest.h>
+
+
+using namespace std;
+
+
+
+TEST(LatencyTrace, Ring_DrainInOrder) {
+	TraceRing ring(8);
+	vector<TraceRecord> records;
+
+	for (int i = 0; i < 5; i++) {
+		ring.Push(i, eTraceStage::MESSAGE_DISPATCHED, 100 + i);
+	}
+
+	ASSERT_EQ(ring.Drain(records), 0);
+	ASSERT_EQ(records.size(), 5);
+	for (int i = 0; i < 5; i++) {
+		ASSERT_EQ(records[i].traceId, i);
+		ASSERT_EQ(records[i].timestamp, 100 + i);
+	}
+
+	records.clear();
+	ASSERT_EQ(ring.Drain(records), 0);
+	ASSERT_TRUE(records.empty());
+}
+
+
+TEST(LatencyTrace, Ring_OverwritesOldest) {
+	TraceRing ring(8);
+	vector<TraceRecord> records;
+
+	for (int i = 0; i < 20; i++) {
+		ring.Push(i, eTraceStage::CHANNEL_SET, i);
+	}
+
+	ASSERT_EQ(ring.Drain(records), 12);
+	ASSERT_EQ(records.size(), 8);
+	ASSERT_EQ(records.front().traceId, 12);
+	ASSERT_EQ(records.back().traceId, 19);
+}
+
+
+TEST(LatencyTrace, Decoder_RecordsAllStages) {
+	TraceRing ring;
+	MessageDecoder decoder;
+	ServoProviderDummy provider(4);
+	ChannelManagerServo manager;
+	ChannelAdapterServo adapter(&manager);
+	stringstream providerLog;
+
+	provider.SetLogStream(providerLog);
+	manager.AddProvider(&provider, 0);
+	decoder.SetTraceRing(&ring);
+	decoder.SetHandler(eMessageType::DEVICE_SERVO, [&](const void* data, size_t size) {
+		ServoMessage msg, reply;
+		if (msg.Deserlialize(data, size)) {
+			adapter.ProcessCommand(msg, reply);
+		}
+	});
+
+	ServoMessage command;
+	command.action = ServoMessage::SET;
+	command.channel = 2;
+	command.state = 0.25f;
+	auto traced = TraceMessage(77, 1000, command).Serialize();
+	auto plain = command.Serialize();
+
+	MessageDecoder::TransportTimes times{ 2000, 3000 };
+	decoder.ProcessMessage(traced.data(), traced.size(), &times);
+	decoder.ProcessMessage(plain.data(), plain.size(), &times);
+
+	vector<TraceRecord> records;
+	ring.Drain(records);
+
+	ASSERT_EQ(provider.GetState(2), 0.25f);
+	ASSERT_EQ(records.size(), 6); // the untraced command leaves no records
+	for (size_t i = 0; i < records.size(); i++) {
+		ASSERT_EQ(records[i].traceId, 77);
+		ASSERT_EQ(records[i].stage, (eTraceStage)i);
+	}
+	ASSERT_EQ(records[0].timestamp, 1000);
+	ASSERT_EQ(records[1].timestamp, 2000);
+	ASSERT_EQ(records[2].timestamp, 3000);
+	ASSERT_FALSE(TraceScope::IsActive());
+}
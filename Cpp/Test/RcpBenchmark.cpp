@@ -23,6 +23,7 @@ using namespace std::chrono;
 // Tests included:
 // - Latency test: 
 //		Attempts to compute average latency.
+//		One way latencies are also reported using the peers' clock sync.
 // - Loss test:
 //		Analyzes the percentage of packet loss.
 // - Bandwidth test:
@@ -54,7 +55,7 @@ enum class eState {
 
 // globals
 eState state = eState::IDLE;
-RcpSocket socket;
+static RcpSocket socket; // static: a global "socket" would hijack the libc function of the same name
 size_t numPackets = 10;
 nanoseconds interval((long long)1e8);
 size_t packetSize = 0;
@@ -186,8 +187,15 @@ void BackgroundThreadFunc() {
 					cout << "Latency test ended." << endl;
 					break;
 				}
-				// echo as soon as possible!
-				socket.send(&msg, Message::HeaderSize, false);
+				// echo as soon as possible, with our receive and send timestamps
+				{
+					int64_t timestamps[2] = {
+						duration_cast<nanoseconds>(recvPacket.getReceiveTime().time_since_epoch()).count(),
+						duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count(),
+					};
+					memcpy(msg.data, timestamps, sizeof(timestamps));
+					socket.send(&msg, Message::HeaderSize + sizeof(timestamps), false);
+				}
 				cout << "Echo sent!" << endl;
 				break;
 			case eState::BANDWIDTH:
@@ -222,6 +230,9 @@ int RcpBenchmark() {
 	// intro
 	cout << "Rcp benchmark" << endl << endl;
 
+	// needed for one way latencies
+	socket.setClockSyncInterval(1000);
+
 	// launch background receive thread
 	runBackgroundThread = true;
 	backgroundThread = thread(BackgroundThreadFunc);
@@ -516,8 +527,14 @@ void Latency(size_t numPackets, nanoseconds interval, size_t packetSize) {
 	}
 
 	// perform latency check
-	unordered_map<unsigned, high_resolution_clock::time_point> sendMap;
-	unordered_map<unsigned, high_resolution_clock::time_point> recvMap;
+	struct EchoTimes {
+		steady_clock::time_point received; // local
+		steady_clock::time_point remoteReceived; // remote clock
+		steady_clock::time_point remoteSent; // remote clock
+		bool hasRemote;
+	};
+	unordered_map<unsigned, steady_clock::time_point> sendMap;
+	unordered_map<unsigned, EchoTimes> recvMap;
 	sendMap.reserve(10000);
 	recvMap.reserve(10000);
 
@@ -529,7 +546,16 @@ void Latency(size_t numPackets, nanoseconds interval, size_t packetSize) {
 		Message m;
 		while (run) {
 			if (socket.receive(p) && DecodeMessage(p, m)) {
-				recvMap.insert({ m.param2, high_resolution_clock::now() });
+				EchoTimes times;
+				times.received = p.getReceiveTime();
+				times.hasRemote = p.getDataSize() >= Message::HeaderSize + 2 * sizeof(int64_t);
+				if (times.hasRemote) {
+					int64_t timestamps[2];
+					memcpy(timestamps, m.data, sizeof(timestamps));
+					times.remoteReceived = steady_clock::time_point(duration_cast<steady_clock::duration>(nanoseconds(timestamps[0])));
+					times.remoteSent = steady_clock::time_point(duration_cast<steady_clock::duration>(nanoseconds(timestamps[1])));
+				}
+				recvMap.insert({ m.param2, times });
 			}
 		}
 	});
@@ -544,8 +570,9 @@ void Latency(size_t numPackets, nanoseconds interval, size_t packetSize) {
 		msg.param1 = eMessageParam::QUERY;
 		msg.param2 = i;
 		try {
+			auto sendTime = steady_clock::now();
 			socket.send(msg.raw, Message::HeaderSize, false);
-			sendMap.insert({ msg.param2, high_resolution_clock::now() });
+			sendMap.insert({ msg.param2, sendTime });
 		}
 		catch (...) {}
 
@@ -571,27 +598,51 @@ void Latency(size_t numPackets, nanoseconds interval, size_t packetSize) {
 	socket.setBlocking(true);
 
 	// analyize results
-	double latency = 0.0;
-	double maxLatency = 0.0;
-	double minLatency = 1e+30;
+	struct LatencyStats {
+		double sum = 0.0, max = 0.0, min = 1e+30;
+		size_t count = 0;
+		void add(steady_clock::duration d) {
+			double l = 1e-9 * duration_cast<nanoseconds>(d).count();
+			sum += l;
+			max = std::max(l, max);
+			min = std::min(l, min);
+			count++;
+		}
+		void print(const char* name) {
+			cout << name << ":" << endl
+				<< "Min = " << 1000 * min << " ms" << endl
+				<< "Avg. = " << 1000 * sum / count << " ms" << endl
+				<< "Max = " << 1000 * max << " ms" << endl;
+		}
+	};
+	LatencyStats retour, forward, backward;
+	const RcpClockSync& clockSync = socket.getClockSync();
+	bool isSynchronized = clockSync.isSynchronized();
 	for (auto& v : sendMap) {
 		auto it = recvMap.find(v.first);
 		if (it != recvMap.end()) {
-			double l = 1e-9 * duration_cast<nanoseconds>(it->second - v.second).count();
-			latency += l;
-			maxLatency = max(l, maxLatency);
-			minLatency = min(l, minLatency);
+			retour.add(it->second.received - v.second);
+			if (isSynchronized && it->second.hasRemote) {
+				forward.add(clockSync.remoteToLocal(it->second.remoteReceived) - v.second);
+				backward.add(it->second.received - clockSync.remoteToLocal(it->second.remoteSent));
+			}
 		}
 	}
 
-	latency /= recvMap.size();
 	cout << "Packets sent:   " << sendMap.size() << endl;
 	cout << "Packets recv'd: " << recvMap.size() << endl;
 
-	cout << "Latency (retour):" << endl
-		<< "Min = " << 1000 * minLatency << " ms" << endl
-		<< "Avg. = " << 1000 * latency << " ms" << endl
-		<< "Max = " << 1000 * maxLatency << " ms" << endl;
+	retour.print("Latency (retour)");
+	if (forward.count > 0) {
+		cout << "Clock offset = " << 1e-6 * clockSync.getOffset().count() << " ms"
+			<< ", drift = " << 1e6 * clockSync.getDrift() << " ppm"
+			<< ", sync round trip = " << 1e-6 * clockSync.getRoundTripDelay().count() << " ms" << endl;
+		forward.print("Latency (one way, to remote)");
+		backward.print("Latency (one way, from remote)");
+	}
+	else {
+		cout << "One way latency not available, clocks are not synchronized yet." << endl;
+	}
 
 	cout << "Packet loss:" << endl
 		<< 100 * (1 - (double)recvMap.size() / (double)sendMap.size()) << " % for echos" << endl
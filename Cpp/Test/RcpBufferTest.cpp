@@ -0,0 +1,117 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpTransport.h>
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+
+TEST(RcpBuffer, Transport_SetsBufferSizes) {
+	RcpUdpTransport transport;
+	size_t receive = 0, send = 0;
+	EXPECT_FALSE(transport.getBufferSizes(receive, send));
+
+	// kept until binding, below the limits of the OS
+	ASSERT_TRUE(transport.setBufferSizes(64 * 1024, 32 * 1024));
+	ASSERT_TRUE(transport.bind(0));
+	ASSERT_TRUE(transport.getBufferSizes(receive, send));
+	EXPECT_EQ(64u * 1024, receive);
+	EXPECT_EQ(32u * 1024, send);
+
+	// 0 leaves one as it is
+	ASSERT_TRUE(transport.setBufferSizes(96 * 1024, 0));
+	ASSERT_TRUE(transport.getBufferSizes(receive, send));
+	EXPECT_EQ(96u * 1024, receive);
+	EXPECT_EQ(32u * 1024, send);
+}
+
+
+// SO_RXQ_OVFL is Linux only
+#ifdef REMCON_LINUX
+
+TEST(RcpBuffer, Transport_CountsKernelDrops) {
+	RcpUdpTransport receiver, sender;
+	receiver.setBufferSizes(4096, 0);
+	ASSERT_TRUE(receiver.bind(0));
+	ASSERT_TRUE(sender.bind(0));
+
+	// a burst that does not fit, nobody receiving meanwhile
+	const int count = 200;
+	std::vector<uint8_t> datagram(1000, 0xAB);
+	for (int i = 0; i < count; ++i) {
+		sender.send(datagram.data(), datagram.size(), sf::IpAddress::LocalHost, receiver.getLocalPort());
+	}
+	std::this_thread::sleep_for(milliseconds(20));
+
+	int received = 0;
+	sf::Packet packet;
+	sf::IpAddress address;
+	uint16_t port;
+	while (receiver.wait(milliseconds(10)) && receiver.receive(packet, address, port)) {
+		EXPECT_EQ(datagram.size(), packet.getDataSize());
+		EXPECT_EQ(sender.getLocalPort(), port);
+		received++;
+	}
+	EXPECT_GT(received, 0);
+
+	// the count comes with a datagram, one more tells the drops after the last
+	sender.send(datagram.data(), datagram.size(), sf::IpAddress::LocalHost, receiver.getLocalPort());
+	ASSERT_TRUE(receiver.wait(milliseconds(100)) && receiver.receive(packet, address, port));
+	received++;
+
+	// on loopback, nothing else loses them
+	EXPECT_GT(receiver.getReceiveDrops(), 0u);
+	EXPECT_EQ((uint64_t)count + 1, received + receiver.getReceiveDrops());
+}
+
+
+TEST(RcpBuffer, Socket_TellsDropsFromLossAndGrowsBuffer) {
+	RcpSocket server, client;
+	ASSERT_TRUE(server.setBufferSizes(4096, 0));
+	server.setBufferAutoTuning(true, 1 << 20);
+	ASSERT_TRUE(server.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(client.bind(RcpSocket::AnyPort));
+	std::thread acceptThread([&] { server.accept(2000); });
+	client.connect("127.0.0.1", server.getLocalPort(), 2000);
+	acceptThread.join();
+	ASSERT_TRUE(server.isConnected());
+
+	// bursts faster than the IO thread takes them, with a pause for the buffer to grow
+	std::vector<uint8_t> message(1000, 0xCD);
+	std::vector<uint64_t> dropsPerBurst;
+	for (int burst = 0; burst < 8; ++burst) {
+		uint64_t before = server.getReceiveDropCount();
+		for (int i = 0; i < 200; ++i) {
+			client.send(message.data(), message.size(), false);
+		}
+		std::this_thread::sleep_for(milliseconds(150));
+		dropsPerBurst.push_back(server.getReceiveDropCount() - before);
+	}
+	std::this_thread::sleep_for(milliseconds(300));
+
+	size_t receive = 0, send = 0;
+	ASSERT_TRUE(server.getBufferSizes(receive, send));
+	auto quality = server.getLinkQuality().getSnapshot();
+	std::cout << "drops per burst of 200:";
+	for (auto drops : dropsPerBurst) {
+		std::cout << " " << drops;
+	}
+	std::cout << ", receive buffer grew to " << receive << " bytes, drop rate " << quality.dropRate << ", loss rate " << quality.lossRate << std::endl;
+
+	// the drops of a burst may show only with the next
+	EXPECT_GT(dropsPerBurst[0] + dropsPerBurst[1], 0u);
+	EXPECT_EQ(server.getReceiveDropCount(), quality.drops);
+	EXPECT_GT(receive, 4096u);
+	// loopback loses nothing, the datagrams missing were the OS's drops,
+	// but for those that showed an interval late
+	EXPECT_GT(quality.dropRate, 0.0);
+	EXPECT_LT(quality.lossRate, quality.dropRate / 10);
+}
+
+#endif
@@ -0,0 +1,187 @@
+#include <gtest/gtest.h>
+
+#include "RcpTestUtil.h"
+
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpCapture.h>
+#include <RemoteControlProtocol/RcpReplayTransport.h>
+#include <RemoteControlProtocol/RcpPacket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+
+// Send count reliable messages holding their index from client to server, and capture them at the server.
+static void CaptureSession(const char* path, uint32_t count, uint16_t& serverPort, uint16_t& clientPort) {
+	RcpSocket server, client;
+	ASSERT_TRUE(server.startCapture(path));
+	Connect(server, client);
+	serverPort = server.getLocalPort();
+	clientPort = client.getLocalPort();
+
+	RcpPacket packet;
+	for (uint32_t i = 0; i < count; ++i) {
+		client.send(&i, sizeof(i), true);
+		ASSERT_TRUE(server.receive(packet, 1000));
+	}
+	// let the last acknowledgements through
+	std::this_thread::sleep_for(milliseconds(50));
+	server.stopCapture();
+	client.disconnect();
+}
+
+
+TEST(RcpCapture, Capture_WritesPcapng) {
+	const char* path = "RcpCaptureTest_capture.pcapng";
+	const uint32_t count = 100;
+	uint16_t serverPort = 0, clientPort = 0;
+	CaptureSession(path, count, serverPort, clientPort);
+
+	std::ifstream file(path, std::ios::binary);
+	std::vector<uint8_t> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	file.close();
+	std::remove(path);
+	ASSERT_GT(contents.size(), 60u + 28u + 28u);
+
+	// section header block, then an interface, then the packets
+	uint32_t blockType;
+	memcpy(&blockType, contents.data(), 4);
+	EXPECT_EQ(0x0A0D0D0Au, blockType);
+	memcpy(&blockType, contents.data() + 28, 4);
+	EXPECT_EQ(1u, blockType);
+	memcpy(&blockType, contents.data() + 60, 4);
+	EXPECT_EQ(6u, blockType);
+
+	// the IPv4 header of the first packet sums to all ones with its checksum
+	const uint8_t* ip = contents.data() + 60 + 28;
+	EXPECT_EQ(0x45, ip[0]);
+	EXPECT_EQ(17, ip[9]);
+	uint32_t sum = 0;
+	for (int i = 0; i < 20; i += 2) {
+		sum += (ip[i] << 8) | ip[i + 1];
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
+	}
+	EXPECT_EQ(0xFFFFu, sum);
+
+	RcpCaptureReader reader;
+	ASSERT_TRUE(reader.open(contents));
+	std::vector<RcpCapturedDatagram> datagrams = reader.readAll();
+	EXPECT_EQ(0u, reader.getSkipped());
+
+	// every message came in once, in order, the server answered on its own port
+	uint32_t next = 0;
+	size_t sent = 0;
+	for (const auto& datagram : datagrams) {
+		if (datagram.sourcePort == clientPort && datagram.destinationPort == serverPort && datagram.data.size() == 12 + sizeof(uint32_t)) {
+			uint32_t index;
+			memcpy(&index, datagram.data.data() + 12, sizeof(index));
+			if (index == next) {
+				next++;
+			}
+		}
+		if (datagram.sourcePort == serverPort && datagram.destinationPort == clientPort) {
+			sent++;
+		}
+	}
+	EXPECT_EQ(count, next);
+	EXPECT_GE(sent, 1u);
+	for (size_t i = 1; i < datagrams.size(); ++i) {
+		EXPECT_LE(datagrams[i - 1].time, datagrams[i].time);
+	}
+}
+
+
+TEST(RcpCapture, Replay_DeliversCapturedMessages) {
+	const char* path = "RcpCaptureTest_replay.pcapng";
+	const uint32_t count = 100;
+	uint16_t serverPort = 0, clientPort = 0;
+	CaptureSession(path, count, serverPort, clientPort);
+
+	RcpCaptureReader reader;
+	ASSERT_TRUE(reader.open(path));
+	std::vector<RcpCapturedDatagram> capture = reader.readAll();
+	std::remove(path);
+
+	uint32_t sequenceNumber = 0, batchNumber = 0;
+	std::vector<RcpCapturedDatagram> datagrams = RcpReplayTransport::selectConnection(capture, clientPort, sequenceNumber, batchNumber);
+	ASSERT_GE(datagrams.size(), count);
+	EXPECT_EQ(serverPort, datagrams.front().destinationPort);
+
+	// the server's side of the connection, played back in a fresh socket
+	RcpReplayTransport* replay = new RcpReplayTransport(datagrams, false);
+	RcpSocket socket{ std::unique_ptr<RcpTransport>(replay) };
+	ASSERT_TRUE(socket.bind(serverPort));
+	socket.debug_connect(datagrams.front().source.toString(), clientPort, sequenceNumber, batchNumber);
+
+	RcpPacket packet;
+	for (uint32_t i = 0; i < count; ++i) {
+		ASSERT_TRUE(socket.receive(packet, 1000));
+		ASSERT_EQ(sizeof(uint32_t), packet.getDataSize());
+		uint32_t index;
+		memcpy(&index, packet.getData(), sizeof(index));
+		EXPECT_EQ(i, index);
+	}
+	EXPECT_TRUE(replay->isFinished() || !socket.receive(packet, 100));
+	EXPECT_GE(replay->getStatistics().sent, 1u); // acknowledged
+	socket.debug_kill();
+}
+
+
+TEST(RcpCapture, Reader_ClassicPcapEthernet) {
+	// a little endian pcap file of one Ethernet frame with a VLAN tag, and an ARP frame
+	std::vector<uint8_t> file = {
+		0xD4, 0xC3, 0xB2, 0xA1, 2, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF, 0, 0, 1, 0, 0, 0,
+	};
+	auto Append32 = [&file](uint32_t value) {
+		for (int i = 0; i < 4; ++i) {
+			file.push_back(uint8_t(value >> (8 * i)));
+		}
+	};
+	const uint8_t payload[] = { 1, 2, 3, 4, 5 };
+	std::vector<uint8_t> frame(12, 0xAA); // MAC addresses
+	frame.insert(frame.end(), { 0x81, 0x00, 0x00, 0x05, 0x08, 0x00 });
+	frame.insert(frame.end(), {
+		0x45, 0xB8, 0, 20 + 8 + 5, 0, 0, 0x40, 0, 64, 17, 0, 0,
+		10, 0, 0, 1, 10, 0, 0, 2,
+		0x30, 0x39, 0x1F, 0x90, 0, 8 + 5, 0, 0,
+	});
+	frame.insert(frame.end(), payload, payload + sizeof(payload));
+	Append32(1500000000);
+	Append32(250);
+	Append32((uint32_t)frame.size());
+	Append32((uint32_t)frame.size());
+	file.insert(file.end(), frame.begin(), frame.end());
+
+	std::vector<uint8_t> arp(12, 0xAA);
+	arp.insert(arp.end(), { 0x08, 0x06 });
+	arp.resize(42);
+	Append32(1500000001);
+	Append32(0);
+	Append32((uint32_t)arp.size());
+	Append32((uint32_t)arp.size());
+	file.insert(file.end(), arp.begin(), arp.end());
+
+	RcpCaptureReader reader;
+	ASSERT_TRUE(reader.open(file));
+	std::vector<RcpCapturedDatagram> datagrams = reader.readAll();
+	ASSERT_EQ(1u, datagrams.size());
+	EXPECT_EQ(1u, reader.getSkipped());
+	const RcpCapturedDatagram& datagram = datagrams[0];
+	EXPECT_EQ(1500000000ll * 1000000000 + 250000, datagram.time);
+	EXPECT_EQ("10.0.0.1", datagram.source.toString());
+	EXPECT_EQ("10.0.0.2", datagram.destination.toString());
+	EXPECT_EQ(12345, datagram.sourcePort);
+	EXPECT_EQ(8080, datagram.destinationPort);
+	EXPECT_EQ(46, datagram.dscp);
+	EXPECT_EQ(std::vector<uint8_t>(payload, payload + sizeof(payload)), datagram.data);
+}
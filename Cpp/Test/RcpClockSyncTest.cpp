@@ -0,0 +1,95 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpClockSync.h>
+#include <RemoteControlProtocol/RcpSocket.h>
+
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std::chrono;
+
+
+// Simulates an exchange with a remote clock of given offset and rate error.
+static void Exchange(RcpClockSync& sync, int64_t t1, int64_t forwardDelay, int64_t backwardDelay, int64_t offset, double drift = 0.0) {
+	auto remote = [&](int64_t local) {
+		return steady_clock::time_point(nanoseconds(local + offset + (int64_t)(drift * local)));
+	};
+	int64_t t2 = t1 + forwardDelay;
+	int64_t t3 = t2 + 10000; // remote turnaround
+	int64_t t4 = t3 + backwardDelay;
+	sync.addSample(steady_clock::time_point(nanoseconds(t1)), remote(t2), remote(t3), steady_clock::time_point(nanoseconds(t4)));
+}
+
+
+TEST(RcpClockSync, SymmetricPath_ExactOffset) {
+	RcpClockSync sync;
+	EXPECT_FALSE(sync.isSynchronized());
+
+	Exchange(sync, 1000000000, 50000, 50000, 123456789);
+	ASSERT_TRUE(sync.isSynchronized());
+	EXPECT_EQ(123456789, sync.getOffset(steady_clock::time_point(nanoseconds(1000000000))).count());
+	EXPECT_EQ(100000, sync.getRoundTripDelay().count());
+
+	auto remote = steady_clock::time_point(nanoseconds(5000000000ll));
+	EXPECT_EQ(remote, sync.localToRemote(sync.remoteToLocal(remote)));
+}
+
+
+TEST(RcpClockSync, Filter_PrefersMinimumDelay) {
+	RcpClockSync sync;
+	const int64_t offset = -40000000;
+
+	// queued samples are asymmetric, only the quiet one is accurate
+	Exchange(sync, 1000000000, 900000, 20000, offset);
+	Exchange(sync, 1100000000, 20000, 20000, offset);
+	Exchange(sync, 1200000000, 20000, 700000, offset);
+	Exchange(sync, 1300000000, 1500000, 20000, offset);
+
+	EXPECT_EQ(offset, sync.getOffset(steady_clock::time_point(nanoseconds(1300000000))).count());
+	EXPECT_EQ(40000, sync.getRoundTripDelay().count());
+}
+
+
+TEST(RcpClockSync, Drift_Tracked) {
+	RcpClockSync sync;
+	const double drift = 20e-6;
+	const int64_t offset = 1000000;
+
+	for (int i = 0; i < 40; ++i) {
+		Exchange(sync, 1000000000ll + i * 250000000ll, 30000, 30000, offset, drift);
+	}
+	EXPECT_NEAR(drift, sync.getDrift(), 1e-6);
+
+	// extrapolate a minute past the last sample
+	int64_t local = 1000000000ll + 40 * 250000000ll + 60000000000ll;
+	int64_t expected = offset + (int64_t)(drift * local);
+	EXPECT_NEAR(expected, sync.getOffset(steady_clock::time_point(nanoseconds(local))).count(), 100000);
+}
+
+
+TEST(RcpClockSync, Socket_SynchronizesOverLoopback) {
+	RcpSocket server, client;
+	ASSERT_TRUE(server.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(client.bind(RcpSocket::AnyPort));
+	server.setClockSyncInterval(200);
+	client.setClockSyncInterval(200);
+
+	std::thread acceptThread([&] { server.accept(2000); });
+	client.connect("127.0.0.1", server.getLocalPort(), 2000);
+	acceptThread.join();
+	ASSERT_TRUE(client.isConnected());
+
+	for (int i = 0; i < 50 && client.getClockSync().getSampleCount() < RcpClockSync::FilterSize; ++i) {
+		std::this_thread::sleep_for(milliseconds(20));
+	}
+	ASSERT_TRUE(client.getClockSync().isSynchronized());
+	ASSERT_TRUE(server.getClockSync().isSynchronized());
+
+	// same clock on both ends
+	EXPECT_LT(std::abs(client.getClockSync().getOffset().count()), 1000000);
+	EXPECT_LT(std::abs(server.getClockSync().getOffset().count()), 1000000);
+
+	client.disconnect();
+}
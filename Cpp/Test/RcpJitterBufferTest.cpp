@@ -0,0 +1,147 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpJitterBuffer.h>
+#include <RemoteControlProtocol/RcpClock.h>
+#include <RemoteControlProtocol/RcpPacket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std::chrono;
+
+
+static RcpPacket MakePacket(uint32_t index) {
+	RcpPacket packet;
+	packet.setData(&index, sizeof(index));
+	return packet;
+}
+
+
+static uint32_t GetIndex(const RcpPacket& packet) {
+	uint32_t index;
+	memcpy(&index, packet.getData(), sizeof(index));
+	return index;
+}
+
+
+// Standard deviation of the spacing of consecutive messages from the period, in ms.
+static double SpacingDeviation(const std::vector<std::pair<uint32_t, RcpClock::time_point>>& times, milliseconds period) {
+	double sum = 0;
+	size_t count = 0;
+	for (size_t i = 1; i < times.size(); ++i) {
+		if (times[i].first != times[i - 1].first + 1) {
+			continue;
+		}
+		double error = duration_cast<microseconds>(times[i].second - times[i - 1].second - period).count() / 1000.0;
+		sum += error * error;
+		++count;
+	}
+	return std::sqrt(sum / count);
+}
+
+
+TEST(RcpJitterBuffer, Playout_SmoothsBurstyArrivals) {
+	RcpSimulatedClock clock;
+	RcpJitterBuffer buffer(clock);
+
+	// a message each 10 ms, 20 ms transit plus up to 5 ms jitter,
+	// and every now and then the link stalls for 30 ms and delivers in a burst
+	const milliseconds period(10);
+	const uint32_t count = 2000;
+	std::mt19937 random(42);
+	std::uniform_int_distribution<int> jitter(0, 5000);
+	auto senderEpoch = RcpClock::time_point(hours(1000)); // the sender's clock is way off
+	auto start = clock.now();
+	std::vector<std::pair<RcpClock::time_point, uint32_t>> arrivals;
+	RcpClock::time_point stallEnd;
+	for (uint32_t i = 0; i < count; ++i) {
+		auto sent = start + i * period;
+		if (i % 50 == 0) {
+			stallEnd = sent + milliseconds(30);
+		}
+		auto arrival = std::max(sent + milliseconds(20) + microseconds(jitter(random)), stallEnd + milliseconds(20));
+		arrivals.push_back({ arrival, i });
+	}
+	std::sort(arrivals.begin(), arrivals.end());
+
+	std::vector<std::pair<uint32_t, RcpClock::time_point>> received, released;
+	size_t next = 0;
+	while (next < arrivals.size() || buffer.getNextPlayoutTime() != RcpClock::time_point::max()) {
+		clock.advance(microseconds(250));
+		for (; next < arrivals.size() && arrivals[next].first <= clock.now(); ++next) {
+			uint32_t index = arrivals[next].second;
+			received.push_back({ index, clock.now() });
+			buffer.push(MakePacket(index), senderEpoch + index * period);
+		}
+		RcpPacket packet;
+		while (buffer.pop(packet)) {
+			released.push_back({ GetIndex(packet), clock.now() });
+		}
+	}
+
+	auto statistics = buffer.getStatistics();
+	double inputDeviation = SpacingDeviation(received, period);
+	double outputDeviation = SpacingDeviation(released, period);
+	std::cout << "spacing deviation: " << inputDeviation << " ms arriving, " << outputDeviation << " ms released; "
+		<< "late discards " << statistics.lateDiscards << " of " << statistics.received
+		<< ", playout delay " << statistics.playoutDelay.count() << " us, target " << statistics.targetDelay.count() << " us" << std::endl;
+
+	// released in order, nearly all of them, and evenly spaced
+	for (size_t i = 1; i < released.size(); ++i) {
+		ASSERT_LT(released[i - 1].first, released[i].first);
+	}
+	EXPECT_EQ(count, statistics.received);
+	EXPECT_EQ(released.size(), statistics.released);
+	EXPECT_EQ(count, statistics.released + statistics.lateDiscards);
+	EXPECT_LT(statistics.lateDiscards, count / 10);
+	EXPECT_LT(outputDeviation, inputDeviation / 3);
+	// the stalls are 6% of the messages, the 95th percentile is in the regular jitter
+	EXPECT_GT(statistics.playoutDelay, milliseconds(3));
+	EXPECT_LT(statistics.playoutDelay, milliseconds(40));
+}
+
+
+TEST(RcpJitterBuffer, Playout_AdaptsAndDiscardsLate) {
+	RcpSimulatedClock clock;
+	RcpJitterBuffer buffer(clock);
+	buffer.setDelayLimits(milliseconds(2), milliseconds(100));
+	auto epoch = clock.now();
+
+	// on a steady link, the delay settles at the minimum
+	RcpPacket packet;
+	uint32_t index = 0;
+	for (; index < 100; ++index) {
+		buffer.push(MakePacket(index), epoch);
+		clock.advance(milliseconds(10));
+		epoch += milliseconds(10);
+		ASSERT_TRUE(buffer.pop(packet));
+	}
+	EXPECT_EQ(milliseconds(2), buffer.getStatistics().playoutDelay);
+
+	// messages taking 50 ms more are too late, until there are enough of them to raise the delay
+	for (int i = 0; i < 10; ++i, ++index) {
+		buffer.push(MakePacket(index), epoch - milliseconds(50));
+		clock.advance(milliseconds(10));
+		epoch += milliseconds(10);
+	}
+	auto statistics = buffer.getStatistics();
+	EXPECT_GE(statistics.lateDiscards, 1u);
+	EXPECT_EQ(milliseconds(50), statistics.targetDelay);
+	EXPECT_GT(statistics.playoutDelay, milliseconds(30));
+	while (buffer.pop(packet)) {}
+	uint64_t lateDiscards = statistics.lateDiscards;
+
+	// and the one released before a late one makes it late too
+	buffer.push(MakePacket(index++), epoch);
+	clock.advance(milliseconds(100));
+	ASSERT_TRUE(buffer.pop(packet));
+	buffer.push(MakePacket(index++), epoch - milliseconds(5));
+	EXPECT_EQ(lateDiscards + 1, buffer.getStatistics().lateDiscards);
+	EXPECT_FALSE(buffer.pop(packet));
+}
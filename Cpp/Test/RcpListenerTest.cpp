@@ -0,0 +1,112 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpListener.h>
+#include <RemoteControlProtocol/RcpSocket.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+
+static std::unique_ptr<RcpSocket> Connect(uint16_t port) {
+	std::unique_ptr<RcpSocket> client(new RcpSocket());
+	client->bind(RcpSocket::AnyPort);
+	client->connect("127.0.0.1", port, 2000);
+	return client;
+}
+
+
+TEST(RcpListener, Accept_ManySessionsOnOnePort) {
+	RcpListener listener;
+	ASSERT_TRUE(listener.bind(0, 4));
+	EXPECT_EQ(RcpListener::isShardingSupported() ? 4u : 1u, listener.getNumShards());
+
+	const int count = 8;
+	std::vector<std::unique_ptr<RcpSocket>> clients;
+	std::vector<std::unique_ptr<RcpSocket>> sessions;
+	std::thread acceptThread([&] {
+		for (int i = 0; i < count; ++i) {
+			auto session = listener.accept(2000);
+			if (session) {
+				sessions.push_back(std::move(session));
+			}
+		}
+	});
+	for (int i = 0; i < count; ++i) {
+		clients.push_back(Connect(listener.getLocalPort()));
+		ASSERT_TRUE(clients.back()->isConnected());
+	}
+	acceptThread.join();
+	ASSERT_EQ(size_t(count), sessions.size());
+
+	// each client talks to its own session, and gets its own answer
+	for (int i = 0; i < count; ++i) {
+		uint32_t value = i;
+		clients[i]->send(&value, sizeof(value), true);
+	}
+	for (auto& session : sessions) {
+		RcpPacket packet;
+		ASSERT_TRUE(session->receive(packet, 1000));
+		session->send(packet.getData(), packet.getDataSize(), true);
+	}
+	for (int i = 0; i < count; ++i) {
+		RcpPacket packet;
+		ASSERT_TRUE(clients[i]->receive(packet, 1000));
+		uint32_t value;
+		memcpy(&value, packet.getData(), sizeof(value));
+		EXPECT_EQ(uint32_t(i), value);
+	}
+
+	uint64_t numSessions = 0;
+	std::cout << "sessions per shard:";
+	for (auto& statistics : listener.getStatistics()) {
+		numSessions += statistics.sessions;
+		std::cout << " " << statistics.sessions;
+	}
+	std::cout << std::endl;
+	EXPECT_EQ(uint64_t(count), numSessions);
+
+	for (auto& client : clients) {
+		client->disconnect();
+	}
+}
+
+
+TEST(RcpListener, Accept_ReconnectFromSamePort) {
+	RcpListener listener;
+	ASSERT_TRUE(listener.bind(0, 2));
+
+	RcpSocket client;
+	ASSERT_TRUE(client.bind(RcpSocket::AnyPort));
+	for (int i = 0; i < 2; ++i) {
+		std::unique_ptr<RcpSocket> session;
+		std::thread acceptThread([&] { session = listener.accept(2000); });
+		client.connect("127.0.0.1", listener.getLocalPort(), 2000);
+		acceptThread.join();
+		ASSERT_TRUE(client.isConnected());
+		ASSERT_TRUE(session != nullptr);
+
+		// a closed session lets the flow start a new one
+		client.disconnect();
+		EXPECT_EQ(RcpSocket::CLOSE_GRACEFUL, client.waitDisconnect(2000));
+		session.reset();
+	}
+}
+
+
+TEST(RcpListener, Accept_Timeout) {
+	RcpListener listener;
+	ASSERT_TRUE(listener.bind(0, 1));
+	auto start = steady_clock::now();
+	EXPECT_EQ(nullptr, listener.accept(50));
+	EXPECT_LT(steady_clock::now() - start, seconds(1));
+
+	listener.unbind();
+	EXPECT_EQ(nullptr, listener.accept());
+}
@@ -0,0 +1,236 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpMulticast.h>
+#include <RemoteControlProtocol/RcpClock.h>
+#include <RemoteControlProtocol/RcpSimulatedNetwork.h>
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <functional>
+#include <thread>
+
+using namespace std::chrono;
+
+
+static const char* Group = "239.255.76.67";
+static const uint16_t GroupPort = 5640;
+
+
+// A publisher and subscribers on a simulated network.
+// Nothing blocks, so the test's thread drives the clock, publishes and receives.
+class RcpMulticastSimulation : public ::testing::Test {
+public:
+	RcpMulticastSimulation() :
+		network(clock, 12345),
+		publisher(network.createTransport(), clock)
+	{
+		publisher.bind(0);
+		publisher.setGroup(Group, GroupPort);
+
+		RcpSimulatedNetwork::LinkParameters link;
+		link.delay = milliseconds(1);
+		network.setLinkParameters(link);
+	}
+
+	RcpMulticastSubscriber& AddSubscriber() {
+		subscribers.emplace_back(new RcpMulticastSubscriber(network.createTransport(), clock));
+		EXPECT_TRUE(subscribers.back()->subscribe(Group, GroupPort));
+		return *subscribers.back();
+	}
+
+	// receive everything that is there
+	std::vector<RcpPacket> ReceiveAll(RcpMulticastSubscriber& subscriber) {
+		std::vector<RcpPacket> packets;
+		RcpPacket packet;
+		uint16_t stream;
+		while (subscriber.receive(packet, stream, 0)) {
+			packets.push_back(packet);
+		}
+		return packets;
+	}
+
+	bool Publish(uint8_t value, bool isKeyframe = false) {
+		return publisher.publish(0, &value, 1, isKeyframe);
+	}
+
+	RcpSimulatedClock clock;
+	RcpSimulatedNetwork network;
+	RcpMulticastPublisher publisher;
+	std::vector<std::unique_ptr<RcpMulticastSubscriber>> subscribers;
+};
+
+
+TEST_F(RcpMulticastSimulation, SentOnceForAllSubscribers) {
+	for (int i = 0; i < 100; ++i) {
+		AddSubscriber();
+	}
+
+	const int count = 10;
+	for (uint8_t i = 0; i < count; ++i) {
+		ASSERT_TRUE(Publish(i));
+		clock.advance(milliseconds(5));
+		for (auto& subscriber : subscribers) {
+			auto packets = ReceiveAll(*subscriber);
+			ASSERT_EQ(1u, packets.size());
+			EXPECT_EQ(i, *(const uint8_t*)packets[0].getData());
+		}
+	}
+	EXPECT_EQ(uint64_t(count), network.getStatistics().sent);
+	EXPECT_EQ(uint64_t(count * 100), network.getStatistics().received);
+}
+
+
+TEST_F(RcpMulticastSimulation, LatestValueOnly) {
+	auto& subscriber = AddSubscriber();
+
+	// reordered by the jitter, the older ones arriving late are dropped
+	RcpSimulatedNetwork::LinkParameters link;
+	link.jitter = milliseconds(20);
+	network.setLinkParameters(link);
+
+	for (uint8_t i = 0; i < 20; ++i) {
+		ASSERT_TRUE(Publish(i));
+		clock.advance(milliseconds(1));
+	}
+	clock.advance(milliseconds(50));
+
+	// whatever arrived meanwhile, only the latest is waiting
+	auto packets = ReceiveAll(subscriber);
+	ASSERT_EQ(1u, packets.size());
+	EXPECT_EQ(19, *(const uint8_t*)packets[0].getData());
+	EXPECT_EQ(19u, subscriber.getStatistics().stale);
+}
+
+
+TEST_F(RcpMulticastSimulation, RepairsLostKeyframe) {
+	auto& lossy = AddSubscriber();
+	auto& fine = AddSubscriber();
+
+	// the keyframe is lost on the way to one subscriber only
+	RcpSimulatedNetwork::LinkParameters blackhole;
+	blackhole.loss = 1.0;
+	network.setLinkParameters(publisher.getLocalPort(), lossy.getLocalPort(), blackhole);
+	ASSERT_TRUE(Publish(100, true));
+	network.setLinkParameters(publisher.getLocalPort(), lossy.getLocalPort(), RcpSimulatedNetwork::LinkParameters());
+	clock.advance(milliseconds(5));
+	EXPECT_EQ(1u, ReceiveAll(fine).size());
+	EXPECT_EQ(0u, ReceiveAll(lossy).size());
+
+	// the next update builds upon it, so it's dropped, and the keyframe is requested
+	ASSERT_TRUE(Publish(1));
+	clock.advance(milliseconds(5));
+	EXPECT_EQ(0u, ReceiveAll(lossy).size());
+	EXPECT_EQ(1u, lossy.getStatistics().requests);
+
+	// which is answered when the publisher gets to it
+	clock.advance(milliseconds(5));
+	EXPECT_EQ(1u, publisher.processRepairs());
+	clock.advance(milliseconds(5));
+	auto packets = ReceiveAll(lossy);
+	ASSERT_EQ(1u, packets.size());
+	EXPECT_TRUE(packets[0].isReliable());
+	EXPECT_EQ(100, *(const uint8_t*)packets[0].getData());
+
+	// and updates go on as usual
+	ASSERT_TRUE(Publish(2));
+	clock.advance(milliseconds(5));
+	packets = ReceiveAll(lossy);
+	ASSERT_EQ(1u, packets.size());
+	EXPECT_EQ(2, *(const uint8_t*)packets[0].getData());
+	EXPECT_EQ(0u, fine.getStatistics().requests);
+}
+
+
+TEST_F(RcpMulticastSimulation, LateSubscriberGetsKeyframe) {
+	ASSERT_TRUE(Publish(100, true));
+	ASSERT_TRUE(Publish(1));
+	clock.advance(milliseconds(5));
+
+	auto& late = AddSubscriber();
+	ASSERT_TRUE(Publish(2));
+	clock.advance(milliseconds(5));
+	EXPECT_EQ(0u, ReceiveAll(late).size());
+
+	// the request is answered along with the next update
+	clock.advance(milliseconds(5));
+	ASSERT_TRUE(Publish(3));
+	clock.advance(milliseconds(5));
+	auto packets = ReceiveAll(late);
+	ASSERT_EQ(2u, packets.size());
+	EXPECT_EQ(100, *(const uint8_t*)packets[0].getData());
+	EXPECT_EQ(3, *(const uint8_t*)packets[1].getData());
+	EXPECT_EQ(1u, publisher.getStatistics().repairs);
+}
+
+
+// The egress cost of the publisher for 1 and 100 observers on the loopback, against unicasting the same.
+// Subscribers on the same host are served by the kernel's multicast loopback, which copies the datagram
+// to each of them in the sender's system call. On a network, the copying is left to the switches.
+TEST(RcpMulticast, Benchmark_EgressCost) {
+	const int count = 1000;
+	const int burst = 20; // then a pause, so that the device queue does not overflow
+	std::vector<uint8_t> state(64, 0);
+
+	// time spent in sending only
+	auto Measure = [&](std::function<bool()> send, int& numFailed) {
+		nanoseconds total(0);
+		numFailed = 0;
+		for (int i = 0; i < count; ++i) {
+			auto start = steady_clock::now();
+			numFailed += !send();
+			total += steady_clock::now() - start;
+			if (i % burst == burst - 1) {
+				std::this_thread::sleep_for(milliseconds(1));
+			}
+		}
+		return total / count;
+	};
+
+	for (int numObservers : { 1, 100 }) {
+		// multicast
+		RcpMulticastPublisher publisher;
+		publisher.bind(0);
+		publisher.setGroup(Group, GroupPort);
+		std::vector<std::unique_ptr<RcpMulticastSubscriber>> subscribers;
+		for (int i = 0; i < numObservers; ++i) {
+			subscribers.emplace_back(new RcpMulticastSubscriber());
+			if (!subscribers.back()->subscribe(Group, GroupPort)) {
+				std::cout << "multicast is not available, skipping" << std::endl;
+				return;
+			}
+		}
+		int multicastFailed;
+		auto multicastTime = Measure([&] { return publisher.publish(0, state.data(), state.size()); }, multicastFailed);
+
+		RcpPacket packet;
+		uint16_t stream;
+		if (!subscribers.back()->receive(packet, stream, 1000)) {
+			std::cout << "multicast is not routed on this host, skipping" << std::endl;
+			return;
+		}
+
+		// unicast to each observer
+		RcpUdpTransport sender;
+		std::vector<std::unique_ptr<RcpUdpTransport>> observers;
+		sender.bind(0);
+		for (int i = 0; i < numObservers; ++i) {
+			observers.emplace_back(new RcpUdpTransport());
+			observers.back()->bind(0);
+		}
+		int unicastFailed;
+		auto unicastTime = Measure([&] {
+			bool isSent = true;
+			for (auto& observer : observers) {
+				isSent = sender.send(state.data(), state.size(), sf::IpAddress::LocalHost, observer->getLocalPort()) && isSent;
+			}
+			return isSent;
+		}, unicastFailed);
+
+		std::cout << numObservers << " observers, per update: "
+			<< "multicast 1 datagram, " << multicastTime.count() / 1000.0 << " us, " << multicastFailed << " failed; "
+			<< "unicast " << numObservers << " datagrams, " << unicastTime.count() / 1000.0 << " us, " << unicastFailed << " failed" << std::endl;
+	}
+}
@@ -0,0 +1,280 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpClock.h>
+#include <RemoteControlProtocol/RcpSimulatedNetwork.h>
+#include <RemoteControlProtocol/RcpMultipathTransport.h>
+
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <iostream>
+
+using namespace std::chrono;
+
+
+// Two sockets on a simulated network, connected over two paths each.
+class RcpMultipath : public ::testing::Test {
+public:
+	RcpMultipath() :
+		network(clock, 4321),
+		serverPaths(new RcpMultipathTransport(clock)),
+		clientPaths(new RcpMultipathTransport(clock)),
+		server(std::unique_ptr<RcpTransport>(serverPaths), clock),
+		client(std::unique_ptr<RcpTransport>(clientPaths), clock)
+	{
+		for (int i = 0; i < 2; ++i) {
+			serverPaths->addPath(network.createTransport());
+			clientPaths->addPath(network.createTransport());
+		}
+		server.bind(RcpSocket::AnyPort);
+		client.bind(RcpSocket::AnyPort);
+		for (size_t i = 0; i < 2; ++i) {
+			serverPaths->setPeer(i, sf::IpAddress::LocalHost, clientPaths->getPathLocalPort(i));
+			clientPaths->setPeer(i, sf::IpAddress::LocalHost, serverPaths->getPathLocalPort(i));
+		}
+	}
+
+	~RcpMultipath() {
+		Run([this] { client.disconnect(); });
+		Run([this] { server.disconnect(); });
+		// the paths' threads take part in the simulation until they are unbound
+		Run([this] { client.unbind(); server.unbind(); });
+		RunUntil([this] { return clock.getNumParticipants() == 0; }, seconds(60));
+	}
+
+	bool RunUntil(std::function<bool()> done, milliseconds limit = seconds(10)) {
+		auto end = clock.now() + limit;
+		while (!done()) {
+			if (clock.now() >= end) {
+				return false;
+			}
+			clock.advance(milliseconds(1));
+		}
+		return true;
+	}
+
+	void Run(std::function<void()> function) {
+		std::atomic_bool isDone(false);
+		std::thread thread([this, function, &isDone] {
+			RcpClock::Participant participant(clock);
+			try {
+				function();
+			}
+			catch (RcpException&) {}
+			isDone = true;
+		});
+		RunUntil([&] { return (bool)isDone; }, seconds(60));
+		thread.join();
+	}
+
+	bool Connect() {
+		std::atomic_bool isAccepted(false);
+		std::thread acceptThread([this, &isAccepted] {
+			RcpClock::Participant participant(clock);
+			try {
+				server.accept(2000);
+			}
+			catch (RcpException&) {}
+			isAccepted = true;
+		});
+		Run([this] { client.connect("127.0.0.1", server.getLocalPort(), 2000); });
+		RunUntil([&] { return (bool)isAccepted; });
+		acceptThread.join();
+		return client.isConnected() && server.isConnected();
+	}
+
+	// set the impairment of a path, both ways
+	void SetPath(size_t path, const RcpSimulatedNetwork::LinkParameters& link) {
+		network.setLinkParameters(serverPaths->getPathLocalPort(path), clientPaths->getPathLocalPort(path), link);
+		network.setLinkParameters(clientPaths->getPathLocalPort(path), serverPaths->getPathLocalPort(path), link);
+	}
+
+	// send unreliable messages at a steady rate, and count which arrive
+	std::vector<int> Stream(int count, milliseconds interval, std::function<void(int)> beforeEach = nullptr) {
+		std::vector<int> arrivals(count, 0);
+		RcpPacket packet;
+		for (int i = 0; i < count; ++i) {
+			if (beforeEach) {
+				beforeEach(i);
+			}
+			uint32_t number = i;
+			client.send(&number, sizeof(number), false);
+			auto next = clock.now() + interval;
+			RunUntil([&] {
+				while (server.receive(packet, 0)) {
+					arrivals[*(const uint32_t*)packet.getData()]++;
+				}
+				return clock.now() >= next;
+			});
+		}
+		RunUntil([&] {
+			while (server.receive(packet, 0)) {
+				arrivals[*(const uint32_t*)packet.getData()]++;
+			}
+			return false;
+		}, milliseconds(100));
+		return arrivals;
+	}
+
+	RcpSimulatedClock clock;
+	RcpSimulatedNetwork network;
+	RcpMultipathTransport* serverPaths; // owned by the sockets
+	RcpMultipathTransport* clientPaths;
+	RcpSocket server;
+	RcpSocket client;
+};
+
+
+TEST_F(RcpMultipath, Redundant_DeliversFirstCopyOnce) {
+	serverPaths->setMode(RcpMultipathTransport::REDUNDANT);
+	clientPaths->setMode(RcpMultipathTransport::REDUNDANT);
+	ASSERT_TRUE(Connect());
+
+	// each path loses a third, both together a ninth
+	RcpSimulatedNetwork::LinkParameters lossy;
+	lossy.loss = 0.33;
+	lossy.delay = milliseconds(5);
+	lossy.jitter = milliseconds(5);
+	SetPath(0, lossy);
+	SetPath(1, lossy);
+
+	const int count = 400;
+	auto arrivals = Stream(count, milliseconds(5));
+	int delivered = 0;
+	for (int i = 0; i < count; ++i) {
+		EXPECT_LE(arrivals[i], 1) << "message " << i << " delivered twice";
+		delivered += arrivals[i];
+	}
+	EXPECT_GT(delivered, count * 83 / 100);
+
+	auto path0 = serverPaths->getPathStatistics(0);
+	auto path1 = serverPaths->getPathStatistics(1);
+	EXPECT_GT(path0.duplicates + path1.duplicates, 0u);
+	EXPECT_GT(path0.delivered, 0u);
+	EXPECT_GT(path1.delivered, 0u);
+	EXPECT_NEAR(0.33, clientPaths->getPathStatistics(0).loss, 0.2);
+	std::cout << "delivered " << delivered << " of " << count << " over two paths losing 33% each" << std::endl;
+}
+
+
+TEST_F(RcpMultipath, Statistics_PickFasterPath) {
+	RcpSimulatedNetwork::LinkParameters slow, fast;
+	slow.delay = milliseconds(20);
+	fast.delay = milliseconds(5);
+	SetPath(0, slow);
+	SetPath(1, fast);
+	ASSERT_TRUE(Connect());
+	RunUntil([] { return false; }, milliseconds(500));
+
+	auto path0 = clientPaths->getPathStatistics(0);
+	auto path1 = clientPaths->getPathStatistics(1);
+	EXPECT_TRUE(path0.isUp);
+	EXPECT_TRUE(path1.isUp);
+	EXPECT_NEAR(40000, (double)path0.roundTrip.count(), 2000);
+	EXPECT_NEAR(10000, (double)path1.roundTrip.count(), 2000);
+	EXPECT_EQ(1u, clientPaths->getBestPath());
+
+	// unreliable messages go over the fast path only
+	auto duplicates = serverPaths->getPathStatistics(0).duplicates;
+	auto arrivals = Stream(50, milliseconds(10));
+	for (int i = 0; i < 50; ++i) {
+		EXPECT_EQ(1, arrivals[i]);
+	}
+	EXPECT_EQ(duplicates, serverPaths->getPathStatistics(0).duplicates);
+}
+
+
+TEST_F(RcpMultipath, Failover_CriticalKeepsFlowing) {
+	RcpSimulatedNetwork::LinkParameters primary, backup, dead;
+	primary.delay = milliseconds(5);
+	backup.delay = milliseconds(15);
+	dead.loss = 1.0;
+	SetPath(0, primary);
+	SetPath(1, backup);
+	ASSERT_TRUE(Connect());
+	RunUntil([] { return false; }, milliseconds(300));
+	ASSERT_EQ(0u, clientPaths->getBestPath());
+
+	// the primary path goes dark halfway
+	const int count = 200;
+	auto arrivals = Stream(count, milliseconds(10), [&](int i) {
+		if (i == count / 2) {
+			SetPath(0, dead);
+		}
+	});
+	int lost = 0;
+	for (int i = 0; i < count; ++i) {
+		lost += arrivals[i] == 0;
+		EXPECT_LE(arrivals[i], 1);
+	}
+	// those sent until the path is found down, 4 probe intervals
+	EXPECT_LE(lost, 25);
+	EXPECT_EQ(1u, clientPaths->getBestPath());
+	EXPECT_FALSE(clientPaths->getPathStatistics(0).isUp);
+	EXPECT_TRUE(client.isConnected());
+
+	// reliable messages go over both paths, so they don't wait for the failover
+	SetPath(0, primary);
+	RunUntil([] { return false; }, milliseconds(300));
+	SetPath(0, dead);
+	auto sendTime = clock.now();
+	uint8_t command = 42;
+	client.send(&command, 1, true);
+	RcpPacket packet;
+	ASSERT_TRUE(RunUntil([&] { return server.receive(packet, 0); }, seconds(1)));
+	EXPECT_LT(clock.now() - sendTime, milliseconds(20));
+	std::cout << "lost " << lost << " messages at 100 Hz when the primary path failed" << std::endl;
+}
+
+
+TEST(RcpMultipathUdp, Loopback_TwoAddresses) {
+	// the second path goes to another loopback address, as if through another interface
+	auto serverTransport = new RcpMultipathTransport();
+	auto clientTransport = new RcpMultipathTransport();
+	RcpSocket server{ std::unique_ptr<RcpTransport>(serverTransport) };
+	RcpSocket client{ std::unique_ptr<RcpTransport>(clientTransport) };
+	for (int i = 0; i < 2; ++i) {
+		serverTransport->addPath(std::unique_ptr<RcpTransport>(new RcpUdpTransport()));
+		clientTransport->addPath(std::unique_ptr<RcpTransport>(new RcpUdpTransport()));
+	}
+	serverTransport->setMode(RcpMultipathTransport::REDUNDANT);
+	clientTransport->setMode(RcpMultipathTransport::REDUNDANT);
+	ASSERT_TRUE(server.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(client.bind(RcpSocket::AnyPort));
+	clientTransport->setPeer(0, "127.0.0.1", serverTransport->getPathLocalPort(0));
+	clientTransport->setPeer(1, "127.0.0.2", serverTransport->getPathLocalPort(1));
+	serverTransport->setPeer(0, "127.0.0.1", clientTransport->getPathLocalPort(0));
+	serverTransport->setPeer(1, "127.0.0.1", clientTransport->getPathLocalPort(1));
+
+	std::thread acceptThread([&] { server.accept(2000); });
+	client.connect("127.0.0.1", server.getLocalPort(), 2000);
+	acceptThread.join();
+	ASSERT_TRUE(client.isConnected());
+	ASSERT_TRUE(server.isConnected());
+
+	const int count = 100;
+	for (uint8_t i = 0; i < count; ++i) {
+		client.send(&i, 1, i % 2 == 0);
+	}
+	int received = 0;
+	RcpPacket packet;
+	while (received < count && server.receive(packet, 500)) {
+		received++;
+	}
+	EXPECT_EQ(count, received);
+	EXPECT_FALSE(server.receive(packet, 50));
+
+	auto path0 = serverTransport->getPathStatistics(0);
+	auto path1 = serverTransport->getPathStatistics(1);
+	EXPECT_GT(path0.received, (uint64_t)count);
+	EXPECT_GT(path1.received, (uint64_t)count);
+	EXPECT_GE(path0.delivered + path1.delivered, (uint64_t)count);
+	EXPECT_TRUE(clientTransport->getPathStatistics(1).isUp);
+	std::cout << "round trip: " << clientTransport->getPathStatistics(0).roundTrip.count() << " us and "
+		<< clientTransport->getPathStatistics(1).roundTrip.count() << " us" << std::endl;
+}
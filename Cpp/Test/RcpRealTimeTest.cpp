@@ -0,0 +1,107 @@
+#include <gtest/gtest.h>
+
+#include "RcpTestUtil.h"
+
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpRealTime.h>
+#include <RemoteControlProtocol/RcpPacket.h>
+#include <RemoteControlServer/Serializer.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+
+// In debug builds, the IO threads of both sockets fail an assertion if they allocate.
+TEST(RcpRealTime, SteadyState_DoesNotAllocate) {
+	RcpSocket server, client;
+	server.setRealTime(true);
+	client.setRealTime(true);
+	EXPECT_TRUE(server.isRealTime());
+	Connect(server, client);
+
+	const uint32_t count = 2000;
+	uint8_t message[64] = {};
+	RcpPacket packet;
+	packet.reserve(sizeof(message));
+	uint64_t allocationsBefore = 0;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (i == count / 2) {
+			allocationsBefore = RcpRealTime::getAllocationCount();
+		}
+		memcpy(message, &i, sizeof(i));
+		client.send(message, sizeof(message), true);
+		ASSERT_TRUE(server.receive(packet, 1000));
+		ASSERT_EQ(sizeof(message), packet.getDataSize());
+		EXPECT_EQ(0, memcmp(&i, packet.getData(), sizeof(i)));
+	}
+	uint64_t allocationsAfter = RcpRealTime::getAllocationCount();
+
+	// reading a message in place does not copy it either
+	Serializer serializer;
+	uint32_t value = 0;
+	uint64_t allocationsSerializer = RcpRealTime::getAllocationCount();
+	{
+		RcpRealTime::NoAllocationScope noAllocation;
+		serializer.Set(packet.getData(), packet.getDataSize());
+		serializer >> value;
+	}
+	EXPECT_EQ(allocationsSerializer, RcpRealTime::getAllocationCount());
+
+	if (RcpRealTime::isAllocationCheckEnabled()) {
+		// the sends of the user thread allocate nothing once the pools are warm
+		EXPECT_EQ(allocationsBefore, allocationsAfter);
+	}
+	else {
+		std::cout << "allocation check is compiled out in release builds" << std::endl;
+	}
+
+	client.disconnect();
+	EXPECT_EQ(RcpSocket::CLOSE_GRACEFUL, client.waitDisconnect(2000));
+}
+
+
+// Round trip of the first messages of a connection, with and without real-time mode.
+TEST(RcpRealTime, Benchmark_FirstMessages) {
+	const int count = 50;
+	auto Measure = [&](bool realTime) {
+		RcpSocket server, client;
+		server.setRealTime(realTime);
+		client.setRealTime(realTime);
+		Connect(server, client);
+		std::thread echo([&] {
+			RcpPacket packet;
+			for (int i = 0; i < count; ++i) {
+				if (server.receive(packet, 1000)) {
+					server.send(packet.getData(), packet.getDataSize(), true);
+				}
+			}
+		});
+		std::vector<double> times;
+		RcpPacket packet;
+		uint8_t message[64] = {};
+		for (int i = 0; i < count; ++i) {
+			auto start = steady_clock::now();
+			client.send(message, sizeof(message), true);
+			client.receive(packet, 1000);
+			times.push_back(duration_cast<nanoseconds>(steady_clock::now() - start).count() / 1000.0);
+		}
+		echo.join();
+		client.disconnect();
+		client.waitDisconnect(2000);
+
+		double first = times.front();
+		double highest = *std::max_element(times.begin(), times.end());
+		std::nth_element(times.begin(), times.begin() + count / 2, times.end());
+		std::cout << (realTime ? "real-time: " : "default:   ")
+			<< "first " << first << " us, max " << highest << " us, median " << times[count / 2] << " us" << std::endl;
+	};
+	Measure(false);
+	Measure(true);
+}
@@ -0,0 +1,276 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpClock.h>
+#include <RemoteControlProtocol/RcpSimulatedNetwork.h>
+#include <RemoteControlProtocol/RcpRelay.h>
+
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <iostream>
+
+using namespace std::chrono;
+
+
+// A client and a server on a simulated network, connected through a relay.
+class RelayNetwork {
+public:
+	RelayNetwork() :
+		network(clock, 1234),
+		relay(network.createTransport(), network.createTransport(), clock),
+		server(network.createTransport(), clock),
+		client(network.createTransport(), clock)
+	{
+		server.bind(RcpSocket::AnyPort);
+		client.bind(RcpSocket::AnyPort);
+		relay.start(0, sf::IpAddress::LocalHost, server.getLocalPort());
+	}
+
+	~RelayNetwork() {
+		Run([this] { client.disconnect(); });
+		Run([this] { server.disconnect(); });
+		// the relay's threads take part in the simulation until it's stopped
+		Run([this] { client.unbind(); server.unbind(); relay.stop(); });
+		RunUntil([this] { return clock.getNumParticipants() == 0; }, seconds(60));
+	}
+
+	bool RunUntil(std::function<bool()> done, milliseconds limit = seconds(10)) {
+		auto end = clock.now() + limit;
+		while (!done()) {
+			if (clock.now() >= end) {
+				return false;
+			}
+			clock.advance(milliseconds(1));
+		}
+		return true;
+	}
+
+	void Run(std::function<void()> function) {
+		std::atomic_bool isDone(false);
+		std::thread thread([this, function, &isDone] {
+			RcpClock::Participant participant(clock);
+			try {
+				function();
+			}
+			catch (RcpException&) {}
+			isDone = true;
+		});
+		RunUntil([&] { return (bool)isDone; }, seconds(60));
+		thread.join();
+	}
+
+	bool Connect() {
+		std::atomic_bool isAccepted(false);
+		std::thread acceptThread([this, &isAccepted] {
+			RcpClock::Participant participant(clock);
+			try {
+				server.accept(2000);
+			}
+			catch (RcpException&) {}
+			isAccepted = true;
+		});
+		Run([this] { client.connect("127.0.0.1", relay.getLocalPort(), 2000); });
+		RunUntil([&] { return (bool)isAccepted; });
+		acceptThread.join();
+		return client.isConnected() && server.isConnected();
+	}
+
+	// set the impairment of the leg between the relay and the server, both ways
+	void SetServerLeg(const RcpSimulatedNetwork::LinkParameters& link) {
+		network.setLinkParameters(relay.getLocalPort(RcpRelay::SERVER_LEG), server.getLocalPort(), link);
+		network.setLinkParameters(server.getLocalPort(), relay.getLocalPort(RcpRelay::SERVER_LEG), link);
+	}
+
+	// send reliable messages at a steady rate, and measure when each arrives, -1 if twice
+	std::vector<microseconds> Stream(int count, milliseconds interval) {
+		std::vector<RcpClock::time_point> sendTimes(count);
+		std::vector<microseconds> latencies(count, microseconds::max());
+		RcpPacket packet;
+		auto take = [&] {
+			while (server.receive(packet, 0)) {
+				uint32_t number = *(const uint32_t*)packet.getData();
+				bool isFirst = latencies[number] == microseconds::max();
+				latencies[number] = isFirst ? duration_cast<microseconds>(clock.now() - sendTimes[number]) : microseconds(-1);
+			}
+		};
+		for (int i = 0; i < count; ++i) {
+			uint32_t number = i;
+			sendTimes[i] = clock.now();
+			client.send(&number, sizeof(number), true);
+			auto next = clock.now() + interval;
+			RunUntil([&] { take(); return clock.now() >= next; });
+		}
+		RunUntil([&] { take(); return false; }, seconds(2));
+		return latencies;
+	}
+
+	RcpSimulatedClock clock;
+	RcpSimulatedNetwork network;
+	RcpRelay relay;
+	RcpSocket server;
+	RcpSocket client;
+};
+
+
+TEST(RcpRelay, Simulated_ForwardsBothWays) {
+	RelayNetwork net;
+	ASSERT_TRUE(net.Connect());
+
+	// the server sees the relay as its client
+	RcpPacket packet;
+	uint8_t request = 1, reply = 2;
+	net.client.send(&request, 1, true);
+	ASSERT_TRUE(net.RunUntil([&] { return net.server.receive(packet, 0); }));
+	EXPECT_EQ(request, *(const uint8_t*)packet.getData());
+	net.server.send(&reply, 1, false);
+	ASSERT_TRUE(net.RunUntil([&] { return net.client.receive(packet, 0); }));
+	EXPECT_EQ(reply, *(const uint8_t*)packet.getData());
+
+	auto toServer = net.relay.getStatistics(RcpRelay::SERVER_LEG);
+	auto toClient = net.relay.getStatistics(RcpRelay::CLIENT_LEG);
+	EXPECT_GT(toServer.forwarded, 0u);
+	EXPECT_GT(toClient.forwarded, 0u);
+	EXPECT_EQ(0u, toServer.retransmitted);
+	EXPECT_EQ(0u, net.relay.getRejectedCount());
+
+	// someone else's datagrams go nowhere
+	uint8_t junk[16] = {};
+	auto stranger = net.network.createTransport();
+	stranger->bind(0);
+	stranger->send(junk, sizeof(junk), sf::IpAddress::LocalHost, net.relay.getLocalPort());
+	net.RunUntil([] { return false; }, milliseconds(50));
+	EXPECT_EQ(1u, net.relay.getRejectedCount());
+	EXPECT_FALSE(net.server.receive(packet, 0));
+}
+
+
+TEST(RcpRelay, Simulated_StrangerSynDoesNotTakeOver) {
+	RelayNetwork net;
+	ASSERT_TRUE(net.Connect());
+
+	// a SYN of another host, while the client is active
+	uint8_t syn[12] = {};
+	syn[11] = 1;
+	auto stranger = net.network.createTransport();
+	stranger->bind(0);
+	stranger->send(syn, sizeof(syn), sf::IpAddress::LocalHost, net.relay.getLocalPort());
+	net.RunUntil([] { return false; }, milliseconds(50));
+	EXPECT_EQ(1u, net.relay.getRejectedSynCount());
+	EXPECT_EQ(1u, net.relay.getRejectedCount());
+
+	// the server's replies still go to the client, none to the stranger
+	RcpPacket packet;
+	uint8_t request = 1, reply = 2;
+	net.server.send(&reply, 1, true);
+	ASSERT_TRUE(net.RunUntil([&] { return net.client.receive(packet, 0); }));
+	EXPECT_EQ(reply, *(const uint8_t*)packet.getData());
+	net.client.send(&request, 1, true);
+	ASSERT_TRUE(net.RunUntil([&] { return net.server.receive(packet, 0); }));
+	EXPECT_EQ(request, *(const uint8_t*)packet.getData());
+	sf::Packet received;
+	sf::IpAddress address;
+	uint16_t port;
+	EXPECT_FALSE(stranger->receive(received, address, port));
+	EXPECT_TRUE(net.client.isConnected());
+}
+
+
+TEST(RcpRelay, Simulated_LocalRetransmissionRepairsLossyLeg) {
+	// the relay's leg to the server loses a fifth, each way
+	RcpSimulatedNetwork::LinkParameters lossy;
+	lossy.loss = 0.2;
+	lossy.delay = milliseconds(10);
+
+	auto percentile = [](std::vector<microseconds> latencies, double p) {
+		std::sort(latencies.begin(), latencies.end());
+		return latencies[size_t(p * (latencies.size() - 1))];
+	};
+
+	const int count = 200;
+	std::vector<microseconds> endToEnd, local;
+	uint64_t retransmitted = 0;
+	microseconds legRoundTrip;
+	{
+		RelayNetwork net;
+		ASSERT_TRUE(net.Connect());
+		net.SetServerLeg(lossy);
+		endToEnd = net.Stream(count, milliseconds(20));
+	}
+	{
+		RelayNetwork net;
+		net.relay.setLocalRetransmission(RcpRelay::SERVER_LEG, true);
+		ASSERT_TRUE(net.Connect());
+		net.SetServerLeg(lossy);
+		local = net.Stream(count, milliseconds(20));
+		retransmitted = net.relay.getStatistics(RcpRelay::SERVER_LEG).retransmitted;
+		legRoundTrip = net.relay.getStatistics(RcpRelay::SERVER_LEG).roundTrip;
+	}
+
+	// each delivered exactly once, the far end drops the copies
+	for (int i = 0; i < count; ++i) {
+		EXPECT_NE(microseconds::max(), local[i]) << "message " << i << " not delivered";
+		EXPECT_NE(microseconds(-1), local[i]) << "message " << i << " delivered twice";
+	}
+	EXPECT_GT(retransmitted, 0u);
+	EXPECT_NEAR(20000, (double)legRoundTrip.count(), 2000);
+
+	// the sender resends after 200 ms, the relay after two round trips of the leg,
+	// the messages after a lost one wait for it either way, they are delivered in order
+	auto endToEnd90 = percentile(endToEnd, 0.9);
+	auto local90 = percentile(local, 0.9);
+	EXPECT_GT(endToEnd90, milliseconds(200));
+	EXPECT_LT(local90, milliseconds(150));
+	EXPECT_LT(local90 * 2, endToEnd90);
+	std::cout << "latency over a leg losing 20%, median and 90th percentile: "
+		<< percentile(endToEnd, 0.5).count() / 1000.0 << " and " << endToEnd90.count() / 1000.0 << " ms resent end to end, "
+		<< percentile(local, 0.5).count() / 1000.0 << " and " << local90.count() / 1000.0 << " ms resent by the relay ("
+		<< retransmitted << " resends)" << std::endl;
+}
+
+
+TEST(RcpRelay, Udp_ForwardsInBatches) {
+	RcpRelay relay;
+	RcpSocket server, client;
+	ASSERT_TRUE(server.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(client.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(relay.start(0, sf::IpAddress::LocalHost, server.getLocalPort()));
+
+	std::thread acceptThread([&] { server.accept(2000); });
+	client.connect("127.0.0.1", relay.getLocalPort(), 2000);
+	acceptThread.join();
+	ASSERT_TRUE(client.isConnected());
+	ASSERT_TRUE(server.isConnected());
+
+	// bursts come out of the kernel in batches
+	const int count = 2000;
+	std::vector<uint8_t> message(200, 0xEE);
+	for (int i = 0; i < count; ++i) {
+		client.send(message.data(), message.size(), i % 10 == 0);
+		if (i % 100 == 99) {
+			std::this_thread::sleep_for(milliseconds(2));
+		}
+	}
+	int received = 0;
+	RcpPacket packet;
+	while (received < count && server.receive(packet, 500)) {
+		received++;
+	}
+	auto toServer = relay.getStatistics(RcpRelay::SERVER_LEG);
+	auto fromClient = relay.getStatistics(RcpRelay::CLIENT_LEG);
+	// the reliable ones get through, the others may be dropped by the OS
+	EXPECT_GE(received, count / 10);
+	EXPECT_GE(toServer.forwarded, (uint64_t)received);
+	EXPECT_LT(fromClient.batches, fromClient.received);
+	std::cout << received << " of " << count << " messages through the relay, "
+		<< fromClient.received << " datagrams received in " << fromClient.batches << " batches" << std::endl;
+
+	client.disconnect();
+	server.disconnect();
+	relay.stop();
+}
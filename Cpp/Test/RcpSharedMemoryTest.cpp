@@ -0,0 +1,396 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpSharedMemoryTransport.h>
+#include <RemoteControlProtocol/RcpSocket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef REMCON_WINDOWS
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std::chrono;
+
+
+static bool ReceiveString(RcpTransport& transport, std::string& data, uint16_t& port) {
+	sf::Packet packet;
+	sf::IpAddress address;
+	if (!transport.wait(seconds(1)) || !transport.receive(packet, address, port)) {
+		return false;
+	}
+	data.assign((const char*)packet.getData(), packet.getDataSize());
+	return true;
+}
+
+
+TEST(RcpSharedMemory, Transport_LocalPeerUsesSharedMemory) {
+	if (!RcpSharedMemoryTransport::isSupported()) {
+		return;
+	}
+	RcpSharedMemoryTransport a, b;
+	ASSERT_TRUE(a.bind(0));
+	ASSERT_TRUE(b.bind(0));
+
+	ASSERT_TRUE(a.send("hello", 5, sf::IpAddress::LocalHost, b.getLocalPort()));
+	std::string data;
+	uint16_t port;
+	ASSERT_TRUE(ReceiveString(b, data, port));
+	EXPECT_EQ("hello", data);
+	EXPECT_EQ(a.getLocalPort(), port);
+
+	// and the reply finds its way back the same way
+	ASSERT_TRUE(b.send("world", 5, sf::IpAddress::LocalHost, port));
+	ASSERT_TRUE(ReceiveString(a, data, port));
+	EXPECT_EQ("world", data);
+
+	EXPECT_EQ(1u, a.getStatistics().sentLocal);
+	EXPECT_EQ(0u, a.getStatistics().sentRemote);
+	EXPECT_EQ(1u, b.getStatistics().sentLocal);
+}
+
+
+TEST(RcpSharedMemory, Transport_UdpPeerFallsBack) {
+	RcpSharedMemoryTransport a;
+	RcpUdpTransport b;
+	ASSERT_TRUE(a.bind(0));
+	ASSERT_TRUE(b.bind(0));
+
+	ASSERT_TRUE(a.send("hello", 5, sf::IpAddress::LocalHost, b.getLocalPort()));
+	std::string data;
+	uint16_t port;
+	ASSERT_TRUE(ReceiveString(b, data, port));
+	EXPECT_EQ("hello", data);
+
+	ASSERT_TRUE(b.send("world", 5, sf::IpAddress::LocalHost, a.getLocalPort()));
+	ASSERT_TRUE(ReceiveString(a, data, port));
+	EXPECT_EQ("world", data);
+
+	EXPECT_EQ(0u, a.getStatistics().sentLocal);
+	EXPECT_EQ(1u, a.getStatistics().sentRemote);
+}
+
+
+TEST(RcpSharedMemory, Transport_WakesSleepingReceiver) {
+	if (!RcpSharedMemoryTransport::isSupported()) {
+		return;
+	}
+	RcpSharedMemoryTransport a, b;
+	ASSERT_TRUE(a.bind(0));
+	ASSERT_TRUE(b.bind(0));
+	b.setSpinTime(microseconds(0));
+
+	std::thread sender([&] {
+		std::this_thread::sleep_for(milliseconds(20));
+		a.send("hello", 5, sf::IpAddress::LocalHost, b.getLocalPort());
+	});
+	auto start = steady_clock::now();
+	bool isReady = b.wait(seconds(5));
+	auto elapsed = steady_clock::now() - start;
+	sender.join();
+
+	ASSERT_TRUE(isReady);
+	EXPECT_LT(elapsed, seconds(1));
+	EXPECT_EQ(1u, a.getStatistics().wakeups);
+
+	// the wake-up datagram itself is not received
+	std::string data;
+	uint16_t port;
+	ASSERT_TRUE(ReceiveString(b, data, port));
+	EXPECT_EQ("hello", data);
+	sf::Packet packet;
+	sf::IpAddress address;
+	EXPECT_FALSE(b.receive(packet, address, port));
+}
+
+
+TEST(RcpSharedMemory, Transport_RingWrapsAndFills) {
+	if (!RcpSharedMemoryTransport::isSupported()) {
+		return;
+	}
+	RcpSharedMemoryTransport a, b(0);
+	ASSERT_TRUE(a.bind(0));
+	ASSERT_TRUE(b.bind(0));
+
+	// several times around the smallest ring, with records of odd sizes
+	std::vector<uint8_t> datagram(999);
+	uint32_t next = 0, expected = 0;
+	for (int round = 0; round < 20; ++round) {
+		for (int i = 0; i < 50; ++i, ++next) {
+			memcpy(datagram.data(), &next, sizeof(next));
+			ASSERT_TRUE(a.send(datagram.data(), datagram.size(), sf::IpAddress::LocalHost, b.getLocalPort()));
+		}
+		sf::Packet packet;
+		sf::IpAddress address;
+		uint16_t port;
+		while (b.receive(packet, address, port)) {
+			ASSERT_EQ(datagram.size(), packet.getDataSize());
+			ASSERT_EQ(0, memcmp(&expected, packet.getData(), sizeof(expected)));
+			++expected;
+		}
+		ASSERT_EQ(next, expected);
+	}
+
+	// a full ring drops the datagram, but keeps the ones inside
+	int numSent = 0;
+	while (a.send(datagram.data(), datagram.size(), sf::IpAddress::LocalHost, b.getLocalPort())) {
+		++numSent;
+	}
+	EXPECT_GT(numSent, 100);
+	EXPECT_LT(numSent, 200);
+	int numReceived = 0;
+	sf::Packet packet;
+	sf::IpAddress address;
+	uint16_t port;
+	while (b.receive(packet, address, port)) {
+		++numReceived;
+	}
+	EXPECT_EQ(numSent, numReceived);
+}
+
+
+#ifndef REMCON_WINDOWS
+
+// The ring of a port, mapped as another process would.
+class MappedRing {
+public:
+	MappedRing(uint16_t port) : memory(nullptr), size(0) {
+		int fd = shm_open(("/remcon-rcp-" + std::to_string(port)).c_str(), O_RDWR, 0);
+		struct stat info;
+		if (fd >= 0 && fstat(fd, &info) == 0) {
+			void* mapped = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (mapped != MAP_FAILED) {
+				memory = (uint8_t*)mapped;
+				size = info.st_size;
+			}
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	~MappedRing() {
+		if (memory) {
+			munmap(memory, size);
+		}
+	}
+
+	uint8_t* find(const std::string& data) {
+		auto it = std::search(memory, memory + size, data.begin(), data.end());
+		return it == memory + size ? nullptr : it;
+	}
+
+	// magic, capacity, isOpen and isSleeping come first
+	uint32_t* getWriteLock() { return (uint32_t*)(memory + 16); }
+
+	uint8_t* memory;
+	size_t size;
+};
+
+
+TEST(RcpSharedMemory, Transport_DropsCorruptRecords) {
+	RcpSharedMemoryTransport a, b;
+	ASSERT_TRUE(a.bind(0));
+	ASSERT_TRUE(b.bind(0));
+	MappedRing ring(b.getLocalPort());
+	ASSERT_NE(nullptr, ring.memory);
+
+	// a record claiming to be larger than the ring, followed by a good one
+	ASSERT_TRUE(a.send("corrupt me", 10, sf::IpAddress::LocalHost, b.getLocalPort()));
+	ASSERT_TRUE(a.send("lost with it", 12, sf::IpAddress::LocalHost, b.getLocalPort()));
+	uint8_t* record = ring.find("corrupt me");
+	ASSERT_NE(nullptr, record);
+	uint32_t size = 0x7FFFFFF0;
+	memcpy(record - 8, &size, sizeof(size));
+
+	sf::Packet packet;
+	sf::IpAddress address;
+	uint16_t port;
+	EXPECT_FALSE(b.receive(packet, address, port));
+	EXPECT_EQ(1u, b.getStatistics().corruptRings);
+
+	// the ring was emptied, and takes datagrams again
+	ASSERT_TRUE(a.send("hello", 5, sf::IpAddress::LocalHost, b.getLocalPort()));
+	std::string data;
+	ASSERT_TRUE(ReceiveString(b, data, port));
+	EXPECT_EQ("hello", data);
+	EXPECT_FALSE(b.receive(packet, address, port));
+}
+
+
+TEST(RcpSharedMemory, Transport_StaleLockFallsBackToUdp) {
+	RcpSharedMemoryTransport a, b;
+	ASSERT_TRUE(a.bind(0));
+	ASSERT_TRUE(b.bind(0));
+	ASSERT_TRUE(a.send("first", 5, sf::IpAddress::LocalHost, b.getLocalPort()));
+	std::string data;
+	uint16_t port;
+	ASSERT_TRUE(ReceiveString(b, data, port));
+
+	// as if a sender died holding the lock
+	MappedRing ring(b.getLocalPort());
+	ASSERT_NE(nullptr, ring.memory);
+	*ring.getWriteLock() = 1;
+
+	auto start = steady_clock::now();
+	ASSERT_TRUE(a.send("hello", 5, sf::IpAddress::LocalHost, b.getLocalPort()));
+	ASSERT_TRUE(a.send("world", 5, sf::IpAddress::LocalHost, b.getLocalPort()));
+	EXPECT_LT(steady_clock::now() - start, milliseconds(500));
+	EXPECT_EQ(1u, a.getStatistics().lockTimeouts);
+	EXPECT_EQ(2u, a.getStatistics().sentRemote);
+
+	ASSERT_TRUE(ReceiveString(b, data, port));
+	EXPECT_EQ("hello", data);
+	ASSERT_TRUE(ReceiveString(b, data, port));
+	EXPECT_EQ("world", data);
+	EXPECT_EQ(a.getLocalPort(), port);
+}
+
+#endif
+
+
+TEST(RcpSharedMemory, Socket_ExchangesReliablePackets) {
+	if (!RcpSharedMemoryTransport::isSupported()) {
+		return;
+	}
+	auto serverTransport = new RcpSharedMemoryTransport();
+	auto clientTransport = new RcpSharedMemoryTransport();
+	RcpSocket server{ std::unique_ptr<RcpTransport>(serverTransport) };
+	RcpSocket client{ std::unique_ptr<RcpTransport>(clientTransport) };
+	ASSERT_TRUE(server.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(client.bind(RcpSocket::AnyPort));
+
+	std::thread acceptThread([&] { server.accept(2000); });
+	client.connect("127.0.0.1", server.getLocalPort(), 2000);
+	acceptThread.join();
+	ASSERT_TRUE(client.isConnected());
+	ASSERT_TRUE(server.isConnected());
+
+	const uint32_t count = 100;
+	for (uint32_t i = 0; i < count; ++i) {
+		client.send(&i, sizeof(i), true);
+	}
+	RcpPacket packet;
+	for (uint32_t i = 0; i < count; ++i) {
+		ASSERT_TRUE(server.receive(packet, 1000));
+		ASSERT_EQ(sizeof(i), packet.getDataSize());
+		EXPECT_EQ(0, memcmp(&i, packet.getData(), sizeof(i)));
+	}
+
+	client.disconnect();
+	EXPECT_EQ(RcpSocket::CLOSE_GRACEFUL, client.waitDisconnect(2000));
+	EXPECT_EQ(0u, clientTransport->getStatistics().sentRemote);
+	EXPECT_EQ(0u, serverTransport->getStatistics().sentRemote);
+	EXPECT_GT(clientTransport->getStatistics().sentLocal, uint64_t(count));
+}
+
+
+// Cost of sending a small datagram, and its round trip between two threads,
+// on the transport alone and through connected sockets.
+// The round trip is only quicker with a spinning receiver, which needs a core of its own.
+TEST(RcpSharedMemory, Benchmark_RoundTrip) {
+	if (!RcpSharedMemoryTransport::isSupported()) {
+		return;
+	}
+	const int count = 10000;
+	uint32_t message = 0;
+
+	// median of the round trips
+	auto Measure = [&](std::function<void()> ping, std::function<void()> pong) {
+		std::thread echo([&] {
+			for (int i = 0; i < count; ++i) {
+				pong();
+			}
+		});
+		std::vector<nanoseconds> times;
+		for (int i = 0; i < count; ++i) {
+			auto start = steady_clock::now();
+			ping();
+			times.push_back(steady_clock::now() - start);
+		}
+		echo.join();
+		std::nth_element(times.begin(), times.begin() + count / 2, times.end());
+		return times[count / 2].count() / 1000.0;
+	};
+
+	auto MeasureTransport = [&](RcpTransport& a, RcpTransport& b) {
+		a.bind(0);
+		b.bind(0);
+		// wait and receive from one thread only, as the sockets do
+		auto Receive = [](RcpTransport& transport) {
+			sf::Packet packet;
+			sf::IpAddress address;
+			uint16_t port;
+			while (!transport.wait(seconds(1)) || !transport.receive(packet, address, port)) {}
+		};
+		return Measure([&] {
+			a.send(&message, sizeof(message), sf::IpAddress::LocalHost, b.getLocalPort());
+			Receive(a);
+		}, [&] {
+			Receive(b);
+			b.send(&message, sizeof(message), sf::IpAddress::LocalHost, a.getLocalPort());
+		});
+	};
+
+	auto MeasureSocket = [&](RcpTransport* serverTransport, RcpTransport* clientTransport) {
+		RcpSocket server{ std::unique_ptr<RcpTransport>(serverTransport) };
+		RcpSocket client{ std::unique_ptr<RcpTransport>(clientTransport) };
+		server.bind(RcpSocket::AnyPort);
+		client.bind(RcpSocket::AnyPort);
+		std::thread acceptThread([&] { server.accept(2000); });
+		client.connect("127.0.0.1", server.getLocalPort(), 2000);
+		acceptThread.join();
+		double median = Measure([&] {
+			RcpPacket packet;
+			client.send(&message, sizeof(message), false);
+			client.receive(packet, 1000);
+		}, [&] {
+			RcpPacket packet;
+			server.receive(packet, 1000);
+			server.send(packet.getData(), packet.getDataSize(), false);
+		});
+		client.disconnect();
+		return median;
+	};
+
+	// what a send costs the sender, the receiver being busy
+	auto MeasureSend = [&](RcpTransport& a, RcpTransport& b) {
+		nanoseconds total(0);
+		for (int round = 0; round < count / 100; ++round) {
+			auto start = steady_clock::now();
+			for (int i = 0; i < 100; ++i) {
+				a.send(&message, sizeof(message), sf::IpAddress::LocalHost, b.getLocalPort());
+			}
+			total += steady_clock::now() - start;
+			sf::Packet packet;
+			sf::IpAddress address;
+			uint16_t port;
+			while (b.wait(milliseconds(10)) && b.receive(packet, address, port)) {}
+		}
+		return total.count() / 1000.0 / count;
+	};
+
+	RcpSharedMemoryTransport sharedA, sharedB;
+	RcpUdpTransport udpA, udpB;
+	double sharedTransport = MeasureTransport(sharedA, sharedB);
+	double udpTransport = MeasureTransport(udpA, udpB);
+	double sharedSend = MeasureSend(sharedA, sharedB);
+	double udpSend = MeasureSend(udpA, udpB);
+	double sharedSocket = MeasureSocket(new RcpSharedMemoryTransport(), new RcpSharedMemoryTransport());
+	double udpSocket = MeasureSocket(new RcpUdpTransport(), new RcpUdpTransport());
+
+	std::cout << "send: " << sharedSend << " us shared memory, " << udpSend << " us UDP" << std::endl;
+	std::cout << "round trip, median: "
+		<< "transport " << sharedTransport << " us shared memory, " << udpTransport << " us UDP; "
+		<< "socket " << sharedSocket << " us shared memory, " << udpSocket << " us UDP" << std::endl;
+}
@@ -0,0 +1,682 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpClock.h>
+#include <RemoteControlProtocol/RcpSimulatedNetwork.h>
+#include <RemoteControlProtocol/RcpSerialNumber.h>
+
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <limits>
+#include <iostream>
+
+using namespace std::chrono;
+
+
+// Two sockets on a simulated network. Nothing happens unless the clock is advanced.
+class RcpSimulation : public ::testing::Test {
+public:
+	RcpSimulation() :
+		network(clock, 12345),
+		server(network.createTransport(), clock),
+		client(network.createTransport(), clock)
+	{
+		server.bind(RcpSocket::AnyPort);
+		client.bind(RcpSocket::AnyPort);
+	}
+
+	~RcpSimulation() {
+		// disconnecting waits for the peer, which needs the clock to move
+		Run([this] { client.disconnect(); });
+		Run([this] { server.disconnect(); });
+		// IO threads may still be finishing the close handshake, and the sockets join them
+		RunUntil([this] { return clock.getNumParticipants() == 0; }, seconds(60));
+	}
+
+	// advance the clock in small steps until done() or the limit
+	bool RunUntil(std::function<bool()> done, milliseconds limit = seconds(10)) {
+		auto end = clock.now() + limit;
+		while (!done()) {
+			if (clock.now() >= end) {
+				return false;
+			}
+			clock.advance(milliseconds(1));
+		}
+		return true;
+	}
+
+	// start a blocking function on another thread, which takes part in the simulation from the start
+	std::thread Spawn(std::function<void()> function, std::atomic_bool& isDone) {
+		std::atomic_bool isStarted(false);
+		std::thread thread([this, function, &isStarted, &isDone] {
+			RcpClock::Participant participant(clock);
+			isStarted = true;
+			try {
+				function();
+			}
+			catch (RcpException&) {}
+			isDone = true;
+		});
+		while (!isStarted) {
+			std::this_thread::yield();
+		}
+		return thread;
+	}
+
+	// call a blocking function on another thread while advancing the clock
+	void Run(std::function<void()> function) {
+		std::atomic_bool isDone(false);
+		std::thread thread = Spawn(function, isDone);
+		RunUntil([&] { return (bool)isDone; }, seconds(60));
+		thread.join();
+	}
+
+	bool Connect() {
+		std::atomic_bool isAccepted(false), isConnected(false);
+		std::thread acceptThread = Spawn([this] { server.accept(2000); }, isAccepted);
+		std::thread connectThread = Spawn([this] { client.connect("127.0.0.1", server.getLocalPort(), 2000); }, isConnected);
+		RunUntil([&] { return isAccepted && isConnected; });
+		acceptThread.join();
+		connectThread.join();
+		return client.isConnected() && server.isConnected();
+	}
+
+	RcpSimulatedClock clock;
+	RcpSimulatedNetwork network;
+	RcpSocket server;
+	RcpSocket client;
+};
+
+
+TEST_F(RcpSimulation, Handshake_TakesSimulatedTime) {
+	RcpSimulatedNetwork::LinkParameters link;
+	link.delay = milliseconds(50);
+	network.setLinkParameters(link);
+
+	auto start = clock.now();
+	ASSERT_TRUE(Connect());
+	// SYN, SYN-ACK and ACK, and not much more
+	EXPECT_GE(clock.now() - start, milliseconds(150));
+	EXPECT_LT(clock.now() - start, milliseconds(200));
+}
+
+
+TEST_F(RcpSimulation, Timeout_DetectsLostPeer) {
+	ASSERT_TRUE(Connect());
+
+	RcpSimulatedNetwork::LinkParameters blackhole;
+	blackhole.loss = 1.0;
+	network.setLinkParameters(blackhole);
+
+	// the default timeout is 5 seconds, but this does not take 5 seconds
+	auto start = clock.now();
+	auto realStart = steady_clock::now();
+	ASSERT_TRUE(RunUntil([this] { return !client.isConnected() && !server.isConnected(); }));
+	EXPECT_GE(clock.now() - start, milliseconds(4800));
+	EXPECT_LT(clock.now() - start, milliseconds(5500));
+	EXPECT_LT(steady_clock::now() - realStart, seconds(5));
+}
+
+
+TEST_F(RcpSimulation, Loss_ReliablePacketsArriveInOrder) {
+	ASSERT_TRUE(Connect());
+
+	RcpSimulatedNetwork::LinkParameters lossy;
+	lossy.loss = 0.3;
+	lossy.delay = milliseconds(2);
+	lossy.jitter = milliseconds(5);
+	network.setLinkParameters(lossy);
+
+	const int count = 50;
+	for (uint8_t i = 0; i < count; ++i) {
+		client.send(&i, 1, true);
+	}
+
+	std::vector<int> received;
+	ASSERT_TRUE(RunUntil([&] {
+		RcpPacket packet;
+		while (server.receive(packet, 0)) {
+			received.push_back(*(const uint8_t*)packet.getData());
+		}
+		return received.size() >= count;
+	}));
+	for (int i = 0; i < count; ++i) {
+		EXPECT_EQ(i, received[i]);
+	}
+	EXPECT_GT(network.getStatistics().dropped, 0u);
+}
+
+
+TEST_F(RcpSimulation, Handshake_AsyncCompletesOnIoThread) {
+	RcpSimulatedNetwork::LinkParameters link;
+	link.delay = milliseconds(10);
+	network.setLinkParameters(link);
+
+	std::atomic<int> acceptResult(RcpSocket::HANDSHAKE_PENDING), connectResult(RcpSocket::HANDSHAKE_PENDING);
+	server.acceptAsync(2000, [&](RcpSocket::eHandshakeResult result) { acceptResult = result; });
+	client.connectAsync("127.0.0.1", server.getLocalPort(), 2000, [&](RcpSocket::eHandshakeResult result) { connectResult = result; });
+	EXPECT_TRUE(server.isConnecting());
+	EXPECT_TRUE(client.isConnecting());
+
+	ASSERT_TRUE(RunUntil([&] { return acceptResult != RcpSocket::HANDSHAKE_PENDING && connectResult != RcpSocket::HANDSHAKE_PENDING; }));
+	EXPECT_EQ(RcpSocket::HANDSHAKE_SUCCESS, acceptResult);
+	EXPECT_EQ(RcpSocket::HANDSHAKE_SUCCESS, connectResult);
+	EXPECT_TRUE(server.isConnected());
+	EXPECT_TRUE(client.isConnected());
+}
+
+
+TEST_F(RcpSimulation, Handshake_SimultaneousOpen) {
+	RcpSimulatedNetwork::LinkParameters link;
+	link.delay = milliseconds(20);
+	network.setLinkParameters(link);
+
+	// both sides connect, neither accepts
+	server.connectAsync("127.0.0.1", client.getLocalPort(), 2000);
+	client.connectAsync("127.0.0.1", server.getLocalPort(), 2000);
+	ASSERT_TRUE(RunUntil([this] { return !server.isConnecting() && !client.isConnecting(); }));
+	ASSERT_EQ(RcpSocket::HANDSHAKE_SUCCESS, server.waitHandshake(0));
+	ASSERT_EQ(RcpSocket::HANDSHAKE_SUCCESS, client.waitHandshake(0));
+
+	// and they have one connection, reliable packets go both ways
+	uint8_t ping = 1, pong = 2;
+	client.send(&ping, 1, true);
+	server.send(&pong, 1, true);
+	RcpPacket fromClient, fromServer;
+	ASSERT_TRUE(RunUntil([&] { return server.receive(fromClient, 0) && client.receive(fromServer, 0); }, seconds(1)));
+	EXPECT_EQ(ping, *(const uint8_t*)fromClient.getData());
+	EXPECT_EQ(pong, *(const uint8_t*)fromServer.getData());
+}
+
+
+TEST_F(RcpSimulation, Handshake_RetransmitsLostSyn) {
+	// the client's first SYN is lost, the second one is sent after the short timeout of 200 ms
+	RcpSimulatedNetwork::LinkParameters blackhole;
+	blackhole.loss = 1.0;
+	network.setLinkParameters(client.getLocalPort(), server.getLocalPort(), blackhole);
+
+	auto start = clock.now();
+	server.acceptAsync(5000);
+	client.connectAsync("127.0.0.1", server.getLocalPort(), 5000);
+	RunUntil([] { return false; }, milliseconds(100));
+	network.setLinkParameters(client.getLocalPort(), server.getLocalPort(), RcpSimulatedNetwork::LinkParameters());
+
+	ASSERT_TRUE(RunUntil([this] { return server.isConnected() && client.isConnected(); }));
+	EXPECT_GE(clock.now() - start, milliseconds(200));
+	EXPECT_LT(clock.now() - start, milliseconds(300));
+}
+
+
+TEST_F(RcpSimulation, Handshake_RetransmitsLostAck) {
+	// the last ACK is lost, the server repeats its SYN/ACK until the client repeats the ACK
+	RcpSimulatedNetwork::LinkParameters link;
+	link.delay = milliseconds(50);
+	network.setLinkParameters(link);
+	server.acceptAsync(5000);
+	client.connectAsync("127.0.0.1", server.getLocalPort(), 5000);
+
+	// the SYN arrives at 50 ms, the ACK is sent at 100 ms
+	RunUntil([] { return false; }, milliseconds(75));
+	RcpSimulatedNetwork::LinkParameters blackhole = link;
+	blackhole.loss = 1.0;
+	network.setLinkParameters(client.getLocalPort(), server.getLocalPort(), blackhole);
+	ASSERT_TRUE(RunUntil([this] { return client.isConnected(); }, seconds(1)));
+	RunUntil([] { return false; }, milliseconds(100));
+	EXPECT_TRUE(server.isConnecting());
+	network.setLinkParameters(client.getLocalPort(), server.getLocalPort(), link);
+
+	ASSERT_TRUE(RunUntil([this] { return server.isConnected(); }, seconds(1)));
+}
+
+
+TEST_F(RcpSimulation, Handshake_BackoffGivesUp) {
+	RcpSimulatedNetwork::LinkParameters blackhole;
+	blackhole.loss = 1.0;
+	network.setLinkParameters(blackhole);
+
+	auto start = clock.now();
+	client.connectAsync("127.0.0.1", server.getLocalPort());
+	ASSERT_TRUE(RunUntil([this] { return !client.isConnecting(); }));
+	EXPECT_EQ(RcpSocket::HANDSHAKE_FAILED, client.waitHandshake(0));
+	EXPECT_GE(clock.now() - start, milliseconds(5000));
+
+	// 200, 400, 800 and 1600 ms apart
+	EXPECT_EQ(5u, network.getStatistics().sent);
+}
+
+
+TEST_F(RcpSimulation, Handshake_DisconnectCancels) {
+	std::atomic<int> acceptResult(RcpSocket::HANDSHAKE_PENDING);
+	server.acceptAsync(std::numeric_limits<int>::max(), [&](RcpSocket::eHandshakeResult result) { acceptResult = result; });
+	Run([this] { server.disconnect(); });
+	EXPECT_EQ(RcpSocket::HANDSHAKE_CANCELLED, acceptResult);
+	EXPECT_FALSE(server.isConnecting());
+}
+
+
+TEST_F(RcpSimulation, Handshake_ParallelConnects) {
+	// a 50 ms link: one handshake takes 150 ms, doing them one by one would take seconds
+	RcpSimulatedNetwork::LinkParameters link;
+	link.delay = milliseconds(50);
+	network.setLinkParameters(link);
+
+	const int count = 50;
+	std::vector<std::unique_ptr<RcpSocket>> servers, clients;
+	for (int i = 0; i < count; ++i) {
+		servers.emplace_back(new RcpSocket(network.createTransport(), clock));
+		clients.emplace_back(new RcpSocket(network.createTransport(), clock));
+		servers.back()->bind(RcpSocket::AnyPort);
+		clients.back()->bind(RcpSocket::AnyPort);
+	}
+
+	std::atomic<int> numConnected(0);
+	auto start = clock.now();
+	for (int i = 0; i < count; ++i) {
+		servers[i]->acceptAsync(5000);
+		clients[i]->connectAsync("127.0.0.1", servers[i]->getLocalPort(), 5000, [&](RcpSocket::eHandshakeResult result) {
+			numConnected += result == RcpSocket::HANDSHAKE_SUCCESS;
+		});
+	}
+	ASSERT_TRUE(RunUntil([&] { return numConnected == count; }));
+	auto elapsed = duration_cast<milliseconds>(clock.now() - start);
+	std::cout << count << " connections established in " << elapsed.count() << " ms of simulated time" << std::endl;
+	EXPECT_LT(elapsed, milliseconds(200));
+
+	Run([&] {
+		for (int i = 0; i < count; ++i) {
+			clients[i]->disconnect();
+			servers[i]->disconnect();
+		}
+	});
+	RunUntil([this] { return clock.getNumParticipants() == 0; }, seconds(60));
+}
+
+
+TEST_F(RcpSimulation, Close_FlushesPendingInBackground) {
+	ASSERT_TRUE(Connect());
+
+	RcpSimulatedNetwork::LinkParameters lossy;
+	lossy.loss = 0.2;
+	lossy.delay = milliseconds(5);
+	network.setLinkParameters(lossy);
+
+	const int count = 20;
+	for (uint8_t i = 0; i < count; ++i) {
+		client.send(&i, 1, true);
+	}
+
+	// returns right away, without the clock moving
+	std::atomic<int> closeResult(RcpSocket::CLOSE_PENDING);
+	client.setLinger(30000);
+	auto start = clock.now();
+	client.disconnectAsync([&](RcpSocket::eCloseResult result) { closeResult = result; });
+	EXPECT_EQ(start, clock.now());
+	EXPECT_FALSE(client.isConnected());
+	EXPECT_EQ(RcpSocket::CLOSE_PENDING, client.waitDisconnect(0));
+
+	// the packets are retransmitted until they arrive, the FIN only after that
+	ASSERT_TRUE(RunUntil([&] { return closeResult != RcpSocket::CLOSE_PENDING; }, seconds(30)));
+	EXPECT_EQ(RcpSocket::CLOSE_GRACEFUL, closeResult);
+	EXPECT_EQ(RcpSocket::CLOSE_GRACEFUL, client.waitDisconnect(0));
+
+	std::vector<int> received;
+	ASSERT_TRUE(RunUntil([&] {
+		RcpPacket packet;
+		while (server.receive(packet, 0)) {
+			received.push_back(*(const uint8_t*)packet.getData());
+		}
+		return received.size() >= count;
+	}));
+	for (int i = 0; i < count; ++i) {
+		EXPECT_EQ(i, received[i]);
+	}
+}
+
+
+TEST_F(RcpSimulation, Close_ZeroLingerDropsPending) {
+	ASSERT_TRUE(Connect());
+
+	RcpSimulatedNetwork::LinkParameters blackhole;
+	blackhole.loss = 1.0;
+	network.setLinkParameters(client.getLocalPort(), server.getLocalPort(), blackhole);
+
+	uint8_t data = 1;
+	client.send(&data, 1, true);
+	client.setLinger(0);
+	auto start = clock.now();
+	client.disconnect();
+
+	ASSERT_TRUE(RunUntil([this] { return client.waitDisconnect(0) != RcpSocket::CLOSE_PENDING; }, seconds(1)));
+	EXPECT_EQ(RcpSocket::CLOSE_TIMEOUT, client.waitDisconnect(0));
+	EXPECT_LT(clock.now() - start, milliseconds(10));
+}
+
+
+TEST_F(RcpSimulation, Close_Simultaneous) {
+	RcpSimulatedNetwork::LinkParameters link;
+	link.delay = milliseconds(20);
+	network.setLinkParameters(link);
+	ASSERT_TRUE(Connect());
+
+	client.disconnect();
+	server.disconnect();
+	ASSERT_TRUE(RunUntil([this] {
+		return client.waitDisconnect(0) != RcpSocket::CLOSE_PENDING && server.waitDisconnect(0) != RcpSocket::CLOSE_PENDING;
+	}, seconds(1)));
+	EXPECT_EQ(RcpSocket::CLOSE_GRACEFUL, client.waitDisconnect(0));
+	EXPECT_EQ(RcpSocket::CLOSE_GRACEFUL, server.waitDisconnect(0));
+}
+
+
+TEST(RcpSerialNumber, Extend_SeveralWraparounds) {
+	// steps up to half the range either way, across 8 wraparounds
+	uint64_t number = RcpSerialNumber::start(0xFFFFF000u);
+	uint64_t latest = number;
+	const int64_t steps[] = { 1, 4095, -1000, (1ll << 31) - 1, -((1ll << 31) - 1), 1ll << 30, 12345, -1 };
+	while (number < (uint64_t(9) << 32)) {
+		for (auto step : steps) {
+			number += step;
+			ASSERT_EQ(number, RcpSerialNumber::extend((uint32_t)number, latest));
+			EXPECT_EQ(step > 0, RcpSerialNumber::isNewer((uint32_t)number, (uint32_t)latest));
+			latest = number;
+		}
+	}
+	EXPECT_EQ(0u, RcpSerialNumber::distance(5, 5));
+	EXPECT_EQ(10u, RcpSerialNumber::distance(0xFFFFFFFBu, 5));
+	EXPECT_EQ(10u, RcpSerialNumber::distance(5, 0xFFFFFFFBu));
+}
+
+
+TEST_F(RcpSimulation, Wraparound_FullRateSessionCrossesWrap) {
+	// start close to the wrap, at different points for sequence and batch numbers on each side
+	client.debug_setInitialSequence(0xFFFFFFFFu - 20000, 0xFFFFFFFFu - 2000);
+	server.debug_setInitialSequence(0xFFFFFFFFu - 300, 0xFFFFFFFFu - 100);
+	ASSERT_TRUE(Connect());
+
+	// reordering and loss right across the wrap
+	RcpSimulatedNetwork::LinkParameters link;
+	link.loss = 0.01;
+	link.delay = milliseconds(1);
+	link.jitter = milliseconds(2);
+	network.setLinkParameters(link);
+
+	// 100k packets per second, every 10th one reliable, and the server answers with a reliable one each ms
+	const uint32_t packetsPerMs = 100;
+	const uint32_t durationMs = 600;
+	uint32_t next = 0, nextReply = 0;
+	std::vector<uint32_t> reliable, replies;
+	uint64_t numReceived = 0, lastSequenceNumber = 0;
+	std::set<uint64_t> offsets; // of the sequence number to the packet's index, just one if they are extended right
+	ASSERT_TRUE(RunUntil([&] {
+		if (next < packetsPerMs * durationMs) {
+			for (uint32_t i = 0; i < packetsPerMs; ++i, ++next) {
+				client.send(&next, sizeof(next), next % 10 == 0);
+			}
+			server.send(&nextReply, sizeof(nextReply), true);
+			++nextReply;
+		}
+		RcpPacket packet;
+		while (server.receive(packet, 0)) {
+			uint32_t value;
+			memcpy(&value, packet.getData(), sizeof(value));
+			if (packet.isReliable()) {
+				reliable.push_back(value);
+			}
+			else {
+				offsets.insert(packet.getSequenceNumber() - value);
+				lastSequenceNumber = std::max(lastSequenceNumber, packet.getSequenceNumber());
+			}
+			++numReceived;
+		}
+		while (client.receive(packet, 0)) {
+			uint32_t value;
+			memcpy(&value, packet.getData(), sizeof(value));
+			replies.push_back(value);
+		}
+		return reliable.size() == packetsPerMs * durationMs / 10 && replies.size() == durationMs;
+	}, seconds(5)));
+
+	EXPECT_TRUE(client.isConnected());
+	EXPECT_TRUE(server.isConnected());
+	// reliable packets arrive in order, on both sides
+	for (uint32_t i = 0; i < reliable.size(); ++i) {
+		ASSERT_EQ(i * 10, reliable[i]);
+	}
+	for (uint32_t i = 0; i < replies.size(); ++i) {
+		ASSERT_EQ(i, replies[i]);
+	}
+	// and the unreliable ones too, their numbers extended past the wrap even when reordered
+	EXPECT_GT(numReceived, uint64_t(packetsPerMs * durationMs * 95 / 100));
+	EXPECT_GE(lastSequenceNumber, uint64_t(2) << 32);
+	EXPECT_EQ(1u, offsets.size());
+}
+
+
+TEST_F(RcpSimulation, LinkQuality_TracksImpairment) {
+	ASSERT_TRUE(Connect());
+
+	std::vector<bool> crossings;
+	server.getLinkQuality().addThreshold(RcpLinkQuality::LOSS_RATE, 0.05, 0.02, [&](RcpLinkQuality::eMetric, bool isAbove, const RcpLinkQuality::Snapshot&) {
+		crossings.push_back(isAbove);
+	});
+
+	// a packet per ms, every 10th reliable, for a while
+	uint32_t next = 0;
+	auto Traffic = [&](milliseconds duration) {
+		auto end = clock.now() + duration;
+		RunUntil([&] {
+			client.send(&next, sizeof(next), next % 10 == 0);
+			++next;
+			RcpPacket packet;
+			while (server.receive(packet, 0)) {}
+			return clock.now() >= end;
+		}, duration + seconds(1));
+	};
+
+	RcpSimulatedNetwork::LinkParameters lossy;
+	lossy.loss = 0.1;
+	lossy.delay = milliseconds(20);
+	lossy.jitter = milliseconds(4);
+	network.setLinkParameters(lossy);
+	Traffic(seconds(3));
+
+	auto inbound = server.getLinkQuality().getSnapshot();
+	auto outbound = client.getLinkQuality().getSnapshot();
+	std::cout << "loss " << inbound.lossRate << ", reordering " << inbound.reorderRate
+		<< ", rtt " << outbound.roundTripTime.count() << " us, jitter " << outbound.jitter.count() << " us"
+		<< ", received " << inbound.receiveRate << " B/s, delivered " << outbound.deliveryRate << " B/s" << std::endl;
+	EXPECT_GT(inbound.numIntervals, 20u);
+	EXPECT_GT(inbound.lossRate, 0.05);
+	EXPECT_LT(inbound.lossRate, 0.15);
+	EXPECT_GT(inbound.reorderRate, 0.0);
+	EXPECT_GE(outbound.roundTripTime, milliseconds(40));
+	EXPECT_LE(outbound.roundTripTime, milliseconds(48));
+	EXPECT_GT(outbound.jitter, microseconds(0));
+	// 16 byte datagrams, 900 of them per second
+	EXPECT_GT(inbound.receiveRate, 16 * 900 * 0.8);
+	EXPECT_LT(inbound.receiveRate, 16 * 900 * 1.2);
+	// 4 bytes in 100 reliable packets per second, some of them lost and resent
+	EXPECT_GT(outbound.deliveryRate, 4 * 100 * 0.7);
+	EXPECT_LT(outbound.deliveryRate, 4 * 100 * 1.3);
+	ASSERT_EQ(1u, crossings.size());
+	EXPECT_TRUE(crossings[0]);
+
+	// and it recovers with the link
+	network.setLinkParameters(RcpSimulatedNetwork::LinkParameters());
+	Traffic(seconds(3));
+	inbound = server.getLinkQuality().getSnapshot();
+	outbound = client.getLinkQuality().getSnapshot();
+	EXPECT_LT(inbound.lossRate, 0.01);
+	EXPECT_LT(outbound.roundTripTime, milliseconds(5));
+	ASSERT_EQ(2u, crossings.size());
+	EXPECT_FALSE(crossings[1]);
+}
+
+
+TEST_F(RcpSimulation, Memory_RecycledAcrossSessions) {
+	RcpSimulatedNetwork::LinkParameters lossy;
+	lossy.loss = 0.05;
+	lossy.delay = milliseconds(10);
+	network.setLinkParameters(lossy);
+
+	std::vector<size_t> reserved;
+	for (int session = 0; session < 5; ++session) {
+		ASSERT_TRUE(Connect());
+		uint8_t payload[100] = {};
+		size_t sent = 0, received = 0;
+		ASSERT_TRUE(RunUntil([&] {
+			for (int i = 0; i < 5 && sent < 2000; ++i, ++sent) {
+				client.send(payload, sizeof(payload), true);
+			}
+			RcpPacket packet;
+			while (server.receive(packet, 0)) {
+				++received;
+			}
+			return received == 2000;
+		}, seconds(30)));
+		EXPECT_GT(client.getMemoryUsage().peak, 0u);
+		EXPECT_GT(server.getMemoryUsage().peak, 0u);
+
+		Run([this] { client.disconnect(); });
+		Run([this] { server.disconnect(); });
+		RunUntil([this] { return clock.getNumParticipants() == 0; });
+
+		// all of it is back in the arena, which is kept for the next session, only the empty containers are left
+		EXPECT_LT(client.getMemoryUsage().current, 1024u);
+		EXPECT_LT(server.getMemoryUsage().current, 1024u);
+		EXPECT_GT(client.getMemoryUsage().reserved, 0u);
+		reserved.push_back(client.getMemoryUsage().reserved);
+	}
+	std::cout << "arena of the sender: " << reserved.front() << " bytes after the first session, " << reserved.back() << " after the last" << std::endl;
+	EXPECT_EQ(reserved.front(), reserved.back());
+}
+
+
+TEST_F(RcpSimulation, Memory_BudgetLimitsSession) {
+	const size_t budget = 16 * 1024;
+	server.setMemoryBudget(budget);
+	client.setMemoryBudget(budget);
+	ASSERT_TRUE(Connect());
+
+	// the receiver does not take the messages for a while, the sender is throttled by it
+	uint8_t payload[100] = {};
+	uint32_t sent = 0;
+	bool isThrottled = false;
+	RunUntil([&] {
+		try {
+			memcpy(payload, &sent, sizeof(sent));
+			client.send(payload, sizeof(payload), true);
+			++sent;
+		}
+		catch (RcpBudgetException&) {
+			isThrottled = true;
+		}
+		return false;
+	}, seconds(1));
+	EXPECT_TRUE(isThrottled);
+	// a soft limit, the message that goes over it and the growth of the containers are let through
+	EXPECT_LE(server.getMemoryUsage().peak, budget + budget / 8);
+	EXPECT_LE(client.getMemoryUsage().peak, budget + budget / 8);
+	EXPECT_GT(server.getMemoryUsage().current, budget / 2);
+
+	// all of them arrive in order once it starts receiving
+	uint32_t received = 0;
+	ASSERT_TRUE(RunUntil([&] {
+		RcpPacket packet;
+		while (server.receive(packet, 0)) {
+			uint32_t index;
+			memcpy(&index, packet.getData(), sizeof(index));
+			EXPECT_EQ(received, index);
+			++received;
+		}
+		return received == sent;
+	}, seconds(4)));
+	EXPECT_TRUE(client.isConnected());
+	std::cout << sent << " messages within a budget of " << budget << " bytes, peak " << client.getMemoryUsage().peak << " at the sender, "
+		<< server.getMemoryUsage().peak << " at the receiver" << std::endl;
+}
+
+
+TEST_F(RcpSimulation, Pacing_ScheduledSendsLeaveOnTime) {
+	RcpSimulatedNetwork::LinkParameters link;
+	link.delay = milliseconds(5);
+	network.setLinkParameters(link);
+	ASSERT_TRUE(Connect());
+
+	// the transport holds the datagrams, then the IO thread does
+	for (bool isKernelPacing : { true, false }) {
+		EXPECT_TRUE(client.setKernelPacing(isKernelPacing));
+		EXPECT_EQ(isKernelPacing, client.isKernelPacing());
+
+		const uint32_t count = 20;
+		auto start = clock.now();
+		for (uint32_t i = 0; i < count; ++i) {
+			client.sendAt(&i, sizeof(i), i % 2 == 0, start + milliseconds(10) * (i + 1));
+		}
+		std::vector<RcpClock::time_point> arrivals;
+		ASSERT_TRUE(RunUntil([&] {
+			RcpPacket packet;
+			while (server.receive(packet, 0)) {
+				uint32_t index;
+				memcpy(&index, packet.getData(), sizeof(index));
+				EXPECT_EQ(arrivals.size(), index);
+				arrivals.push_back(packet.getReceiveTime());
+			}
+			return arrivals.size() == count;
+		}));
+		for (uint32_t i = 0; i < count; ++i) {
+			EXPECT_EQ(start + milliseconds(10) * (i + 1) + link.delay, arrivals[i]);
+		}
+	}
+
+	// a launch time in the past sends right away, one too far ahead is refused
+	uint32_t late = 0;
+	client.sendAt(&late, sizeof(late), true, clock.now() - seconds(1));
+	RcpPacket packet;
+	ASSERT_TRUE(RunUntil([&] { return server.receive(packet, 0); }, milliseconds(10)));
+	EXPECT_THROW(client.sendAt(&late, sizeof(late), true, clock.now() + seconds(60)), RcpInvalidArgumentException);
+}
+
+
+TEST_F(RcpSimulation, Pacing_RetransmissionsSpacedOut) {
+	ASSERT_TRUE(Connect());
+	RcpSimulatedNetwork::LinkParameters blackhole;
+	blackhole.loss = 1.0;
+	RcpSimulatedNetwork::LinkParameters clean;
+
+	// a burst of messages is lost, and resent when the link is back
+	const microseconds interval(2000);
+	client.setRetransmitPacing((unsigned)interval.count());
+	for (bool isKernelPacing : { true, false }) {
+		client.setKernelPacing(isKernelPacing);
+		network.setLinkParameters(client.getLocalPort(), server.getLocalPort(), blackhole);
+		const uint32_t count = 10;
+		for (uint32_t i = 0; i < count; ++i) {
+			client.send(&i, sizeof(i), true);
+		}
+		RunUntil([] { return false; }, milliseconds(50));
+		network.setLinkParameters(client.getLocalPort(), server.getLocalPort(), clean);
+
+		std::vector<RcpClock::time_point> arrivals;
+		ASSERT_TRUE(RunUntil([&] {
+			RcpPacket packet;
+			while (server.receive(packet, 0)) {
+				arrivals.push_back(packet.getReceiveTime());
+			}
+			return arrivals.size() == count;
+		}, seconds(2)));
+		// they're delivered in order, but resent in any order, each at its own time
+		std::sort(arrivals.begin(), arrivals.end());
+		for (size_t i = 1; i < arrivals.size(); ++i) {
+			EXPECT_GE(arrivals[i] - arrivals[i - 1], interval);
+		}
+	}
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpSocket.h>
+
+#include <thread>
+
+
+// Bind both sockets and connect the client to the server on localhost.
+inline void Connect(RcpSocket& server, RcpSocket& client) {
+	ASSERT_TRUE(server.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(client.bind(RcpSocket::AnyPort));
+	std::thread acceptThread([&] { server.accept(2000); });
+	client.connect("127.0.0.1", server.getLocalPort(), 2000);
+	acceptThread.join();
+	ASSERT_TRUE(client.isConnected());
+	ASSERT_TRUE(server.isConnected());
+}
@@ -0,0 +1,220 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlProtocol/RcpSocket.h>
+#include <RemoteControlProtocol/RcpTransport.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// the ToS of received datagrams is read from the ancillary data Linux attaches
+#ifdef REMCON_LINUX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std::chrono;
+
+
+// UDP transport recording the ToS byte of each datagram it receives.
+class CaptureTransport : public RcpTransport {
+public:
+	struct Capture {
+		std::vector<uint8_t> data;
+		uint16_t port; // of the sender
+		uint8_t dscp;
+	};
+
+	CaptureTransport() : handle(-1) {}
+	~CaptureTransport() { unbind(); }
+
+	bool bind(uint16_t port) override {
+		unbind();
+		handle = ::socket(AF_INET, SOCK_DGRAM, 0);
+		int enable = 1;
+		setsockopt(handle, IPPROTO_IP, IP_RECVTOS, &enable, sizeof(enable));
+		sockaddr_in address = {};
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		return ::bind(handle, (const sockaddr*)&address, sizeof(address)) == 0;
+	}
+	void unbind() override {
+		if (handle >= 0) {
+			close(handle);
+			handle = -1;
+		}
+	}
+	uint16_t getLocalPort() const override {
+		sockaddr_in address = {};
+		socklen_t length = sizeof(address);
+		if (handle < 0 || getsockname(handle, (sockaddr*)&address, &length) != 0) {
+			return 0;
+		}
+		return ntohs(address.sin_port);
+	}
+	bool send(const void* data, size_t size, const sf::IpAddress& address, uint16_t port) override {
+		sockaddr_in target = {};
+		target.sin_family = AF_INET;
+		target.sin_port = htons(port);
+		target.sin_addr.s_addr = htonl(address.toInteger());
+		return sendto(handle, data, size, 0, (const sockaddr*)&target, sizeof(target)) == (ssize_t)size;
+	}
+	bool wait(microseconds timeout) override {
+		pollfd descriptor = { handle, POLLIN, 0 };
+		int timeoutMs = timeout == microseconds::max() ? -1 : (int)duration_cast<milliseconds>(timeout + microseconds(999)).count();
+		return poll(&descriptor, 1, timeoutMs) > 0;
+	}
+	bool receive(sf::Packet& packet, sf::IpAddress& address, uint16_t& port) override {
+		packet.clear();
+		uint8_t buffer[65536];
+		iovec vector = { buffer, sizeof(buffer) };
+		sockaddr_in sender = {};
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+		msghdr message = {};
+		message.msg_name = &sender;
+		message.msg_namelen = sizeof(sender);
+		message.msg_iov = &vector;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		ssize_t size = recvmsg(handle, &message, MSG_DONTWAIT);
+		if (size < 0) {
+			return false;
+		}
+		uint8_t tos = 0;
+		for (cmsghdr* header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+			if (header->cmsg_level == IPPROTO_IP && header->cmsg_type == IP_TOS) {
+				tos = *(const uint8_t*)CMSG_DATA(header);
+			}
+		}
+		packet.append(buffer, size);
+		address = sf::IpAddress(ntohl(sender.sin_addr.s_addr));
+		port = ntohs(sender.sin_port);
+		std::lock_guard<std::mutex> lk(mutex);
+		captures.push_back({ std::vector<uint8_t>(buffer, buffer + size), port, uint8_t(tos >> 2) });
+		return true;
+	}
+
+	std::vector<Capture> getCaptures() {
+		std::lock_guard<std::mutex> lk(mutex);
+		return captures;
+	}
+private:
+	int handle;
+	std::mutex mutex;
+	std::vector<Capture> captures;
+};
+
+
+// Send one datagram and capture the class it arrived with.
+static uint8_t Capture(CaptureTransport& capture, std::function<bool()> send) {
+	EXPECT_TRUE(send());
+	sf::Packet packet;
+	sf::IpAddress address;
+	uint16_t port;
+	EXPECT_TRUE(capture.wait(seconds(1)) && capture.receive(packet, address, port));
+	auto captures = capture.getCaptures();
+	return captures.empty() ? 0xFF : captures.back().dscp;
+}
+
+
+TEST(RcpTrafficClass, Transport_MarksSocketAndMessages) {
+	CaptureTransport capture;
+	RcpUdpTransport transport;
+	ASSERT_TRUE(capture.bind(0));
+	uint16_t port = capture.getLocalPort();
+	const char data = 'x';
+
+	// set before binding, it's applied at binding
+	ASSERT_TRUE(transport.setTrafficClass(RcpTransport::AF41));
+	ASSERT_TRUE(transport.bind(0));
+	EXPECT_EQ(RcpTransport::AF41, Capture(capture, [&] { return transport.send(&data, 1, sf::IpAddress::LocalHost, port); }));
+
+	// a marked datagram leaves the socket's class as it was
+	EXPECT_EQ(RcpTransport::EF, Capture(capture, [&] { return transport.sendMarked(&data, 1, sf::IpAddress::LocalHost, port, RcpTransport::EF); }));
+	EXPECT_EQ(RcpTransport::CS1, Capture(capture, [&] { return transport.sendMarked(&data, 1, sf::IpAddress::LocalHost, port, RcpTransport::CS1); }));
+	EXPECT_EQ(RcpTransport::AF41, Capture(capture, [&] { return transport.send(&data, 1, sf::IpAddress::LocalHost, port); }));
+
+	ASSERT_TRUE(transport.setTrafficClass(RcpTransport::CS0));
+	EXPECT_EQ(RcpTransport::CS0, Capture(capture, [&] { return transport.send(&data, 1, sf::IpAddress::LocalHost, port); }));
+}
+
+
+// Launch times go with the marking in the same ancillary data. Loopback has no fq qdisc,
+// so the kernel sends the datagrams right away, but it checks the launch time is well formed.
+TEST(RcpTrafficClass, Transport_MarksScheduledDatagrams) {
+	CaptureTransport capture;
+	RcpUdpTransport transport;
+	ASSERT_TRUE(capture.bind(0));
+	uint16_t port = capture.getLocalPort();
+	const char data = 'x';
+
+	ASSERT_TRUE(transport.setTrafficClass(RcpTransport::AF41));
+	bool isScheduling = transport.setLaunchTimes(true);
+	ASSERT_TRUE(transport.bind(0));
+	std::cout << "SO_TXTIME is " << (isScheduling ? "supported" : "not supported") << std::endl;
+
+	auto launchTime = steady_clock::now() + milliseconds(5);
+	EXPECT_EQ(RcpTransport::EF, Capture(capture, [&] { return transport.sendAt(&data, 1, sf::IpAddress::LocalHost, port, RcpTransport::EF, launchTime); }));
+	EXPECT_EQ(RcpTransport::AF41, Capture(capture, [&] { return transport.sendAt(&data, 1, sf::IpAddress::LocalHost, port, RcpTransport::AF41, launchTime); }));
+}
+
+
+TEST(RcpTrafficClass, Socket_MarksControlAndBulk) {
+	auto capture = new CaptureTransport();
+	RcpSocket server{ std::unique_ptr<RcpTransport>(capture) };
+	RcpSocket client;
+	ASSERT_TRUE(server.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(client.bind(RcpSocket::AnyPort));
+	ASSERT_TRUE(client.setTrafficClass(RcpTransport::EF));
+	EXPECT_EQ(RcpTransport::EF, client.getTrafficClass());
+
+	std::thread acceptThread([&] { server.accept(2000); });
+	client.connect("127.0.0.1", server.getLocalPort(), 2000);
+	acceptThread.join();
+	ASSERT_TRUE(server.isConnected());
+
+	const char control = 'c', telemetry = 't', bulk = 'b';
+	client.send(&control, 1, true);
+	client.send(&telemetry, 1, false, RcpTransport::AF41);
+	client.send(&bulk, 1, true, RcpTransport::CS1);
+	RcpPacket packet;
+	for (int i = 0; i < 3; ++i) {
+		ASSERT_TRUE(server.receive(packet, 1000));
+	}
+	client.disconnect();
+	EXPECT_EQ(RcpSocket::CLOSE_GRACEFUL, client.waitDisconnect(2000));
+
+	// messages are marked with their own class, everything else with the socket's
+	int numMessages = 0;
+	for (auto& datagram : capture->getCaptures()) {
+		if (datagram.port != client.getLocalPort()) {
+			continue; // the server waking itself
+		}
+		ASSERT_GE(datagram.data.size(), 12u);
+		if (datagram.data.size() == 12) {
+			EXPECT_EQ(RcpTransport::EF, datagram.dscp);
+			continue;
+		}
+		++numMessages;
+		switch (datagram.data[12]) {
+			case 'c': EXPECT_EQ(RcpTransport::EF, datagram.dscp); break;
+			case 't': EXPECT_EQ(RcpTransport::AF41, datagram.dscp); break;
+			case 'b': EXPECT_EQ(RcpTransport::CS1, datagram.dscp); break;
+			default: ADD_FAILURE() << "unexpected message";
+		}
+	}
+	EXPECT_GE(numMessages, 3);
+}
+
+#endif
@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlClient/RemoteControlClient.h>
+#include <RemoteControlServer/RemoteControlServer.h>
+#include <RemoteControlServer/ServoProviderDummy.h>
+
+#include <future>
+#include <sstream>
+#include <vector>
+#include <chrono>
+
+using namespace std;
+using namespace std::chrono;
+
+
+class TEST_RemoteControlClient : public ::testing::Test {
+public:
+	TEST_RemoteControlClient() : provider(16) {
+		provider.SetLogStream(log);
+		server.SetLocalPort(RcpSocket::AnyPort);
+		client.SetLocalPort(RcpSocket::AnyPort);
+		server.GetManagerServo().AddProvider(&provider, 100);
+	}
+
+	// accept the client, optionally asking for a password
+	future<bool> Serve(bool authenticate = false) {
+		return async(launch::async, [this, authenticate] {
+			if (!server.Listen()) {
+				return false;
+			}
+			bool accept = authenticate ? server.Authenticate() : true;
+			return server.Reply(accept) && accept;
+		});
+	}
+
+	bool Connect() {
+		auto connected = client.Connect("127.0.0.1", server.GetLocalPort());
+		return connected.wait_for(seconds(5)) == future_status::ready && connected.get();
+	}
+
+	stringstream log;
+	ServoProviderDummy provider;
+	RemoteControlServer server;
+	RemoteControlClient client;
+};
+
+
+TEST_F(TEST_RemoteControlClient, Connect_Accepted) {
+	auto served = Serve();
+	ASSERT_TRUE(Connect());
+	ASSERT_TRUE(served.get());
+	ASSERT_TRUE(client.IsConnected());
+}
+
+
+TEST_F(TEST_RemoteControlClient, Connect_Password) {
+	server.SetPassword({ 's', 'e', 'c', 'r', 'e', 't' });
+	client.SetPassword({ 's', 'e', 'c', 'r', 'e', 't' });
+	auto served = Serve(true);
+	ASSERT_TRUE(Connect());
+	ASSERT_TRUE(served.get());
+}
+
+
+TEST_F(TEST_RemoteControlClient, Connect_WrongPassword) {
+	server.SetPassword({ 's', 'e', 'c', 'r', 'e', 't' });
+	client.SetPassword({ 'g', 'u', 'e', 's', 's' });
+	auto served = Serve(true);
+	ASSERT_FALSE(Connect());
+	ASSERT_FALSE(served.get());
+	ASSERT_FALSE(client.IsConnected());
+}
+
+
+TEST_F(TEST_RemoteControlClient, PipelinedQueries) {
+	auto served = Serve();
+	ASSERT_TRUE(Connect());
+	ASSERT_TRUE(served.get());
+
+	// set all channels in one batch
+	vector<RemoteControlClient::ServoCommand> commands;
+	for (int i = 0; i < 16; ++i) {
+		commands.push_back({ 100 + i, i / 16.0f });
+	}
+	ASSERT_TRUE(client.SetServos(commands, true));
+
+	// queries are all in flight before the first reply is awaited
+	vector<future<float>> replies;
+	for (int i = 0; i < 16; ++i) {
+		replies.push_back(client.QueryServo(100 + i));
+	}
+	for (int i = 0; i < 16; ++i) {
+		ASSERT_EQ(future_status::ready, replies[i].wait_for(seconds(5)));
+		EXPECT_EQ(i / 16.0f, replies[i].get());
+	}
+	EXPECT_EQ(0u, client.GetNumPendingQueries());
+}
+
+
+TEST_F(TEST_RemoteControlClient, Enumerate) {
+	auto served = Serve();
+	ASSERT_TRUE(Connect());
+	ASSERT_TRUE(served.get());
+
+	auto devices = client.EnumDevices();
+	auto channels = client.EnumChannels(EnumChannelsMessage::SERVO);
+
+	ASSERT_EQ(future_status::ready, devices.wait_for(seconds(5)));
+	auto deviceList = devices.get();
+	ASSERT_EQ(1u, deviceList.devices.size());
+	EXPECT_EQ(EnumDevicesMessage::SERVO, deviceList.devices[0].type);
+	EXPECT_EQ(16u, deviceList.devices[0].channelCount);
+
+	ASSERT_EQ(future_status::ready, channels.wait_for(seconds(5)));
+	auto channelList = channels.get();
+	ASSERT_EQ(16u, channelList.channels.size());
+	EXPECT_EQ(100u, channelList.channels.front());
+	EXPECT_EQ(115u, channelList.channels.back());
+}
+
+
+TEST_F(TEST_RemoteControlClient, Disconnect_FailsPendingQueries) {
+	auto served = Serve();
+	ASSERT_TRUE(Connect());
+	ASSERT_TRUE(served.get());
+
+	client.Disconnect();
+	EXPECT_FALSE(client.IsConnected());
+
+	auto reply = client.QueryServo(100);
+	ASSERT_EQ(future_status::ready, reply.wait_for(seconds(1)));
+	EXPECT_THROW(reply.get(), RcpException);
+}
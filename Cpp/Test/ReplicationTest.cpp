@@ -0,0 +1,310 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlClient/RemoteControlClient.h>
+#include <RemoteControlServer/RemoteControlServer.h>
+#include <RemoteControlServer/ServoProviderDummy.h>
+
+#include <future>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cmath>
+#include <iostream>
+
+using namespace std;
+using namespace std::chrono;
+
+
+class TEST_Replication : public ::testing::Test {
+public:
+	TEST_Replication() : primaryProvider(16), standbyProvider(16) {
+		primaryProvider.SetLogStream(primaryLog);
+		standbyProvider.SetLogStream(standbyLog);
+		primary.SetLocalPort(RcpSocket::AnyPort);
+		standby.SetLocalPort(RcpSocket::AnyPort);
+		standby.SetReplicationPort(RcpSocket::AnyPort);
+		client.SetLocalPort(RcpSocket::AnyPort);
+		primary.GetManagerServo().AddProvider(&primaryProvider, 100);
+		standby.GetManagerServo().AddProvider(&standbyProvider, 100);
+	}
+
+	// the primary streams to the standby
+	bool Replicate() {
+		auto standing = async(launch::async, [this] { return standby.StartStandby(5000); });
+		bool isStreaming = primary.StartReplication("127.0.0.1", standby.GetReplicationPort());
+		return standing.get() && isStreaming;
+	}
+
+	// accept a client on server
+	future<bool> Serve(RemoteControlServer& server) {
+		return async(launch::async, [&server] {
+			if (!server.Listen()) {
+				return false;
+			}
+			return server.Authenticate() && server.Reply(true);
+		});
+	}
+
+	bool Connect(RemoteControlServer& server) {
+		auto connected = client.Connect("127.0.0.1", server.GetLocalPort());
+		return connected.wait_for(seconds(5)) == future_status::ready && connected.get();
+	}
+
+	// wait until the standby's provider has the state on a port
+	bool WaitStandby(int port, float state, milliseconds timeout = milliseconds(2000)) {
+		auto deadline = steady_clock::now() + timeout;
+		while (standbyProvider.GetState(port) != state) {
+			if (steady_clock::now() > deadline) {
+				return false;
+			}
+			this_thread::sleep_for(milliseconds(1));
+		}
+		return true;
+	}
+
+	stringstream primaryLog, standbyLog;
+	ServoProviderDummy primaryProvider, standbyProvider;
+	RemoteControlServer primary, standby;
+	RemoteControlClient client;
+};
+
+
+TEST(Replication, Message_RoundTrip) {
+	ReplicationMessage message;
+	message.flags = ReplicationMessage::SNAPSHOT;
+	message.time = 1234567890123LL;
+	message.changes = { { 100, 0.5f }, { -3, -1.0f } };
+	message.sessions = { { 0xDEADBEEFCAFEULL, true }, { 42, false } };
+	auto data = message.Serialize();
+	ASSERT_EQ(message.GetSize(), data.size());
+
+	ReplicationMessage decoded;
+	ASSERT_TRUE(decoded.Deserlialize(data.data(), data.size()));
+	EXPECT_EQ(message.flags, decoded.flags);
+	EXPECT_EQ(message.time, decoded.time);
+	ASSERT_EQ(2u, decoded.changes.size());
+	EXPECT_EQ(-3, decoded.changes[1].channel);
+	EXPECT_EQ(-1.0f, decoded.changes[1].state);
+	ASSERT_EQ(2u, decoded.sessions.size());
+	EXPECT_EQ(0xDEADBEEFCAFEULL, decoded.sessions[0].token);
+	EXPECT_FALSE(decoded.sessions[1].isOpen);
+	EXPECT_FALSE(decoded.Deserlialize(data.data(), data.size() - 1));
+
+	// the session goes with the reply, a reply without it is still understood
+	ConnectionMessage reply{ ConnectionMessage::CONNECTION_REPLY, true };
+	reply.session = 0x0123456789ABCDEFULL;
+	data = reply.Serialize();
+	ConnectionMessage decodedReply;
+	ASSERT_TRUE(decodedReply.Deserlialize(data.data(), data.size()));
+	EXPECT_EQ(reply, decodedReply);
+	ASSERT_TRUE(decodedReply.Deserlialize(data.data(), 3));
+	EXPECT_TRUE(decodedReply.isOk);
+	EXPECT_EQ(0u, decodedReply.session);
+
+	ConnectionMessage resume{ ConnectionMessage::RESUME_REQUEST };
+	resume.session = 77;
+	data = resume.Serialize();
+	ConnectionMessage decodedResume;
+	ASSERT_TRUE(decodedResume.Deserlialize(data.data(), data.size()));
+	EXPECT_EQ(resume, decodedResume);
+}
+
+
+TEST_F(TEST_Replication, Standby_MirrorsState) {
+	// set before replicating, goes with the snapshot
+	primaryProvider.SetState(0.5f, 3);
+	ASSERT_TRUE(Replicate());
+	EXPECT_TRUE(WaitStandby(3, 0.5f));
+	EXPECT_TRUE(standby.IsStandby());
+
+	auto served = Serve(primary);
+	ASSERT_TRUE(Connect(primary));
+	ASSERT_TRUE(served.get());
+	EXPECT_NE(0u, client.GetSession());
+	EXPECT_EQ(primary.GetSession(), client.GetSession());
+
+	// the last of several states in a batch
+	for (int i = 1; i <= 10; ++i) {
+		client.SetServo(101, i / 10.0f, true);
+	}
+	for (int port = 4; port < 16; ++port) {
+		client.SetServo(100 + port, -port / 16.0f, true);
+	}
+	EXPECT_TRUE(WaitStandby(1, 1.0f));
+	for (int port = 4; port < 16; ++port) {
+		EXPECT_TRUE(WaitStandby(port, -port / 16.0f));
+	}
+	EXPECT_FALSE(standby.WaitTakeover(0));
+
+	auto primaryStatistics = primary.GetReplicationStatistics();
+	auto standbyStatistics = standby.GetReplicationStatistics();
+	EXPECT_EQ(primaryStatistics.changes, standbyStatistics.changes);
+	EXPECT_GE(standbyStatistics.messages, 2u);
+	EXPECT_GT(standbyStatistics.maxLag.count(), 0);
+
+	client.Disconnect();
+}
+
+
+TEST_F(TEST_Replication, Standby_DeclinesWhilePrimaryAlive) {
+	ASSERT_TRUE(Replicate());
+	auto served = Serve(standby);
+	EXPECT_FALSE(Connect(standby));
+	EXPECT_FALSE(served.get());
+	EXPECT_TRUE(standby.IsStandby());
+}
+
+
+TEST_F(TEST_Replication, Failover_ResumesSession) {
+	ASSERT_TRUE(Replicate());
+	auto served = Serve(primary);
+	ASSERT_TRUE(Connect(primary));
+	ASSERT_TRUE(served.get());
+	client.SetServo(105, 0.25f, true);
+	ASSERT_TRUE(WaitStandby(5, 0.25f));
+	uint64_t session = client.GetSession();
+
+	// the client notices at once, the standby within a takeover interval
+	auto resumed = Serve(standby);
+	primary.DBG_Crash();
+	auto resuming = client.Resume("127.0.0.1", standby.GetLocalPort());
+	ASSERT_EQ(future_status::ready, resuming.wait_for(seconds(5)));
+	ASSERT_TRUE(resuming.get());
+	ASSERT_TRUE(resumed.get());
+	EXPECT_TRUE(standby.WaitTakeover(0));
+	EXPECT_TRUE(standby.IsResumed());
+	EXPECT_EQ(session, client.GetSession());
+	EXPECT_EQ(session, standby.GetSession());
+
+	// the state is where the client left it
+	auto query = client.QueryServo(105);
+	ASSERT_EQ(future_status::ready, query.wait_for(seconds(2)));
+	EXPECT_EQ(0.25f, query.get());
+
+	// a session that ended can't be resumed
+	client.Disconnect();
+	EXPECT_FALSE(client.Resume("127.0.0.1", standby.GetLocalPort()).get());
+}
+
+
+TEST_F(TEST_Replication, Failover_ResumeNeedsTheToken) {
+	ASSERT_TRUE(Replicate());
+	auto served = Serve(primary);
+	ASSERT_TRUE(Connect(primary));
+	ASSERT_TRUE(served.get());
+	client.SetServo(105, 0.25f, true);
+	ASSERT_TRUE(WaitStandby(5, 0.25f));
+	uint64_t session = client.GetSession();
+	primary.DBG_Crash();
+
+	// another host tries the session, answering the challenge, if any, with a proof of the given token
+	auto tryResume = [&](uint64_t id, uint64_t token) {
+		auto resumed = async(launch::async, [&] { return standby.Listen(); });
+		RcpSocket socket;
+		socket.bind(RcpSocket::AnyPort);
+		bool isAccepted = false;
+		try {
+			socket.connect("127.0.0.1", standby.GetLocalPort(), 5000);
+			ConnectionMessage request{ ConnectionMessage::RESUME_REQUEST };
+			request.session = id;
+			auto data = request.Serialize();
+			socket.send(data.data(), data.size(), true);
+			RcpPacket packet;
+			ConnectionMessage msg;
+			while (socket.receive(packet, 5000) && msg.Deserlialize(packet.getData(), packet.getDataSize())) {
+				if (msg.action == ConnectionMessage::RESUME_CHALLENGE) {
+					ConnectionMessage proof{ ConnectionMessage::RESUME_PROOF };
+					proof.challenge = ConnectionMessage::GetResumeProof(token, msg.challenge);
+					data = proof.Serialize();
+					socket.send(data.data(), data.size(), true);
+				}
+				else if (msg.action == ConnectionMessage::CONNECTION_REPLY) {
+					isAccepted = msg.isOk;
+					break;
+				}
+			}
+		}
+		catch (RcpException&) {}
+		socket.disconnect();
+		return resumed.get() || isAccepted;
+	};
+
+	// the token that went over the wire once does not name the session, and the ID alone is not enough
+	EXPECT_FALSE(tryResume(session, session));
+	EXPECT_FALSE(tryResume(ConnectionMessage::GetSessionId(session), session + 1));
+	EXPECT_EQ(0u, standby.GetSession());
+
+	// the client holding the token still resumes
+	auto resumed = Serve(standby);
+	ASSERT_TRUE(client.Resume("127.0.0.1", standby.GetLocalPort()).get());
+	ASSERT_TRUE(resumed.get());
+	EXPECT_EQ(session, standby.GetSession());
+}
+
+
+// Replication lag of a steady stream of commands, and the time from losing the primary to resuming on the standby.
+TEST(Replication, Benchmark_LagAndFailover) {
+	const int commands = 2000;
+	for (unsigned batchMs : { 5, 1, 0 }) {
+		stringstream log;
+		ServoProviderDummy primaryProvider(16), standbyProvider(16);
+		primaryProvider.SetLogStream(log);
+		standbyProvider.SetLogStream(log);
+		RemoteControlServer primary, standby;
+		RemoteControlClient client;
+		primary.SetLocalPort(RcpSocket::AnyPort);
+		standby.SetLocalPort(RcpSocket::AnyPort);
+		standby.SetReplicationPort(RcpSocket::AnyPort);
+		client.SetLocalPort(RcpSocket::AnyPort);
+		primary.SetReplicationTiming(batchMs, 200);
+		standby.SetReplicationTiming(batchMs, 200);
+		primary.GetManagerServo().AddProvider(&primaryProvider, 0);
+		standby.GetManagerServo().AddProvider(&standbyProvider, 0);
+
+		auto standing = async(launch::async, [&] { return standby.StartStandby(5000); });
+		ASSERT_TRUE(primary.StartReplication("127.0.0.1", standby.GetReplicationPort()));
+		ASSERT_TRUE(standing.get());
+		auto served = async(launch::async, [&] { return primary.Listen() && primary.Reply(true); });
+		ASSERT_TRUE(client.Connect("127.0.0.1", primary.GetLocalPort()).get());
+		ASSERT_TRUE(served.get());
+
+		// a command every 250 us, sweeping the channels
+		auto start = steady_clock::now();
+		for (int i = 0; i < commands; ++i) {
+			client.SetServo(i % 16, (i % 200) / 100.0f - 1.0f, true);
+			this_thread::sleep_until(start + microseconds(250 * (i + 1)));
+		}
+		auto query = client.QueryServo(15);
+		ASSERT_EQ(future_status::ready, query.wait_for(seconds(2)));
+		float last = query.get();
+		auto deadline = steady_clock::now() + seconds(2);
+		while (standbyProvider.GetState(15) != last && steady_clock::now() < deadline) {
+			this_thread::sleep_for(milliseconds(1));
+		}
+		auto primaryStatistics = primary.GetReplicationStatistics();
+		auto standbyStatistics = standby.GetReplicationStatistics();
+
+		auto resumed = async(launch::async, [&] { return standby.Listen() && standby.Authenticate() && standby.Reply(true); });
+		auto lost = steady_clock::now();
+		primary.DBG_Crash();
+		ASSERT_TRUE(client.Resume("127.0.0.1", standby.GetLocalPort()).get());
+		ASSERT_TRUE(resumed.get());
+		auto check = client.QueryServo(15);
+		ASSERT_EQ(future_status::ready, check.wait_for(seconds(2)));
+		EXPECT_EQ(last, check.get());
+		auto answered = steady_clock::now();
+		auto takeover = standby.GetReplicationStatistics().takeoverTime;
+
+		cout << "batch " << batchMs << " ms: " << commands << " commands, "
+			<< primaryStatistics.messages << " messages (" << primaryStatistics.bytes << " bytes), "
+			<< primaryStatistics.coalesced << " changes coalesced" << endl;
+		cout << "    lag mean " << duration_cast<microseconds>(standbyStatistics.meanLag).count() << " us, max "
+			<< duration_cast<microseconds>(standbyStatistics.maxLag).count() << " us" << endl;
+		cout << "    takeover " << duration_cast<milliseconds>(takeover - lost).count() << " ms, answered on standby "
+			<< duration_cast<milliseconds>(answered - lost).count() << " ms after losing the primary" << endl;
+		// one takeover interval, and some slack for scheduling
+		EXPECT_LE(duration_cast<milliseconds>(takeover - lost).count(), 250);
+		client.Disconnect();
+	}
+}
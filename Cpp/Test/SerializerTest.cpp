@@ -0,0 +1,232 @@
+#include <gtest/gtest.h>
+
+#include <RemoteControlServer/Serializer.h>
+#include <RemoteControlServer/Message.h>
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <iostream>
+
+
+// round trip a value as a varint, behind some bytes or not, which takes the fast or the slow path
+template <class T>
+static void ExpectVarintRoundTrip(T value, size_t before) {
+	Serializer ser;
+	for (size_t i = 0; i < before; ++i) {
+		ser << (uint8_t)0xFF;
+	}
+	ser << Serializer::Varint(value);
+	ASSERT_EQ(before + Serializer::VarintSize(value), ser.Size()) << "value " << +value;
+
+	T read = 0;
+	ser >> Serializer::Varint(read);
+	EXPECT_FALSE(ser.IsFailed()) << "value " << +value;
+	EXPECT_EQ(value, read);
+	EXPECT_EQ(before, ser.Size());
+}
+
+
+TEST(Serializer, Varint_RoundTripsAtLengthBoundaries) {
+	std::vector<uint64_t> values = { 0, 1, 127, 128, 16383, 16384, (1ull << 28) - 1, 1ull << 28,
+		(1ull << 56) - 1, 1ull << 56, (1ull << 63) - 1, 1ull << 63, std::numeric_limits<uint64_t>::max() };
+	for (auto value : values) {
+		ExpectVarintRoundTrip(value, 0);
+		ExpectVarintRoundTrip(value, 8);
+	}
+	EXPECT_EQ(1u, Serializer::VarintSize(127u));
+	EXPECT_EQ(2u, Serializer::VarintSize(128u));
+	EXPECT_EQ(8u, Serializer::VarintSize((1ull << 56) - 1));
+	EXPECT_EQ(10u, Serializer::VarintSize(std::numeric_limits<uint64_t>::max()));
+
+	// the smaller types, and the zigzag of signed ones
+	ExpectVarintRoundTrip<uint8_t>(255, 8);
+	ExpectVarintRoundTrip<uint32_t>(std::numeric_limits<uint32_t>::max(), 8);
+	for (int64_t value : { 0ll, -1ll, 1ll, -64ll, 63ll, -65ll, 64ll, (long long)std::numeric_limits<int64_t>::min(), (long long)std::numeric_limits<int64_t>::max() }) {
+		ExpectVarintRoundTrip(value, 0);
+		ExpectVarintRoundTrip(value, 8);
+	}
+	ExpectVarintRoundTrip<int32_t>(std::numeric_limits<int32_t>::min(), 8);
+	ExpectVarintRoundTrip<int16_t>(-300, 0);
+	EXPECT_EQ(1u, Serializer::VarintSize(-64));
+	EXPECT_EQ(1u, Serializer::VarintSize(63));
+	EXPECT_EQ(2u, Serializer::VarintSize(64));
+}
+
+
+TEST(Serializer, Varint_FastAndSlowPathAgree) {
+	// every length, read with fewer than 8 bytes left and with more, from a buffer and in place
+	for (int bits = 0; bits <= 64; ++bits) {
+		uint64_t value = bits == 64 ? ~0ull : (1ull << bits) - 1;
+		for (size_t before : { 0, 1, 7, 9, 16 }) {
+			ExpectVarintRoundTrip(value, before);
+
+			Serializer writer;
+			for (size_t i = 0; i < before; ++i) {
+				writer << (uint8_t)0x80;
+			}
+			writer << Serializer::Varint(value);
+			std::vector<uint8_t> data = writer.Get();
+			Serializer reader;
+			reader.Set(data.data(), data.size());
+			uint64_t read = 0;
+			reader >> Serializer::Varint(read);
+			EXPECT_FALSE(reader.IsFailed());
+			EXPECT_EQ(value, read);
+			EXPECT_EQ(before, reader.Size());
+		}
+	}
+}
+
+
+TEST(Serializer, Varint_MixesWithFixedFields) {
+	// runs of varints, and fixed fields of bytes with the top bit set in between
+	Serializer ser;
+	ser << (uint32_t)0xFFFFFFFF;
+	for (uint32_t i = 0; i < 1000; ++i) {
+		ser << Serializer::Varint(i * i * 37);
+		ser << Serializer::Varint(-(int32_t)i);
+		if (i % 7 == 0) {
+			ser << (uint16_t)0x8080;
+		}
+	}
+	ser << (double)-1.5;
+
+	double last;
+	ser >> last;
+	EXPECT_EQ(-1.5, last);
+	for (uint32_t i = 1000; i > 0; --i) {
+		uint32_t n = i - 1;
+		if (n % 7 == 0) {
+			uint16_t fixed;
+			ser >> fixed;
+			ASSERT_EQ(0x8080, fixed);
+		}
+		int32_t negative;
+		uint32_t square;
+		ser >> Serializer::Varint(negative);
+		ser >> Serializer::Varint(square);
+		ASSERT_EQ(-(int32_t)n, negative);
+		ASSERT_EQ(n * n * 37, square);
+	}
+	uint32_t first;
+	ser >> first;
+	EXPECT_EQ(0xFFFFFFFF, first);
+	EXPECT_FALSE(ser.IsFailed());
+	EXPECT_EQ(0u, ser.Size());
+}
+
+
+TEST(Serializer, Varint_RejectsMalformed) {
+	// truncated, the continuation runs out of bytes
+	std::vector<uint8_t> truncated = { 0x80, 0x80 };
+	Serializer ser;
+	ser.Set(truncated.data(), truncated.size());
+	uint64_t value = 42;
+	ser >> Serializer::Varint(value);
+	EXPECT_TRUE(ser.IsFailed());
+	EXPECT_EQ(42u, value);
+
+	// more than 64 bits
+	std::vector<uint8_t> tooLong(11, 0xFF);
+	tooLong[0] = 0x01;
+	ser.Set(tooLong.data(), tooLong.size());
+	ser >> Serializer::Varint(value);
+	EXPECT_TRUE(ser.IsFailed());
+
+	// fits 64 bits but not the type read
+	Serializer narrow;
+	narrow << Serializer::Varint(300u);
+	uint8_t small = 7;
+	narrow >> Serializer::Varint(small);
+	EXPECT_TRUE(narrow.IsFailed());
+	EXPECT_EQ(7, small);
+
+	Serializer negative;
+	negative << Serializer::Varint((int64_t)std::numeric_limits<int32_t>::min() - 1);
+	int32_t signedSmall = 0;
+	negative >> Serializer::Varint(signedSmall);
+	EXPECT_TRUE(negative.IsFailed());
+
+	// fixed fields past the end fail too, Set clears it
+	uint32_t fixed;
+	ser.Set(truncated.data(), truncated.size());
+	EXPECT_FALSE(ser.IsFailed());
+	ser >> fixed;
+	EXPECT_TRUE(ser.IsFailed());
+}
+
+
+TEST(Serializer, Messages_EnumerationsShrink) {
+	EnumDevicesMessage devices;
+	devices.devices = { { EnumDevicesMessage::SERVO, 16 }, { EnumDevicesMessage::PWM, 8 }, { EnumDevicesMessage::ADJUSTABLE_PWM, 200 } };
+	auto data = devices.Serialize();
+	// type, 1 + 1 per device but 1 + 2 for 200 channels, count
+	EXPECT_EQ(1u + 2 + 2 + 3 + 1, data.size());
+
+	EnumDevicesMessage readDevices;
+	ASSERT_TRUE(readDevices.Deserlialize(data.data(), data.size()));
+	ASSERT_EQ(3u, readDevices.devices.size());
+	for (size_t i = 0; i < 3; ++i) {
+		EXPECT_EQ(devices.devices[i].type, readDevices.devices[i].type);
+		EXPECT_EQ(devices.devices[i].channelCount, readDevices.devices[i].channelCount);
+	}
+	for (size_t size = 0; size < data.size(); ++size) {
+		EXPECT_FALSE(readDevices.Deserlialize(data.data() + data.size() - size, size));
+	}
+
+	EnumChannelsMessage channels;
+	channels.type = EnumChannelsMessage::SERVO;
+	for (uint32_t i = 0; i < 64; ++i) {
+		channels.channels.push_back(i);
+	}
+	channels.channels.push_back(100000);
+	data = channels.Serialize();
+	// 4 bytes a channel before
+	size_t fixedSize = 1 + 1 + 4 + channels.channels.size() * 4;
+	EXPECT_EQ(1u + 1 + 64 + 3 + 1, data.size());
+	std::cout << "channel enumeration of 65 channels: " << data.size() << " bytes, " << fixedSize << " with fixed width" << std::endl;
+
+	EnumChannelsMessage readChannels;
+	ASSERT_TRUE(readChannels.Deserlialize(data.data(), data.size()));
+	EXPECT_EQ(channels.type, readChannels.type);
+	EXPECT_EQ(channels.channels, readChannels.channels);
+	EXPECT_FALSE(readChannels.Deserlialize(data.data() + 1, data.size() - 1));
+	data[0] = (uint8_t)eMessageType::ENUM_DEVICES;
+	EXPECT_FALSE(readChannels.Deserlialize(data.data(), data.size()));
+}
+
+
+TEST(Serializer, Messages_ReplicationShrinks) {
+	ReplicationMessage message;
+	message.time = 123456789;
+	for (int32_t i = 0; i < 100; ++i) {
+		message.changes.push_back({ i, i * 0.5f });
+	}
+	message.changes.push_back({ -1, 1.0f });
+	message.changes.push_back({ 5000, 2.0f });
+	message.sessions.push_back({ 0xFFFFFFFFFFFFFFFF, true });
+
+	auto data = message.Serialize();
+	EXPECT_EQ(message.GetSize(), data.size());
+	// zigzag takes a byte up to channel 63, 2 up to 8191
+	EXPECT_EQ(ReplicationMessage::HeaderSize + 64 * 5 + 36 * 6 + 5 + 6 + 9, data.size());
+	std::cout << "replication of 102 changes: " << data.size() << " bytes, "
+		<< 1 + 1 + 8 + 4 + 4 + 102 * 8 + 9 << " with fixed width channels" << std::endl;
+
+	ReplicationMessage read;
+	ASSERT_TRUE(read.Deserlialize(data.data(), data.size()));
+	ASSERT_EQ(message.changes.size(), read.changes.size());
+	for (size_t i = 0; i < message.changes.size(); ++i) {
+		EXPECT_EQ(message.changes[i].channel, read.changes[i].channel);
+		EXPECT_EQ(message.changes[i].state, read.changes[i].state);
+	}
+	ASSERT_EQ(1u, read.sessions.size());
+	EXPECT_EQ(message.sessions[0].token, read.sessions[0].token);
+
+	// the first channel id running past the changes does not parse
+	auto corrupt = data;
+	ASSERT_EQ(0, corrupt[ReplicationMessage::HeaderSize]);
+	corrupt[ReplicationMessage::HeaderSize] |= 0x80;
+	EXPECT_FALSE(read.Deserlialize(corrupt.data(), corrupt.size()));
+}
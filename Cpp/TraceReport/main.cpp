@@ -0,0 +1,170 @@
+#include <RemoteControlServer/LatencyTrace.h>
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+using namespace std;
+
+// Usage: TraceReport [--client-offset <ns>] [dump files...]
+// Reads "traceId,stage,timestamp" lines as written by TraceRing::Dump, from
+// stdin if no files are given. Prints a latency histogram for each stage,
+// measured from the previous stage of the same command.
+// The first stage, network, compares the client's clock to the server's, so it
+// is only meaningful if the clocks are synchronized, or if the offset of the
+// client's clock is passed in --client-offset (added to client timestamps).
+
+
+static const int NumStages = (int)eTraceStage::PROVIDER_LATCHED + 1;
+static const int NumBuckets = 24; // log2 buckets of microseconds: <1us ... >4s
+
+static const char* stageNames[NumStages] = {
+	"client send",
+	"network (client send -> datagram received)",
+	"rcp queue (datagram received -> packet delivered)",
+	"decode (packet delivered -> message dispatched)",
+	"dispatch (message dispatched -> channel set)",
+	"provider (channel set -> provider latched)",
+};
+
+
+struct StageStatistics {
+	vector<int64_t> samples; // nanoseconds
+	array<size_t, NumBuckets> buckets;
+
+	StageStatistics() {
+		buckets.fill(0);
+	}
+
+	void Add(int64_t latency) {
+		samples.push_back(latency);
+		int bucket = 0;
+		int64_t us = latency / 1000;
+		while (us > 0 && bucket < NumBuckets - 1) {
+			us >>= 1;
+			bucket++;
+		}
+		buckets[latency < 0 ? 0 : bucket]++;
+	}
+};
+
+
+bool ReadTraces(istream& is, map<uint64_t, array<int64_t, NumStages>>& traces, int64_t clientOffset) {
+	string line;
+	while (getline(is, line)) {
+		if (line.empty()) {
+			continue;
+		}
+		istringstream ls(line);
+		uint64_t traceId;
+		int stage;
+		int64_t timestamp;
+		char comma1, comma2;
+		if (!(ls >> traceId >> comma1 >> stage >> comma2 >> timestamp) || comma1 != ',' || comma2 != ',' || stage < 0 || stage >= NumStages) {
+			cerr << "Malformed line: " << line << endl;
+			continue;
+		}
+		auto it = traces.find(traceId);
+		if (it == traces.end()) {
+			array<int64_t, NumStages> empty;
+			empty.fill(INT64_MIN);
+			it = traces.insert({ traceId, empty }).first;
+		}
+		it->second[stage] = stage == (int)eTraceStage::CLIENT_SEND ? timestamp + clientOffset : timestamp;
+	}
+	return true;
+}
+
+
+void PrintHistogram(const char* name, StageStatistics& stats) {
+	cout << name << endl;
+	if (stats.samples.empty()) {
+		cout << "    no samples" << endl << endl;
+		return;
+	}
+
+	sort(stats.samples.begin(), stats.samples.end());
+	auto Percentile = [&](double p) {
+		size_t index = min(stats.samples.size() - 1, (size_t)(p * stats.samples.size()));
+		return stats.samples[index] / 1000.0;
+	};
+	cout << fixed << setprecision(1)
+		<< "    count = " << stats.samples.size()
+		<< ", min = " << Percentile(0.0) << " us"
+		<< ", median = " << Percentile(0.5) << " us"
+		<< ", p99 = " << Percentile(0.99) << " us"
+		<< ", max = " << stats.samples.back() / 1000.0 << " us" << endl;
+
+	size_t largest = *max_element(stats.buckets.begin(), stats.buckets.end());
+	int first = 0, last = NumBuckets - 1;
+	while (stats.buckets[first] == 0) first++;
+	while (stats.buckets[last] == 0) last--;
+	for (int i = first; i <= last; ++i) {
+		int barLength = (int)(50 * stats.buckets[i] / largest);
+		cout << "    " << (i == 0 ? " <" : ">=") << setw(8) << (i == 0 ? 1 : 1LL << (i - 1)) << " us | "
+			<< string(barLength, '#') << " " << stats.buckets[i] << endl;
+	}
+	cout << endl;
+}
+
+
+int main(int argc, char* argv[]) {
+	map<uint64_t, array<int64_t, NumStages>> traces;
+	int64_t clientOffset = 0;
+	bool anyFile = false;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--client-offset" && i + 1 < argc) {
+			clientOffset = strtoll(argv[++i], nullptr, 10);
+			continue;
+		}
+		ifstream file(arg);
+		if (!file.is_open()) {
+			cerr << "Could not open " << arg << endl;
+			return 1;
+		}
+		ReadTraces(file, traces, clientOffset);
+		anyFile = true;
+	}
+	if (!anyFile) {
+		ReadTraces(cin, traces, clientOffset);
+	}
+
+	// each stage is measured from the closest earlier stage that was recorded
+	array<StageStatistics, NumStages> stats;
+	StageStatistics total;
+	for (auto& trace : traces) {
+		auto& stamps = trace.second;
+		int previous = -1;
+		for (int stage = 0; stage < NumStages; ++stage) {
+			if (stamps[stage] == INT64_MIN) {
+				continue;
+			}
+			if (previous >= 0) {
+				stats[stage].Add(stamps[stage] - stamps[previous]);
+			}
+			previous = stage;
+		}
+		int lastServerStage = previous;
+		if (lastServerStage > (int)eTraceStage::DATAGRAM_RECEIVED && stamps[(int)eTraceStage::DATAGRAM_RECEIVED] != INT64_MIN) {
+			total.Add(stamps[lastServerStage] - stamps[(int)eTraceStage::DATAGRAM_RECEIVED]);
+		}
+	}
+
+	cout << traces.size() << " traced commands" << endl << endl;
+	for (int stage = 1; stage < NumStages; ++stage) {
+		PrintHistogram(stageNames[stage], stats[stage]);
+	}
+	PrintHistogram("server total (datagram received -> last stage)", total);
+
+	return 0;
+}